@@ -10,9 +10,12 @@
 #include <map>
 #include <string>
 #include <string.h>
+#include <vector>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
+#include <boost/type_traits/integral_constant.hpp>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
 /**
@@ -250,6 +253,121 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+//
+// Pool of small objects for node based containers. Objects are carved out
+// of large blocks and kept on per size free lists once freed; the blocks
+// go back to the system when the pool is destroyed. Not thread safe.
+//
+class CMemoryPool
+{
+public:
+    static const size_t BLOCK_SIZE = 256 * 1024;
+    static const size_t ALIGN = 16;
+    static const size_t MAX_OBJECT_SIZE = 256;
+
+    CMemoryPool() : pNext(NULL), pEnd(NULL), nUsage(0)
+    {
+        memset(vFree, 0, sizeof(vFree));
+    }
+
+    ~CMemoryPool()
+    {
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+            ::operator delete(vBlocks[i]);
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        size_t nClass = (nSize + ALIGN - 1) / ALIGN;
+        nUsage += nClass * ALIGN;
+        if (vFree[nClass] != NULL) {
+            void* p = vFree[nClass];
+            vFree[nClass] = *(void**)p;
+            return p;
+        }
+        if (pNext + nClass * ALIGN > pEnd) {
+            // the rest of the current block is lost, at most MAX_OBJECT_SIZE
+            vBlocks.push_back(static_cast<char*>(::operator new(BLOCK_SIZE)));
+            pNext = vBlocks.back();
+            pEnd = pNext + BLOCK_SIZE;
+        }
+        void* p = pNext;
+        pNext += nClass * ALIGN;
+        return p;
+    }
+
+    void Free(void* p, size_t nSize)
+    {
+        size_t nClass = (nSize + ALIGN - 1) / ALIGN;
+        nUsage -= nClass * ALIGN;
+        *(void**)p = vFree[nClass];
+        vFree[nClass] = p;
+    }
+
+    // Bytes handed out and not freed
+    size_t GetUsage() const { return nUsage; }
+    // Bytes taken from the system
+    size_t GetReserved() const { return vBlocks.size() * BLOCK_SIZE; }
+
+private:
+    std::vector<char*> vBlocks;
+    char* pNext;
+    char* pEnd;
+    void* vFree[MAX_OBJECT_SIZE / ALIGN + 1];
+    size_t nUsage;
+
+    CMemoryPool(const CMemoryPool&);
+    CMemoryPool& operator=(const CMemoryPool&);
+};
+
+//
+// Allocator that takes single objects from a CMemoryPool shared by all
+// its copies, so a container and its nodes share one pool. Arrays, such
+// as hash table buckets, come from operator new.
+//
+template<typename T>
+struct pool_allocator
+{
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef boost::true_type propagate_on_container_copy_assignment;
+    typedef boost::true_type propagate_on_container_move_assignment;
+    typedef boost::true_type propagate_on_container_swap;
+
+    boost::shared_ptr<CMemoryPool> pool;
+
+    pool_allocator() : pool(new CMemoryPool()) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) : pool(a.pool) {}
+    template<typename _Other> struct rebind
+    { typedef pool_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        if (n == 1 && sizeof(T) <= CMemoryPool::MAX_OBJECT_SIZE)
+            return static_cast<T*>(pool->Allocate(sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n == 1 && sizeof(T) <= CMemoryPool::MAX_OBJECT_SIZE)
+            pool->Free(p, sizeof(T));
+        else
+            ::operator delete(p);
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& a) const { return pool == a.pool; }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& a) const { return pool != a.pool; }
+};
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -0,0 +1,353 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Original Code: Copyright (c) 2009-2014 The Bitcoin Core Developers
+// Modified Code: Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_ARITH_UINT256_H
+#define BITMARK_ARITH_UINT256_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/** Fixed-width unsigned integer for work and target arithmetic.
+ * Unlike CBigNum it lives entirely on the stack, so consensus math does not
+ * allocate. uint256 stays the type for hashes; convert with
+ * UintToArith256/ArithToUint256. Widths other than 256 are used where an
+ * intermediate value can exceed 256 bits (weighted testnet targets, work
+ * sums scaled for the subsidy scaling factor).
+ */
+template<unsigned int BITS>
+class arith_uint
+{
+protected:
+    enum { WIDTH=BITS/32 };
+    uint32_t pn[WIDTH];
+
+    template<unsigned int> friend class arith_uint;
+    friend uint256 ArithToUint256(const arith_uint<256> &a);
+    friend arith_uint<256> UintToArith256(const uint256 &a);
+
+public:
+    arith_uint()
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint(uint64_t b)
+    {
+        pn[0] = (unsigned int)b;
+        pn[1] = (unsigned int)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    // Zero-extends or truncates a value of a different width
+    template<unsigned int BITS2>
+    explicit arith_uint(const arith_uint<BITS2>& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = i < (int)arith_uint<BITS2>::WIDTH ? b.pn[i] : 0;
+    }
+
+    bool operator!() const
+    {
+        for (int i = 0; i < WIDTH; i++)
+            if (pn[i] != 0)
+                return false;
+        return true;
+    }
+
+    const arith_uint operator~() const
+    {
+        arith_uint ret;
+        for (int i = 0; i < WIDTH; i++)
+            ret.pn[i] = ~pn[i];
+        return ret;
+    }
+
+    const arith_uint operator-() const
+    {
+        arith_uint ret;
+        for (int i = 0; i < WIDTH; i++)
+            ret.pn[i] = ~pn[i];
+        ++ret;
+        return ret;
+    }
+
+    arith_uint& operator<<=(unsigned int shift)
+    {
+        arith_uint a(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int k = shift / 32;
+        shift = shift % 32;
+        for (int i = 0; i < WIDTH; i++) {
+            if (i + k + 1 < WIDTH && shift != 0)
+                pn[i + k + 1] |= (a.pn[i] >> (32 - shift));
+            if (i + k < WIDTH)
+                pn[i + k] |= (a.pn[i] << shift);
+        }
+        return *this;
+    }
+
+    arith_uint& operator>>=(unsigned int shift)
+    {
+        arith_uint a(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int k = shift / 32;
+        shift = shift % 32;
+        for (int i = 0; i < WIDTH; i++) {
+            if (i - k - 1 >= 0 && shift != 0)
+                pn[i - k - 1] |= (a.pn[i] << (32 - shift));
+            if (i - k >= 0)
+                pn[i - k] |= (a.pn[i] >> shift);
+        }
+        return *this;
+    }
+
+    arith_uint& operator+=(const arith_uint& b)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++) {
+            uint64_t n = carry + pn[i] + b.pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint& operator-=(const arith_uint& b)
+    {
+        *this += -b;
+        return *this;
+    }
+
+    arith_uint& operator*=(uint32_t b32)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++) {
+            uint64_t n = carry + (uint64_t)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint& operator*=(const arith_uint& b)
+    {
+        arith_uint a;
+        for (int j = 0; j < WIDTH; j++) {
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++) {
+                uint64_t n = carry + a.pn[i + j] + (uint64_t)pn[j] * b.pn[i];
+                a.pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        *this = a;
+        return *this;
+    }
+
+    // Division by zero yields zero, as a guard; callers never divide by zero.
+    arith_uint& operator/=(const arith_uint& b)
+    {
+        arith_uint div = b;     // make a copy, so we can shift.
+        arith_uint num = *this; // make a copy, so we can subtract.
+        *this = 0;              // the quotient.
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0 || div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align.
+        while (shift >= 0) {
+            if (num >= div) {
+                num -= div;
+                pn[shift / 32] |= (1 << (shift & 31)); // set a bit of the result.
+            }
+            div >>= 1; // shift back.
+            shift--;
+        }
+        // num now contains the remainder of the division.
+        return *this;
+    }
+
+    arith_uint& operator++()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && ++pn[i] == 0)
+            i++;
+        return *this;
+    }
+
+    arith_uint& operator--()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && --pn[i] == (uint32_t)-1)
+            i++;
+        return *this;
+    }
+
+    int CompareTo(const arith_uint& b) const
+    {
+        for (int i = WIDTH - 1; i >= 0; i--) {
+            if (pn[i] < b.pn[i])
+                return -1;
+            if (pn[i] > b.pn[i])
+                return 1;
+        }
+        return 0;
+    }
+
+    bool EqualTo(uint64_t b) const
+    {
+        for (int i = WIDTH - 1; i >= 2; i--) {
+            if (pn[i])
+                return false;
+        }
+        if (pn[1] != (b >> 32))
+            return false;
+        if (pn[0] != (b & 0xfffffffful))
+            return false;
+        return true;
+    }
+
+    friend inline const arith_uint operator+(const arith_uint& a, const arith_uint& b) { return arith_uint(a) += b; }
+    friend inline const arith_uint operator-(const arith_uint& a, const arith_uint& b) { return arith_uint(a) -= b; }
+    friend inline const arith_uint operator*(const arith_uint& a, const arith_uint& b) { return arith_uint(a) *= b; }
+    friend inline const arith_uint operator/(const arith_uint& a, const arith_uint& b) { return arith_uint(a) /= b; }
+    friend inline const arith_uint operator*(const arith_uint& a, uint32_t b) { return arith_uint(a) *= b; }
+    friend inline const arith_uint operator>>(const arith_uint& a, int shift) { return arith_uint(a) >>= shift; }
+    friend inline const arith_uint operator<<(const arith_uint& a, int shift) { return arith_uint(a) <<= shift; }
+    friend inline bool operator==(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) == 0; }
+    friend inline bool operator!=(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) != 0; }
+    friend inline bool operator>(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) > 0; }
+    friend inline bool operator<(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) < 0; }
+    friend inline bool operator>=(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) >= 0; }
+    friend inline bool operator<=(const arith_uint& a, const arith_uint& b) { return a.CompareTo(b) <= 0; }
+    friend inline bool operator==(const arith_uint& a, uint64_t b) { return a.EqualTo(b); }
+    friend inline bool operator!=(const arith_uint& a, uint64_t b) { return !a.EqualTo(b); }
+
+    /** Number of significant bits, 0 for zero */
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--) {
+            if (pn[pos]) {
+                for (int nbits = 31; nbits > 0; nbits--) {
+                    if (pn[pos] & 1U << nbits)
+                        return 32 * pos + nbits + 1;
+                }
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    uint64_t GetLow64() const
+    {
+        return pn[0] | (uint64_t)pn[1] << 32;
+    }
+
+    /** Low 64 bits, or all ones if the value does not fit, like CBigNum::getulong */
+    uint64_t GetLow64Saturated() const
+    {
+        return bits() > 64 ? ~(uint64_t)0 : GetLow64();
+    }
+
+    double getdouble() const
+    {
+        double ret = 0.0;
+        double fact = 1.0;
+        for (int i = 0; i < WIDTH; i++) {
+            ret += fact * pn[i];
+            fact *= 4294967296.0;
+        }
+        return ret;
+    }
+
+    std::string GetHex() const
+    {
+        char psz[sizeof(pn)*2 + 1];
+        for (unsigned int i = 0; i < sizeof(pn); i++)
+            sprintf(psz + i*2, "%02x", ((unsigned char*)pn)[sizeof(pn) - i - 1]);
+        return std::string(psz, psz + sizeof(pn)*2);
+    }
+
+    std::string ToString() const
+    {
+        return GetHex();
+    }
+
+    /**
+     * Decode the "compact" format used for nBits (see CBigNum::SetCompact).
+     * pfNegative is set for a negative value and pfOverflow if the value does
+     * not fit in BITS bits; the stored value is then meaningless.
+     */
+    arith_uint& SetCompact(uint32_t nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3) {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        } else {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > (int)BITS/8 + 2) ||
+                                         (nWord > 0xff && nSize > (int)BITS/8 + 1) ||
+                                         (nWord > 0xffff && nSize > (int)BITS/8));
+        return *this;
+    }
+
+    /** Encode a non-negative value in the compact format, as CBigNum::GetCompact does */
+    uint32_t GetCompact() const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3) {
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        } else {
+            arith_uint bn = *this >> 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000) {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
+};
+
+typedef arith_uint<256> arith_uint256;
+typedef arith_uint<320> arith_uint320;
+
+inline uint256 ArithToUint256(const arith_uint256 &a)
+{
+    uint256 b;
+    memcpy(b.begin(), a.pn, sizeof(a.pn));
+    return b;
+}
+
+inline arith_uint256 UintToArith256(const uint256 &a)
+{
+    arith_uint256 b;
+    memcpy(b.pn, a.begin(), sizeof(b.pn));
+    return b;
+}
+
+#endif // BITMARK_ARITH_UINT256_H
@@ -0,0 +1,93 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Proof of work throughput of every registered algorithm, one thread,
+// then of the multi-buffer kernels at each lane width the CPU supports.
+// Usage: bench_bitmark [seconds per algo]
+
+#include "multibuffer.h"
+#include "powalgo.h"
+#include "pureheader.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const unsigned int BATCH_SIZE = 8;
+
+static double HashesPerSec(const CPoWAlgo& algo, CPureBlockHeader& header, bool fBatch, int64_t nMicros)
+{
+    CPureBlockHeader vHeader[BATCH_SIZE];
+    const CPureBlockHeader* vpHeader[BATCH_SIZE];
+    uint256 vHash[BATCH_SIZE];
+    for (unsigned int i = 0; i < BATCH_SIZE; i++)
+        vpHeader[i] = &vHeader[i];
+
+    int64_t nHashes = 0;
+    int64_t nStart = GetTimeMicros();
+    int64_t nElapsed;
+    do {
+        if (fBatch) {
+            for (unsigned int i = 0; i < BATCH_SIZE; i++) {
+                vHeader[i] = header;
+                header.nNonce++;
+            }
+            algo.HashBatch(vpHeader, vHash, BATCH_SIZE);
+            nHashes += BATCH_SIZE;
+        } else {
+            vHash[0] = algo.Hash(header);
+            header.nNonce++;
+            nHashes++;
+        }
+        nElapsed = GetTimeMicros() - nStart;
+    } while (nElapsed < nMicros);
+    return nHashes * 1000000.0 / nElapsed;
+}
+
+static void InitHeader(CPureBlockHeader& header, int algo)
+{
+    header.nVersion = CPureBlockHeader::CURRENT_VERSION;
+    header.SetAlgo(algo);
+    header.nTime = 1405274442;
+    header.nBits = 0x1d00ffff;
+}
+
+int main(int argc, char* argv[])
+{
+    double nSeconds = argc > 1 ? atof(argv[1]) : 1.0;
+    if (nSeconds <= 0) {
+        fprintf(stderr, "Usage: bench_bitmark [seconds per algo]\n");
+        return 1;
+    }
+
+    printf("%-12s %6s %14s %14s\n", "algo", "memory", "hashes/s", "batch hashes/s");
+    for (int i = 0; i < NUM_ALGOS; i++) {
+        const CPoWAlgo& algo = vPoWAlgos[i];
+        CPureBlockHeader header;
+        InitHeader(header, algo.nId);
+
+        double dSingle = HashesPerSec(algo, header, false, nSeconds * 1000000);
+        double dBatch = HashesPerSec(algo, header, true, nSeconds * 1000000);
+        printf("%-12s %6s %14.1f %14.1f\n", algo.pszName, algo.fMemoryHard ? "hard" : "-", dSingle, dBatch);
+    }
+    printf("EQUIHASH measures the header hash only; solution checking is separate.\n");
+
+    const int vMultiAlgo[] = { ALGO_SCRYPT, ALGO_SHA256D };
+    const unsigned int vLanes[] = { 1, 4, 8 };
+    unsigned int nMaxLanes = multibuffer_lanes();
+    printf("\n%-12s %6s %14s\n", "algo", "lanes", "batch hashes/s");
+    for (unsigned int i = 0; i < sizeof(vMultiAlgo) / sizeof(vMultiAlgo[0]); i++) {
+        const CPoWAlgo& algo = GetPoWAlgo(vMultiAlgo[i]);
+        for (unsigned int j = 0; j < sizeof(vLanes) / sizeof(vLanes[0]); j++) {
+            if (multibuffer_set_lanes(vLanes[j]) != vLanes[j])
+                continue;
+            CPureBlockHeader header;
+            InitHeader(header, algo.nId);
+            double dBatch = HashesPerSec(algo, header, true, nSeconds * 1000000);
+            printf("%-12s %6u %14.1f\n", algo.pszName, vLanes[j], dBatch);
+        }
+    }
+    multibuffer_set_lanes(nMaxLanes);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Block index load and lookups for a chain the size of mainnet. Loading
+// inserts every block and its parent in the order the block tree database
+// returns them (by hash), as LoadBlockIndexGuts does; then every block is
+// looked up once in random order. Timed for the index as it was (a std::map
+// with an entry allocated for each block) and for mapBlockIndex.
+// Usage: bench_blockindex [blocks]
+
+#include "main.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+
+typedef std::map<uint256, CBlockIndex*> OrderedMap;
+
+// InsertBlockIndex as it was
+static CBlockIndex* InsertOrdered(OrderedMap& map, const uint256& hash)
+{
+    if (hash == 0)
+        return NULL;
+    OrderedMap::iterator mi = map.find(hash);
+    if (mi != map.end())
+        return mi->second;
+    CBlockIndex* pindexNew = new CBlockIndex();
+    mi = map.insert(std::make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &mi->first;
+    return pindexNew;
+}
+
+// vBlock holds (hash, parent hash) pairs sorted by hash
+static int64_t LoadOrdered(OrderedMap& map, const std::vector<std::pair<uint256, uint256> >& vBlock)
+{
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vBlock.size(); i++) {
+        CBlockIndex* pindexNew = InsertOrdered(map, vBlock[i].first);
+        pindexNew->pprev = InsertOrdered(map, vBlock[i].second);
+    }
+    return GetTimeMicros() - nStart;
+}
+
+static int64_t LoadHashed(const std::vector<std::pair<uint256, uint256> >& vBlock)
+{
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vBlock.size(); i++) {
+        CBlockIndex* pindexNew = InsertBlockIndex(vBlock[i].first);
+        pindexNew->pprev = InsertBlockIndex(vBlock[i].second);
+    }
+    return GetTimeMicros() - nStart;
+}
+
+template<typename Map>
+static int64_t Lookup(const Map& map, const std::vector<uint256>& vHash, unsigned int& nFound)
+{
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHash.size(); i++) {
+        typename Map::const_iterator mi = map.find(vHash[i]);
+        if (mi != map.end() && *mi->second->phashBlock == vHash[i])
+            nFound++;
+    }
+    return GetTimeMicros() - nStart;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nBlocks = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (nBlocks == 0) {
+        fprintf(stderr, "Usage: bench_blockindex [blocks]\n");
+        return 1;
+    }
+
+    std::vector<uint256> vHash(nBlocks);
+    for (unsigned int i = 0; i < nBlocks; i++)
+        vHash[i] = GetRandHash();
+    std::vector<std::pair<uint256, uint256> > vBlock(nBlocks);
+    for (unsigned int i = 0; i < nBlocks; i++)
+        vBlock[i] = std::make_pair(vHash[i], i > 0 ? vHash[i - 1] : uint256(0));
+    std::sort(vBlock.begin(), vBlock.end());
+    std::random_shuffle(vHash.begin(), vHash.end());
+
+    printf("%u blocks, %u bytes per index entry\n", nBlocks, (unsigned int)sizeof(CBlockIndex));
+    printf("%-24s %10s %12s\n", "", "load ms", "lookups ms");
+
+    OrderedMap mapOrdered;
+    unsigned int nFoundOrdered = 0;
+    int64_t nLoad = LoadOrdered(mapOrdered, vBlock);
+    int64_t nLookup = Lookup(mapOrdered, vHash, nFoundOrdered);
+    printf("%-24s %10.0f %12.0f\n", "std::map, entry each", nLoad * 0.001, nLookup * 0.001);
+    for (OrderedMap::iterator mi = mapOrdered.begin(); mi != mapOrdered.end(); ++mi)
+        delete mi->second;
+    mapOrdered.clear();
+
+    unsigned int nFoundHashed = 0;
+    nLoad = LoadHashed(vBlock);
+    nLookup = Lookup(mapBlockIndex, vHash, nFoundHashed);
+    printf("%-24s %10.0f %12.0f\n", "mapBlockIndex", nLoad * 0.001, nLookup * 0.001);
+    UnloadBlockIndex();
+
+    if (nFoundOrdered != nBlocks || nFoundHashed != nBlocks) {
+        fprintf(stderr, "lookups missed blocks\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Memory pool upkeep and block template selection with a large pool: time to
+// add the transactions with their indexes, to choose a block from the indexes,
+// against rebuilding the fee order and dependency graph on every call as the
+// miner used to (without its coin lookups), and to remove the chosen block.
+// Usage: bench_mempool [transactions] [rounds]
+
+#include "main.h"
+#include "miner.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+static const unsigned int BLOCK_MAX_SIZE = DEFAULT_BLOCK_MAX_SIZE;
+
+// A fifth of the transactions spend an output of an earlier one, so the
+// pool holds chains as well as independent transactions
+static void MakeTransactions(unsigned int nTx, std::vector<CTransaction>& vtx, std::vector<int64_t>& vFee)
+{
+    std::vector<unsigned int> vFreeOutputs;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (!vFreeOutputs.empty() && GetRand(5) == 0) {
+            unsigned int nPos = GetRand(vFreeOutputs.size());
+            unsigned int nOutput = vFreeOutputs[nPos];
+            vFreeOutputs[nPos] = vFreeOutputs.back();
+            vFreeOutputs.pop_back();
+            tx.vin[0].prevout = COutPoint(vtx[nOutput / 2].GetHash(), nOutput % 2);
+        } else {
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        }
+        tx.vin[0].scriptSig << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < 2; j++) {
+            tx.vout[j].nValue = COIN;
+            tx.vout[j].scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+            vFreeOutputs.push_back(2 * i + j);
+        }
+        vtx.push_back(tx);
+        vFee.push_back(1000 + GetRand(50000));
+    }
+}
+
+// The previous selection: every call orders the whole pool by fee rate and
+// links each transaction to the parents it waits for
+static unsigned int RebuildSelect(CTxMemPool& pool)
+{
+    typedef std::pair<double, const CTxMemPoolEntry*> FeeEntry;
+    std::vector<FeeEntry> vecPriority;
+    std::map<uint256, std::vector<const CTxMemPoolEntry*> > mapDependers;
+    std::map<const CTxMemPoolEntry*, unsigned int> mapWaiting;
+    for (std::map<uint256, CTxMemPoolEntry>::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+        const CTxMemPoolEntry& entry = mi->second;
+        unsigned int nWaiting = 0;
+        BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin) {
+            if (pool.mapTx.count(txin.prevout.hash)) {
+                mapDependers[txin.prevout.hash].push_back(&entry);
+                nWaiting++;
+            }
+        }
+        double dFeePerKb = entry.GetFee() / (entry.GetTxSize() / 1000.0);
+        if (nWaiting)
+            mapWaiting[&entry] = nWaiting;
+        else
+            vecPriority.push_back(FeeEntry(dFeePerKb, &entry));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end());
+    uint64_t nBlockSize = 1000;
+    unsigned int nBlockTx = 0;
+    while (!vecPriority.empty()) {
+        const CTxMemPoolEntry* pentry = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end());
+        vecPriority.pop_back();
+        if (nBlockSize + pentry->GetTxSize() >= BLOCK_MAX_SIZE)
+            continue;
+        nBlockSize += pentry->GetTxSize();
+        nBlockTx++;
+        std::map<uint256, std::vector<const CTxMemPoolEntry*> >::iterator it = mapDependers.find(pentry->GetTx().GetHash());
+        if (it == mapDependers.end())
+            continue;
+        BOOST_FOREACH(const CTxMemPoolEntry* pchild, it->second) {
+            if (--mapWaiting[pchild] == 0) {
+                vecPriority.push_back(FeeEntry(pchild->GetFee() / (pchild->GetTxSize() / 1000.0), pchild));
+                std::push_heap(vecPriority.begin(), vecPriority.end());
+            }
+        }
+    }
+    return nBlockTx;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nTx = argc > 1 ? atoi(argv[1]) : 50000;
+    unsigned int nRounds = argc > 2 ? atoi(argv[2]) : 10;
+    if (nTx == 0 || nRounds == 0) {
+        fprintf(stderr, "Usage: bench_mempool [transactions] [rounds]\n");
+        return 1;
+    }
+
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vFee;
+    MakeTransactions(nTx, vtx, vFee);
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nTx; i++)
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], vFee[i], 0, 0, 1, 1));
+    int64_t nAdd = GetTimeMicros() - nStart;
+    printf("%u transactions in the pool, added in %.1f ms (%.2f us each)\n", nTx, nAdd / 1000.0, (double)nAdd / nTx);
+
+    std::vector<const CTxMemPoolEntry*> vSelected;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nRounds; i++) {
+        vSelected.clear();
+        SelectMemPoolTransactions(pool, 2, BLOCK_MAX_SIZE, 0, 0, vSelected);
+    }
+    int64_t nSelect = (GetTimeMicros() - nStart) / nRounds;
+
+    unsigned int nRebuildTx = 0;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nRounds; i++)
+        nRebuildTx = RebuildSelect(pool);
+    int64_t nRebuild = (GetTimeMicros() - nStart) / nRounds;
+
+    printf("%-28s %8s %10s\n", "block selection", "txs", "ms");
+    printf("%-28s %8u %10.2f\n", "indexed walk", (unsigned int)vSelected.size(), nSelect / 1000.0);
+    printf("%-28s %8u %10.2f\n", "rebuild on every call", nRebuildTx, nRebuild / 1000.0);
+
+    // The chosen block confirms, as ConnectTip removes it
+    std::vector<CTransaction> vBlock;
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, vSelected)
+        vBlock.push_back(pentry->GetTx());
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTransaction& tx, vBlock) {
+        std::list<CTransaction> removed;
+        pool.remove(tx, removed);
+    }
+    int64_t nRemove = GetTimeMicros() - nStart;
+    printf("removed the block's %u transactions in %.1f ms, %u left\n",
+           (unsigned int)vBlock.size(), nRemove / 1000.0, (unsigned int)pool.mapTx.size());
+    return 0;
+}
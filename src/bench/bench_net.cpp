@@ -0,0 +1,199 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Socket handler throughput with many loopback peers: every peer streams
+// small messages at the node, which are counted as they complete in the
+// receive queues, as the message handler would take them. With a payload
+// of 0 the peers stay idle, which measures the cost of waiting on them.
+// Usage: bench_net [peers] [seconds] [payload bytes]
+
+#if defined(HAVE_CONFIG_H)
+#include "bitmark-config.h"
+#endif
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <boost/thread.hpp>
+
+extern void ThreadSocketHandler();
+
+static uint64_t nMessages = 0;
+static uint64_t nBytes = 0;
+
+// Stand in for the message handler: take complete messages off every node
+static void ThreadConsume()
+{
+    while (true) {
+        boost::this_thread::interruption_point();
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        bool fAny = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv)
+                continue;
+            while (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete()) {
+                nMessages++;
+                nBytes += pnode->vRecvMsg.front().vRecv.size() + 24;
+                pnode->vRecvMsg.pop_front();
+                fAny = true;
+            }
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+        if (!fAny)
+            MilliSleep(1);
+    }
+}
+
+static std::string MakeMessage(unsigned int nPayload)
+{
+    std::vector<char> vPayload(nPayload, 0x42);
+    CMessageHeader hdr("bench", nPayload);
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write(&vPayload[0], nPayload);
+    return ss.str();
+}
+
+static double CpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nPeers = argc > 1 ? atoi(argv[1]) : 500;
+    double nSeconds = argc > 2 ? atof(argv[2]) : 5.0;
+    unsigned int nPayload = argc > 3 ? atoi(argv[3]) : 200;
+    if (nPeers == 0 || nSeconds <= 0) {
+        fprintf(stderr, "Usage: bench_net [peers] [seconds] [payload bytes]\n");
+        return 1;
+    }
+    fPrintToDebugLog = false;
+    SelectParams(CChainParams::MAIN);
+
+    // a client and a node socket per peer
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    unsigned int nMaxPeers = (limit.rlim_cur - 64) / 2;
+#ifndef HAVE_SYS_EPOLL_H
+    nMaxPeers = std::min(nMaxPeers, (unsigned int)(FD_SETSIZE - 64) / 2);
+#endif
+    if (nPeers > nMaxPeers) {
+        printf("limiting to %u peers by the number of file descriptors\n", nMaxPeers);
+        nPeers = nMaxPeers;
+    }
+    // with room for the slots kept for outbound connections
+    nMaxConnections = nPeers + 16;
+
+    unsigned short nPort = 0;
+    std::string strError;
+    for (int i = 0; i < 20 && nPort == 0; i++) {
+        unsigned short n = 20000 + GetRand(20000);
+        if (BindListenPort(CService("127.0.0.1", n), strError))
+            nPort = n;
+    }
+    if (nPort == 0) {
+        fprintf(stderr, "cannot listen on the loopback interface: %s\n", strError.c_str());
+        return 1;
+    }
+
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadSocketHandler);
+    if (nPayload > 0)
+        threadGroup.create_thread(&ThreadConsume);
+
+    std::vector<int> vSocket;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(nPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (unsigned int i = 0; i < nPeers; i++) {
+        int hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hSocket < 0 || connect(hSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "connection %u failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        fcntl(hSocket, F_SETFL, O_NONBLOCK);
+        vSocket.push_back(hSocket);
+    }
+    while (true) {
+        LOCK(cs_vNodes);
+        if (vNodes.size() >= nPeers)
+            break;
+        MilliSleep(10);
+    }
+
+    // every peer sends a message, or what is left of it, in turn
+    std::string strMessage = MakeMessage(nPayload);
+    std::vector<size_t> vOffset(nPeers, 0);
+    int64_t nStart = GetTimeMicros();
+    double nCpuStart = CpuSeconds();
+    uint64_t nSent = 0;
+    while (GetTimeMicros() - nStart < nSeconds * 1000000) {
+        if (nPayload == 0) {
+            MilliSleep(10);
+            continue;
+        }
+        for (unsigned int i = 0; i < nPeers; i++) {
+            int n = send(vSocket[i], strMessage.data() + vOffset[i], strMessage.size() - vOffset[i], MSG_NOSIGNAL);
+            if (n > 0) {
+                vOffset[i] = (vOffset[i] + n) % strMessage.size();
+                nSent += n;
+            }
+        }
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    double nCpu = CpuSeconds() - nCpuStart;
+    uint64_t nReceived = nMessages, nReceivedBytes = nBytes;
+    unsigned int nConnected;
+    {
+        LOCK(cs_vNodes);
+        nConnected = vNodes.size();
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    BOOST_FOREACH(int hSocket, vSocket)
+        close(hSocket);
+
+#ifdef HAVE_SYS_EPOLL_H
+    const char* pszLoop = "epoll";
+#else
+    const char* pszLoop = "select";
+#endif
+    printf("%s, %u peers (%u connected at the end), %u byte payloads, %.1fs\n", pszLoop, nPeers, nConnected, nPayload, nElapsed / 1e6);
+    printf("%14s %14s %14s %10s\n", "messages/s", "MB/s received", "MB/s sent", "cpu %");
+    printf("%14.0f %14.2f %14.2f %10.1f\n", nReceived * 1e6 / nElapsed, nReceivedBytes / (double)nElapsed,
+           nSent / (double)nElapsed, 100.0 * nCpu * 1e6 / nElapsed);
+    return 0;
+}
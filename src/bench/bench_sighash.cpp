@@ -0,0 +1,66 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Time to compute the signature hash of every input of a consolidation
+// transaction (n pay-to-pubkey-hash inputs, one output), serializing the
+// transaction for each input and with its precomputed parts.
+// Usage: bench_sighash [max inputs]
+
+#include "core.h"
+#include "script.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static CTransaction ConsolidationTransaction(unsigned int nInputs)
+{
+    CTransaction tx;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        tx.vin[i].prevout = COutPoint(GetRandHash(), i % 4);
+        // a signature and a compressed public key
+        tx.vin[i].scriptSig << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 50 * COIN;
+    tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x01) << OP_EQUALVERIFY << OP_CHECKSIG;
+    return tx;
+}
+
+static int64_t HashAllInputs(const CTransaction& tx, const CScript& scriptCode, bool fPrecomputed, uint256& hashRet)
+{
+    int64_t nStart = GetTimeMicros();
+    CPrecomputedTransactionData txdata;
+    if (fPrecomputed)
+        txdata = CPrecomputedTransactionData(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        hashRet ^= SignatureHash(scriptCode, tx, i, SIGHASH_ALL, fPrecomputed ? &txdata : NULL);
+    return GetTimeMicros() - nStart;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nMaxInputs = argc > 1 ? atoi(argv[1]) : 5000;
+    if (nMaxInputs == 0) {
+        fprintf(stderr, "Usage: bench_sighash [max inputs]\n");
+        return 1;
+    }
+
+    CScript scriptCode = ConsolidationTransaction(1).vout[0].scriptPubKey;
+    printf("%8s %10s %14s %14s %8s\n", "inputs", "bytes", "serialize ms", "precomputed ms", "speedup");
+    for (unsigned int nInputs = 10; nInputs <= nMaxInputs; nInputs *= nInputs < 1000 ? 10 : 5) {
+        CTransaction tx = ConsolidationTransaction(nInputs);
+        uint256 hashSerialized = 0, hashPrecomputed = 0;
+        int64_t nSerialized = HashAllInputs(tx, scriptCode, false, hashSerialized);
+        int64_t nPrecomputed = HashAllInputs(tx, scriptCode, true, hashPrecomputed);
+        if (hashSerialized != hashPrecomputed) {
+            fprintf(stderr, "signature hashes differ for %u inputs\n", nInputs);
+            return 1;
+        }
+        printf("%8u %10u %14.2f %14.2f %7.1fx\n", nInputs, (unsigned int)::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION),
+               nSerialized / 1000.0, nPrecomputed / 1000.0, nPrecomputed ? (double)nSerialized / nPrecomputed : 0.0);
+    }
+    return 0;
+}
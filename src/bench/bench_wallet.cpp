@@ -0,0 +1,137 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// listtransactions and listsinceblock on a large wallet, through the ordered
+// and height indexes, against ordering every transaction on each call and
+// walking all of them as the calls used to. The wallet is in memory only, so
+// the accounting entries the old listtransactions read from disk are left out.
+// Usage: bench_wallet [transactions] [transactions per block]
+
+#include "init.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace json_spirit;
+
+void ListTransactions(const CWalletTx& wtx, const std::string& strAccount, int nMinDepth, bool fLong, Array& ret, const isminefilter& filter);
+
+// nTx payments to key, nPerBlock to a block of a chain made up for them
+static void MakeWallet(CWallet& wallet, const CKey& key, unsigned int nTx, unsigned int nPerBlock)
+{
+    wallet.LoadKey(key, key.GetPubKey());
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CBlockIndex* pindexPrev = NULL;
+    for (unsigned int i = 0; i < nTx; i++) {
+        if (i % nPerBlock == 0) {
+            CBlockIndex* pindex = new CBlockIndex();
+            BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first;
+            pindex->phashBlock = &mi->first;
+            pindex->pprev = pindexPrev;
+            pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+            pindexPrev = pindex;
+        }
+        CWalletTx wtx;
+        wtx.vin.resize(1);
+        wtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        wtx.vout.resize(1);
+        wtx.vout[0].nValue = COIN;
+        wtx.vout[0].scriptPubKey = scriptPubKey;
+        wtx.hashBlock = pindexPrev->GetBlockHash();
+        wtx.nIndex = i % nPerBlock;
+        // there are no real blocks to check the merkle branch against
+        wtx.fMerkleVerified = true;
+        wtx.nTimeReceived = i;
+        wtx.nOrderPos = wallet.nOrderPosNext++;
+        wallet.AddToWallet(wtx, true);
+    }
+    chainActive.SetTip(pindexPrev);
+    wallet.IndexTransactions();
+}
+
+// The previous listtransactions: order the whole wallet, then walk it back
+static unsigned int RebuildListTransactions(CWallet& wallet, int nCount, int nFrom)
+{
+    CWallet::TxItems txOrdered;
+    for (std::map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        txOrdered.insert(std::make_pair(it->second.nOrderPos, CWallet::TxPair(&it->second, (CAccountingEntry*)0)));
+    Array ret;
+    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
+        ListTransactions(*it->second.first, "*", 0, true, ret, ISMINE_SPENDABLE);
+        if ((int)ret.size() >= nCount + nFrom)
+            break;
+    }
+    return std::min((int)ret.size() - std::min((int)ret.size(), nFrom), nCount);
+}
+
+// The previous listsinceblock: a copy of every transaction and its depth
+static Value RebuildListSinceBlock(CWallet& wallet, const CBlockIndex* pindex)
+{
+    int depth = 1 + chainActive.Height() - pindex->nHeight;
+    Array transactions;
+    for (std::map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); it++) {
+        CWalletTx tx = it->second;
+        if (tx.GetDepthInMainChain() < depth)
+            ListTransactions(tx, "*", 0, true, transactions, ISMINE_SPENDABLE);
+    }
+    Object ret;
+    ret.push_back(Pair("transactions", transactions));
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nTx = argc > 1 ? atoi(argv[1]) : 500000;
+    unsigned int nPerBlock = argc > 2 ? atoi(argv[2]) : 50;
+    if (nTx == 0 || nPerBlock == 0) {
+        fprintf(stderr, "Usage: bench_wallet [transactions] [transactions per block]\n");
+        return 1;
+    }
+
+    CWallet wallet;
+    pwalletMain = &wallet;
+    CKey key;
+    key.MakeNewKey(true);
+    LOCK2(cs_main, wallet.cs_wallet);
+    int64_t nStart = GetTimeMicros();
+    MakeWallet(wallet, key, nTx, nPerBlock);
+    printf("%u transactions in %d blocks, loaded in %.1f ms\n", nTx, chainActive.Height() + 1, (GetTimeMicros() - nStart) / 1000.0);
+
+    printf("%-34s %8s %12s %12s\n", "call", "entries", "indexed ms", "rebuild ms");
+    int vFrom[] = {0, 1000, 100000};
+    for (unsigned int i = 0; i < sizeof(vFrom) / sizeof(vFrom[0]); i++) {
+        Array params;
+        params.push_back("*");
+        params.push_back(10);
+        params.push_back(vFrom[i]);
+        nStart = GetTimeMicros();
+        Value ret = listtransactions(params, false);
+        int64_t nIndexed = GetTimeMicros() - nStart;
+        nStart = GetTimeMicros();
+        RebuildListTransactions(wallet, 10, vFrom[i]);
+        int64_t nRebuild = GetTimeMicros() - nStart;
+        printf("listtransactions \"*\" 10 %-15d %8u %12.2f %12.2f\n", vFrom[i], (unsigned int)ret.get_array().size(), nIndexed / 1000.0, nRebuild / 1000.0);
+    }
+
+    int vBack[] = {10, 100, 1000};
+    for (unsigned int i = 0; i < sizeof(vBack) / sizeof(vBack[0]); i++) {
+        const CBlockIndex* pindex = chainActive[std::max(0, chainActive.Height() - vBack[i])];
+        Array params;
+        params.push_back(pindex->GetBlockHash().GetHex());
+        nStart = GetTimeMicros();
+        Value ret = listsinceblock(params, false);
+        int64_t nIndexed = GetTimeMicros() - nStart;
+        nStart = GetTimeMicros();
+        RebuildListSinceBlock(wallet, pindex);
+        int64_t nRebuild = GetTimeMicros() - nStart;
+        printf("listsinceblock %4d blocks back         %8u %12.2f %12.2f\n", vBack[i],
+               (unsigned int)find_value(ret.get_obj(), "transactions").get_array().size(), nIndexed / 1000.0, nRebuild / 1000.0);
+    }
+    return 0;
+}
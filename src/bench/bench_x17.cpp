@@ -0,0 +1,106 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// X17 throughput with 1, 2, 4... threads hashing block headers at once, each
+// with the context HashX17 keeps on its stack and with a context of its own
+// reused for every hash. Every hash is checked against a serial run, so this
+// also shows that hashes running concurrently do not disturb each other.
+// Usage: bench_x17 [max threads] [seconds per run]
+
+#include "hash.h"
+#include "hashx17.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+static const unsigned int HEADER_SIZE = 80;
+// Headers every thread cycles through, with their expected hashes
+static const unsigned int CHECK_HEADERS = 64;
+
+static std::vector<uint256> vExpected;
+
+struct CResult
+{
+    uint64_t nHashes;
+    bool fMismatch;
+
+    CResult() : nHashes(0), fMismatch(false) {}
+};
+
+static void SetNonce(char* header, uint32_t nNonce)
+{
+    memcpy(header + HEADER_SIZE - 4, &nNonce, 4);
+}
+
+static void HashLoop(bool fReuse, int64_t nEnd, CResult* presult)
+{
+    char header[HEADER_SIZE];
+    memset(header, 0x5a, HEADER_SIZE);
+    CX17Context ctx;
+    uint64_t nHashes = 0;
+    while (GetTimeMicros() < nEnd) {
+        for (uint32_t i = 0; i < CHECK_HEADERS; i++) {
+            SetNonce(header, i);
+            uint256 hash = fReuse ? HashX17(header, header + HEADER_SIZE, ctx) : hash_x17(header, header + HEADER_SIZE);
+            if (hash != vExpected[i])
+                presult->fMismatch = true;
+        }
+        nHashes += CHECK_HEADERS;
+    }
+    presult->nHashes = nHashes;
+}
+
+static double HashesPerSec(unsigned int nThreads, bool fReuse, int64_t nMicros, bool& fMismatch)
+{
+    std::vector<CResult> vResult(nThreads);
+    int64_t nStart = GetTimeMicros();
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&HashLoop, fReuse, nStart + nMicros, &vResult[i]));
+    threads.join_all();
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    uint64_t nTotal = 0;
+    for (unsigned int i = 0; i < nThreads; i++) {
+        nTotal += vResult[i].nHashes;
+        if (vResult[i].fMismatch)
+            fMismatch = true;
+    }
+    return nTotal * 1000000.0 / nElapsed;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nMaxThreads = argc > 1 ? atoi(argv[1]) : std::max(4U, boost::thread::hardware_concurrency());
+    double dSeconds = argc > 2 ? atof(argv[2]) : 2;
+    if (nMaxThreads == 0 || dSeconds <= 0) {
+        fprintf(stderr, "Usage: bench_x17 [max threads] [seconds per run]\n");
+        return 1;
+    }
+
+    char header[HEADER_SIZE];
+    memset(header, 0x5a, HEADER_SIZE);
+    for (uint32_t i = 0; i < CHECK_HEADERS; i++) {
+        SetNonce(header, i);
+        vExpected.push_back(hash_x17(header, header + HEADER_SIZE));
+    }
+
+    printf("%d cores\n", boost::thread::hardware_concurrency());
+    printf("%8s %18s %18s\n", "threads", "stack ctx hash/s", "reused ctx hash/s");
+    bool fMismatch = false;
+    for (unsigned int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2) {
+        double dStack = HashesPerSec(nThreads, false, dSeconds * 1000000, fMismatch);
+        double dReused = HashesPerSec(nThreads, true, dSeconds * 1000000, fMismatch);
+        printf("%8u %18.0f %18.0f\n", nThreads, dStack, dReused);
+    }
+    if (fMismatch) {
+        fprintf(stderr, "concurrent hashes differ from the serial ones\n");
+        return 1;
+    }
+    return 0;
+}
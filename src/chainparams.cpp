@@ -51,7 +51,7 @@ public:
         vAlertPubKey = ParseHex("04bf5a75ff0f823840ef512b08add20bb4275ff6e097f2830ad28645e28cb5ea4dc2cfd0972b94019ad46f331b45ef4ba679f2e6c87fd19c864365fadb4f8d2269");
         nDefaultPort = 9265;
         nRPCPort = 9266;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 32);
+        bnProofOfWorkLimit = ~arith_uint256(0) >> 32;
         nSubsidyHalvingInterval = 788000;
 	fStrictChainId = true;
 	nAuxpowChainId = 0x005B;
@@ -164,7 +164,7 @@ public:
         vAlertPubKey = ParseHex("0468770c9d451dd5d6d373ae6096d4ab0705c4ab66e55cc25c40788580039bd04b7672322b9bd26ce22a3ad95f490d7d188a905ce30246b2425eca8cc5102190d0");
         nDefaultPort = 19265;
         nRPCPort = 19266;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 8);
+        bnProofOfWorkLimit = ~arith_uint256(0) >> 8;
         strDataDir = "testnet4";
 	fStrictChainId = true;
 	nAuxpowChainId = 0x005B;
@@ -228,7 +228,7 @@ public:
         pchMessageStart[2] = 0xb5;
         pchMessageStart[3] = 0xda;
         nSubsidyHalvingInterval = 300;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 1);
+        bnProofOfWorkLimit = ~arith_uint256(0) >> 1;
         genesis.nTime = 1405274400;
         genesis.nBits = 0x207fffff;
 	genesis.nNonce = 713058;
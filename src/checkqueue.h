@@ -6,7 +6,11 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include "util.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,6 +20,27 @@
 
 template<typename T> class CCheckQueueControl;
 
+/** Work done by one worker of a CCheckQueue since the control was created */
+struct CCheckQueueWorkerStats
+{
+    unsigned int nChecks;
+    // batches taken from another worker's queue
+    unsigned int nSteals;
+    // time spent running checks; the rest of the wall time it was idle
+    int64_t nBusyMicros;
+};
+
+/** Work done by a CCheckQueue for one CCheckQueueControl (one block) */
+struct CCheckQueueStats
+{
+    unsigned int nChecks;
+    int64_t nWallMicros;
+    // worker 0 is the master
+    std::vector<CCheckQueueWorkerStats> vWorker;
+
+    CCheckQueueStats() : nChecks(0), nWallMicros(0) {}
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -24,10 +49,27 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker owns a deque. The master spreads added checks over them,
+  * a worker takes batches from the back of its own deque, and a worker
+  * that ran out steals half of another one's from the front, so workers
+  * only meet on the shared mutex when they go to sleep or are woken.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+
+        // Statistics since the last ResetStats
+        std::atomic<unsigned int> nChecks;
+        std::atomic<unsigned int> nSteals;
+        std::atomic<int64_t> nBusyMicros;
+
+        WorkerQueue() : nChecks(0), nSteals(0), nBusyMicros(0) {}
+    };
+
+    // Mutex for sleeping, waking up and registering workers
     boost::mutex mutex;
 
     // Worker threads block on this when out of work
@@ -36,23 +78,26 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // The worker deques; 0 belongs to the master. Workers register while
+    // others may be reading the list, so it is replaced rather than
+    // modified, and the old lists are kept until destruction.
+    std::atomic<std::vector<WorkerQueue*>*> pvQueues;
+    std::vector<std::vector<WorkerQueue*>*> vOldQueues;
 
-    // The number of workers (including the master) that are idle.
-    int nIdle;
+    // Bumped under mutex whenever checks become available to steal, so a
+    // worker that found nothing knows whether it can go to sleep.
+    std::atomic<uint64_t> nGeneration;
 
-    // The total number of workers (including the master).
-    int nTotal;
+    // The number of workers (excluding the master) that are asleep.
+    int nIdle;
 
     // The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
+    // This includes elements that are not anymore in a deque, but still in
     // worker's own batches.
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
     // Whether we're shutting down.
     bool fQuit;
@@ -60,96 +105,213 @@ private:
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Deque the next Add starts spreading checks from
+    unsigned int nNextQueue;
+
+    // Start of the current statistics period, and its length once finished
+    int64_t nStatsStart;
+    int64_t nStatsWall;
+
+    unsigned int Register() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::vector<WorkerQueue*> *pvOld = pvQueues.load();
+        std::vector<WorkerQueue*> *pvNew = new std::vector<WorkerQueue*>(*pvOld);
+        pvNew->push_back(new WorkerQueue());
+        pvQueues.store(pvNew);
+        vOldQueues.push_back(pvOld);
+        return pvNew->size() - 1;
+    }
+
+    // Let sleeping workers know there are checks to take.
+    void Wake(bool fAll) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGeneration++;
+        if (nIdle == 0)
+            return;
+        if (fAll)
+            condWorker.notify_all();
+        else
+            condWorker.notify_one();
+    }
+
+    // Take a batch of checks, from our own deque if possible, else by
+    // stealing from another worker. Returns false if all deques were empty.
+    bool TakeWork(unsigned int nQueue, std::vector<T> &vChecks) {
+        const std::vector<WorkerQueue*> &vQueues = *pvQueues.load();
+        WorkerQueue &own = *vQueues[nQueue];
+        {
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            if (!own.queue.empty()) {
+                // Leave at least half behind for thieves, so the batches
+                // shrink and all workers finish approximately together.
+                unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)own.queue.size() / 2));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++) {
+                    // Swap rather than copy to keep the critical section short.
+                    vChecks[i].swap(own.queue.back());
+                    own.queue.pop_back();
+                }
+                return true;
+            }
+        }
+
+        std::vector<T> vStolen;
+        for (unsigned int i = 1; i < vQueues.size() && vStolen.empty(); i++) {
+            WorkerQueue &victim = *vQueues[(nQueue + i) % vQueues.size()];
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            unsigned int nSteal = (victim.queue.size() + 1) / 2;
+            vStolen.resize(nSteal);
+            for (unsigned int j = 0; j < nSteal; j++) {
+                vStolen[j].swap(victim.queue.front());
+                victim.queue.pop_front();
+            }
+        }
+        if (vStolen.empty())
+            return false;
+        own.nSteals++;
+
+        unsigned int nNow = std::min(nBatchSize, (unsigned int)vStolen.size());
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++)
+            vChecks[i].swap(vStolen[vStolen.size() - nNow + i]);
+        if (vStolen.size() > nNow) {
+            {
+                boost::unique_lock<boost::mutex> lock(own.mutex);
+                for (unsigned int i = 0; i < vStolen.size() - nNow; i++) {
+                    own.queue.push_back(T());
+                    own.queue.back().swap(vStolen[i]);
+                }
+            }
+            Wake(false);
+        }
+        return true;
+    }
+
     // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
+    bool Loop(unsigned int nQueue, bool fMaster = false) {
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
+            uint64_t nSeen = nGeneration.load();
+            if (!TakeWork(nQueue, vChecks)) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+                if (fMaster && nTodo.load() == 0) {
+                    nStatsWall = GetTimeMicros() - nStatsStart;
+                    bool fRet = fAllOk.load();
+                    // reset the status for new work later
+                    fAllOk.store(true);
+                    // return the current status
+                    return fRet;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
+                if (!fMaster && fQuit)
+                    return fAllOk.load();
+                // new checks were added while we were looking
+                if (nGeneration.load() != nSeen)
+                    continue;
+                if (fMaster) {
+                    condMaster.wait(lock);
+                } else {
                     nIdle++;
-                    cond.wait(lock); // wait
+                    condWorker.wait(lock); // wait
                     nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
+
             // execute work
+            WorkerQueue &own = *(*pvQueues.load())[nQueue];
+            int64_t nStart = GetTimeMicros();
+            // Check whether we need to do work at all
+            bool fOk = fAllOk.load();
             BOOST_FOREACH(T &check, vChecks)
                 if (fOk)
                     fOk = check();
+            own.nBusyMicros += GetTimeMicros() - nStart;
+            own.nChecks += vChecks.size();
+            if (!fOk)
+                fAllOk.store(false);
+            unsigned int nNow = vChecks.size();
             vChecks.clear();
+            if (nTodo.fetch_sub(nNow) == nNow) {
+                // We processed the last element; inform the master he can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_one();
+            }
         } while(true);
     }
 
+    void ResetStats() {
+        const std::vector<WorkerQueue*> &vQueues = *pvQueues.load();
+        BOOST_FOREACH(WorkerQueue *pqueue, vQueues) {
+            pqueue->nChecks.store(0);
+            pqueue->nSteals.store(0);
+            pqueue->nBusyMicros.store(0);
+        }
+        nStatsStart = GetTimeMicros();
+        nStatsWall = 0;
+    }
+
 public:
     // Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+        nGeneration(0), nIdle(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn),
+        nNextQueue(0), nStatsStart(0), nStatsWall(0) {
+        pvQueues.store(new std::vector<WorkerQueue*>(1, new WorkerQueue()));
+    }
 
     // Worker thread
     void Thread() {
-        Loop();
+        Loop(Register());
     }
 
     // Wait until execution finishes, and return whether all evaluations where succesful.
     bool Wait() {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // count them first, so no worker can finish them before they are
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        const std::vector<WorkerQueue*> &vQueues = *pvQueues.load();
+        unsigned int nQueues = vQueues.size();
+        unsigned int nChunk = (vChecks.size() + nQueues - 1) / nQueues;
+        for (unsigned int i = 0; i < vChecks.size(); i += nChunk) {
+            WorkerQueue &queue = *vQueues[nNextQueue];
+            nNextQueue = (nNextQueue + 1) % nQueues;
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            for (unsigned int j = i; j < std::min(i + nChunk, (unsigned int)vChecks.size()); j++) {
+                queue.queue.push_back(T());
+                vChecks[j].swap(queue.queue.back());
+            }
+        }
+        Wake(vChecks.size() > 1);
+    }
+
+    // Statistics of the last finished control
+    void GetStats(CCheckQueueStats &stats) {
+        const std::vector<WorkerQueue*> &vQueues = *pvQueues.load();
+        stats.nChecks = 0;
+        stats.nWallMicros = nStatsWall;
+        stats.vWorker.resize(vQueues.size());
+        for (unsigned int i = 0; i < vQueues.size(); i++) {
+            CCheckQueueWorkerStats &worker = stats.vWorker[i];
+            worker.nChecks = vQueues[i]->nChecks.load();
+            worker.nSteals = vQueues[i]->nSteals.load();
+            worker.nBusyMicros = vQueues[i]->nBusyMicros.load();
+            stats.nChecks += worker.nChecks;
+        }
     }
 
     ~CCheckQueue() {
+        std::vector<WorkerQueue*> *pvCurrent = pvQueues.load();
+        BOOST_FOREACH(WorkerQueue *pqueue, *pvCurrent)
+            delete pqueue;
+        delete pvCurrent;
+        BOOST_FOREACH(std::vector<WorkerQueue*> *pvOld, vOldQueues)
+            delete pvOld;
     }
 
     friend class CCheckQueueControl<T>;
@@ -167,9 +329,9 @@ public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
             assert(pqueue->nTodo == 0);
             assert(pqueue->fAllOk == true);
+            pqueue->ResetStats();
         }
     }
 
@@ -186,6 +348,14 @@ public:
             pqueue->Add(vChecks);
     }
 
+    // Work done by the queue for this control; call after Wait
+    bool GetStats(CCheckQueueStats &stats) {
+        if (pqueue == NULL || !fDone)
+            return false;
+        pqueue->GetStats(stats);
+        return true;
+    }
+
     ~CCheckQueueControl() {
         if (!fDone)
             Wait();
@@ -6,7 +6,9 @@
 #ifndef BITMARK_COINS_H
 #define BITMARK_COINS_H
 
+#include "allocators.h"
 #include "core.h"
+#include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
 
@@ -14,10 +16,12 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
 
 /** pruned version of CTransaction: only retains metadata and unspent transaction outputs
  *
- * Serialized format:
+ * Serialized format (of the coin database records before per output records,
+ * read when upgrading):
  * - VARINT(nVersion)
  * - VARINT(nCode)
  * - unspentness bitvector, for vout[2] and further; least significant byte first
@@ -90,6 +94,14 @@ public:
     // empty constructor
     CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
 
+    // return to the empty state, releasing vout's memory
+    void Clear() {
+        fCoinBase = false;
+        std::vector<CTxOut>().swap(vout);
+        nHeight = 0;
+        nVersion = 0;
+    }
+
     // remove spent outputs at the end of vout
     void Cleanup() {
         while (vout.size() > 0 && vout.back().IsNull())
@@ -238,8 +250,57 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory used by the outputs
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += memusage::DynamicUsage(out.scriptPubKey);
+        return nUsage;
+    }
+};
+
+/** Hashes txids for the coins cache with a secret salt, so that an attacker
+ *  cannot choose transactions that end up in the same bucket. */
+class CCoinsKeyHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CCoinsKeyHasher();
+
+    size_t operator()(const uint256& key) const {
+        uint64_t w0, w1;
+        memcpy(&w0, key.begin(), 8);
+        memcpy(&w1, key.begin() + 8, 8);
+        uint64_t h = (w0 ^ k0) * 0x9e3779b97f4a7c15ULL;
+        h ^= (w1 ^ k1) + (h >> 29);
+        h *= 0xbf58476d1ce4e5b9ULL;
+        return h ^ (h >> 32);
+    }
 };
 
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+    // Size of coins.vout when fetched from the parent view: outputs the parent
+    // may hold, so that writing the entry back needs no read.
+    unsigned int nBaseOutputs;
+
+    enum Flags {
+        DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
+        FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        REPLACED = (1 << 2), // Set as a whole, so its unspent outputs may differ from the parent's version.
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0), nBaseOutputs(0) {}
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+                             pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
+
 
 struct CCoinsStats
 {
@@ -275,8 +336,9 @@ public:
     // Modify the currently active block hash
     virtual bool SetBestBlock(const uint256 &hashBlock);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // The passed mapCoins can be modified.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -300,20 +362,52 @@ public:
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats);
 };
 
 
-/** CCoinsView that adds a memory cache for transactions to another CCoinsView */
+class CCoinsViewCache;
+
+/** A reference to a mutable cache entry. Encapsulating it allows us to run
+ *  cleanup code after the modification is finished, and keeping track of
+ *  concurrent modifications. */
+class CCoinsModifier
+{
+private:
+    CCoinsViewCache& cache;
+    CCoinsMap::iterator it;
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
+
+public:
+    CCoins* operator->() { return &it->second.coins; }
+    CCoins& operator*() { return it->second.coins; }
+    ~CCoinsModifier();
+    friend class CCoinsViewCache;
+};
+
+/** CCoinsView that adds a memory cache for transactions to another CCoinsView.
+ *
+ * Entries are flagged DIRTY when modified, so that Flush only writes those,
+ * and FRESH when the parent view has no unspent version of them, so that a
+ * FRESH entry that gets fully spent is simply dropped.
+ */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     uint256 hashBlock;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Memory used by the CCoins in cacheCoins, beyond the map nodes
+    size_t cachedCoinsUsage;
+
+    // Whether a CCoinsModifier is outstanding
+    bool hasModifier;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
+    ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
@@ -321,20 +415,33 @@ public:
     bool HaveCoins(const uint256 &txid);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    // Return a pointer to the CCoins in the cache, or NULL if not found. This is
+    // more efficient than GetCoins. The pointer is only valid until the next
+    // modification of the cache.
+    const CCoins* AccessCoins(const uint256 &txid);
 
-    // Return a modifiable reference to a CCoins. Check HaveCoins first.
-    // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
-    CCoins &GetCoins(const uint256 &txid);
+    // Return a modifiable reference to a CCoins. If no entry with the given
+    // txid exists, a new one is created. Simultaneous modifications are not
+    // allowed.
+    CCoinsModifier ModifyCoins(const uint256 &txid);
+
+    // Add coins read from the base view ahead of time, unless the cache
+    // holds its own, possibly newer, version. Returns whether they were added.
+    bool Warm(const uint256 &txid, CCoins &coins);
 
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
+    // If false is returned, the state of this cache (and its backing view) will be undefined.
     bool Flush();
 
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage() const;
+
     /** Amount of bitmarks coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
@@ -352,8 +459,14 @@ public:
 
     const CTxOut &GetOutputFor(const CTxIn& input);
 
+    friend class CCoinsModifier;
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+
+    // By making the copy constructor private, we prevent accidentally using it
+    // when one intends to create a cache on top of a base cache.
+    CCoinsViewCache(const CCoinsViewCache &);
 };
 
 #endif
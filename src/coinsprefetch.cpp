@@ -0,0 +1,185 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <algorithm>
+#include <set>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+CCoinsPrefetcher::CCoinsPrefetcher(CCoinsViewDB &dbIn) : db(dbIn)
+{
+}
+
+void CCoinsPrefetcher::Thread()
+{
+    while (true) {
+        Job job;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                condJob.wait(lock);
+            job = queue.front();
+            queue.pop_front();
+        }
+        try {
+            Run(job);
+        } catch (boost::thread_interrupted &) {
+            Finish(job.pblock);
+            throw;
+        } catch (std::exception &e) {
+            LogPrintf("CCoinsPrefetcher::Thread() : %s\n", e.what());
+        }
+        Finish(job.pblock);
+    }
+}
+
+void CCoinsPrefetcher::Run(Job &job)
+{
+    if (job.vTxid.empty()) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, job.pos))
+            return;
+        // outputs created by the block itself are not in the database yet
+        std::set<uint256> setCreated;
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            setCreated.insert(tx.GetHash());
+        std::vector<uint256> vTxid;
+        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                if (!setCreated.count(txin.prevout.hash))
+                    vTxid.push_back(txin.prevout.hash);
+        }
+        std::sort(vTxid.begin(), vTxid.end());
+        vTxid.erase(std::unique(vTxid.begin(), vTxid.end()), vTxid.end());
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (job.pblock->fCancelled)
+            return;
+        for (unsigned int i = 0; i < vTxid.size(); i += LOOKUP_BATCH) {
+            Job lookup;
+            lookup.pblock = job.pblock;
+            lookup.vTxid.assign(vTxid.begin() + i, vTxid.begin() + std::min((size_t)i + LOOKUP_BATCH, vTxid.size()));
+            queue.push_back(lookup);
+            job.pblock->nJobs++;
+        }
+        condJob.notify_all();
+        return;
+    }
+
+    // Read before the lookups: a write that lands meanwhile makes them stale
+    unsigned int nWriteCount = db.GetWriteCount();
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+    vCoins.reserve(job.vTxid.size());
+    BOOST_FOREACH(const uint256 &txid, job.vTxid) {
+        boost::this_thread::interruption_point();
+        CCoins coins;
+        if (db.GetCoins(txid, coins)) {
+            vCoins.push_back(std::make_pair(txid, CCoins()));
+            vCoins.back().second.swap(coins);
+        }
+    }
+
+    // stored even if the block was cancelled meanwhile: Apply waits for them
+    boost::unique_lock<boost::mutex> lock(mutex);
+    Block &block = *job.pblock;
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        block.vCoins.push_back(std::make_pair(vCoins[i].first, CCoins()));
+        block.vCoins.back().second.swap(vCoins[i].second);
+        block.vWriteCount.push_back(nWriteCount);
+    }
+}
+
+void CCoinsPrefetcher::Finish(Block *pblock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (--pblock->nJobs == 0)
+        condDone.notify_all();
+}
+
+// Drop the queued jobs of a block and queue no more; the running ones still
+// store their results. Requires mutex.
+void CCoinsPrefetcher::Cancel(Block *pblock)
+{
+    pblock->fCancelled = true;
+    for (std::deque<Job>::iterator it = queue.begin(); it != queue.end(); ) {
+        if (it->pblock == pblock) {
+            it = queue.erase(it);
+            pblock->nJobs--;
+        } else
+            it++;
+    }
+}
+
+void CCoinsPrefetcher::Prefetch(const uint256 &hashBlock, const CDiskBlockPos &pos)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    BOOST_FOREACH(const Block &block, listBlocks)
+        if (block.hash == hashBlock)
+            return;
+
+    // Blocks that were never applied, for instance after a reorganisation.
+    // This runs under cs_main, so it does not wait for their reads in
+    // progress: such a block is dropped by a later call once they are done,
+    // and until then this block is not prefetched
+    size_t nEvict = listBlocks.size() >= MAX_PENDING_BLOCKS ? listBlocks.size() + 1 - MAX_PENDING_BLOCKS : 0;
+    std::list<Block>::iterator it = listBlocks.begin();
+    for (; nEvict > 0; nEvict--) {
+        Cancel(&*it);
+        if (it->nJobs == 0)
+            it = listBlocks.erase(it);
+        else
+            it++;
+    }
+    if (listBlocks.size() >= MAX_PENDING_BLOCKS)
+        return;
+
+    listBlocks.push_back(Block());
+    Block &block = listBlocks.back();
+    block.hash = hashBlock;
+    block.fCancelled = false;
+    block.nJobs = 1;
+    Job job;
+    job.pblock = &block;
+    job.pos = pos;
+    queue.push_back(job);
+    condJob.notify_one();
+}
+
+unsigned int CCoinsPrefetcher::Apply(const uint256 &hashBlock, CCoinsViewCache &cache)
+{
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+    std::vector<unsigned int> vWriteCount;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::list<Block>::iterator it = listBlocks.begin();
+        while (it != listBlocks.end() && it->hash != hashBlock)
+            it++;
+        if (it == listBlocks.end())
+            return 0;
+        // whatever was not started yet is looked up by ConnectBlock itself,
+        // the reads in progress are worth waiting for
+        Cancel(&*it);
+        while (it->nJobs > 0)
+            condDone.wait(lock);
+        vCoins.swap(it->vCoins);
+        vWriteCount.swap(it->vWriteCount);
+        listBlocks.erase(it);
+    }
+
+    unsigned int nWriteCount = db.GetWriteCount();
+    unsigned int nApplied = 0;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        if (vWriteCount[i] == nWriteCount && cache.Warm(vCoins[i].first, vCoins[i].second))
+            nApplied++;
+    return nApplied;
+}
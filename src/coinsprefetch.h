@@ -0,0 +1,97 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_COINSPREFETCH_H
+#define BITMARK_COINSPREFETCH_H
+
+#include "coins.h"
+#include "core.h"
+#include "uint256.h"
+
+#include <deque>
+#include <list>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CCoinsViewDB;
+
+/** Default for -prefetchthreads, the number of coin database readers (0 disables prefetching) */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+
+/**
+ * Reads the coins spent by a block from the coin database ahead of time,
+ * while the block before it is being connected, so that ConnectBlock finds
+ * them in memory instead of going to disk one input at a time.
+ *
+ * Prefetch queues a block; reader threads load it from disk and look up its
+ * prevouts in parallel. Apply, called by the thread connecting the block,
+ * cancels what was not started, waits for the reads in progress and adds
+ * the results to the coins cache.
+ *
+ * Results are only valid as long as the database has not been written
+ * since they were read, and only for coins the cache does not hold itself,
+ * as those may be newer. Apply drops everything else.
+ */
+class CCoinsPrefetcher
+{
+public:
+    explicit CCoinsPrefetcher(CCoinsViewDB &dbIn);
+
+    /** Reader thread; runs until interrupted */
+    void Thread();
+
+    /** Start prefetching the coins spent by the block stored at pos; never
+        waits, and does nothing while older blocks still being read take up
+        every slot */
+    void Prefetch(const uint256 &hashBlock, const CDiskBlockPos &pos);
+
+    /** Add what was prefetched for a block to cache; returns the number of coins added */
+    unsigned int Apply(const uint256 &hashBlock, CCoinsViewCache &cache);
+
+private:
+    // Number of prevout txids a reader looks up in one go
+    static const unsigned int LOOKUP_BATCH = 64;
+    // Blocks prefetched but not applied that are kept around
+    static const unsigned int MAX_PENDING_BLOCKS = 4;
+
+    struct Block
+    {
+        uint256 hash;
+        // no more jobs are queued
+        bool fCancelled;
+        // jobs queued or running
+        unsigned int nJobs;
+        std::vector<std::pair<uint256, CCoins> > vCoins;
+        // coin database write count when each result was read
+        std::vector<unsigned int> vWriteCount;
+    };
+
+    struct Job
+    {
+        Block *pblock;
+        // empty: read the block from pos and queue its lookups
+        std::vector<uint256> vTxid;
+        CDiskBlockPos pos;
+    };
+
+    CCoinsViewDB &db;
+
+    boost::mutex mutex;
+    boost::condition_variable condJob;
+    boost::condition_variable condDone;
+    std::deque<Job> queue;
+    std::list<Block> listBlocks;
+
+    CCoinsPrefetcher(const CCoinsPrefetcher&);
+    CCoinsPrefetcher& operator=(const CCoinsPrefetcher&);
+
+    void Run(Job &job);
+    void Finish(Block *pblock);
+    void Cancel(Block *pblock);
+};
+
+#endif // BITMARK_COINSPREFETCH_H
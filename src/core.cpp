@@ -380,6 +380,38 @@ bool CBlockIndex::IsSuperMajorityVariant2(int minVersion, bool variant, const CB
   return (nFound >= nRequired);
 }
 
+void CBlockIndex::BuildAlgoLinks()
+{
+  fAlgoLinks = false;
+  for (int algo = 0; algo < NUM_ALGOS; algo++)
+    pprevAlgo[algo] = NULL;
+  if (pprev && !pprev->fAlgoLinks)
+    return;
+
+  fOnFork = onFork();
+  if (pprev && pprev->fOnFork) {
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+      pprevAlgo[algo] = pprev->pprevAlgo[algo];
+    pprevAlgo[pprev->GetAlgo()] = pprev;
+  }
+  fAlgoLinks = true;
+}
+
+CBlockIndex* CBlockIndex::GetPrevAlgo(int algo) const
+{
+  if (!onFork() || algo < 0 || algo >= NUM_ALGOS)
+    return NULL;
+  if (fAlgoLinks)
+    return pprevAlgo[algo];
+  CBlockIndex* pindex = pprev;
+  while (pindex && pindex->onFork()) {
+    if (pindex->GetAlgo() == algo)
+      return pindex;
+    pindex = pindex->pprev;
+  }
+  return NULL;
+}
+
 int64_t CBlockIndex::GetMedianTime() const
 {
   AssertLockHeld(cs_main);
@@ -657,9 +689,9 @@ bool CheckAuxPowProofOfWork(const CBlockHeader& block, const CChainParams& param
 
   if(fDebug)
     {
-      CBigNum bnTarget;
+      arith_uint256 bnTarget;
       bnTarget.SetCompact(block.nBits);
-      uint256 target = bnTarget.getuint256();
+      uint256 target = ArithToUint256(bnTarget);
 
       LogPrintf("DEBUG: proof-of-work submitted  \n  parent-PoWhash: %s\n  target: %s  bits: %08x \n",
 		block.auxpow->getParentBlockPoWHash(algo).ToString().c_str(),
@@ -690,24 +722,5 @@ bool CheckAuxPowProofOfWork(const CBlockHeader& block, const CChainParams& param
 //   As of June, 2018 these values are closely reflective of market values seen on
 //      nicehash.com and miningrigrentals.com
 unsigned int GetAlgoWeight (const int algo) {
-  unsigned int weight = 8000; // scrypt, lyra2rev2 and 17 share this value.
-  switch (algo)
-    {
-    case ALGO_SHA256D:
-      weight = 1;
-      break;
-    case ALGO_ARGON2:
-      weight = 4000000;
-      break;
-    case ALGO_EQUIHASH:
-      weight = 8000000;
-      break;
-    case ALGO_CRYPTONIGHT:
-      weight = 8000000;
-      break;
-    case ALGO_YESCRYPT:
-      weight = 800000;
-      break;
-    }
-  return weight;
+  return GetPoWAlgo(algo).nWeight;
 }
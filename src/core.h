@@ -10,6 +10,7 @@
 #include "script.h"
 #include "serialize.h"
 #include "uint256.h"
+#include "arith_uint256.h"
 #include "scrypt.h"
 #include <stdint.h>
 #include "hash.h"
@@ -810,9 +811,6 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    // pointer to the AuxPoW header, if this block has one
-    boost::shared_ptr<CAuxPow> pauxpow;
-
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -820,7 +818,7 @@ public:
     int64_t nMoneySupply;
 
     // the scaling factor for the block
-    CBigNum subsidyScalingFactor;
+    arith_uint256 subsidyScalingFactor;
     
     // Which # file this block is stored in (blk?????.dat)
     int nFile;
@@ -850,18 +848,29 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
-    uint256 nNonce256;
-    std::vector<unsigned char> nSolution;
-    uint256 hashReserved;
+    // the auxpow and Equihash fields of the header are not kept here, see CBlockIndexAux
 
     // (memory only) Sequencial id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+    // (memory only) nearest ancestor of each algo within the run of post-fork blocks
+    // directly preceding this one, filled in by BuildAlgoLinks()
+    CBlockIndex* pprevAlgo[NUM_ALGOS];
+
+    // (memory only) cached result of onFork(), valid once fAlgoLinks is set
+    bool fOnFork;
+
+    // (memory only) whether pprevAlgo and fOnFork have been filled in
+    bool fAlgoLinks;
+
     void SetNull()
     {
         phashBlock = NULL;
         pprev = NULL;
-	pauxpow.reset();
+        for (int algo = 0; algo < NUM_ALGOS; algo++)
+            pprevAlgo[algo] = NULL;
+        fOnFork = false;
+        fAlgoLinks = false;
         nHeight = 0;
         nMoneySupply = 0;
 	subsidyScalingFactor = 0;
@@ -895,10 +904,6 @@ public:
       nTime          = block.nTime;
       nBits          = block.nBits;
       nNonce         = block.nNonce;
-      hashReserved = block.hashReserved;
-      nNonce256 = block.nNonce256;
-      nSolution = block.nSolution;
-      
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -920,6 +925,7 @@ public:
     }
 
     bool onFork() const {
+      if (fAlgoLinks) return fOnFork;
       if (this->nHeight >= nForkHeight && IsSuperMajority(4,this->pprev,75,100)) return true;
       return false;
     }
@@ -976,22 +982,24 @@ public:
         return (int64_t)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    // 2**256 / (target/weight + 1), which is 257 bits wide for the hardest targets
+    arith_uint320 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative;
+        bool fOverflow;
+        arith_uint320 bnTarget;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
 	unsigned int algo_weight = GetAlgoWeight(this->GetAlgo());
-	CBigNum weight(algo_weight);
-	//LogPrintf("algo is %d and weight is %lu\n",nVersion & BLOCK_VERSION_ALGO,weight.getulong());
-        return (CBigNum(1)<<256) / (bnTarget/weight+1);
+	//LogPrintf("algo is %d and weight is %u\n",nVersion & BLOCK_VERSION_ALGO,algo_weight);
+        return (arith_uint320(1)<<256) / (bnTarget/algo_weight+1);
     }
   
     // Get Average Work of latest 50 Blocks
-    CBigNum GetBlockWorkAv() const
+    arith_uint320 GetBlockWorkAv() const
     {
-      CBigNum work = 0;
+      arith_uint320 work = 0;
       const CBlockIndex * pindex = this;
       int n = 0;
       for (int i=0; i<50; i++) {
@@ -1030,6 +1038,20 @@ public:
 
     int64_t GetMedianTime() const;
 
+    /**
+     * Fill in pprevAlgo and cache the fork state, so that get_pprev_algo is a
+     * single lookup instead of a walk over pprev. Requires pprev (if any) to
+     * have its links built already; otherwise the links are left unset and
+     * callers fall back to walking the chain.
+     */
+    void BuildAlgoLinks();
+
+    /**
+     * Previous block of the given algo, as get_pprev_algo would find it by
+     * walking pprev. Returns NULL if this block is not on the fork.
+     */
+    CBlockIndex* GetPrevAlgo(int algo) const;
+
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
      * in the last nToCheck blocks, starting at pstart and going backwards.
@@ -1096,8 +1118,45 @@ public:
 
 };
 
+/**
+ * The parts of a block header that CBlockIndex does not keep in memory: the
+ * auxpow and the Equihash nonce, solution and reserved hash. They are only
+ * needed to rewrite the block's record in the block tree db, so they are read
+ * back from there on demand (see GetBlockIndexAux in main.h).
+ */
+class CBlockIndexAux
+{
+public:
+    // the AuxPoW header, if this block has one
+    boost::shared_ptr<CAuxPow> pauxpow;
+    uint256 nNonce256;
+    std::vector<unsigned char> nSolution;
+    uint256 hashReserved;
+
+    CBlockIndexAux()
+    {
+        SetNull();
+    }
+
+    explicit CBlockIndexAux(const CBlockHeader& block)
+    {
+        pauxpow      = block.auxpow;
+        nNonce256    = block.nNonce256;
+        nSolution    = block.nSolution;
+        hashReserved = block.hashReserved;
+    }
+
+    void SetNull()
+    {
+        pauxpow.reset();
+        nNonce256 = 0;
+        nSolution.clear();
+        hashReserved = 0;
+    }
+};
+
 /** Used to marshal pointers into hashes for db storage. */
-class CDiskBlockIndex : public CBlockIndex
+class CDiskBlockIndex : public CBlockIndex, public CBlockIndexAux
 {
 public:
     uint256 hashPrev;
@@ -1106,7 +1165,7 @@ public:
       SetNull();
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
+    CDiskBlockIndex(CBlockIndex* pindex, const CBlockIndexAux& aux) : CBlockIndex(*pindex), CBlockIndexAux(aux) {
       hashPrev = (pprev ? pprev->GetBlockHash() : 0);
     }
 
@@ -1278,7 +1337,7 @@ public:
  
     void SetNull() {
       CBlockIndex::SetNull();
-      pauxpow.reset();
+      CBlockIndexAux::SetNull();
       hashPrev = 0;
     }
       
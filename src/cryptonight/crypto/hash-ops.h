@@ -75,11 +75,16 @@ extern "C" {
 
 enum {
   HASH_SIZE = 32,
-  HASH_DATA_AREA = 136
+  HASH_DATA_AREA = 136,
+  SLOW_HASH_SCRATCHPAD_SIZE = 1 << 21
 };
 
 void cn_fast_hash(const void *data, size_t length, char *hash);
 void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed);
+/* Same as cn_slow_hash, with the 2MB scratchpad supplied by the caller */
+void cn_slow_hash_ctx(const void *data, size_t length, char *hash, int variant, int prehashed, uint8_t *scratchpad);
+uint8_t *cn_slow_hash_alloc_scratchpad(int *mapped);
+void cn_slow_hash_free_scratchpad(uint8_t *scratchpad, int mapped);
 
 void hash_extra_blake(const void *data, size_t length, char *hash);
 void hash_extra_groestl(const void *data, size_t length, char *hash);
@@ -89,6 +89,110 @@ extern int aesb_pseudo_round(const uint8_t *in, uint8_t *out, const uint8_t *exp
   } \
   const uint64_t tweak1_2 = variant > 0 ? (state.hs.w[24] ^ (*((const uint64_t*)NONCE_POINTER))) : 0
 
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+BOOL SetLockPagesPrivilege(HANDLE hProcess, BOOL bEnable)
+{
+    struct
+    {
+        DWORD count;
+        LUID_AND_ATTRIBUTES privilege[1];
+    } info;
+
+    HANDLE token;
+    if(!OpenProcessToken(hProcess, TOKEN_ADJUST_PRIVILEGES, &token))
+        return FALSE;
+
+    info.count = 1;
+    info.privilege[0].Attributes = bEnable ? SE_PRIVILEGE_ENABLED : 0;
+
+    if(!LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &(info.privilege[0].Luid)))
+        return FALSE;
+
+    if(!AdjustTokenPrivileges(token, FALSE, (PTOKEN_PRIVILEGES) &info, 0, NULL, NULL))
+        return FALSE;
+
+    if (GetLastError() != ERROR_SUCCESS)
+        return FALSE;
+
+    CloseHandle(token);
+
+    return TRUE;
+
+}
+#endif
+
+/**
+ * @brief allocate a MEMORY sized scratchpad, preferring huge pages
+ *
+ * Tries an explicit 2MB huge page first (MAP_HUGETLB / MEM_LARGE_PAGES), which
+ * needs pages reserved by the administrator.  Otherwise falls back to an
+ * aligned heap buffer; on Linux that buffer is marked for transparent huge
+ * pages, so it usually still ends up backed by a single 2MB page.
+ *
+ * @param mapped set to 1 if the buffer was mapped and 0 if it came from the heap;
+ *        pass it back to cn_slow_hash_free_scratchpad
+ * @return the scratchpad, or NULL if no memory could be allocated
+ */
+uint8_t *cn_slow_hash_alloc_scratchpad(int *mapped)
+{
+    uint8_t *pad = NULL;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    SetLockPagesPrivilege(GetCurrentProcess(), TRUE);
+    pad = (uint8_t *) VirtualAlloc(NULL, MEMORY, MEM_LARGE_PAGES |
+                                   MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+    pad = mmap(0, MEMORY, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(pad == MAP_FAILED)
+        pad = NULL;
+#endif
+    *mapped = 1;
+    if(pad != NULL)
+        return pad;
+
+    *mapped = 0;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    pad = (uint8_t *) _aligned_malloc(MEMORY, MEMORY);
+#else
+    if(posix_memalign((void **) &pad, MEMORY, MEMORY) != 0)
+        pad = NULL;
+#if defined(MADV_HUGEPAGE)
+    if(pad != NULL)
+        madvise(pad, MEMORY, MADV_HUGEPAGE);
+#endif
+#endif
+    return pad;
+}
+
+/**
+ * @brief free a scratchpad returned by cn_slow_hash_alloc_scratchpad
+ */
+void cn_slow_hash_free_scratchpad(uint8_t *pad, int mapped)
+{
+    if(pad == NULL)
+        return;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    if(mapped)
+        VirtualFree(pad, 0, MEM_RELEASE);
+    else
+        _aligned_free(pad);
+#else
+    if(mapped)
+        munmap(pad, MEMORY);
+    else
+        free(pad);
+#endif
+}
+
 #if !defined NO_AES && (defined(__x86_64__) || (defined(_MSC_VER) && defined(_WIN64)))
 // Optimised code below, uses x86-specific intrinsics, SSE2, AES-NI
 // Fall back to more portable code is down at the bottom
@@ -437,37 +541,6 @@ STATIC INLINE void aes_pseudo_round_xor(const uint8_t *in, uint8_t *out,
     }
 }
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-BOOL SetLockPagesPrivilege(HANDLE hProcess, BOOL bEnable)
-{
-    struct
-    {
-        DWORD count;
-        LUID_AND_ATTRIBUTES privilege[1];
-    } info;
-
-    HANDLE token;
-    if(!OpenProcessToken(hProcess, TOKEN_ADJUST_PRIVILEGES, &token))
-        return FALSE;
-
-    info.count = 1;
-    info.privilege[0].Attributes = bEnable ? SE_PRIVILEGE_ENABLED : 0;
-
-    if(!LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &(info.privilege[0].Luid)))
-        return FALSE;
-
-    if(!AdjustTokenPrivileges(token, FALSE, (PTOKEN_PRIVILEGES) &info, 0, NULL, NULL))
-        return FALSE;
-
-    if (GetLastError() != ERROR_SUCCESS)
-        return FALSE;
-
-    CloseHandle(token);
-
-    return TRUE;
-
-}
-#endif
 
 /**
  * @brief allocate the 2MB scratch buffer using OS support for huge pages, if available
@@ -486,28 +559,7 @@ void slow_hash_allocate_state(void)
     if(hp_state != NULL)
         return;
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-    SetLockPagesPrivilege(GetCurrentProcess(), TRUE);
-    hp_state = (uint8_t *) VirtualAlloc(hp_state, MEMORY, MEM_LARGE_PAGES |
-                                        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
-  defined(__DragonFly__)
-    hp_state = mmap(0, MEMORY, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANON, 0, 0);
-#else
-    hp_state = mmap(0, MEMORY, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
-#endif
-    if(hp_state == MAP_FAILED)
-        hp_state = NULL;
-#endif
-    hp_allocated = 1;
-    if(hp_state == NULL)
-    {
-        hp_allocated = 0;
-        hp_state = (uint8_t *) malloc(MEMORY);
-    }
+    hp_state = cn_slow_hash_alloc_scratchpad(&hp_allocated);
 }
 
 /**
@@ -516,20 +568,7 @@ void slow_hash_allocate_state(void)
 
 void slow_hash_free_state(void)
 {
-    if(hp_state == NULL)
-        return;
-
-    if(!hp_allocated)
-        free(hp_state);
-    else
-    {
-#if defined(_MSC_VER) || defined(__MINGW32__)
-        VirtualFree(hp_state, 0, MEM_RELEASE);
-#else
-        munmap(hp_state, MEMORY);
-#endif
-    }
-
+    cn_slow_hash_free_scratchpad(hp_state, hp_allocated);
     hp_state = NULL;
     hp_allocated = 0;
 }
@@ -563,8 +602,9 @@ void slow_hash_free_state(void)
  * @param data the data to hash
  * @param length the length in bytes of the data
  * @param hash a pointer to a buffer in which the final 256 bit hash will be stored
+ * @param hp_state a MEMORY sized, 16 byte aligned scratch buffer owned by the caller
  */
-void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+void cn_slow_hash_ctx(const void *data, size_t length, char *hash, int variant, int prehashed, uint8_t *hp_state)
 {
     RDATA_ALIGN16 uint8_t expandedKey[240];  /* These buffers are aligned to use later with SSE functions */
 
@@ -586,10 +626,6 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
         hash_extra_blake, hash_extra_groestl, hash_extra_jh, hash_extra_skein
     };
 
-    // this isn't supposed to happen, but guard against it for now.
-    if(hp_state == NULL)
-        slow_hash_allocate_state();
-
     /* CryptoNight Step 1:  Use Keccak1600 to initialize the 'state' (and 'text') buffers from the data. */
     if (prehashed) {
         memcpy(&state.hs, data, length);
@@ -698,6 +734,17 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
     extra_hashes[state.hs.b[0] & 3](&state, 200, hash);
 }
 
+/**
+ * @brief cn_slow_hash_ctx using this thread's scratch buffer from slow_hash_allocate_state
+ */
+void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+{
+    if(hp_state == NULL)
+        slow_hash_allocate_state();
+
+    cn_slow_hash_ctx(data, length, hash, variant, prehashed, hp_state);
+}
+
 #elif !defined NO_AES && (defined(__arm__) || defined(__aarch64__))
 void slow_hash_allocate_state(void)
 {
@@ -905,10 +952,9 @@ STATIC INLINE void aes_pseudo_round_xor(const uint8_t *in, uint8_t *out, const u
 	}
 }
 
-void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+void cn_slow_hash_ctx(const void *data, size_t length, char *hash, int variant, int prehashed, uint8_t *hp_state)
 {
     RDATA_ALIGN16 uint8_t expandedKey[240];
-    uint8_t *hp_state = (uint8_t *) malloc(MEMORY);
     uint8_t text[INIT_SIZE_BYTE];
     RDATA_ALIGN16 uint64_t a[2];
     RDATA_ALIGN16 uint64_t b[2];
@@ -992,6 +1038,12 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
     memcpy(state.init, text, INIT_SIZE_BYTE);
     hash_permutation(&state.hs);
     extra_hashes[state.hs.b[0] & 3](&state, 200, hash);
+}
+
+void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+{
+    uint8_t *hp_state = (uint8_t *) malloc(MEMORY);
+    cn_slow_hash_ctx(data, length, hash, variant, prehashed, hp_state);
     free(hp_state);
 }
 #else /* aarch64 && crypto */
@@ -1105,7 +1157,7 @@ STATIC INLINE void xor_blocks(uint8_t* a, const uint8_t* b)
   U64(a)[1] ^= U64(b)[1];
 }
 
-void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+void cn_slow_hash_ctx(const void *data, size_t length, char *hash, int variant, int prehashed, uint8_t *long_state)
 {
     uint8_t text[INIT_SIZE_BYTE];
     uint8_t a[AES_BLOCK_SIZE];
@@ -1124,13 +1176,6 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
         hash_extra_blake, hash_extra_groestl, hash_extra_jh, hash_extra_skein
     };
 
-#ifndef FORCE_USE_HEAP
-    uint8_t long_state[MEMORY];
-#else
-    uint8_t *long_state = NULL;
-    long_state = (uint8_t *)malloc(MEMORY);
-#endif
-
     if (prehashed) {
         memcpy(&state.hs, data, length);
     } else {
@@ -1198,6 +1243,17 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
     memcpy(state.init, text, INIT_SIZE_BYTE);
     hash_permutation(&state.hs);
     extra_hashes[state.hs.b[0] & 3](&state, 200, hash);
+}
+
+void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed)
+{
+#ifndef FORCE_USE_HEAP
+    uint8_t long_state[MEMORY];
+#else
+    uint8_t *long_state = NULL;
+    long_state = (uint8_t *)malloc(MEMORY);
+#endif
+    cn_slow_hash_ctx(data, length, hash, variant, prehashed, long_state);
 #ifdef FORCE_USE_HEAP
     free(long_state);
 #endif
@@ -1293,8 +1349,7 @@ union cn_slow_hash_state {
 };
 #pragma pack(pop)
 
-void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed) {
-  uint8_t long_state[MEMORY];
+void cn_slow_hash_ctx(const void *data, size_t length, char *hash, int variant, int prehashed, uint8_t *long_state) {
   union cn_slow_hash_state state;
   uint8_t text[INIT_SIZE_BYTE];
   uint8_t a[AES_BLOCK_SIZE];
@@ -1372,4 +1427,9 @@ void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int
   oaes_free((OAES_CTX **) &aes_ctx);
 }
 
+void cn_slow_hash(const void *data, size_t length, char *hash, int variant, int prehashed) {
+  uint8_t long_state[MEMORY];
+  cn_slow_hash_ctx(data, length, hash, variant, prehashed, long_state);
+}
+
 #endif
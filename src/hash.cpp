@@ -172,8 +172,80 @@ void hash_equihash(const char * input, char * output) {
   //lyra2re2_hash(input,output);
 }
 
+namespace {
+
+/** Idle CryptoNight scratchpads, shared by every CCryptoNightContext */
+class CCryptoNightPool
+{
+private:
+    // Beyond this many idle buffers (32 MiB) returned ones are freed
+    static const size_t MAX_IDLE = 16;
+
+    boost::mutex cs;
+    std::vector<std::pair<unsigned char*, int> > vIdle;
+
+public:
+    ~CCryptoNightPool()
+    {
+        for (unsigned int i = 0; i < vIdle.size(); i++)
+            cn_slow_hash_free_scratchpad(vIdle[i].first, vIdle[i].second);
+    }
+
+    unsigned char *Get(int& fMapped)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            if (!vIdle.empty()) {
+                unsigned char *p = vIdle.back().first;
+                fMapped = vIdle.back().second;
+                vIdle.pop_back();
+                return p;
+            }
+        }
+        unsigned char *p = cn_slow_hash_alloc_scratchpad(&fMapped);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void Put(unsigned char *p, int fMapped)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            if (vIdle.size() < MAX_IDLE) {
+                vIdle.push_back(std::make_pair(p, fMapped));
+                return;
+            }
+        }
+        cn_slow_hash_free_scratchpad(p, fMapped);
+    }
+};
+
+CCryptoNightPool& CryptoNightPool()
+{
+    static CCryptoNightPool pool;
+    return pool;
+}
+
+}
+
+CCryptoNightContext::CCryptoNightContext()
+{
+    pScratchpad = CryptoNightPool().Get(fMapped);
+}
+
+CCryptoNightContext::~CCryptoNightContext()
+{
+    CryptoNightPool().Put(pScratchpad, fMapped);
+}
+
+void hash_cryptonight(const char * input, char * output, int len, CCryptoNightContext& ctx) {
+  cn_slow_hash_ctx((const void*)input,len,(char*)output,1,0,ctx.Scratchpad());
+}
+
 void hash_cryptonight(const char * input, char * output, int len) {
-  cn_slow_hash((const void*)input,len,(char*)output,1,0);
+  CCryptoNightContext ctx;
+  hash_cryptonight(input,output,len,ctx);
 }
 
 void hash_yescrypt(const char * input, char * output) {
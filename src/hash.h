@@ -201,12 +201,34 @@ int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
+/** Scratchpad for hash_cryptonight.
+ * Holds one of the 2 MiB buffers kept in a process-wide pool (huge pages where
+ * the OS provides them) for as long as it lives, so that hashing in a loop
+ * neither allocates nor faults in fresh memory. Use one per thread.
+ */
+class CCryptoNightContext
+{
+private:
+    unsigned char *pScratchpad;
+    int fMapped;
+
+    CCryptoNightContext(const CCryptoNightContext&);
+    CCryptoNightContext& operator=(const CCryptoNightContext&);
+
+public:
+    CCryptoNightContext();
+    ~CCryptoNightContext();
+
+    unsigned char *Scratchpad() const { return pScratchpad; }
+};
+
 void hash_scrypt(const char * input, char * output);
 void hash_argon2(const char * input, char * output);
 uint256 hash_x17(const char * begin, const char * end);
 void hash_lyra2rev2(const char * input, char * output);
 void hash_equihash(const char * input, char * output);
 void hash_cryptonight(const char * input, char * output, int len);
+void hash_cryptonight(const char * input, char * output, int len, CCryptoNightContext& ctx);
 void hash_yescrypt(const char * input, char * output);
 void hash_easy(const char * input, char * output); //special hash for testing
 
@@ -12,11 +12,14 @@
 
 #include "addrman.h"
 #include "checkpoints.h"
+#include "coinsprefetch.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "sigcache.h"
+#include "templatecache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -135,6 +138,8 @@ void Shutdown()
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinsPrefetcher; pcoinsPrefetcher = NULL;
+        delete ptemplateCache; ptemplateCache = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
@@ -209,7 +214,8 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
-    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (at least %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -prefetchthreads=<n>   " + strprintf(_("Number of threads reading the coins of the next block while one is connected (0 to disable, default: %d)"), DEFAULT_PREFETCH_THREADS) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: bitmarkd.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
@@ -286,7 +292,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n";
+        strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (deprecated, use -sigcachesize)") + "\n";
     }
     strUsage += "  -mintxfee=<amt>        " + _("Fees smaller than this are considered zero fee (for transaction creation) (default:") + " " + FormatMoney(CTransaction::nMinTxFee) + ")" + "\n";
     strUsage += "  -minrelaytxfee=<amt>   " + _("Fees smaller than this are considered zero fee (for relaying) (default:") + " " + FormatMoney(CTransaction::nMinRelayTxFee) + ")" + "\n";
@@ -300,6 +306,7 @@ std::string HelpMessage(HelpMessageMode hmm)
         strUsage += "  -regtest               " + _("Enter regression test mode, which uses a special chain in which blocks can be solved instantly.") + "\n";
         strUsage += "                         " + _("This is intended for regression testing tools and app development.") + "\n";
         strUsage += "                         " + _("In this mode -genproclimit controls how many blocks are generated immediately.") + "\n";
+        strUsage += "  -sigcachesize=<n>      " + strprintf(_("Limit size of signature cache to <n> megabytes (default: %u, at most %u)"), DEFAULT_SIG_CACHE_SIZE, MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n";
     strUsage += "  -testnet               " + _("Use the test network") + "\n";
@@ -539,6 +546,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
 
+    // Check for -maxsigcachesize (deprecated, counts entries rather than megabytes)
+    if (mapArgs.count("-maxsigcachesize"))
+        InitWarning(mapArgs.count("-sigcachesize") ?
+                    _("Warning: Deprecated argument -maxsigcachesize ignored, -sigcachesize is set") :
+                    _("Warning: Deprecated argument -maxsigcachesize read as a number of signature cache entries, use -sigcachesize=<megabytes>"));
+
     fBenchmark = GetBoolArg("-benchmark", false);
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
@@ -549,8 +562,6 @@ bool AppInit2(boost::thread_group& threadGroup)
         nScriptCheckThreads += boost::thread::hardware_concurrency();
     if (nScriptCheckThreads <= 1)
         nScriptCheckThreads = 0;
-    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
-        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
@@ -642,9 +653,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     std::ostringstream strErrors;
 
     if (nScriptCheckThreads) {
-        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        LogPrintf("Using %u threads for script and proof-of-work verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadPoWCheck);
+        }
     }
 
     int64_t nStart;
@@ -834,7 +847,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest is for the in-memory coins cache
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -857,6 +870,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading coin database");
+                    break;
+                }
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -923,6 +940,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    int nPrefetchThreads = GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS);
+    if (nPrefetchThreads > 0) {
+        pcoinsPrefetcher = new CCoinsPrefetcher(*pcoinsdbview);
+        for (int i = 0; i < nPrefetchThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCoinsPrefetcher::Thread, pcoinsPrefetcher));
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -933,7 +957,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1111,6 +1135,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    {
+        LOCK(cs_main);
+        ptemplateCache = new CBlockTemplateCache();
+        ptemplateCache->NotifyTip(chainActive.Tip());
+    }
+    threadGroup.create_thread(boost::bind(&CBlockTemplateCache::Thread, ptemplateCache));
+
     StartNode(threadGroup);
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
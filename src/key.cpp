@@ -3,6 +3,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "bitmark-config.h"
+#endif
+
 #include "key.h"
 
 #include <openssl/bn.h>
@@ -10,6 +14,11 @@
 #include <openssl/obj_mac.h>
 #include <openssl/rand.h>
 
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#include <secp256k1_recovery.h>
+#endif
+
 // anonymous namespace with local implementation code (OpenSSL interaction)
 namespace {
 
@@ -402,6 +411,133 @@ public:
     }
 };
 
+#ifdef USE_SECP256K1
+// libsecp256k1 signs, verifies and recovers keys; OpenSSL above is only used
+// for the DER private key format of the wallet.
+
+secp256k1_context* CreateSecp256k1Context() {
+    secp256k1_context* ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+    assert(ctx != NULL);
+    // blind the signing context against timing side channels
+    unsigned char vchSeed[32];
+    RAND_bytes(vchSeed, sizeof(vchSeed));
+    bool ret = secp256k1_context_randomize(ctx, vchSeed);
+    assert(ret);
+    return ctx;
+}
+
+const secp256k1_context* Secp256k1Context() {
+    static secp256k1_context* ctx = CreateSecp256k1Context();
+    return ctx;
+}
+
+bool ParsePubKey(const CPubKey& pubkey, secp256k1_pubkey& pk) {
+    return secp256k1_ec_pubkey_parse(Secp256k1Context(), &pk, pubkey.begin(), pubkey.size());
+}
+
+void SerializePubKey(const secp256k1_pubkey& pk, CPubKey& pubkey, bool fCompressed) {
+    unsigned char c[65];
+    size_t nSize = sizeof(c);
+    secp256k1_ec_pubkey_serialize(Secp256k1Context(), c, &nSize, &pk, fCompressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED);
+    pubkey.Set(&c[0], &c[nSize]);
+}
+
+// Parse a DER signature as leniently as OpenSSL's d2i_ECDSA_SIG did, which
+// the OpenSSL path relies on: lengths may use the long form and integers may
+// carry extra leading zeroes. Signatures in transactions are held to strict
+// DER before they get here, by CheckSignatureEncoding once DERSIG applies.
+// An R or S that does not fit the curve order yields a signature that fails
+// to verify rather than a parse error, as with OpenSSL.
+bool ParseDERSignatureLax(const unsigned char* input, size_t inputlen, secp256k1_ecdsa_signature& sig) {
+    const secp256k1_context* ctx = Secp256k1Context();
+    unsigned char tmpsig[64] = {0};
+    size_t pos = 0;
+    size_t vPos[2], vLen[2];
+
+    // start out with a correctly parsed but invalid signature
+    secp256k1_ecdsa_signature_parse_compact(ctx, &sig, tmpsig);
+
+    // sequence tag and length
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    size_t lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        pos += lenbyte;
+    }
+
+    // the integers R and S
+    for (int i = 0; i < 2; i++) {
+        if (pos == inputlen || input[pos] != 0x02)
+            return false;
+        pos++;
+        if (pos == inputlen)
+            return false;
+        lenbyte = input[pos++];
+        size_t len;
+        if (lenbyte & 0x80) {
+            lenbyte -= 0x80;
+            if (lenbyte > inputlen - pos)
+                return false;
+            while (lenbyte > 0 && input[pos] == 0) {
+                pos++;
+                lenbyte--;
+            }
+            if (lenbyte >= 4)
+                return false;
+            len = 0;
+            while (lenbyte > 0) {
+                len = (len << 8) + input[pos];
+                pos++;
+                lenbyte--;
+            }
+        } else {
+            len = lenbyte;
+        }
+        if (len > inputlen - pos)
+            return false;
+        vPos[i] = pos;
+        vLen[i] = len;
+        pos += len;
+    }
+
+    bool fOverflow = false;
+    for (int i = 0; i < 2; i++) {
+        while (vLen[i] > 0 && input[vPos[i]] == 0) {
+            vPos[i]++;
+            vLen[i]--;
+        }
+        if (vLen[i] > 32)
+            fOverflow = true;
+        else
+            memcpy(tmpsig + 32 * (i + 1) - vLen[i], input + vPos[i], vLen[i]);
+    }
+    if (!fOverflow)
+        fOverflow = !secp256k1_ecdsa_signature_parse_compact(ctx, &sig, tmpsig);
+    if (fOverflow) {
+        memset(tmpsig, 0, sizeof(tmpsig));
+        secp256k1_ecdsa_signature_parse_compact(ctx, &sig, tmpsig);
+    }
+    return true;
+}
+
+// Recover the public key of a compact signature, rec as in CKey::SignCompact
+bool RecoverPubKey(const uint256 &hash, const unsigned char *p64, int rec, secp256k1_pubkey& pk) {
+    if (rec<0 || rec>=3)
+        return false;
+    const secp256k1_context* ctx = Secp256k1Context();
+    secp256k1_ecdsa_recoverable_signature sig;
+    if (!secp256k1_ecdsa_recoverable_signature_parse_compact(ctx, &sig, p64, rec))
+        return false;
+    return secp256k1_ecdsa_recover(ctx, &pk, &sig, hash.begin());
+}
+#endif
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -457,30 +593,58 @@ CPrivKey CKey::GetPrivKey() const {
 
 CPubKey CKey::GetPubKey() const {
     assert(fValid);
+    CPubKey pubkey;
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    bool ret = secp256k1_ec_pubkey_create(Secp256k1Context(), &pk, vch);
+    assert(ret);
+    SerializePubKey(pk, pubkey, fCompressed);
+#else
     CECKey key;
     key.SetSecretBytes(vch);
-    CPubKey pubkey;
     key.GetPubKey(pubkey, fCompressed);
+#endif
     return pubkey;
 }
 
 bool CKey::Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) const {
     if (!fValid)
         return false;
+#ifdef USE_SECP256K1
+    // RFC6979 nonces; the signature comes out with a low S value
+    const secp256k1_context* ctx = Secp256k1Context();
+    secp256k1_ecdsa_signature sig;
+    if (!secp256k1_ecdsa_sign(ctx, &sig, hash.begin(), vch, secp256k1_nonce_function_rfc6979, NULL))
+        return false;
+    vchSig.resize(72);
+    size_t nSize = vchSig.size();
+    secp256k1_ecdsa_signature_serialize_der(ctx, &vchSig[0], &nSize, &sig);
+    vchSig.resize(nSize);
+    return true;
+#else
     CECKey key;
     key.SetSecretBytes(vch);
     return key.Sign(hash, vchSig);
+#endif
 }
 
 bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const {
     if (!fValid)
         return false;
-    CECKey key;
-    key.SetSecretBytes(vch);
     vchSig.resize(65);
     int rec = -1;
+#ifdef USE_SECP256K1
+    const secp256k1_context* ctx = Secp256k1Context();
+    secp256k1_ecdsa_recoverable_signature sig;
+    if (!secp256k1_ecdsa_sign_recoverable(ctx, &sig, hash.begin(), vch, secp256k1_nonce_function_rfc6979, NULL))
+        return false;
+    secp256k1_ecdsa_recoverable_signature_serialize_compact(ctx, &vchSig[1], &rec, &sig);
+#else
+    CECKey key;
+    key.SetSecretBytes(vch);
     if (!key.SignCompact(hash, &vchSig[1], rec))
         return false;
+#endif
     assert(rec != -1);
     vchSig[0] = 27 + rec + (fCompressed ? 4 : 0);
     return true;
@@ -507,6 +671,20 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    if (vchSig.empty())
+        return false;
+    secp256k1_pubkey pk;
+    if (!ParsePubKey(*this, pk))
+        return false;
+    secp256k1_ecdsa_signature sig;
+    if (!ParseDERSignatureLax(&vchSig[0], vchSig.size(), sig))
+        return false;
+    // OpenSSL accepts high S values; libsecp256k1 only verifies low S
+    const secp256k1_context* ctx = Secp256k1Context();
+    secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+    return secp256k1_ecdsa_verify(ctx, &sig, hash.begin(), &pk);
+#else
     CECKey key;
     if (!key.SetPubKey(*this)) {
       //printf("cpubkey::verify: !key.SetPubKey\n");
@@ -517,15 +695,23 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
       return false;
     }
     return true;
+#endif
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    if (!RecoverPubKey(hash, &vchSig[1], (vchSig[0] - 27) & ~4, pk))
+        return false;
+    SerializePubKey(pk, *this, (vchSig[0] - 27) & 4);
+#else
     CECKey key;
     if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
         return false;
     key.GetPubKey(*this, (vchSig[0] - 27) & 4);
+#endif
     return true;
 }
 
@@ -534,11 +720,18 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
         return false;
     if (vchSig.size() != 65)
         return false;
+    CPubKey pubkeyRec;
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    if (!RecoverPubKey(hash, &vchSig[1], (vchSig[0] - 27) & ~4, pk))
+        return false;
+    SerializePubKey(pk, pubkeyRec, IsCompressed());
+#else
     CECKey key;
     if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
         return false;
-    CPubKey pubkeyRec;
     key.GetPubKey(pubkeyRec, IsCompressed());
+#endif
     if (*this != pubkeyRec)
         return false;
     return true;
@@ -547,19 +740,32 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
 bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    if (!ParsePubKey(*this, pk))
+        return false;
+#else
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
+#endif
     return true;
 }
 
 bool CPubKey::Decompress() {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    if (!ParsePubKey(*this, pk))
+        return false;
+    SerializePubKey(pk, *this, false);
+#else
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
     key.GetPubKey(*this, false);
+#endif
     return true;
 }
 
@@ -591,7 +797,12 @@ bool CKey::Derive(CKey& keyChild, unsigned char ccChild[32], unsigned int nChild
         BIP32Hash(cc, nChild, 0, begin(), out);
     }
     memcpy(ccChild, out+32, 32);
+#ifdef USE_SECP256K1
+    memcpy((unsigned char*)keyChild.begin(), begin(), 32);
+    bool ret = secp256k1_ec_privkey_tweak_add(Secp256k1Context(), (unsigned char*)keyChild.begin(), out);
+#else
     bool ret = CECKey::TweakSecret((unsigned char*)keyChild.begin(), begin(), out);
+#endif
     UnlockObject(out);
     keyChild.fCompressed = true;
     keyChild.fValid = ret;
@@ -605,11 +816,21 @@ bool CPubKey::Derive(CPubKey& pubkeyChild, unsigned char ccChild[32], unsigned i
     unsigned char out[64];
     BIP32Hash(cc, nChild, *begin(), begin()+1, out);
     memcpy(ccChild, out+32, 32);
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pk;
+    if (!ParsePubKey(*this, pk))
+        return false;
+    if (!secp256k1_ec_pubkey_tweak_add(Secp256k1Context(), &pk, out))
+        return false;
+    SerializePubKey(pk, pubkeyChild, true);
+    return true;
+#else
     CECKey key;
     bool ret = key.SetPubKey(*this);
     ret &= key.TweakPublic(out);
     key.GetPubKey(pubkeyChild, true);
     return ret;
+#endif
 }
 
 bool CExtKey::Derive(CExtKey &out, unsigned int nChild) const {
@@ -697,5 +918,16 @@ bool ECC_InitSanityCheck() {
         return false;
     EC_KEY_free(pkey);
 
+#ifdef USE_SECP256K1
+    // a key made and used by libsecp256k1 must round trip
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = Hash(pubkey.begin(), pubkey.end());
+    std::vector<unsigned char> vchSig;
+    if (!key.Sign(hash, vchSig) || !pubkey.Verify(hash, vchSig))
+        return false;
+#endif
+
     return true;
 }
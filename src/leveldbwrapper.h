@@ -151,6 +151,27 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // iterator for short range lookups, which fill the block cache like Read
+    leveldb::Iterator *NewReadIterator() {
+        return pdb->NewIterator(readoptions);
+    }
+
+    // fixed state of the database for long reads while writes go on;
+    // iterate it with NewIterator(snapshot) and give it back with ReleaseSnapshot
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *snapshot) {
+        pdb->ReleaseSnapshot(snapshot);
+    }
+
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *snapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
 };
 
 #endif // BITMARK_LEVELDBWRAPPER_H
@@ -11,8 +11,10 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
 #include "init.h"
 #include "net.h"
+#include "templatecache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -39,16 +41,17 @@ using namespace boost;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 CChain chainMostWork;
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsPrefetcher *pcoinsPrefetcher = NULL;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 static const int64_t v2checkpoint = 230000;
 
 /** The term "satoshi" is kept in homage to entity who gave the block chain to the world */
@@ -109,6 +112,63 @@ namespace {
     CBlockFileInfo infoLastBlockFile;
     int nLastBlockFile = 0;
 
+    // Most recently used SSF windows first, by the hash of their most recent
+    // block, see get_ssf_window.
+    CCriticalSection cs_ssfWindows;
+    typedef list<pair<uint256, CSSFWindow> > SSFWindowList;
+    SSFWindowList listSSFWindows;
+    map<uint256, SSFWindowList::iterator> mapSSFWindows;
+
+    // Most recently used CBlockIndexAux records first, see GetBlockIndexAux.
+    CCriticalSection cs_blockIndexAux;
+    typedef list<pair<uint256, CBlockIndexAux> > BlockIndexAuxList;
+    BlockIndexAuxList listBlockIndexAux;
+    map<uint256, BlockIndexAuxList::iterator> mapBlockIndexAux;
+
+    /**
+     * Allocates the entries of mapBlockIndex in large contiguous chunks, each
+     * CBlockIndex next to the block hash its phashBlock points to. Entries are
+     * never freed individually; the block index only grows.
+     */
+    class CBlockIndexArena
+    {
+    private:
+        struct CEntry
+        {
+            uint256 hash;
+            CBlockIndex index;
+        };
+        static const size_t nChunkSize = 4096;
+        std::vector<CEntry*> vChunks;
+        size_t nUsed; // entries used in the last chunk
+
+    public:
+        CBlockIndexArena() : nUsed(nChunkSize) {}
+        ~CBlockIndexArena() { Clear(); }
+
+        CBlockIndex* Allocate(const uint256& hash, const CBlockIndex& index)
+        {
+            if (nUsed == nChunkSize) {
+                vChunks.push_back(new CEntry[nChunkSize]);
+                nUsed = 0;
+            }
+            CEntry& entry = vChunks.back()[nUsed++];
+            entry.hash = hash;
+            entry.index = index;
+            entry.index.phashBlock = &entry.hash;
+            return &entry.index;
+        }
+
+        void Clear()
+        {
+            BOOST_FOREACH(CEntry* chunk, vChunks)
+                delete[] chunk;
+            vChunks.clear();
+            nUsed = nChunkSize;
+        }
+    };
+    CBlockIndexArena blockIndexArena;
+
     // Every received block is assigned a unique and increasing identifier, so we
     // know which one to give priority in case of a fork.
     CCriticalSection cs_nBlockSequenceId;
@@ -128,6 +188,23 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
     map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+    // Headers-first synchronization. Protected by cs_main.
+    //
+    // Headers validated ahead of their block (see AcceptBlockHeader) get a
+    // CBlockIndex of their own in mapHeaderIndex; mapBlockIndex keeps holding
+    // only blocks we have accepted. When the block is accepted, AddToBlockIndex
+    // moves the entry over, so pointers to it stay valid. Header entries are
+    // written to the block tree database too, and LoadBlockIndexDB sorts them
+    // back in here by their BLOCK_VALID_TREE status.
+    BlockMap mapHeaderIndex;
+    // The most-work header known, on either map, and the chain leading to it.
+    CBlockIndex *pindexBestHeader = NULL;
+    CChain chainBestHeader;
+    // Blocks stored on disk before their parent was accepted, by parent.
+    multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+    // Number of peers we are synchronizing headers from.
+    int nSyncStarted = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -217,6 +294,12 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // The best header this peer has announced, or NULL.
+    CBlockIndex *pindexBestKnownBlock;
+    // Whether we've asked this peer for headers.
+    bool fSyncStarted;
+    // Since when this peer holds up the block download window, or 0.
+    int64_t nStallingSince;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -225,6 +308,9 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        pindexBestKnownBlock = NULL;
+        fSyncStarted = false;
+        nStallingSince = 0;
     }
 };
 
@@ -260,6 +346,9 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload)
         mapBlocksToDownload.erase(hash);
 
+    if (state->fSyncStarted)
+        nSyncStarted--;
+
     EraseOrphansFor(nodeid);
     mapNodeState.erase(nodeid);
 }
@@ -279,8 +368,10 @@ void MarkBlockAsReceived(const uint256 &hash, NodeId nodeFrom = -1) {
         CNodeState *state = State(itInFlight->second.first);
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
-        if (itInFlight->second.first == nodeFrom)
+        if (itInFlight->second.first == nodeFrom) {
             state->nLastBlockReceive = GetTimeMicros();
+            state->nStallingSince = 0;
+        }
         mapBlocksInFlight.erase(itInFlight);
     }
 
@@ -319,6 +410,105 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main.
+CBlockIndex *LookupHeaderIndex(const uint256 &hash) {
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return mi->second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return mi->second;
+    return NULL;
+}
+
+// Requires cs_main.
+void UpdateBestHeader(CBlockIndex *pindex) {
+    if (pindexBestHeader == NULL || pindex->nChainWork > pindexBestHeader->nChainWork) {
+        pindexBestHeader = pindex;
+        chainBestHeader.SetTip(pindex);
+    }
+}
+
+// Called when pindex turns out invalid: if the best header chain runs through
+// it, fall back to the active chain until better headers are announced.
+// Requires cs_main.
+void InvalidateBestHeader(CBlockIndex *pindex) {
+    if (chainBestHeader.Contains(pindex)) {
+        pindexBestHeader = chainActive.Tip();
+        chainBestHeader.SetTip(pindexBestHeader);
+    }
+}
+
+// Requires cs_main.
+void UpdateBlockAvailability(NodeId nodeid, CBlockIndex *pindex) {
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+    if (state->pindexBestKnownBlock == NULL || pindex->nChainWork > state->pindexBestKnownBlock->nChainWork)
+        state->pindexBestKnownBlock = pindex;
+}
+
+// A locator for continuing header download after pindex, which may be ahead of
+// the active chain: the last few headers up to pindex, then the active chain.
+// Requires cs_main.
+CBlockLocator GetHeaderLocator(const CBlockIndex *pindex) {
+    CBlockLocator locator = chainActive.GetLocator();
+    std::vector<uint256> vHave;
+    for (int i = 0; pindex && i < 10 && !chainActive.Contains(pindex); i++) {
+        vHave.push_back(pindex->GetBlockHash());
+        pindex = pindex->pprev;
+    }
+    locator.vHave.insert(locator.vHave.begin(), vHave.begin(), vHave.end());
+    return locator;
+}
+
+// Pick up to count blocks on the best header chain to request from this peer,
+// lowest first, within BLOCK_DOWNLOAD_WINDOW of the active tip. If the window
+// is used up while its first missing block is in flight from another peer,
+// that peer is returned in nodeStaller.
+// Requires cs_main.
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+    if (count == 0)
+        return;
+
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+    CBlockIndex *pindexBestKnown = state->pindexBestKnownBlock;
+    if (pindexBestKnown == NULL || pindexBestKnown->nChainWork <= chainActive.Tip()->nChainWork ||
+        !chainBestHeader.Contains(pindexBestKnown))
+        return;
+
+    // Start right after the last block the active chain shares with the best header chain
+    CBlockIndex *pindexFork = chainActive.Tip();
+    while (pindexFork && !chainBestHeader.Contains(pindexFork))
+        pindexFork = pindexFork->pprev;
+    int nWindowEnd = (pindexFork ? pindexFork->nHeight : -1) + BLOCK_DOWNLOAD_WINDOW;
+    int nMaxHeight = std::min(pindexBestKnown->nHeight, nWindowEnd);
+    NodeId nodeWaitingFor = -1;
+    for (int nHeight = (pindexFork ? pindexFork->nHeight + 1 : 0); nHeight <= nMaxHeight; nHeight++) {
+        CBlockIndex *pindex = chainBestHeader[nHeight];
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return;
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            continue;
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+        if (itInFlight != mapBlocksInFlight.end()) {
+            if (nodeWaitingFor == -1)
+                nodeWaitingFor = itInFlight->second.first;
+            continue;
+        }
+        vBlocks.push_back(pindex);
+        if (vBlocks.size() == count)
+            return;
+    }
+    if (vBlocks.empty() && nMaxHeight == nWindowEnd && nodeWaitingFor != nodeid)
+        nodeStaller = nodeWaitingFor;
+}
+
+}
+
+int GetBestHeaderHeight() {
+    LOCK(cs_main);
+    return pindexBestHeader ? pindexBestHeader->nHeight : chainActive.Height();
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -327,6 +517,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     return true;
 }
 
@@ -397,7 +588,7 @@ CBlockLocator CChain::GetLocator(const CBlockIndex *pindex) const {
 CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, locator.vHave) {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -731,7 +922,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -921,8 +1112,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nValueOut = tx.GetValueOut();
         int64_t nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
+        unsigned int nSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -983,7 +1175,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1140,8 +1332,8 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
-    // Check the header
-    if (!CheckAuxPowProofOfWork(block, Params())) {
+    // Check the header, unless CheckBlock has verified it already
+    if (!IsPoWVerified(GetPoWCacheKey(block)) && !CheckAuxPowProofOfWork(block, Params())) {
         return error("ReadBlockFromDisk : Errors in block header");
     }
 
@@ -1158,6 +1350,78 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+void static CacheBlockIndexAux(const uint256& hash, const CBlockIndexAux& aux)
+{
+    LOCK(cs_blockIndexAux);
+    map<uint256, BlockIndexAuxList::iterator>::iterator it = mapBlockIndexAux.find(hash);
+    if (it != mapBlockIndexAux.end()) {
+        it->second->second = aux;
+        listBlockIndexAux.splice(listBlockIndexAux.begin(), listBlockIndexAux, it->second);
+        return;
+    }
+    listBlockIndexAux.push_front(make_pair(hash, aux));
+    mapBlockIndexAux.insert(make_pair(hash, listBlockIndexAux.begin()));
+    if (listBlockIndexAux.size() > MAX_BLOCKINDEX_AUX_CACHE) {
+        mapBlockIndexAux.erase(listBlockIndexAux.back().first);
+        listBlockIndexAux.pop_back();
+    }
+}
+
+bool GetBlockIndexAux(const CBlockIndex* pindex, CBlockIndexAux& aux)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_blockIndexAux);
+        map<uint256, BlockIndexAuxList::iterator>::iterator it = mapBlockIndexAux.find(hash);
+        if (it != mapBlockIndexAux.end()) {
+            listBlockIndexAux.splice(listBlockIndexAux.begin(), listBlockIndexAux, it->second);
+            aux = it->second->second;
+            return true;
+        }
+    }
+    CDiskBlockIndex diskindex;
+    if (!pblocktree->ReadBlockIndex(hash, diskindex))
+        return error("GetBlockIndexAux() : block index record for %s not found", hash.ToString());
+    aux = diskindex;
+    CacheBlockIndexAux(hash, aux);
+    return true;
+}
+
+// The header of a block in the index as it was received, including the fields
+// CBlockIndex does not keep in memory
+bool static GetBlockIndexHeader(const CBlockIndex* pindex, CBlockHeader& header)
+{
+    header.SetNull();
+    header.nVersion       = pindex->nVersion;
+    if (pindex->pprev)
+        header.hashPrevBlock = pindex->pprev->GetBlockHash();
+    header.hashMerkleRoot = pindex->hashMerkleRoot;
+    header.nTime          = pindex->nTime;
+    header.nBits          = pindex->nBits;
+    header.nNonce         = pindex->nNonce;
+    if (!pindex->IsAuxpow() && pindex->GetAlgo() != ALGO_EQUIHASH)
+        return true;
+
+    CBlockIndexAux aux;
+    if (!GetBlockIndexAux(pindex, aux))
+        return false;
+    header.auxpow       = aux.pauxpow;
+    header.nNonce256    = aux.nNonce256;
+    header.nSolution    = aux.nSolution;
+    header.hashReserved = aux.hashReserved;
+    if (header.IsAuxpow() && !header.auxpow)
+        header = pindex->GetBlockHeader(); // read from the block itself
+    return true;
+}
+
+bool static WriteBlockIndex(CBlockIndex* pindex)
+{
+    CBlockIndexAux aux;
+    if (!GetBlockIndexAux(pindex, aux))
+        return false;
+    return pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, aux));
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
     map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
@@ -1244,14 +1508,18 @@ int64_t GetBlockValue(CBlockIndex* pindex, int64_t nFees, bool noScale)
       emitted = NUM_ALGOS * get_mpow_ms_correction(pindex);
     }
 
-    CBigNum scalingFactor = CBigNum(0);
+    arith_uint256 scalingFactor = 0;
     if (onForkNow && !noScale) {
       scalingFactor = pindex->subsidyScalingFactor;
-      if (!scalingFactor.getuint()) { // find the key block and recalculate
+      if (scalingFactor == 0) { // find the key block and recalculate
 	CBlockIndex * pprev_algo = pindex;
 	do {
 	  if (update_ssf(pprev_algo->nVersion)) {
-	    scalingFactor = get_ssf(pprev_algo);
+	    scalingFactor = pprev_algo->subsidyScalingFactor;
+	    if (scalingFactor == 0) {
+	      scalingFactor = get_ssf(pprev_algo);
+	      pprev_algo->subsidyScalingFactor = scalingFactor;
+	    }
 	    pindex->subsidyScalingFactor = scalingFactor;
 	    break;
 	  }
@@ -1269,7 +1537,7 @@ int64_t GetBlockValue(CBlockIndex* pindex, int64_t nFees, bool noScale)
       baseSubsidy = 1500000000;
       //LogPrintf("getblockvalue with scalingFactor %u\n",scalingFactor);
       if (!scalingFactor) return nFees + baseSubsidy;
-      return nFees + baseSubsidy - ((CBigNum(baseSubsidy)*CBigNum(100000000))/scalingFactor).getuint()/2;
+      return nFees + baseSubsidy - (unsigned int)((arith_uint256(baseSubsidy)*100000000)/scalingFactor).GetLow64()/2;
     }
 
     // Generated by generate_emitted_points.py
@@ -1386,7 +1654,7 @@ int64_t GetBlockValue(CBlockIndex* pindex, int64_t nFees, bool noScale)
     // 		   Seventy three million, one hundred and eight thousand   Bitmark-Satoshis.
 
     if (!scalingFactor) return nFees + baseSubsidy;
-    return nFees + baseSubsidy - ((CBigNum(baseSubsidy)*CBigNum(100000000))/scalingFactor).getuint() / 2;
+    return nFees + baseSubsidy - (unsigned int)((arith_uint256(baseSubsidy)*100000000)/scalingFactor).GetLow64() / 2;
 }
 
 static const int64_t nTargetTimespan = 24*60*60; // one day
@@ -1400,13 +1668,13 @@ static const int64_t DGWtimespan = 960; // 16 min for dark gravity wave
 //
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime)
 {
-  const CBigNum &bnLimit = Params().ProofOfWorkLimit();
+  const arith_uint320 bnLimit(Params().ProofOfWorkLimit());
     // Testnet has min-difficulty blocks
     // after nTargetSpacing*2 time between blocks:
     if (TestNet() && nTime > nTargetSpacing*2)
       return bnLimit.GetCompact();
 
-    CBigNum bnResult;
+    arith_uint320 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnLimit)
     {
@@ -1430,9 +1698,9 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
     int64_t PastBlocksMin = 25;
     int64_t PastBlocksMax = 25; // We have same max and min, just using same variables from old code
     int64_t CountBlocks = 0;
-    CBigNum PastDifficultyAverage;
-    CBigNum PastDifficultyAveragePrev;
-    CBigNum LastDifficultyAlgo;
+    arith_uint320 PastDifficultyAverage;
+    arith_uint320 PastDifficultyAveragePrev;
+    arith_uint320 LastDifficultyAlgo;
     int64_t time_since_last_algo = -1;
     int64_t LastBlockTimeOtherAlgos = 0;
     unsigned int algoWeight = GetAlgoWeight(algo);
@@ -1444,7 +1712,7 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
     bool nInRowDone = false; // if an island of 9 or more is found, then stop the count
 
     if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || BlockLastSolved->nHeight < PastBlocksMin) {
-      return (Params().ProofOfWorkLimit()*algoWeight).GetCompact();
+      return (arith_uint320(Params().ProofOfWorkLimit())*algoWeight).GetCompact();
     }
 
     for (int i=0; BlockReading && BlockReading->nHeight >= nForkHeight - 1; i++) {
@@ -1495,7 +1763,7 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
 	  LastBlockTime = BlockReading->GetMedianTimePast();
 	  if (fDebug) LogPrintf("block time final = %d\n",LastBlockTime);
 	}
-	else { PastDifficultyAverage = ((PastDifficultyAveragePrev * (CountBlocks-1)) + (CBigNum().SetCompact(BlockReading->nBits))) / CountBlocks; }
+	else { PastDifficultyAverage = ((PastDifficultyAveragePrev * arith_uint320(CountBlocks-1)) + (arith_uint320().SetCompact(BlockReading->nBits))) / arith_uint320(CountBlocks); }
 	PastDifficultyAveragePrev = PastDifficultyAverage;
       }
  
@@ -1531,7 +1799,7 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
       if (!lastInRowDone) lastInRow += pastInRow;
     }
     
-    CBigNum bnNew;
+    arith_uint320 bnNew;
     int lastInRowMod = lastInRow%9;
     if (fDebug) LogPrintf("nInRow = %d lastInRow=%d\n",nInRow,lastInRow);
     bool justHadSurge = nInRow>=9 || nInRow && pastInRow && (nInRow+pastInRow)>=9 && pastInRow%9!=0;
@@ -1564,8 +1832,8 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
 	bnNew /= 3;
       }
       else if (!justHadSurge || smultiply && CBlockIndex::IsSuperMajorityVariant12(4,true,pindexLast,950,1000)) {
-	bnNew *= nActualTimespan;
-	bnNew /= _nTargetTimespan;
+	bnNew *= arith_uint320(nActualTimespan);
+	bnNew /= arith_uint320(_nTargetTimespan);
       }
     }
     else if (CountBlocks==1) { // first block of algo for fork
@@ -1590,24 +1858,24 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, int algo) {
 	bnNew *= algoWeight;
 	bnNew /= 128;
       }
-      if (smultiply) bnNew *= smultiplier*3;
+      if (smultiply) bnNew *= arith_uint320(smultiplier*3);
     }
     else {
-      if (smultiply) bnNew *= smultiplier*3;
+      if (smultiply) bnNew *= arith_uint320(smultiplier*3);
       if (lastInRow>=9 && !lastInRowMod) bnNew /= 3;
     }
     
-    if (bnNew > Params().ProofOfWorkLimit()*algoWeight){
-      bnNew = Params().ProofOfWorkLimit()*algoWeight;
+    if (bnNew > arith_uint320(Params().ProofOfWorkLimit())*algoWeight){
+      bnNew = arith_uint320(Params().ProofOfWorkLimit())*algoWeight;
     }
     
     if (fDebug) {
       LogPrintf("DarkGravityWave RETARGET algo %d\n",algo);
       LogPrintf("_nTargetTimespan = %d    nActualTimespan = %d\n", _nTargetTimespan, nActualTimespan);
-      LogPrintf("Before: %08x  %lu\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString());
-      LogPrintf("BlockReading: %08x %lu\n",BlockReading->nBits,CBigNum().SetCompact(BlockReading->nBits).getuint256().ToString());
-      LogPrintf("Avg from past %d: %08x %lu\n", CountBlocks,PastDifficultyAverage.GetCompact(), PastDifficultyAverage.getuint256().ToString());
-      LogPrintf("After:  %08x  %lu\n", bnNew.GetCompact(), bnNew.getuint256().ToString());
+      LogPrintf("Before: %08x  %s\n", pindexLast->nBits, arith_uint320().SetCompact(pindexLast->nBits).ToString());
+      LogPrintf("BlockReading: %08x %s\n",BlockReading->nBits,arith_uint320().SetCompact(BlockReading->nBits).ToString());
+      LogPrintf("Avg from past %d: %08x %s\n", CountBlocks,PastDifficultyAverage.GetCompact(), PastDifficultyAverage.ToString());
+      LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString());
     }
 
     return bnNew.GetCompact();
@@ -1675,19 +1943,19 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, int algo)
             nActualTimespan = nTargetTimespan*4;
 
         // Retarget
-        CBigNum bnNew;
+        arith_uint320 bnNew;
         bnNew.SetCompact(pindexLast->nBits);
-        bnNew *= nActualTimespan;
-        bnNew /= nTargetTimespan;
+        bnNew *= arith_uint320(nActualTimespan);
+        bnNew /= arith_uint320(nTargetTimespan);
 
-        if (bnNew > Params().ProofOfWorkLimit())
-            bnNew = Params().ProofOfWorkLimit();
+        if (bnNew > arith_uint320(Params().ProofOfWorkLimit()))
+            bnNew = arith_uint320(Params().ProofOfWorkLimit());
 
         /// debug print
         LogPrintf("GetNextWorkRequired RETARGET\n");
         LogPrintf("nTargetTimespan = %d    nActualTimespan = %d\n", nTargetTimespan, nActualTimespan);
-        LogPrintf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString());
-        LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString());
+        LogPrintf("Before: %08x  %s\n", pindexLast->nBits, arith_uint256().SetCompact(pindexLast->nBits).ToString());
+        LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), arith_uint256(bnNew).ToString());
 
          return bnNew.GetCompact();
     } else {
@@ -1738,7 +2006,7 @@ void CheckForkWarningConditions()
     if (pindexBestForkTip && chainActive.Height() - pindexBestForkTip->nHeight >= 180)
         pindexBestForkTip = NULL;
 
-    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->nChainWork > chainActive.Tip()->nChainWork + (chainActive.Tip()->GetBlockWorkAv() * 30).getuint256()))
+    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->nChainWork > chainActive.Tip()->nChainWork + ArithToUint256(arith_uint256(chainActive.Tip()->GetBlockWorkAv() * 30))))
     {
         if (!fLargeWorkForkFound)
         {
@@ -1790,7 +2058,7 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     // the 31-block condition and from this always have the most-likely-to-cause-warning fork
     //  31 was previously set to 7 blocks
     if (pfork && (!pindexBestForkTip || (pindexBestForkTip && pindexNewForkTip->nHeight > pindexBestForkTip->nHeight)) &&
-            pindexNewForkTip->nChainWork - pfork->nChainWork > (pfork->GetBlockWorkAv() * 31).getuint256() &&
+            pindexNewForkTip->nChainWork - pfork->nChainWork > ArithToUint256(arith_uint256(pfork->GetBlockWorkAv() * 31)) &&
             chainActive.Height() - pindexNewForkTip->nHeight < 180)
     {
         pindexBestForkTip = pindexNewForkTip;
@@ -1837,6 +2105,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     LogPrintf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()));
+    InvalidateBestHeader(pindexNew);
     CheckForkWarningConditions();
 }
 
@@ -1853,7 +2122,7 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     }
     if (!state.CorruptionPossible()) {
         pindex->nStatus |= BLOCK_FAILED_VALID;
-        pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        WriteBlockIndex(pindex);
         setBlockIndexValid.erase(pindex);
         InvalidChainFound(pindex);
     }
@@ -1876,9 +2145,9 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     // mark inputs spent
     if (!tx.IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
             CTxInUndo undo;
-            ret = coins.Spend(txin.prevout, undo);
+            ret = coins->Spend(txin.prevout, undo);
             assert(ret);
             txundo.vprevout.push_back(undo);
         }
@@ -1891,7 +2160,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, ptxdata)) {
       return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
     }
     return true;
@@ -1902,7 +2171,7 @@ bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned in
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks, const CPrecomputedTransactionData *ptxdata)
 {
     if (!tx.IsCoinBase())
     {
@@ -1923,19 +2192,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins *coins = inputs.AccessCoins(prevout.hash);
+            assert(coins);
 
             // If prev is coinbase, check that it's matured
-            if (coins.IsCoinBase()) {
-                if (nSpendHeight - coins.nHeight < COINBASE_MATURITY)
+            if (coins->IsCoinBase()) {
+                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d", nSpendHeight - coins.nHeight),
+                        error("CheckInputs() : tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins.vout[prevout.n].nValue;
-            if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coins->vout[prevout.n].nValue;
+            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -1964,12 +2234,19 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
 	  LogPrintf("fScriptChecks true\n");
+            // Inline checks can share data that lives as long as this call
+            CPrecomputedTransactionData txdata;
+            if (ptxdata == NULL && pvChecks == NULL) {
+                txdata = CPrecomputedTransactionData(tx);
+                ptxdata = &txdata;
+            }
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins* coins = inputs.AccessCoins(prevout.hash);
+                assert(coins);
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(*coins, tx, i, flags, 0, ptxdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1977,7 +2254,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(*coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, ptxdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
                     }
@@ -2018,21 +2295,22 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         // exactly. Note that transactions with only provably unspendable outputs won't
         // have outputs available even in the block itself, so we handle that case
         // specially with outsEmpty.
-        CCoins outsEmpty;
-        CCoins &outs = view.HaveCoins(hash) ? view.GetCoins(hash) : outsEmpty;
-        outs.ClearUnspendable();
+        {
+        CCoinsModifier outs = view.ModifyCoins(hash);
+        outs->ClearUnspendable();
 
         CCoins outsBlock = CCoins(tx, pindex->nHeight);
         // The CCoins serialization does not serialize negative numbers.
         // No network rules currently depend on the version here, so an inconsistency is harmless
         // but it must be corrected before txout nversion ever influences a network rule.
         if (outsBlock.nVersion < 0)
-            outs.nVersion = outsBlock.nVersion;
-        if (outs != outsBlock)
+            outs->nVersion = outsBlock.nVersion;
+        if (*outs != outsBlock)
             fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
-        outs = CCoins();
+        outs->Clear();
+        }
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -2105,6 +2383,41 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
+// Statistics of the last block whose scripts went through scriptcheckqueue
+static CCriticalSection cs_scriptcheckstats;
+static uint256 hashScriptCheckBlock;
+static int nScriptCheckHeight = -1;
+static CCheckQueueStats scriptCheckStats;
+
+bool GetScriptCheckStats(uint256 &hashBlock, int &nHeight, CCheckQueueStats &stats)
+{
+    LOCK(cs_scriptcheckstats);
+    if (nScriptCheckHeight < 0)
+        return false;
+    hashBlock = hashScriptCheckBlock;
+    nHeight = nScriptCheckHeight;
+    stats = scriptCheckStats;
+    return true;
+}
+
+static void UpdateScriptCheckStats(const CBlockIndex *pindex, const CCheckQueueStats &stats)
+{
+    if (fBenchmark) {
+        int64_t nBusy = 0;
+        std::string strIdle;
+        BOOST_FOREACH(const CCheckQueueWorkerStats &worker, stats.vWorker) {
+            nBusy += worker.nBusyMicros;
+            strIdle += strprintf(" %.2f", 0.001 * (stats.nWallMicros - worker.nBusyMicros));
+        }
+        LogPrintf("- Script checks: %u in %.2fms on %u workers (%.2fms busy), idle ms:%s\n", stats.nChecks,
+                  0.001 * stats.nWallMicros, (unsigned int)stats.vWorker.size(), 0.001 * nBusy, strIdle);
+    }
+    LOCK(cs_scriptcheckstats);
+    hashScriptCheckBlock = pindex->GetBlockHash();
+    nScriptCheckHeight = pindex->nHeight;
+    scriptCheckStats = stats;
+}
+
 void ThreadScriptCheck() {
     RenameThread("bitmark-scriptch");
     scriptcheckqueue.Thread();
@@ -2198,7 +2511,8 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
 	for (unsigned int i = 0; i < block.vtx.size(); i++) {
 		uint256 hash = block.GetTxHash(i);
-		if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+		const CCoins* coins = view.AccessCoins(hash);
+		if (coins && !coins->IsPruned())
 			return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
 							 REJECT_INVALID, "bad-txns-BIP30");
 	}
@@ -2221,6 +2535,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     CBlockUndo blockundo;
 
+    // Shared by the queued script checks of each transaction: it must not
+    // reallocate, and must outlive control, whose destructor waits for them
+    std::vector<CPrecomputedTransactionData> vTxData(block.vtx.size());
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nStart = GetTimeMicros();
@@ -2257,7 +2574,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
+            if (fScriptChecks)
+                vTxData[i] = CPrecomputedTransactionData(tx);
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL, &vTxData[i]))
                 return false;
             control.Add(vChecks);
         }
@@ -2305,6 +2624,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     if (!control.Wait())
         return state.DoS(100, false);
+    CCheckQueueStats stats;
+    if (!fJustCheck && control.GetStats(stats))
+        UpdateScriptCheckStats(pindex, stats);
     int64_t nTime2 = GetTimeMicros() - nStart;
     if (fBenchmark)
         LogPrintf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
@@ -2350,8 +2672,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
         pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
 
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
+        if (!WriteBlockIndex(pindex))
             return state.Abort(_("Failed to write block index"));
     }
 
@@ -2374,7 +2695,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 // Update the on-disk chain state.
 bool static WriteChainState(CValidationState &state) {
     static int64_t nLastWrite = 0;
-    if (!IsInitialBlockDownload() || pcoinsTip->GetCacheSize() > nCoinCacheSize || GetTimeMicros() > nLastWrite + 600*1000000) {
+    if (!IsInitialBlockDownload() || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage || GetTimeMicros() > nLastWrite + 600*1000000) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2404,6 +2725,8 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    if (ptemplateCache)
+        ptemplateCache->NotifyTip(pindexNew);
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%d progress=%f nbits=%u algo=%d\n",chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx, chainActive.Tip()->GetBlockTime(),Checkpoints::GuessVerificationProgress(chainActive.Tip()), chainActive.Tip()->nBits,GetAlgo(chainActive.Tip()->nVersion));
     //char * blocktime = (char *)malloc(50);
     //sprintf(blocktime,"%d %d\n",chainActive.Tip()->nTime,GetAlgo(chainActive.Tip()->nVersion));
@@ -2486,8 +2809,14 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
       LogPrintf("Failed to read block (connecttip)\n");
       return false;
     }
-    // Apply the block atomically to the chain state.
+    // Take over the coins read while the previous block was being connected.
     int64_t nStart = GetTimeMicros();
+    if (pcoinsPrefetcher) {
+        unsigned int nPrefetched = pcoinsPrefetcher->Apply(pindexNew->GetBlockHash(), *pcoinsTip);
+        if (fBenchmark)
+            LogPrintf("- Prefetched %u coins: %.2fms\n", nPrefetched, (GetTimeMicros() - nStart) * 0.001);
+    }
+    // Apply the block atomically to the chain state.
     {
         CCoinsViewCache view(*pcoinsTip, true);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
@@ -2600,6 +2929,10 @@ bool ActivateBestChain(CValidationState &state) {
         // Connect new blocks.
         while (!chainActive.Contains(chainMostWork.Tip())) {
             CBlockIndex *pindexConnect = chainMostWork[chainActive.Height() + 1];
+            // Have the coins of the block after it read while this one connects
+            CBlockIndex *pindexNext = chainMostWork[chainActive.Height() + 2];
+            if (pcoinsPrefetcher && pindexNext && (pindexNext->nStatus & BLOCK_HAVE_DATA))
+                pcoinsPrefetcher->Prefetch(pindexNext->GetBlockHash(), pindexNext->GetBlockPos());
             if (!ConnectTip(state, pindexConnect)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
@@ -2635,36 +2968,42 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString()), 0, "duplicate");
 
-    // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    // Construct new block index object, or take over the one made for its header
+    CBlockIndex* pindexNew;
+    BlockMap::iterator miHeader = mapHeaderIndex.find(hash);
+    if (miHeader != mapHeaderIndex.end()) {
+        pindexNew = miHeader->second;
+        mapHeaderIndex.erase(miHeader);
+    } else
+        pindexNew = blockIndexArena.Allocate(hash, CBlockIndex(block));
     {
          LOCK(cs_nBlockSequenceId);
          pindexNew->nSequenceId = nBlockSequenceId++;
     }
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
+    BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
+    pindexNew->BuildAlgoLinks();
     pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
-    if (block.IsAuxpow()) {
-      pindexNew->pauxpow = block.auxpow;
-      assert(NULL != pindexNew->pauxpow.get());
-    }
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + ArithToUint256(arith_uint256(pindexNew->GetBlockWork()));
+    CBlockIndexAux aux(block);
+    if (block.IsAuxpow())
+      assert(NULL != aux.pauxpow.get());
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
+    UpdateBestHeader(pindexNew);
 
-    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew, aux)))
         return state.Abort(_("Failed to write block index"));
+    CacheBlockIndexAux(hash, aux);
     
     // New best?
     if (!ActivateBestChain(state))
@@ -2786,6 +3125,129 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+bool CheckBlockHeaderPoW(const CBlockHeader& block, CValidationState& state)
+{
+    uint256 hashPoWKey = GetPoWCacheKey(block);
+    if (IsPoWVerified(hashPoWKey))
+        return true;
+
+    if (block.IsAuxpow()) {
+      if (!CheckAuxPowProofOfWork(block, Params())) {
+	return state.DoS(50, error("CheckBlock() : auxpow proof of work failed"),
+			 REJECT_INVALID, "high-hash");
+      }
+    }
+    else {
+          if (block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params())) {
+	    return state.DoS(50, error("CheckBlock() : Invalid Equihash Solution"),
+			     REJECT_INVALID, "bad-equihash-solution");      
+	  }
+
+	  //LogPrintf("check proof of work of block with algo %d\n",block.GetAlgo());
+	  if (!CheckProofOfWork(block.GetPoWHash(),block.nBits,block.GetAlgo())) {
+	    return state.DoS(50, error("CheckBlock() : proof of work failed"),
+			     REJECT_INVALID, "high-hash");
+	  }
+    }
+
+    SetPoWVerified(hashPoWKey);
+    return true;
+}
+
+/** Headers of one algo hashed together by a CPoWCheck, filling the multi-buffer lanes */
+static const unsigned int POW_CHECK_BATCH = 8;
+
+/**
+ * Proof-of-work check of one or more block headers, run on the PoW check
+ * threads ahead of ProcessBlock. Several headers are only grouped when they
+ * share an algo and need nothing beyond the PoW hash (no auxpow or Equihash
+ * solution), so they can go through the algo's batch hash.
+ */
+class CPoWCheck
+{
+private:
+    std::vector<CBlockHeader> vHeader;
+
+public:
+    CPoWCheck() {}
+    CPoWCheck(const CBlockHeader& headerIn) : vHeader(1, headerIn) {}
+
+    void Add(const CBlockHeader& header) {
+        vHeader.push_back(header);
+    }
+
+    unsigned int size() const {
+        return vHeader.size();
+    }
+
+    bool operator()() {
+        // the outcome only matters through the PoW cache; ProcessBlock reports failures
+        if (vHeader.size() == 1) {
+            CValidationState state;
+            CheckBlockHeaderPoW(vHeader[0], state);
+            return true;
+        }
+
+        int algo = vHeader[0].GetAlgo();
+        std::vector<const CPureBlockHeader*> vpHeader(vHeader.size());
+        std::vector<uint256> vHash(vHeader.size());
+        for (unsigned int i = 0; i < vHeader.size(); i++)
+            vpHeader[i] = &vHeader[i];
+        GetPoWAlgo(algo).HashBatch(&vpHeader[0], &vHash[0], vHeader.size());
+        for (unsigned int i = 0; i < vHeader.size(); i++)
+            if (CheckProofOfWork(vHash[i], vHeader[i].nBits, algo))
+                SetPoWVerified(GetPoWCacheKey(vHeader[i]));
+        return true;
+    }
+
+    void swap(CPoWCheck &check) {
+        vHeader.swap(check.vHeader);
+    }
+};
+
+static CCheckQueue<CPoWCheck> powcheckqueue(1);
+static CCriticalSection cs_powcheckqueue;
+
+void ThreadPoWCheck() {
+    RenameThread("bitmark-powch");
+    powcheckqueue.Thread();
+}
+
+void PreVerifyBlockPoW(const std::vector<const CBlockHeader*>& vpblock)
+{
+    std::vector<CPoWCheck> vChecks;
+    // index in vChecks of the batch being filled for each algo, or -1
+    int vBatch[NUM_ALGOS];
+    std::fill(vBatch, vBatch + NUM_ALGOS, -1);
+    BOOST_FOREACH(const CBlockHeader* pblock, vpblock) {
+        if (IsPoWVerified(GetPoWCacheKey(*pblock)))
+            continue;
+        int algo = pblock->GetAlgo();
+        if (pblock->IsAuxpow() || algo == ALGO_EQUIHASH) {
+            vChecks.push_back(CPoWCheck(*pblock));
+            continue;
+        }
+        if (vBatch[algo] >= 0 && vChecks[vBatch[algo]].size() < POW_CHECK_BATCH) {
+            vChecks[vBatch[algo]].Add(*pblock);
+            continue;
+        }
+        vBatch[algo] = vChecks.size();
+        vChecks.push_back(CPoWCheck(*pblock));
+    }
+    if (vChecks.empty())
+        return;
+
+    if (!nScriptCheckThreads) {
+        BOOST_FOREACH(CPoWCheck& check, vChecks)
+            check();
+        return;
+    }
+    LOCK(cs_powcheckqueue);
+    CCheckQueueControl<CPoWCheck> control(&powcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
@@ -2802,7 +3264,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     /*
     bool blockOnFork = false;
     if (fCheckPOW && block.GetHash() != Params().HashGenesisBlock()) {
-      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+      BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
       if (mi == mapBlockIndex.end())
 	return state.DoS(10, error("CheckBlock() : prev block not found"), 0, "bad-prevblk");
       CBlockIndex * pindexPrev = (*mi).second;
@@ -2810,24 +3272,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
       }*/
     
     // Check proof of work matches claimed amount
-    if(fCheckPOW && block.IsAuxpow()) {
-      if (!CheckAuxPowProofOfWork(block, Params())) {
-	return state.DoS(50, error("CheckBlock() : auxpow proof of work failed"),
-			 REJECT_INVALID, "high-hash");
-      }
-    }
-    else {
-          if (fCheckPOW && block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params())) {
-	    return state.DoS(50, error("CheckBlock() : Invalid Equihash Solution"),
-			     REJECT_INVALID, "bad-equihash-solution");      
-	  }
-
-	  //LogPrintf("check proof of work of block with algo %d\n",block.GetAlgo());
-	  if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(),block.nBits,block.GetAlgo())) {
-	    return state.DoS(50, error("CheckBlock() : proof of work failed"),
-			     REJECT_INVALID, "high-hash");
-	  }
-    }
+    if (fCheckPOW && !CheckBlockHeaderPoW(block, state))
+        return false;
 
     // Check timestamp
     int64_t nNow = GetTime();
@@ -2896,6 +3342,114 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
+bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    uint256 hash = block.GetHash();
+    int nHeight = pindexPrev->nHeight+1;
+
+    // Check proof of work
+    int block_algo = GetAlgo(block.nVersion);
+    unsigned int next_work_required = GetNextWorkRequired(pindexPrev, block_algo);
+    if (block.nBits != next_work_required) {
+      LogPrintf("nbits = %d, required = %d\n",block.nBits,next_work_required);
+      return state.DoS(100, error("ContextualCheckBlockHeader() : incorrect proof of work"),
+		       REJECT_INVALID, "bad-diffbits");
+    }
+
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("ContextualCheckBlockHeader() : block's timestamp is too early"),
+                             REJECT_INVALID, "time-too-old");
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("ContextualCheckBlockHeader() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    // Don't accept any forks from the main chain prior to last checkpoint
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("ContextualCheckBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    // Reject block.nVersion=1 blocks
+    if (block.nVersion < 2)
+    {
+		return state.Invalid(error("ContextualCheckBlockHeader() : rejected nVersion=1 block"),
+							 REJECT_OBSOLETE, "bad-version");
+    }
+
+    // Reject block.nVersion=2 blocks when 95% of the network has upgraded:
+
+    if (block.nVersion < 3 &&
+	CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000))
+      {
+	return state.Invalid(error("ContextualCheckBlockHeader() : rejected nVersion=2 block"),
+			     REJECT_OBSOLETE, "bad-version");
+      }
+
+    if (block.IsAuxpow() || block.GetAlgo() != ALGO_SCRYPT) {
+      if (pindexPrev->nHeight < nForkHeight-1 || !CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
+	return state.DoS(100,error("ContextualCheckBlockHeader() : new block format requires fork activation"),REJECT_INVALID,"bad-version-fork");
+      }
+    }
+
+    return true;
+}
+
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    // Check for duplicate
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindex = LookupHeaderIndex(hash);
+    if (pindex) {
+        if (ppindex)
+            *ppindex = pindex;
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString()), 0, "duplicate");
+        UpdateBestHeader(pindex);
+        return true;
+    }
+
+    // The context-free header checks of CheckBlock
+    if (!CheckBlockHeaderPoW(block, state))
+        return false;
+    if (block.GetBlockTime() > GetTime() + 12 * 60)
+        return state.Invalid(error("AcceptBlockHeader() : block timestamp too far in the future"),
+                             REJECT_INVALID, "time-too-new");
+
+    // Get prev block index
+    CBlockIndex* pindexPrev = NULL;
+    if (hash != Params().HashGenesisBlock()) {
+        pindexPrev = LookupHeaderIndex(block.hashPrevBlock);
+        if (!pindexPrev)
+            return state.DoS(10, error("AcceptBlockHeader() : prev block not found"), 0, "bad-prevblk");
+        if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+            return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"), REJECT_INVALID, "bad-prevblk");
+        if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+            return false;
+    }
+
+    pindex = blockIndexArena.Allocate(hash, CBlockIndex(block));
+    mapHeaderIndex.insert(make_pair(hash, pindex));
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+    pindex->BuildAlgoLinks();
+    pindex->nChainWork = (pindexPrev ? pindexPrev->nChainWork : 0) + ArithToUint256(arith_uint256(pindex->GetBlockWork()));
+    pindex->nStatus = BLOCK_VALID_TREE;
+    UpdateBestHeader(pindex);
+
+    // Kept on disk as well, for GetBlockIndexAux and for the next start
+    CBlockIndexAux aux(block);
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, aux)))
+        return state.Abort(_("Failed to write block index"));
+    CacheBlockIndexAux(hash, aux);
+
+    if (ppindex)
+        *ppindex = pindex;
+    return true;
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
 {
     AssertLockHeld(cs_main);
@@ -2908,25 +3462,14 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"), 0, "bad-prevblk");
         pindexPrev = (*mi).second;
         nHeight = pindexPrev->nHeight+1;	
 
-        // Check proof of work
-	int block_algo = GetAlgo(block.nVersion);
-	unsigned int next_work_required = GetNextWorkRequired(pindexPrev, block_algo);
-        if (block.nBits != next_work_required) {
-	  LogPrintf("nbits = %d, required = %d\n",block.nBits,next_work_required);
-	  return state.DoS(100, error("AcceptBlock() : incorrect proof of work"),
-			   REJECT_INVALID, "bad-diffbits");
-	}
-
-        // Check timestamp against prev
-        if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"),
-                                 REJECT_INVALID, "time-too-old");
+        if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+            return false;
 
         // Check that all transactions are finalized
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
@@ -2934,23 +3477,6 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
                 return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"),
                                  REJECT_INVALID, "bad-txns-nonfinal");
 
-        // Check that the block chain matches the known block chain up to a checkpoint
-        if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight),
-                             REJECT_CHECKPOINT, "checkpoint mismatch");
-
-        // Don't accept any forks from the main chain prior to last checkpoint
-        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-        if (pcheckpoint && nHeight < pcheckpoint->nHeight)
-            return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
-
-        // Reject block.nVersion=1 blocks
-        if (block.nVersion < 2)
-        {
-			return state.Invalid(error("AcceptBlock() : rejected nVersion=1 block"),
-								 REJECT_OBSOLETE, "bad-version");
-        }
-
         // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
         if (block.nVersion >= 2)
         {
@@ -2960,34 +3486,25 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
 			  return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase, nHeight=%d",nHeight),
 								 REJECT_INVALID, "bad-cb-height");
         }
-
-        // Reject block.nVersion=2 blocks when 95% of the network has upgraded:
-
-	if (block.nVersion < 3 &&
-	    CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000))
-	  {
-	    return state.Invalid(error("AcceptBlock() : rejected nVersion=2 block"),
-				 REJECT_OBSOLETE, "bad-version");
-	  }
-
-	if (block.IsAuxpow() || block.GetAlgo() != ALGO_SCRYPT) {
-	  if (pindexPrev->nHeight < nForkHeight-1 || !CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
-	    return state.DoS(100,error("AcceptBlock() : new block format requires fork activation"),REJECT_INVALID,"bad-version-fork");
-	  }
-	}	
     }
 
     // Write block to history file
     try {
         unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
-            blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
-            return error("AcceptBlock() : FindBlockPos failed");
-        if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos))
-                return state.Abort(_("Failed to write block"));
+        BlockMap::iterator miHeader = mapHeaderIndex.find(hash);
+        if (miHeader != mapHeaderIndex.end() && (miHeader->second->nStatus & BLOCK_HAVE_DATA)) {
+            // stored ahead of its parent, see StoreUnlinkedBlock
+            blockPos = miHeader->second->GetBlockPos();
+        } else {
+            if (dbp != NULL)
+                blockPos = *dbp;
+            if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
+                return error("AcceptBlock() : FindBlockPos failed");
+            if (dbp == NULL)
+                if (!WriteBlockToDisk(block, blockPos))
+                    return state.Abort(_("Failed to write block"));
+        }
         if (!AddToBlockIndex(block, state, blockPos))
 	  return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
@@ -3007,6 +3524,33 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     return true;
 }
 
+// Write a block whose header is in the header index to disk before its parent
+// is accepted, so headers-first download needs no orphan pool. ProcessBlock
+// accepts it from there once the parent is.
+bool static StoreUnlinkedBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (pindex->nStatus & BLOCK_HAVE_DATA)
+        return state.Invalid(error("StoreUnlinkedBlock() : already have block %s", pindex->GetBlockHash().ToString()), 0, "duplicate");
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, block.nTime))
+            return error("StoreUnlinkedBlock() : FindBlockPos failed");
+        if (!WriteBlockToDisk(block, blockPos))
+            return state.Abort(_("Failed to write block"));
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+    if (!WriteBlockIndex(pindex))
+        return state.Abort(_("Failed to write block index"));
+    mapBlocksUnlinked.insert(make_pair(pindex->pprev, pindex));
+    return true;
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     AssertLockHeld(cs_main);
@@ -3029,13 +3573,17 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString()), 0, "duplicate");
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
+    BlockMap::iterator miHeader = mapHeaderIndex.find(hash);
+    CBlockIndex* pindexHeader = miHeader != mapHeaderIndex.end() ? miHeader->second : NULL;
+    if (pindexHeader && (pindexHeader->nStatus & BLOCK_HAVE_DATA))
+        return state.Invalid(error("ProcessBlock() : already have block (unlinked) %s", hash.ToString()), 0, "duplicate");
     
     // Preliminary checks
     if (!CheckBlock(*pblock, state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     if (0) { // skip these extra checks until we have the fork height set
-      CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+      CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
       if (pcheckpoint && pblock->hashPrevBlock != (chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256(0)))
 	{
 	  // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -3045,11 +3593,13 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 	      return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"),
 			       REJECT_CHECKPOINT, "time-too-old");
 	    }
-	  CBigNum bnNewBlock;
-	  bnNewBlock.SetCompact(pblock->nBits);
-	  CBigNum bnRequired;
+	  bool fNegative;
+	  bool fOverflow;
+	  arith_uint320 bnNewBlock;
+	  bnNewBlock.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+	  arith_uint320 bnRequired;
 	  bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
-	  if (bnNewBlock > bnRequired)
+	  if (fNegative || fOverflow || bnNewBlock > bnRequired)
 	    {
 	      return state.DoS(100, error("ProcessBlock() : block with too little proof-of-work"),
 			       REJECT_INVALID, "bad-diffbits");
@@ -3060,6 +3610,13 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
     {
+        // With its header validated already, the block waits on disk instead
+        if (pindexHeader && dbp == NULL) {
+            if (!StoreUnlinkedBlock(*pblock, state, pindexHeader))
+                return error("ProcessBlock() : StoreUnlinkedBlock FAILED");
+            return true;
+        }
+
       //LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
 
         // Accept orphans as long as there is a node to request its parents from
@@ -3083,16 +3640,50 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     }
 
     // Store to disk
-    if (!AcceptBlock(*pblock, state, dbp))
-      return error("ProcessBlock() : AcceptBlock FAILED");
+    if (!AcceptBlock(*pblock, state, dbp)) {
+        // keep headers-first download from requesting it again
+        if (pindexHeader && !mapBlockIndex.count(hash) && state.IsInvalid() && !state.CorruptionPossible()) {
+            pindexHeader->nStatus |= BLOCK_FAILED_VALID;
+            WriteBlockIndex(pindexHeader);
+            InvalidateBestHeader(pindexHeader);
+        }
+        return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
-    // Recursively process any orphan blocks that depended on this one
+    // Recursively process any orphan and unlinked blocks that depended on this one
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
       //LogPrintf("processblock work queue %d of %d\n",i,vWorkQueue.size());
         uint256 hashPrev = vWorkQueue[i];
+        std::vector<CBlockIndex*> vUnlinked;
+        BlockMap::iterator miPrev = mapBlockIndex.find(hashPrev);
+        if (miPrev != mapBlockIndex.end()) {
+            std::pair<multimap<CBlockIndex*, CBlockIndex*>::iterator, multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(miPrev->second);
+            for (multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first; it != range.second; ++it)
+                vUnlinked.push_back(it->second);
+            mapBlocksUnlinked.erase(range.first, range.second);
+        }
+        BOOST_FOREACH(CBlockIndex* pindex, vUnlinked)
+        {
+            CBlock block;
+            CValidationState stateDummy;
+            if (!ReadBlockFromDisk(block, pindex)) {
+                // forget the stored copy, so the block is downloaded again
+                pindex->nStatus &= ~BLOCK_HAVE_DATA;
+                WriteBlockIndex(pindex);
+                continue;
+            }
+            block.BuildMerkleTree();
+            if (AcceptBlock(block, stateDummy))
+                vWorkQueue.push_back(pindex->GetBlockHash());
+            else if (stateDummy.IsInvalid()) {
+                pindex->nStatus |= BLOCK_FAILED_VALID;
+                WriteBlockIndex(pindex);
+                InvalidateBestHeader(pindex);
+            }
+        }
         for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
@@ -3285,17 +3876,14 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(hash, CBlockIndex());
     //LogPrintf("insert to mapBlockIndex hash %s\n",hash.GetHex().c_str());
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
 
     return pindexNew;
 }
@@ -3319,15 +3907,33 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->BuildAlgoLinks();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + ArithToUint256(arith_uint256(pindex->GetBlockWork()));
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK)) {
 	  //LogPrintf("insert pindex at height %d (%s) as valid\n",pindex->nHeight,(pindex->phashBlock)->GetHex().c_str());
             setBlockIndexValid.insert(pindex);
 	}
+        if ((pindex->nStatus & BLOCK_VALID_MASK) == BLOCK_VALID_TREE) {
+            // a header stored ahead of its block, see AcceptBlockHeader
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            mapHeaderIndex.insert(make_pair(pindex->GetBlockHash(), pindex));
+            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+                if (pindex->pprev && mapBlockIndex.count(pindex->pprev->GetBlockHash())) {
+                    // the parent was accepted after this was stored; download it again
+                    pindex->nStatus &= ~BLOCK_HAVE_DATA;
+                    WriteBlockIndex(pindex);
+                } else
+                    mapBlocksUnlinked.insert(make_pair(pindex->pprev, pindex));
+            }
+            if (!(pindex->nStatus & BLOCK_FAILED_MASK))
+                UpdateBestHeader(pindex);
+            continue;
+        }
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
     }
+    LogPrintf("LoadBlockIndexDB(): %u block index entries, %u headers ahead of them, %u bytes each\n", mapBlockIndex.size(), mapHeaderIndex.size(), sizeof(CBlockIndex));
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3346,10 +3952,11 @@ bool static LoadBlockIndexDB()
 
     // Load pointer to end of best chain
     //LogPrintf("load pcoinstip bestblock %s\n",pcoinsTip->GetBestBlock().GetHex().c_str());
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    UpdateBestHeader(it->second);
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3398,7 +4005,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3434,10 +4041,27 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 
 void UnloadBlockIndex()
 {
+    {
+        LOCK(cs_ssfWindows);
+        listSSFWindows.clear();
+        mapSSFWindows.clear();
+    }
+    {
+        LOCK(cs_blockIndexAux);
+        listBlockIndexAux.clear();
+        mapBlockIndexAux.clear();
+    }
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    mapHeaderIndex.clear();
+    mapBlocksUnlinked.clear();
+    chainBestHeader.SetTip(NULL);
+    pindexBestHeader = NULL;
+    pindexBestForkTip = pindexBestForkBase = NULL;
+    // nothing may point into the entries any more
+    blockIndexArena.Clear();
 }
 
 bool LoadBlockIndex()
@@ -3506,7 +4130,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3570,11 +4194,42 @@ void PrintBlockTree()
     }
 }
 
+// Process a batch of blocks read by LoadExternalBlockFile, in order, after checking
+// their proof of work in parallel. Returns false if loading should stop.
+bool static ProcessExternalBlocks(vector<pair<CBlock, uint64_t> >& vBlocks, CDiskBlockPos *dbp, int& nLoaded)
+{
+    vector<const CBlockHeader*> vpblock;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        vpblock.push_back(&vBlocks[i].first);
+    PreVerifyBlockPoW(vpblock);
+
+    bool fContinue = true;
+    for (unsigned int i = 0; i < vBlocks.size() && fContinue; i++) {
+        try {
+            LOCK(cs_main);
+            if (dbp)
+                dbp->nPos = vBlocks[i].second;
+            CValidationState state;
+            if (ProcessBlock(state, NULL, &vBlocks[i].first, dbp))
+                nLoaded++;
+            if (state.IsError())
+                fContinue = false;
+        } catch (std::exception &e) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    vBlocks.clear();
+    return fContinue;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    // blocks read but not processed yet, with their positions in the file
+    vector<pair<CBlock, uint64_t> > vBlocks;
+    const unsigned int nBatchSize = std::max(1, 2*nScriptCheckThreads);
     try {
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nStartByte = 0;
@@ -3618,21 +4273,19 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat >> block;
                 nRewind = blkdat.GetPos();
 
-                // process block
+                // queue block for processing
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    vBlocks.push_back(make_pair(CBlock(), nBlockPos));
+                    std::swap(vBlocks.back().first, block);
                 }
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
+            if (vBlocks.size() >= nBatchSize && !ProcessExternalBlocks(vBlocks, dbp, nLoaded))
+                break;
         }
+        if (!vBlocks.empty())
+            ProcessExternalBlocks(vBlocks, dbp, nLoaded);
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3721,8 +4374,12 @@ bool static AlreadyHave(const CInv& inv)
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+        {
+            BlockMap::iterator mi = mapHeaderIndex.find(inv.hash);
+            return mapBlockIndex.count(inv.hash) ||
+                   mapOrphanBlocks.count(inv.hash) ||
+                   (mi != mapHeaderIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA));
+        }
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3750,13 +4407,13 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = false;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     // If the requested block is at a height below our last
                     // checkpoint, only serve it if it's in the checkpointed chain
                     int nHeight = mi->second->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
                     if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
                         if (!chainActive.Contains(mi->second))
                         {
@@ -4082,11 +4739,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK) {
+                CBlockIndex* pindex = LookupHeaderIndex(inv.hash);
+                if (pindex)
+                    UpdateBlockAvailability(pfrom->GetId(), pindex);
+            }
+
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex) {
-                    if (inv.type == MSG_BLOCK)
-                        AddBlockToQueue(pfrom->GetId(), inv.hash);
-                    else
+                    if (inv.type == MSG_BLOCK) {
+                        if (pfrom->nVersion >= HEADERS_FIRST_VERSION) {
+                            // Fetch the headers leading to it first; during initial download the
+                            // block is then fetched with the others, later straight away.
+                            if (!mapHeaderIndex.count(inv.hash))
+                                pfrom->PushMessage("getheaders", GetHeaderLocator(pindexBestHeader), inv.hash);
+                            if (!IsInitialBlockDownload())
+                                AddBlockToQueue(pfrom->GetId(), inv.hash);
+                        } else
+                            AddBlockToQueue(pfrom->GetId(), inv.hash);
+                    } else
                         pfrom->AskFor(inv);
                 }
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
@@ -4170,7 +4841,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4185,17 +4856,65 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = chainActive.Next(pindex))
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            CBlockHeader header;
+            if (!GetBlockIndexHeader(pindex, header))
+                break;
+            vHeaders.push_back(CBlock(header));
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
         pfrom->PushMessage("headers", vHeaders);
     }
 
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
+    {
+        // sent as blocks without transactions, see getheaders
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("headers message size = %u", vHeaders.size());
+        }
+        if (vHeaders.empty())
+            return true;
+
+        // Do the expensive PoW hashing before taking cs_main
+        std::vector<const CBlockHeader*> vpHeader;
+        vpHeader.reserve(vHeaders.size());
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+            vpHeader.push_back(&header);
+        PreVerifyBlockPoW(vpHeader);
+
+        LOCK(cs_main);
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlock& header, vHeaders) {
+            CValidationState state;
+            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("non-continuous headers sequence");
+            }
+            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received");
+            }
+        }
+
+        if (pindexLast)
+            UpdateBlockAvailability(pfrom->GetId(), pindexLast);
+
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && pindexLast) {
+            // There are more headers; continue where this message ended
+            LogPrint("net", "more getheaders (%d) to end to peer=%s (startheight:%d)\n", pindexLast->nHeight, pfrom->addrName, pfrom->nStartingHeight);
+            pfrom->PushMessage("getheaders", GetHeaderLocator(pindexLast), uint256(0));
+        }
+    }
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -4309,6 +5028,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Do the expensive PoW hashing before taking cs_main
+        PreVerifyBlockPoW(std::vector<const CBlockHeader*>(1, &block));
+
         LOCK(cs_main);
         // Remember who we got this block from.
         mapBlockSource[inv.hash] = pfrom->GetId();
@@ -4755,10 +5477,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
         state.rejects.clear();
 
-        // Start block sync
+        // Start block sync. Headers-first peers are asked for headers, one at a
+        // time until the best header is recent, then all of them so we learn
+        // which blocks each can serve; the others sync through getblocks.
+        if (pindexBestHeader == NULL && chainActive.Tip() != NULL)
+            UpdateBestHeader(chainActive.Tip());
+        if (pindexBestHeader != NULL && !state.fSyncStarted && pto->nVersion >= HEADERS_FIRST_VERSION && !pto->fClient && !fImporting && !fReindex) {
+            if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
+                state.fSyncStarted = true;
+                nSyncStarted++;
+                LogPrint("net", "initial getheaders (%d) to peer=%s (startheight:%d)\n", pindexBestHeader->nHeight, pto->addrName, pto->nStartingHeight);
+                pto->PushMessage("getheaders", GetHeaderLocator(pindexBestHeader), uint256(0));
+            }
+        }
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, chainActive.Tip(), uint256(0));
+            if (pto->nVersion < HEADERS_FIRST_VERSION)
+                PushGetBlocks(pto, chainActive.Tip(), uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4829,6 +5564,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LogPrintf("Peer %s is stalling block download, disconnecting\n", state.name.c_str());
             pto->fDisconnect = true;
         }
+        // A peer holding up the download window loses its slot much sooner
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - BLOCK_STALLING_TIMEOUT*1000000) {
+            LogPrintf("Peer %s is stalling the block download window, disconnecting\n", state.name.c_str());
+            pto->fDisconnect = true;
+        }
 
         //
         // Message: getdata (blocks)
@@ -4845,6 +5585,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 vGetData.clear();
             }
         }
+        if (!pto->fDisconnect && !pto->fClient && state.fSyncStarted && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            std::vector<CBlockIndex*> vToDownload;
+            NodeId staller = -1;
+            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            BOOST_FOREACH(CBlockIndex* pindex, vToDownload) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash());
+                LogPrint("net", "Requesting block %s (%d) from %s\n", pindex->GetBlockHash().ToString(), pindex->nHeight, state.name.c_str());
+            }
+            if (staller != -1) {
+                CNodeState *stateStaller = State(staller);
+                if (stateStaller && stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
+                    LogPrint("net", "Stall started peer=%s\n", stateStaller->name.c_str());
+                }
+            }
+        }
 
         //
         // Message: getdata (non-blocks)
@@ -4878,10 +5635,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan blocks
         std::map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -4895,78 +5650,10 @@ public:
     }
 } instance_of_cmaincleanup;
 
-int GetAlgo (int nVersion) {
-  switch (nVersion & BLOCK_VERSION_ALGO)
-    {
-    case BLOCK_VERSION_SHA256D:
-      return ALGO_SHA256D;
-    case BLOCK_VERSION_SCRYPT:
-      return ALGO_SCRYPT;
-    case BLOCK_VERSION_ARGON2:
-      return ALGO_ARGON2;
-    case BLOCK_VERSION_X17:
-      return ALGO_X17;
-    case BLOCK_VERSION_LYRA2REv2:
-      return ALGO_LYRA2REv2;
-    case BLOCK_VERSION_EQUIHASH:
-      return ALGO_EQUIHASH;
-    case BLOCK_VERSION_CRYPTONIGHT:
-      return ALGO_CRYPTONIGHT;
-    case BLOCK_VERSION_YESCRYPT:
-      return ALGO_YESCRYPT;
-    }
-  return ALGO_SCRYPT;
-}
-
-const char * GetAlgoName (int algo) {
-  if (algo == 0) {
-    return "SCRYPT";
-  }
-  if (algo == 1) {
-    return "SHA256D";
-  }
-  else if (algo == 2) {
-    return "YESCRYPT";
-  }
-  else if (algo == 3) {
-    return "ARGON2";
-  }
-  else if (algo == 4) {
-    return "X17";
-  }
-  else if (algo == 5) {
-    return "LYRA2REv2";
-  }
-  else  if (algo == 6) {
-    return "EQUIHASH";
-  }
-  else if (algo == 7) {
-    return "CRYPTONIGHT";
-  }
-  return "SCRYPT";
-}
-
 /* Get previous CBlockIndex pointer with the given algo */
 CBlockIndex * get_pprev_algo (const CBlockIndex * p, int use_algo) {
   if (!p) return 0;
-  if (!onFork(p)) return 0;
-  int algo = -1;
-  if (use_algo>=0) {
-    algo = use_algo;
-  }
-  else {
-    algo = GetAlgo(p->nVersion);
-  }
-  CBlockIndex * pprev = p->pprev;
-  while (pprev && onFork(pprev)) {
-    int cur_algo = GetAlgo(pprev->nVersion);
-    if (cur_algo == algo) {
-      return pprev;
-    }
-    pprev = pprev->pprev;
-  }
-  //LogPrintf("return 0 for pprev_algo (%d)\n",algo);
-  return 0;
+  return p->GetPrevAlgo(use_algo>=0 ? use_algo : p->GetAlgo());
 }
 
 int64_t get_mpow_ms_correction (CBlockIndex * p) {
@@ -4988,59 +5675,87 @@ bool update_ssf (int nVersion) {
   return nVersion & BLOCK_VERSION_UPDATE_SSF;
 }
 
-CBigNum get_ssf (CBlockIndex * pindex) {
-  CBigNum scalingFactor = CBigNum(0); // ensures that it has no effect
-  CBlockIndex * pprev_algo = pindex;
-  CBigNum hashes_peak = CBigNum(0);
-  CBigNum hashes_cur = CBigNum(0);
-  for (int i=0; i<365; i++) { // use at most a year's worth of history
-    //LogPrintf("i=%d\n",i);
+CSSFWindow get_ssf_window (const CBlockIndex * phead) {
+  // dummy indexes (miner, rpc) are not in mapBlockIndex and may live on the stack, so never cache those
+  bool fCache = phead->phashBlock != NULL;
+  if (fCache) {
+    LOCK(cs_ssfWindows);
+    map<uint256, SSFWindowList::iterator>::iterator it = mapSSFWindows.find(phead->GetBlockHash());
+    if (it != mapSSFWindows.end()) {
+      listSSFWindows.splice(listSSFWindows.begin(), listSSFWindows, it->second);
+      return it->second->second;
+    }
+  }
+
+  CSSFWindow window;
+  const CBlockIndex * pprev_algo = phead;
+  window.hashes = phead->GetBlockWork();
+  window.fComplete = true;
+  window.nTimeFirst = phead->GetMedianTimePast();
+  window.nTimeLast = 0;
+  for (int j=0; j<nSSF-1; j++) {  // nSSF blocks = 24 hours, using only blocks from the same algo as the target block
     pprev_algo = get_pprev_algo(pprev_algo,-1);
     if (!pprev_algo) {
+      window.hashes = 0;
+      window.fComplete = false;
       break;
     }
-    CBigNum hashes = pprev_algo->GetBlockWork();
-    unsigned int time_f = pprev_algo->GetMedianTimePast();
-    unsigned int time_i = 0;
-    for (int j=0; j<nSSF-1; j++) {  // nSSF blocks = 24 hours, using only blocks from the same algo as the target block
-      pprev_algo = get_pprev_algo(pprev_algo,-1);
-      if (!pprev_algo) {
-	hashes = CBigNum(0);
-	break;
-      }
-      hashes += pprev_algo->GetBlockWork();
-      time_i = pprev_algo->GetMedianTimePast();
-    }
-    CBlockIndex * pprev_algo_time = get_pprev_algo(pprev_algo,-1);
-    if (pprev_algo_time) {
-      time_i = pprev_algo_time->GetMedianTimePast();
+    window.hashes += pprev_algo->GetBlockWork();
+    window.nTimeLast = pprev_algo->GetMedianTimePast();
+  }
+  window.pnext = get_pprev_algo(pprev_algo,-1);
+  if (window.pnext) {
+    window.nTimeLast = window.pnext->GetMedianTimePast();
+  }
+  else { // get prefork block time
+    const CBlockIndex * blockindex = pprev_algo;
+    while (blockindex && onFork(blockindex)) {
+      blockindex = blockindex->pprev;
     }
-    else { // get prefork block time
-      CBlockIndex * blockindex = pprev_algo;
-      while (blockindex && onFork(blockindex)) {
-	blockindex = blockindex->pprev;
+    if (blockindex) window.nTimeLast = blockindex->GetBlockTime();
+  }
+  window.hashrate = 0;
+  if (window.nTimeFirst>window.nTimeLast) {
+    window.hashrate = (window.hashes*100000000)/(window.nTimeFirst-window.nTimeLast);
+  }
+
+  if (fCache) {
+    LOCK(cs_ssfWindows);
+    // another thread may have computed it meanwhile
+    if (!mapSSFWindows.count(phead->GetBlockHash())) {
+      listSSFWindows.push_front(make_pair(phead->GetBlockHash(), window));
+      mapSSFWindows.insert(make_pair(phead->GetBlockHash(), listSSFWindows.begin()));
+      if (listSSFWindows.size() > MAX_SSF_WINDOW_CACHE) {
+        mapSSFWindows.erase(listSSFWindows.back().first);
+        listSSFWindows.pop_back();
       }
-      if (blockindex) time_i = blockindex->GetBlockTime();
     }
-    if (time_f>time_i) {
-      time_f -= time_i;
-    }
-    else {
-      //LogPrintf("time_f = %d while time_i = %d\n",time_f,time_i);
+  }
+  return window;
+}
+
+arith_uint256 get_ssf (CBlockIndex * pindex) {
+  arith_uint256 scalingFactor = 0; // ensures that it has no effect
+  CBlockIndex * pprev_algo = get_pprev_algo(pindex,-1);
+  arith_uint320 hashes_peak = 0;
+  arith_uint320 hashes_cur = 0;
+  for (int i=0; i<365 && pprev_algo; i++) { // use at most a year's worth of history
+    CSSFWindow window = get_ssf_window(pprev_algo);
+    if (window.nTimeFirst<=window.nTimeLast) {
+      //LogPrintf("time_f = %d while time_i = %d\n",window.nTimeFirst,window.nTimeLast);
       return scalingFactor;
     }
-    //LogPrintf("hashes = %lu, time = %u\n",hashes.getulong(),time_f);
-    hashes = (hashes*100000000)/time_f;
-    //LogPrintf("hashes per sec = %f\n",hashes);
-    if (hashes>hashes_peak) hashes_peak = hashes;
-    if (i==0) hashes_cur = hashes;
+    if (window.hashrate>hashes_peak) hashes_peak = window.hashrate;
+    if (i==0) hashes_cur = window.hashrate;
+    pprev_algo = window.pnext;
   }
-  if (hashes_peak > CBigNum(0) && hashes_cur != hashes_peak) {
+  if (hashes_peak > 0 && hashes_cur != hashes_peak) {
+    arith_uint320 ssf = (hashes_peak*100000000)/(hashes_peak-hashes_cur);
     if (onFork2(pindex)) {
-      scalingFactor = (100000000*hashes_peak)/(hashes_peak-hashes_cur);
+      scalingFactor = arith_uint256(ssf); // fits, hashrates are far below 2**228
     }
     else {
-      scalingFactor = CBigNum(((100000000*hashes_peak)/(hashes_peak-hashes_cur)).getuint());
+      scalingFactor = (unsigned int)ssf.GetLow64Saturated();
     }
   }
   //LogPrintf("return scaling factor %lu\n",scalingFactor);
@@ -5061,10 +5776,10 @@ int get_ssf_height (const CBlockIndex * pindex) {
 
 unsigned long get_ssf_work (const CBlockIndex * pindex) {
   const CBlockIndex * pprev_algo = pindex;
-  CBigNum hashes_bn = pprev_algo->GetBlockWork();
+  arith_uint320 hashes_bn = pprev_algo->GetBlockWork();
   for (int i=0; i<nSSF; i++) {
     if (update_ssf(pprev_algo->nVersion)) {
-      return ((hashes_bn/1000000)/1000).getulong();
+      return ((hashes_bn/1000000)/1000).GetLow64Saturated();
     }
     pprev_algo = get_pprev_algo(pprev_algo,-1);
     if (!pprev_algo) return 0;
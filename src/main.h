@@ -29,8 +29,12 @@
 #include <utility>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 class CBlockIndex;
 class CBloomFilter;
+class CCoinsPrefetcher;
+struct CCheckQueueStats;
 class CInv;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
@@ -56,14 +60,25 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 720;
-/** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Number of headers sent in one getheaders result. */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Size of the window ahead of the active chain tip in which blocks are fetched
+ *  from several peers at once during headers-first synchronization. Larger
+ *  windows tolerate larger download speed differences between peers, but
+ *  leave more blocks stored out of order on disk. */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of recently used block index records whose auxpow/Equihash data is kept in memory. */
+static const unsigned int MAX_BLOCKINDEX_AUX_CACHE = 1000;
+/** Number of recently used SSF windows kept in memory: two years of windows of every algo. */
+static const unsigned int MAX_SSF_WINDOW_CACHE = 8192;
 
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -81,10 +96,17 @@ static const unsigned char REJECT_DUST = 0x41;
 static const unsigned char REJECT_INSUFFICIENTFEE = 0x42;
 static const unsigned char REJECT_CHECKPOINT = 0x43;
 
+/** Block hashes are already uniformly distributed, so their low bits make a good hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern const std::string strMessageMagic;
@@ -94,7 +116,7 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -127,6 +149,10 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
 /** Process an incoming block */
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Height of the most-work valid header known, which may be ahead of the active chain */
+int GetBestHeaderHeight();
+/** Script check queue statistics of the last block connected with -par, if any */
+bool GetScriptCheckStats(uint256 &hashBlock, int &nHeight, CCheckQueueStats &stats);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -151,6 +177,11 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the proof-of-work checking thread */
+void ThreadPoWCheck();
+/** Verify the proof of work of a batch of blocks in parallel, outside cs_main. Valid
+    headers are remembered, so the check in CheckBlock becomes a lookup. */
+void PreVerifyBlockPoW(const std::vector<const CBlockHeader*>& vpblock);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -185,6 +216,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nSyncHeight;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -258,10 +290,10 @@ inline bool AllowFree(double dPriority)
 
 // Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
 // This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
-// instead of being performed inline.
+// instead of being performed inline; they share ptxdata, which must outlive them, if it is given.
 bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &view, bool fScriptChecks = true,
                  unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY,
-                 std::vector<CScriptCheck> *pvChecks = NULL);
+                 std::vector<CScriptCheck> *pvChecks = NULL, const CPrecomputedTransactionData *ptxdata = NULL);
 
 // Apply the effects of this transaction on the UTXO set represented by view
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash);
@@ -356,12 +388,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    const CPrecomputedTransactionData *ptxdata;
 
 public:
-    CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck() : ptxdata(NULL) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const CPrecomputedTransactionData* ptxdataIn = NULL) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), ptxdata(ptxdataIn) { }
 
     bool operator()() const;
 
@@ -371,6 +405,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        std::swap(ptxdata, check.ptxdata);
     }
 };
 
@@ -474,6 +509,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Get the header fields a CBlockIndex does not keep in memory, from the cache or the block tree db */
+bool GetBlockIndexAux(const CBlockIndex* pindex, CBlockIndexAux& aux);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -491,11 +528,20 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
 
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+/** The proof-of-work part of CheckBlock: PoW hash, auxpow and Equihash solution */
+bool CheckBlockHeaderPoW(const CBlockHeader& block, CValidationState& state);
 
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
 
+// Checks of a block header that depend on its parent: difficulty, timestamp, checkpoints and version
+bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
+
+// Validate a block header ahead of its transactions and add it to the header index,
+// which links headers-first downloads to the block index (see AcceptBlock)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+
 class CBlockFileInfo
 {
 public:
@@ -618,6 +664,9 @@ extern CChain chainMostWork;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Reads the coins of the next block to connect ahead of time (NULL if disabled) */
+extern CCoinsPrefetcher *pcoinsPrefetcher;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -668,12 +717,6 @@ protected:
     friend void ::UnregisterAllWallets();
 };
 
-/* Get Proof of Work Algo for the block from the block's nVersion */
-int GetAlgo (int nVersion);
-
-/* Get name of algo from its number */
-const char * GetAlgoName (int algo);
-
 /* Get previous CBlockIndex pointer that has the same POW algo as p */
 CBlockIndex * get_pprev_algo (const CBlockIndex * p, int use_algo = 0);
 
@@ -683,8 +726,22 @@ int64_t get_mpow_ms_correction (CBlockIndex * p);
 /* Check if this block requires an update to the subsidy scaling factor, using the block's nVersion */
 bool update_ssf (int nVersion);
 
+/** The nSSF consecutive blocks of one algo that the subsidy scaling factor averages hashrate over */
+struct CSSFWindow
+{
+    arith_uint320 hashes;    // work summed over the window, 0 if the algo has fewer than nSSF blocks
+    bool fComplete;          // whether all nSSF blocks were found
+    unsigned int nTimeFirst; // median time past of the most recent block in the window
+    unsigned int nTimeLast;  // median time past of the block preceding the window (or the pre-fork block time)
+    arith_uint320 hashrate;  // hashes*100000000/(nTimeFirst-nTimeLast), 0 if that time span is not positive
+    CBlockIndex * pnext;     // most recent block of the preceding window, NULL if there is none
+};
+
+/* Get the SSF window whose most recent block is phead. Windows only depend on the blocks they cover, so the most recently used are cached */
+CSSFWindow get_ssf_window (const CBlockIndex * phead);
+
 /* Calculate the subsidy scaling factor for the CBlockIndex pointer */
-CBigNum get_ssf (CBlockIndex * pindex);
+arith_uint256 get_ssf (CBlockIndex * pindex);
 
 /* Get the number of blocks since the last update of the subsidy scaling factor */
 int get_ssf_height (const CBlockIndex * pindex);
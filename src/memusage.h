@@ -0,0 +1,33 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_MEMUSAGE_H
+#define BITMARK_MEMUSAGE_H
+
+#include <stddef.h>
+#include <vector>
+
+/** Estimates of the heap memory used by objects, beyond their own size */
+namespace memusage
+{
+
+/** Bytes taken by a malloc of the given size, including its overhead */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+}
+
+#endif // BITMARK_MEMUSAGE_H
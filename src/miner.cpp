@@ -15,6 +15,8 @@
 #include "tromp/equi_miner.h"
 #include "equihash.h"
 
+#include <queue>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitmarkMiner
@@ -56,59 +58,266 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Give up looking for transactions that fit once the block is this close to full
+static const unsigned int BLOCK_FULL_MARGIN = 4000;
+static const unsigned int MAX_CONSECUTIVE_FAILURES = 1000;
+
+namespace {
+
+// A package whose ancestors were partly taken already, with its score
+// recomputed over the ones left
+struct CModifiedPackage
+{
+    double dScore;
+    CTxMemPool::txiter it;
+
+    CModifiedPackage(double dScoreIn, CTxMemPool::txiter itIn) : dScore(dScoreIn), it(itIn) { }
+
+    bool operator<(const CModifiedPackage& other) const
+    {
+        // std::priority_queue puts the greatest first
+        if (dScore != other.dScore)
+            return dScore < other.dScore;
+        return other.it->first < it->first;
+    }
+};
+
+// Fills a block from the memory pool indexes: transactions with the highest
+// priority first, up to nBlockPrioritySize, then packages of a transaction and
+// its unconfirmed ancestors by ancestor fee rate. Nothing is looked up outside
+// the pool; the block is checked once assembled.
+class CBlockSelector
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlockSelector(CTxMemPool& poolIn, int nHeightIn, unsigned int nBlockMaxSizeIn,
+                   unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn,
+                   std::vector<const CTxMemPoolEntry*>& vSelectedIn) :
+        pool(poolIn), nHeight(nHeightIn), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+        vSelected(vSelectedIn), nBlockSize(1000), nBlockSigOps(100), fSkippedNonFinal(false)
+    {
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
 
-    COrphan(const CTransaction* ptxIn)
+    void Select()
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        if (nBlockPrioritySize > 0)
+            AddPriorityTxs();
+        AddPackages();
     }
 
-    void print() const
+    bool SkippedNonFinal() const { return fSkippedNonFinal; }
+
+private:
+    CTxMemPool& pool;
+    int nHeight;
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    std::vector<const CTxMemPoolEntry*>& vSelected;
+    CTxMemPool::setEntries setInBlock;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    bool fSkippedNonFinal;
+    bool fPrintPriority;
+
+    bool CanInclude(const CTransaction& tx)
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        if (tx.IsCoinBase())
+            return false;
+        if (!IsFinalTx(tx, nHeight)) {
+            fSkippedNonFinal = true;
+            return false;
+        }
+        return true;
     }
-};
 
+    bool Fits(uint64_t nSize, unsigned int nSigOps) const
+    {
+        return nBlockSize + nSize < nBlockMaxSize && nBlockSigOps + nSigOps < MAX_BLOCK_SIGOPS;
+    }
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+    void Add(CTxMemPool::txiter it)
+    {
+        const CTxMemPoolEntry& entry = it->second;
+        setInBlock.insert(it);
+        vSelected.push_back(&entry);
+        nBlockSize += entry.GetTxSize();
+        nBlockSigOps += entry.GetSigOps();
+        if (fPrintPriority)
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                      entry.GetPriority(nHeight), entry.GetFeeRate() * 1000, it->first.ToString());
+    }
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    void AddPriorityTxs()
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        BOOST_FOREACH(CTxMemPool::txiter it, pool.setByPriority) {
+            const CTxMemPoolEntry& entry = it->second;
+            if (!CanInclude(entry.GetTx()))
+                continue;
+            // Children wait for the fee pass
+            bool fReady = true;
+            BOOST_FOREACH(CTxMemPool::txiter itParent, pool.GetParents(it))
+                if (!setInBlock.count(itParent))
+                    fReady = false;
+            if (!fReady || !Fits(entry.GetTxSize(), entry.GetSigOps()))
+                continue;
+            if (nBlockSize + entry.GetTxSize() >= nBlockPrioritySize || !AllowFree(entry.GetPriority(nHeight)))
+                break;
+            Add(it);
         }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+    }
+
+    void AddPackages()
+    {
+        std::set<CTxMemPool::txiter, CTxMemPool::CompareByAncestorScore>::iterator mi = pool.setByAncestorScore.begin();
+        std::priority_queue<CModifiedPackage> queueModified;
+        unsigned int nFailures = 0;
+        while (mi != pool.setByAncestorScore.end() || !queueModified.empty()) {
+            CTxMemPool::txiter it;
+            bool fModified = false;
+            double dQueuedScore = 0;
+            if (mi != pool.setByAncestorScore.end() &&
+                (queueModified.empty() || (*mi)->second.GetAncestorScore() >= queueModified.top().dScore)) {
+                it = *mi++;
+            } else {
+                it = queueModified.top().it;
+                dQueuedScore = queueModified.top().dScore;
+                queueModified.pop();
+                fModified = true;
+            }
+            if (setInBlock.count(it))
+                continue;
+
+            // The package is the transaction and the ancestors not taken yet
+            const CTxMemPoolEntry& entry = it->second;
+            CTxMemPool::setEntries setAncestors;
+            pool.CalculateAncestors(it, setAncestors);
+            std::vector<CTxMemPool::txiter> vPackage;
+            uint64_t nPackageSize = entry.GetTxSize();
+            int64_t nPackageFees = entry.GetFee();
+            unsigned int nPackageSigOps = entry.GetSigOps();
+            BOOST_FOREACH(CTxMemPool::txiter itAncestor, setAncestors) {
+                if (setInBlock.count(itAncestor))
+                    continue;
+                vPackage.push_back(itAncestor);
+                nPackageSize += itAncestor->second.GetTxSize();
+                nPackageFees += itAncestor->second.GetFee();
+                nPackageSigOps += itAncestor->second.GetSigOps();
+            }
+            vPackage.push_back(it);
+            double dScore = std::min(entry.GetFeeRate(), (double)nPackageFees / nPackageSize);
+            if (fModified ? dScore != dQueuedScore : vPackage.size() != entry.GetCountWithAncestors()) {
+                queueModified.push(CModifiedPackage(dScore, it));
+                continue;
+            }
+
+            if (!Fits(nPackageSize, nPackageSigOps)) {
+                if (++nFailures > MAX_CONSECUTIVE_FAILURES && nBlockSize + BLOCK_FULL_MARGIN > nBlockMaxSize)
+                    break;
+                continue;
+            }
+            // Skip free transactions if we're past the minimum block size
+            if (dScore * 1000 < CTransaction::nMinRelayTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+                continue;
+
+            bool fValid = true;
+            BOOST_FOREACH(CTxMemPool::txiter itPackage, vPackage)
+                if (!CanInclude(itPackage->second.GetTx()))
+                    fValid = false;
+            if (!fValid)
+                continue;
+
+            // An ancestor always has fewer ancestors than its descendants,
+            // which gives the package in a valid block order
+            std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount);
+            BOOST_FOREACH(CTxMemPool::txiter itPackage, vPackage)
+                Add(itPackage);
+            nFailures = 0;
         }
     }
+
+    static bool CompareByAncestorCount(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b)
+    {
+        if (a->second.GetCountWithAncestors() != b->second.GetCountWithAncestors())
+            return a->second.GetCountWithAncestors() < b->second.GetCountWithAncestors();
+        return a->first < b->first;
+    }
 };
 
+// The last selection, handed out again while neither the pool nor the tip
+// has changed; it already passed ConnectBlock on that tip
+struct CSelectionCache
+{
+    uint256 hashPrevBlock;
+    int nHeight;
+    unsigned int nTransactionsUpdated;
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    bool fValid;
+    std::vector<uint256> vHash;
+    uint64_t nBlockSize;
+
+    CSelectionCache() : fValid(false) { }
+};
+CSelectionCache selectionCache;
+
+// Keep the transactions of a template that connect one after the other on
+// the tip, for when the pool holds one that is not valid any more
+void RemoveInvalidTransactions(CBlockTemplate& tmpl, CBlockIndex* pindexPrev)
+{
+    CBlock& block = tmpl.block;
+    CCoinsViewCache view(*pcoinsTip, true);
+    std::vector<CTransaction> vtx(1, block.vtx[0]);
+    std::vector<int64_t> vTxFees(1, tmpl.vTxFees[0]);
+    std::vector<int64_t> vTxSigOps(1, tmpl.vTxSigOps[0]);
+    unsigned int nBlockSigOps = 100;
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        if (!view.HaveInputs(tx))
+            continue;
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+        int64_t nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+        CValidationState state;
+        if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
+            continue;
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight + 1, tx.GetHash());
+        vtx.push_back(tx);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+        nBlockSigOps += nTxSigOps;
+    }
+    LogPrintf("CreateNewBlock() : kept %u of %u transactions\n", vtx.size() - 1, block.vtx.size() - 1);
+    block.vtx.swap(vtx);
+    tmpl.vTxFees.swap(vTxFees);
+    tmpl.vTxSigOps.swap(vTxSigOps);
+}
+
+}
+
+void SelectMemPoolTransactions(CTxMemPool& pool, int nHeight, unsigned int nBlockMaxSize,
+                               unsigned int nBlockPrioritySize, unsigned int nBlockMinSize,
+                               std::vector<const CTxMemPoolEntry*>& vSelected, bool* pfSkippedNonFinal)
+{
+    CBlockSelector selector(pool, nHeight, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize, vSelected);
+    selector.Select();
+    if (pfSkippedNonFinal)
+        *pfSkippedNonFinal = selector.SkippedNonFinal();
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    if (!confAlgoIsSet) {
+      miningAlgo = GetArg("-miningalgo", miningAlgo);
+      confAlgoIsSet = true;
+    }
+    return CreateNewBlock(scriptPubKeyIn, miningAlgo);
+}
+
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
 {
     // Create new block
     auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
@@ -116,12 +325,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         return NULL;
     CBlock *pblock = &pblocktemplate->block; // pointer for convenience
     CBlockIndex* pindexPrev = chainActive.Tip();
-    if (!confAlgoIsSet) {
-      miningAlgo = GetArg("-miningalgo", miningAlgo);
-      confAlgoIsSet = true;
-    }
     // To simulate v3 blocks occuring after nForkHeight
-    if (TestNet() && pindexPrev->nHeight < 300 && miningAlgo==0) {
+    if (TestNet() && pindexPrev->nHeight < 300 && algo==0) {
       pblock->nVersion = 3;
     }
 
@@ -130,7 +335,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
       //LogPrintf("algo set to %d\n",miningAlgo);
       //pblock->nVersion = 3;
       //LogPrintf("pblock nVersion is %d\n",pblock->nVersion);
-      pblock->SetAlgo(miningAlgo);
+      pblock->SetAlgo(algo);
       //pblock->SetVariant2(true);
       //pblock->SetChainId(Params().GetAuxpowChainId());
       //LogPrintf("after setting algo to %d, it is %d\n",miningAlgo,pblock->nVersion);
@@ -172,188 +377,35 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
-        CCoinsViewCache view(*pcoinsTip, true);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
+        int nHeight = pindexPrev->nHeight + 1;
+
+        // Walk the pool indexes again only if the pool or the tip changed
+        CSelectionCache& cache = selectionCache;
+        bool fReused = cache.fValid && cache.hashPrevBlock == pindexPrev->GetBlockHash() &&
+            cache.nHeight == nHeight && cache.nTransactionsUpdated == mempool.GetTransactionsUpdated() &&
+            cache.nBlockMaxSize == nBlockMaxSize && cache.nBlockPrioritySize == nBlockPrioritySize &&
+            cache.nBlockMinSize == nBlockMinSize;
+        bool fSkippedNonFinal = false;
+        std::vector<const CTxMemPoolEntry*> vSelected;
+        if (fReused) {
+            BOOST_FOREACH(const uint256& hash, cache.vHash)
+                vSelected.push_back(&mempool.mapTx.find(hash)->second);
+        } else {
+            SelectMemPoolTransactions(mempool, nHeight, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize,
+                                      vSelected, &fSkippedNonFinal);
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vSelected) {
+            pblock->vtx.push_back(pentry->GetTx());
+            pblocktemplate->vTxFees.push_back(pentry->GetFee());
+            pblocktemplate->vTxSigOps.push_back(pentry->GetSigOps());
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
 	if (pindexPrev->nHeight>=nForkHeight-1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
 	  //LogPrintf("miner on fork\n");
 	  CBlockIndex * pprev_algo = pindexPrev;
-	  if (GetAlgo(pprev_algo->nVersion)!=miningAlgo) {
-	    pprev_algo = get_pprev_algo(pindexPrev,miningAlgo);
+	  if (GetAlgo(pprev_algo->nVersion)!=algo) {
+	    pprev_algo = get_pprev_algo(pindexPrev,algo);
 	  }
 	  if (!pprev_algo) {
 	    //LogPrintf("miner set update ssf\n");
@@ -378,17 +430,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 	}
 
 	//pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev, nFees);
-	pblocktemplate->vTxFees[0] = -nFees;
 
 	// Fill in header
 	pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
 	//printf("create new block with hash prev = %s (height %d)\n",pblock->hashPrevBlock.GetHex().c_str(),pindexPrev->nHeight);
 
 	UpdateTime(*pblock, pindexPrev);
-	pblock->nBits          = GetNextWorkRequired(pindexPrev, miningAlgo);
-	//LogPrintf("create block nBits = %s\n",CBigNum().SetCompact(pblock->nBits).getuint256().GetHex().c_str());
+	pblock->nBits          = GetNextWorkRequired(pindexPrev, algo);
+	//LogPrintf("create block nBits = %s\n",ArithToUint256(arith_uint256().SetCompact(pblock->nBits)).GetHex().c_str());
 	pblock->nNonce         = 0;
-	if (miningAlgo==ALGO_EQUIHASH) {
+	if (algo==ALGO_EQUIHASH) {
 	  pblock->nNonce256.SetNull();
 	  pblock->nSolution.clear();
 	}
@@ -398,15 +449,48 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
         indexDummy.nHeight = pindexPrev->nHeight + 1;
+        indexDummy.BuildAlgoLinks();
+
+        // The pool was checked as transactions entered it, so the block is
+        // checked as a whole; only if that fails is each transaction
+        // checked on its own, and the ones that do not connect dropped
+        for (int nAttempt = 0; ; nAttempt++) {
+            nFees = 0;
+            for (unsigned int i = 1; i < pblocktemplate->vTxFees.size(); i++)
+                nFees += pblocktemplate->vTxFees[i];
+            pblocktemplate->vTxFees[0] = -nFees;
+            pblock->vtx[0].vout[0].nValue = GetBlockValue(&indexDummy, nFees, false);
+            if (fReused)
+                break;
+
+            CCoinsViewCache viewNew(*pcoinsTip, true);
+            CValidationState state;
+            if (ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
+                break;
+            if (nAttempt > 0)
+                throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+            LogPrintf("CreateNewBlock() : template with %u transactions failed to connect (%s), checking them one by one\n",
+                      pblock->vtx.size() - 1, state.GetRejectReason());
+            RemoveInvalidTransactions(*pblocktemplate, pindexPrev);
+        }
 
-	pblock->vtx[0].vout[0].nValue = GetBlockValue(&indexDummy, nFees, false);
-
-        CCoinsViewCache viewNew(*pcoinsTip, true);
-
-        CValidationState state;	
-	
-        if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
-            throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        if (!fReused) {
+            cache.nBlockSize = 1000;
+            for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+                cache.nBlockSize += ::GetSerializeSize(pblock->vtx[i], SER_NETWORK, PROTOCOL_VERSION);
+            cache.fValid = !fSkippedNonFinal;
+            cache.hashPrevBlock = pindexPrev->GetBlockHash();
+            cache.nHeight = nHeight;
+            cache.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            cache.nBlockMaxSize = nBlockMaxSize;
+            cache.nBlockPrioritySize = nBlockPrioritySize;
+            cache.nBlockMinSize = nBlockMinSize;
+            cache.vHash.clear();
+            for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+                cache.vHash.push_back(pblock->vtx[i].GetHash());
+        }
+        nLastBlockTx = cache.vHash.size();
+        nLastBlockSize = cache.nBlockSize;
     }
 
     return pblocktemplate.release();
@@ -415,7 +499,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
+    static CCriticalSection cs_hashPrevBlock;
     static uint256 hashPrevBlock;
+    LOCK(cs_hashPrevBlock);
     if (hashPrevBlock != pblock->hashPrevBlock)
     {
         nExtraNonce = 0;
@@ -483,6 +569,9 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
+// Headers hashed per call to the algo's HashBatch; divides the 256 nonce round
+static const unsigned int MINER_BATCH = 8;
+
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 {
     CPubKey pubkey;
@@ -495,14 +584,8 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
-    uint256 hash;
-    if (pblock->nVersion<=3) {
-      hash = pblock->GetPoWHash(ALGO_SCRYPT);
-    }
-    else {
-      hash = pblock->GetPoWHash(miningAlgo);
-    }
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hash = pblock->GetPoWHash(pblock->nVersion<=3 ? ALGO_SCRYPT : miningAlgo);
+    uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
     if (hash > hashTarget)
         return false;
@@ -579,25 +662,11 @@ void static BitmarkMiner(CWallet *pwallet)
 	//printf("Running BitmarkMiner with %lu transactions in block (%u bytes)\n", pblock->vtx.size(),
 	//::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
-
         //
         // Search
         //
         int64_t nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 	//LogPrintf("miner hashTarget: %s\n",hashTarget.GetHex().c_str());
 
         while (true)
@@ -608,6 +677,16 @@ void static BitmarkMiner(CWallet *pwallet)
 	  //LogPrintf("starting best hash: %s\n",best_hash.GetHex().c_str());
 	  //LogPrintf("hash target = %s\n",hashTarget.GetHex().c_str());
 
+	  // Nonces are tried MINER_BATCH at a time so multi-buffer algos fill their lanes
+	  const CPoWAlgo& powAlgo = GetPoWAlgo(pblock->nVersion<=3 ? ALGO_SCRYPT : miningAlgo);
+	  CPureBlockHeader vHeader[MINER_BATCH];
+	  const CPureBlockHeader* vpHeader[MINER_BATCH];
+	  uint256 vHash[MINER_BATCH];
+	  for (unsigned int i = 0; i < MINER_BATCH; i++) {
+	    vHeader[i] = *pblock;
+	    vpHeader[i] = &vHeader[i];
+	  }
+
 	  if (miningAlgo==ALGO_EQUIHASH) {
 	    unsigned int n = Params().EquihashN();
 	    unsigned int k = Params().EquihashK();
@@ -695,34 +774,39 @@ void static BitmarkMiner(CWallet *pwallet)
 	      }
 	    }
 
-	    pblock->nNonce256 = (CBigNum(pblock->nNonce256) + 1).getuint256();
+	    pblock->nNonce256 = ArithToUint256(UintToArith256(pblock->nNonce256) + 1);
 	    nHashesDone += 1;
 	    
 	  }
 	  else while(true) {
-	    
-	    uint256 thash;
-	    if (pblock->nVersion<=3) {
-	      thash = pblock->GetPoWHash(ALGO_SCRYPT);
-	    }
-	    else {
-	      thash = pblock->GetPoWHash(miningAlgo);
-	    }
-	    if (thash < best_hash || first_hash) {
-	      first_hash = false;
-	      best_hash = thash;
-	      //LogPrintf("best hash: %s\n",best_hash.GetHex().c_str());
-	    }
-	      
-	    if (thash <= hashTarget)
-	      {
-		SetThreadPriority(THREAD_PRIORITY_NORMAL);
-		CheckWork(pblock, *pwallet, reservekey);
-		SetThreadPriority(THREAD_PRIORITY_LOWEST);
-		break;
+
+	    for (unsigned int i = 0; i < MINER_BATCH; i++)
+	      vHeader[i].nNonce = pblock->nNonce + i;
+	    powAlgo.HashBatch(vpHeader, vHash, MINER_BATCH);
+
+	    bool fFound = false;
+	    for (unsigned int i = 0; i < MINER_BATCH; i++) {
+	      const uint256& thash = vHash[i];
+	      if (thash < best_hash || first_hash) {
+		first_hash = false;
+		best_hash = thash;
+		//LogPrintf("best hash: %s\n",best_hash.GetHex().c_str());
 	      }
-	    pblock->nNonce += 1;
-	    nHashesDone += 1;
+
+	      if (thash <= hashTarget)
+		{
+		  pblock->nNonce = vHeader[i].nNonce;
+		  SetThreadPriority(THREAD_PRIORITY_NORMAL);
+		  CheckWork(pblock, *pwallet, reservekey);
+		  SetThreadPriority(THREAD_PRIORITY_LOWEST);
+		  fFound = true;
+		  break;
+		}
+	    }
+	    if (fFound)
+	      break;
+	    pblock->nNonce += MINER_BATCH;
+	    nHashesDone += MINER_BATCH;
 	    if ((pblock->nNonce & 0xFF) == 0) {
 	      //LogPrintf("break 0xff\n");
 	      break;
@@ -764,7 +848,7 @@ void static BitmarkMiner(CWallet *pwallet)
 	  boost::this_thread::interruption_point();
 	  if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
 	    break;
-	  if (nBlockNonce >= 0xffff0000)
+	  if (pblock->nNonce >= 0xffff0000)
 	    break;
 	  if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
 	    break;
@@ -773,12 +857,10 @@ void static BitmarkMiner(CWallet *pwallet)
 
 	  // Update nTime every few seconds
 	  UpdateTime(*pblock, pindexPrev);
-	  nBlockTime = ByteReverse(pblock->nTime);
 	  if (TestNet())
             {
 	      // Changing pblock->nTime can change work required on testnet:
-	      nBlockBits = ByteReverse(pblock->nBits);
-	      hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+	      hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
             }
         }
       } }
@@ -7,20 +7,31 @@
 #ifndef BITMARK_MINER_H
 #define BITMARK_MINER_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 class CBlock;
 class CBlockIndex;
 struct CBlockTemplate;
 class CReserveKey;
 class CScript;
+class CTxMemPool;
+class CTxMemPoolEntry;
 class CWallet;
 
 /** Run the miner threads */
 void GenerateBitmarks(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
+/** Choose memory pool transactions for a block at nHeight, in block order; the
+    caller holds pool.cs. pfSkippedNonFinal tells whether a transaction was left
+    out for not being final yet. */
+void SelectMemPoolTransactions(CTxMemPool& pool, int nHeight, unsigned int nBlockMaxSize,
+                               unsigned int nBlockPrioritySize, unsigned int nBlockMinSize,
+                               std::vector<const CTxMemPoolEntry*>& vSelected, bool* pfSkippedNonFinal = NULL);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
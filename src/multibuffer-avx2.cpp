@@ -0,0 +1,36 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 8 lane AVX2 build of multibuffer-impl.h, only called when the CPU has AVX2.
+// Nothing outside this file may be compiled for AVX2, so it includes no
+// C++ headers whose inline functions could end up shared with other files.
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC target("avx2")
+#endif
+
+#define MB_LANES 8
+#include "multibuffer-impl.h"
+
+void sha256d_80_x8(const unsigned char* const* pinput, unsigned char* const* poutput)
+{
+    mb_sha256d_80(pinput, poutput);
+}
+
+void scrypt_1024_1_1_256_x8(const unsigned char* const* pinput, unsigned char* const* poutput, void* scratchpad)
+{
+    mb_scrypt_1024_1_1_256(pinput, poutput, (mb_vec*)scratchpad);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
@@ -0,0 +1,285 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Multi-buffer double-SHA256 and scrypt(1024,1,1) over 80 byte headers.
+//
+// Lane l of every vector belongs to header l, so one pass hashes MB_LANES
+// headers with the same instruction stream as the scalar code in sha2.c and
+// scrypt.cpp. Written with GCC vector extensions; the including file sets
+// MB_LANES and the instruction set (see multibuffer.cpp and
+// multibuffer-avx2.cpp). Everything here has internal linkage, so each
+// including file gets its own copy compiled for its own target.
+
+#ifndef MB_LANES
+#error "define MB_LANES before including multibuffer-impl.h"
+#endif
+
+typedef uint32_t mb_vec __attribute__((vector_size(4 * MB_LANES)));
+
+static const uint32_t mb_sha256_h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t mb_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline mb_vec mb_set1(uint32_t x)
+{
+    mb_vec v;
+    for (int l = 0; l < MB_LANES; l++)
+        v[l] = x;
+    return v;
+}
+
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline mb_vec mb_bswap(mb_vec x)
+{
+    return (x << 24) | ((x << 8) & 0x00ff0000) | ((x >> 8) & 0x0000ff00) | (x >> 24);
+}
+
+/** Load nWords big endian words from offset of every lane's input */
+static inline void mb_load_be(mb_vec* w, const unsigned char* const* pinput, unsigned int nOffset, unsigned int nWords)
+{
+    for (unsigned int i = 0; i < nWords; i++)
+        for (int l = 0; l < MB_LANES; l++) {
+            const unsigned char* p = pinput[l] + nOffset + 4 * i;
+            w[i][l] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+}
+
+/** Store a SHA256 state as every lane's 32 byte digest */
+static inline void mb_store_digest(unsigned char* const* poutput, const mb_vec s[8])
+{
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < MB_LANES; l++) {
+            unsigned char* p = poutput[l] + 4 * i;
+            uint32_t x = s[i][l];
+            p[0] = x >> 24;
+            p[1] = x >> 16;
+            p[2] = x >> 8;
+            p[3] = x;
+        }
+}
+
+static inline void mb_sha256_init(mb_vec s[8])
+{
+    for (int i = 0; i < 8; i++)
+        s[i] = mb_set1(mb_sha256_h[i]);
+}
+
+static void mb_sha256_transform(mb_vec s[8], const mb_vec block[16])
+{
+    mb_vec W[64];
+    for (int i = 0; i < 16; i++)
+        W[i] = block[i];
+    for (int i = 16; i < 64; i++) {
+        mb_vec s0 = MB_ROTR(W[i - 15], 7) ^ MB_ROTR(W[i - 15], 18) ^ (W[i - 15] >> 3);
+        mb_vec s1 = MB_ROTR(W[i - 2], 17) ^ MB_ROTR(W[i - 2], 19) ^ (W[i - 2] >> 10);
+        W[i] = W[i - 16] + s0 + W[i - 7] + s1;
+    }
+
+    mb_vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        mb_vec t1 = h + (MB_ROTR(e, 6) ^ MB_ROTR(e, 11) ^ MB_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + mb_sha256_k[i] + W[i];
+        mb_vec t2 = (MB_ROTR(a, 2) ^ MB_ROTR(a, 13) ^ MB_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+/** SHA256 of every lane's 80 byte header; also returns the state after its first block */
+static void mb_sha256_80(mb_vec hash[8], mb_vec midstate[8], const unsigned char* const* pinput)
+{
+    mb_vec block[16];
+    mb_sha256_init(midstate);
+    mb_load_be(block, pinput, 0, 16);
+    mb_sha256_transform(midstate, block);
+
+    for (int i = 0; i < 8; i++)
+        hash[i] = midstate[i];
+    mb_load_be(block, pinput, 64, 4);
+    block[4] = mb_set1(0x80000000);
+    for (int i = 5; i < 15; i++)
+        block[i] = mb_set1(0);
+    block[15] = mb_set1(80 * 8);
+    mb_sha256_transform(hash, block);
+}
+
+/** Finish a SHA256 whose remaining input is one 32 byte digest, after nPrefix bytes */
+static void mb_sha256_digest_block(mb_vec s[8], const mb_vec digest[8], uint32_t nPrefix)
+{
+    mb_vec block[16];
+    for (int i = 0; i < 8; i++)
+        block[i] = digest[i];
+    block[8] = mb_set1(0x80000000);
+    for (int i = 9; i < 15; i++)
+        block[i] = mb_set1(0);
+    block[15] = mb_set1((nPrefix + 32) * 8);
+    mb_sha256_transform(s, block);
+}
+
+static void mb_sha256d_80(const unsigned char* const* pinput, unsigned char* const* poutput)
+{
+    mb_vec hash1[8], midstate[8], hash[8];
+    mb_sha256_80(hash1, midstate, pinput);
+    mb_sha256_init(hash);
+    mb_sha256_digest_block(hash, hash1, 0);
+    mb_store_digest(poutput, hash);
+}
+
+static inline void mb_xor_salsa8(mb_vec B[16], const mb_vec Bx[16])
+{
+    mb_vec x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = (B[i] ^= Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        x[ 4] ^= MB_ROTL(x[ 0] + x[12],  7);  x[ 9] ^= MB_ROTL(x[ 5] + x[ 1],  7);
+        x[14] ^= MB_ROTL(x[10] + x[ 6],  7);  x[ 3] ^= MB_ROTL(x[15] + x[11],  7);
+
+        x[ 8] ^= MB_ROTL(x[ 4] + x[ 0],  9);  x[13] ^= MB_ROTL(x[ 9] + x[ 5],  9);
+        x[ 2] ^= MB_ROTL(x[14] + x[10],  9);  x[ 7] ^= MB_ROTL(x[ 3] + x[15],  9);
+
+        x[12] ^= MB_ROTL(x[ 8] + x[ 4], 13);  x[ 1] ^= MB_ROTL(x[13] + x[ 9], 13);
+        x[ 6] ^= MB_ROTL(x[ 2] + x[14], 13);  x[11] ^= MB_ROTL(x[ 7] + x[ 3], 13);
+
+        x[ 0] ^= MB_ROTL(x[12] + x[ 8], 18);  x[ 5] ^= MB_ROTL(x[ 1] + x[13], 18);
+        x[10] ^= MB_ROTL(x[ 6] + x[ 2], 18);  x[15] ^= MB_ROTL(x[11] + x[ 7], 18);
+
+        /* Operate on rows. */
+        x[ 1] ^= MB_ROTL(x[ 0] + x[ 3],  7);  x[ 6] ^= MB_ROTL(x[ 5] + x[ 4],  7);
+        x[11] ^= MB_ROTL(x[10] + x[ 9],  7);  x[12] ^= MB_ROTL(x[15] + x[14],  7);
+
+        x[ 2] ^= MB_ROTL(x[ 1] + x[ 0],  9);  x[ 7] ^= MB_ROTL(x[ 6] + x[ 5],  9);
+        x[ 8] ^= MB_ROTL(x[11] + x[10],  9);  x[13] ^= MB_ROTL(x[12] + x[15],  9);
+
+        x[ 3] ^= MB_ROTL(x[ 2] + x[ 1], 13);  x[ 4] ^= MB_ROTL(x[ 7] + x[ 6], 13);
+        x[ 9] ^= MB_ROTL(x[ 8] + x[11], 13);  x[14] ^= MB_ROTL(x[13] + x[12], 13);
+
+        x[ 0] ^= MB_ROTL(x[ 3] + x[ 2], 18);  x[ 5] ^= MB_ROTL(x[ 4] + x[ 7], 18);
+        x[10] ^= MB_ROTL(x[ 9] + x[ 8], 18);  x[15] ^= MB_ROTL(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] += x[i];
+}
+
+/**
+ * scrypt(N=1024, r=1, p=1) of every lane's 80 byte header, as
+ * scrypt_1024_1_1_256_sp_generic computes it. The header is both password
+ * and salt; being longer than a SHA256 block, the HMAC key is its SHA256.
+ * V is the scratchpad, 1024 * 32 vectors.
+ */
+static void mb_scrypt_1024_1_1_256(const unsigned char* const* pinput, unsigned char* const* poutput, mb_vec* V)
+{
+    mb_vec khash[8], midstate[8], istate[8], ostate[8], s[8], u[8], block[16];
+    mb_vec X[32];
+
+    // HMAC-SHA256 inner and outer states keyed with SHA256(header)
+    mb_sha256_80(khash, midstate, pinput);
+    for (int i = 0; i < 8; i++)
+        block[i] = khash[i] ^ 0x36363636;
+    for (int i = 8; i < 16; i++)
+        block[i] = mb_set1(0x36363636);
+    mb_sha256_init(istate);
+    mb_sha256_transform(istate, block);
+    for (int i = 0; i < 16; i++)
+        block[i] ^= 0x36363636 ^ 0x5c5c5c5c;
+    mb_sha256_init(ostate);
+    mb_sha256_transform(ostate, block);
+
+    // B = PBKDF2(header, header, 1, 128): the salt's first block is shared by all four output blocks
+    mb_vec saltstate[8];
+    for (int i = 0; i < 8; i++)
+        saltstate[i] = istate[i];
+    mb_load_be(block, pinput, 0, 16);
+    mb_sha256_transform(saltstate, block);
+    for (uint32_t n = 0; n < 4; n++) {
+        for (int i = 0; i < 8; i++)
+            u[i] = saltstate[i];
+        mb_load_be(block, pinput, 64, 4);
+        block[4] = mb_set1(n + 1);
+        block[5] = mb_set1(0x80000000);
+        for (int i = 6; i < 15; i++)
+            block[i] = mb_set1(0);
+        block[15] = mb_set1((64 + 80 + 4) * 8);
+        mb_sha256_transform(u, block);
+
+        for (int i = 0; i < 8; i++)
+            s[i] = ostate[i];
+        mb_sha256_digest_block(s, u, 64);
+        // B is read as little endian words
+        for (int i = 0; i < 8; i++)
+            X[8 * n + i] = mb_bswap(s[i]);
+    }
+
+    // ROMix with per-lane random reads
+    uint32_t* x = (uint32_t*)X;
+    const uint32_t* v = (const uint32_t*)V;
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++)
+            V[i * 32 + k] = X[k];
+        mb_xor_salsa8(&X[0], &X[16]);
+        mb_xor_salsa8(&X[16], &X[0]);
+    }
+    for (int i = 0; i < 1024; i++) {
+        for (int l = 0; l < MB_LANES; l++) {
+            const uint32_t* vj = v + 32 * MB_LANES * (x[16 * MB_LANES + l] & 1023) + l;
+            for (int k = 0; k < 32; k++)
+                x[k * MB_LANES + l] ^= vj[k * MB_LANES];
+        }
+        mb_xor_salsa8(&X[0], &X[16]);
+        mb_xor_salsa8(&X[16], &X[0]);
+    }
+
+    // output = PBKDF2(header, B, 1, 32)
+    for (int i = 0; i < 8; i++)
+        u[i] = istate[i];
+    for (int i = 0; i < 16; i++)
+        block[i] = mb_bswap(X[i]);
+    mb_sha256_transform(u, block);
+    for (int i = 0; i < 16; i++)
+        block[i] = mb_bswap(X[16 + i]);
+    mb_sha256_transform(u, block);
+    block[0] = mb_set1(1);
+    block[1] = mb_set1(0x80000000);
+    for (int i = 2; i < 15; i++)
+        block[i] = mb_set1(0);
+    block[15] = mb_set1((64 + 128 + 4) * 8);
+    mb_sha256_transform(u, block);
+
+    for (int i = 0; i < 8; i++)
+        s[i] = ostate[i];
+    mb_sha256_digest_block(s, u, 64);
+    mb_store_digest(poutput, s);
+}
+
+#undef MB_ROTR
+#undef MB_ROTL
@@ -0,0 +1,195 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "multibuffer.h"
+
+#include "hash.h"
+#include "scrypt.h"
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <malloc.h>
+#endif
+
+#include <boost/thread/tss.hpp>
+
+#if defined(__GNUC__)
+#define USE_MULTIBUFFER 1
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_MULTIBUFFER_AVX2 1
+#endif
+#endif
+
+#ifdef USE_MULTIBUFFER
+#define MB_LANES 4
+#include "multibuffer-impl.h"
+#endif
+
+#ifdef USE_MULTIBUFFER_AVX2
+void sha256d_80_x8(const unsigned char* const* pinput, unsigned char* const* poutput);
+void scrypt_1024_1_1_256_x8(const unsigned char* const* pinput, unsigned char* const* poutput, void* scratchpad);
+#endif
+
+namespace {
+
+// Bytes of scrypt scratchpad per lane
+const size_t SCRYPT_LANE_SCRATCHPAD = 1024 * 128;
+
+unsigned int DetectLanes()
+{
+#ifdef USE_MULTIBUFFER_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return 8;
+#endif
+#ifdef USE_MULTIBUFFER
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+const unsigned int nMaxLanes = DetectLanes();
+// Read once per call, so a pass never changes width under a miner thread
+std::atomic<unsigned int> nLanes(nMaxLanes);
+
+/** scrypt scratchpad for the widest kernel, allocated once per thread */
+class CScratchpad
+{
+public:
+    void* p;
+
+    CScratchpad()
+    {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        p = _aligned_malloc(nMaxLanes * SCRYPT_LANE_SCRATCHPAD, 64);
+#else
+        if (posix_memalign(&p, 64, nMaxLanes * SCRYPT_LANE_SCRATCHPAD) != 0)
+            p = NULL;
+#endif
+        if (!p)
+            throw std::bad_alloc();
+    }
+
+    ~CScratchpad()
+    {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+// thread_specific_ptr frees each thread's scratchpad when the thread ends
+boost::thread_specific_ptr<CScratchpad> ptrScratchpad;
+
+void* GetScratchpad()
+{
+    if (!ptrScratchpad.get())
+        ptrScratchpad.reset(new CScratchpad());
+    return ptrScratchpad->p;
+}
+
+/** Hash n headers in passes of nWidth, padding the last pass with copies of the last header */
+template<typename Kernel>
+void ForEachPass(const unsigned char* const* pinput, unsigned char* const* poutput, unsigned int n, unsigned int nWidth, Kernel kernel)
+{
+    const unsigned char* vpin[8];
+    unsigned char* vpout[8];
+    unsigned char vdummy[8][32];
+    for (unsigned int i = 0; i < n; i += nWidth) {
+        for (unsigned int l = 0; l < nWidth; l++) {
+            bool fReal = i + l < n;
+            vpin[l] = pinput[fReal ? i + l : n - 1];
+            vpout[l] = fReal ? poutput[i + l] : vdummy[l];
+        }
+        kernel(vpin, vpout);
+    }
+}
+
+struct CSHA256DKernel
+{
+    unsigned int nWidth;
+
+    void operator()(const unsigned char* const* pinput, unsigned char* const* poutput) const
+    {
+#ifdef USE_MULTIBUFFER_AVX2
+        if (nWidth == 8)
+            return sha256d_80_x8(pinput, poutput);
+#endif
+#ifdef USE_MULTIBUFFER
+        mb_sha256d_80(pinput, poutput);
+#endif
+    }
+};
+
+struct CScryptKernel
+{
+    unsigned int nWidth;
+    void* scratchpad;
+
+    void operator()(const unsigned char* const* pinput, unsigned char* const* poutput) const
+    {
+#ifdef USE_MULTIBUFFER_AVX2
+        if (nWidth == 8)
+            return scrypt_1024_1_1_256_x8(pinput, poutput, scratchpad);
+#endif
+#ifdef USE_MULTIBUFFER
+        mb_scrypt_1024_1_1_256(pinput, poutput, (mb_vec*)scratchpad);
+#endif
+    }
+};
+
+}
+
+void sha256d_80_multi(const unsigned char* const* pinput, unsigned char* const* poutput, unsigned int n)
+{
+    unsigned int nWidth = nLanes;
+    if (nWidth == 1) {
+        for (unsigned int i = 0; i < n; i++) {
+            uint256 hash = Hash(pinput[i], pinput[i] + 80);
+            memcpy(poutput[i], hash.begin(), 32);
+        }
+        return;
+    }
+    CSHA256DKernel kernel;
+    kernel.nWidth = nWidth;
+    ForEachPass(pinput, poutput, n, nWidth, kernel);
+}
+
+void scrypt_1024_1_1_256_multi(const char* const* pinput, char* const* poutput, unsigned int n)
+{
+    unsigned int nWidth = nLanes;
+    if (nWidth == 1 || n == 1) {
+        for (unsigned int i = 0; i < n; i++)
+            scrypt_1024_1_1_256(pinput[i], poutput[i]);
+        return;
+    }
+    CScryptKernel kernel;
+    kernel.nWidth = nWidth;
+    kernel.scratchpad = GetScratchpad();
+    ForEachPass((const unsigned char* const*)pinput, (unsigned char* const*)poutput, n, nWidth, kernel);
+}
+
+unsigned int multibuffer_lanes()
+{
+    return nLanes;
+}
+
+unsigned int multibuffer_set_lanes(unsigned int nLanesIn)
+{
+    unsigned int nWidth = 1;
+    if (nLanesIn >= 8 && nMaxLanes >= 8)
+        nWidth = 8;
+    else if (nLanesIn >= 4 && nMaxLanes >= 4)
+        nWidth = 4;
+    nLanes = nWidth;
+    return nWidth;
+}
@@ -0,0 +1,27 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_MULTIBUFFER_H
+#define BITMARK_MULTIBUFFER_H
+
+/**
+ * Multi-buffer proof of work kernels: hash several 80 byte headers in one
+ * pass, one SIMD lane per header. The widest kernel the CPU supports is
+ * picked at startup (8 lanes with AVX2, otherwise 4); any n is accepted and
+ * the results match hashing each header on its own.
+ */
+
+/** Double SHA256 of n 80 byte headers into n 32 byte outputs */
+void sha256d_80_multi(const unsigned char* const* pinput, unsigned char* const* poutput, unsigned int n);
+
+/** scrypt(1024, 1, 1) of n 80 byte headers into n 32 byte outputs, as scrypt_1024_1_1_256 */
+void scrypt_1024_1_1_256_multi(const char* const* pinput, char* const* poutput, unsigned int n);
+
+/** Headers hashed per pass */
+unsigned int multibuffer_lanes();
+
+/** Use at most nLanes lanes (1 hashes one header at a time); returns the width now in use */
+unsigned int multibuffer_set_lanes(unsigned int nLanes);
+
+#endif // BITMARK_MULTIBUFFER_H
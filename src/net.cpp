@@ -19,6 +19,9 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #endif
 
 #ifdef USE_UPNP
@@ -58,6 +61,7 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+static void RegisterSocket(CNode *pnode);
 CAddrMan addrman;
 int nMaxConnections = 125;
 
@@ -488,6 +492,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -739,75 +744,404 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef HAVE_SYS_EPOLL_H
+// Most events taken from the kernel in one epoll_wait
+static const int MAX_SOCKET_EVENTS = 256;
+// Most reads from one socket in a round, so that a fast peer cannot starve the others
+static const int MAX_RECV_PER_ROUND = 4;
+
+// The epoll instance of the socket handler. Sockets are added as soon as
+// their node exists, from whichever thread creates it.
+static int GetEpollHandle()
+{
+    static int hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    return hEpoll;
+}
+
+// Node sockets are edge triggered: an event means the socket became readable
+// or writable, and stays so until a call would block. A closed socket leaves
+// the epoll set by itself.
+static void RegisterSocket(CNode *pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(GetEpollHandle(), EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+        LogPrintf("socket epoll_ctl failed: %s\n", NetworkErrorString(errno));
+}
+#else
+static void RegisterSocket(CNode *pnode) {}
+#endif
+
+// Remove disconnected and unused nodes from vNodes, and delete the ones
+// no other thread uses any more
+static void DisconnectNodes(unsigned int &nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// Accept one connection waiting on a listening socket
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+#ifndef WIN32
+        // edge triggered events need reads that do not block
+        if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+            LogPrintf("AcceptConnection() : fcntl non-blocking setting failed, error %s\n", NetworkErrorString(errno));
+#endif
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterSocket(pnode);
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Read once from the socket. While a message body is being received the
+// bytes go straight into it, so large messages are not copied through a
+// buffer. Returns the number of bytes read, 0 if the read would block and
+// -1 if the socket was closed.
+static int ReceiveData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    char *pch = pchBuf;
+    unsigned int nSize = sizeof(pchBuf);
+    CNetMessage *pmsg = NULL;
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().in_data && !pnode->vRecvMsg.back().complete()) {
+        pmsg = &pnode->vRecvMsg.back();
+        pch = &pmsg->vRecv[pmsg->nDataPos];
+        nSize = pmsg->hdr.nMessageSize - pmsg->nDataPos;
+    }
+
+    int nBytes = recv(pnode->hSocket, pch, nSize, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pmsg)
+            pmsg->nDataPos += nBytes;
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS)
+            return 0;
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+        pnode->CloseSocketDisconnect();
+    }
+    return -1;
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Whether there is room to receive more: no complete message is waiting,
+// or the receive buffer is below -maxreceivebuffer
+static bool CanReceive(CNode *pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            LogPrintf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            LogPrintf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// Socket handler on epoll. Only nodes whose sockets reported an edge, or
+// that still had readiness left over from an earlier round, are looked at;
+// the rest of vNodes is only walked once a second for inactivity.
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int hEpoll = GetEpollHandle();
+    if (hEpoll == SOCKET_ERROR) {
+        LogPrintf("socket epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        return;
+    }
+
+    // listening sockets are level triggered; a NULL pointer marks them
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR)
+            LogPrintf("socket epoll_ctl failed: %s\n", NetworkErrorString(errno));
+    }
+
+    std::vector<struct epoll_event> vEvents(MAX_SOCKET_EVENTS);
+    // nodes to service, each holding a reference while queued
+    vector<CNode*> vQueue;
+    int64_t nLastInactivityCheck = 0;
+    bool fMoreWork = false;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        // wait 50ms at most, the frequency of the checks below
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), fMoreWork ? 0 : 50);
+        boost::this_thread::interruption_point();
+        if (nEvents == SOCKET_ERROR)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        bool fAccept = false;
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; i++)
+            {
+                CNode *pnode = (CNode*)vEvents[i].data.ptr;
+                if (pnode == NULL) {
+                    fAccept = true;
+                    continue;
+                }
+                // errors and hangups show up on the next recv
+                if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (vEvents[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+                if (!pnode->fSocketQueued) {
+                    pnode->fSocketQueued = true;
+                    pnode->AddRef();
+                    vQueue.push_back(pnode);
+                }
+            }
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+
+        //
+        // Service the queued sockets
+        //
+        fMoreWork = false;
+        vector<CNode*> vRelease;
+        vector<CNode*>::iterator itKeep = vQueue.begin();
+        BOOST_FOREACH(CNode* pnode, vQueue)
+        {
+            boost::this_thread::interruption_point();
+            bool fSendPending = false;
+
+            //
+            // Send: drain the write buffer before receiving more, which
+            // leaves flow control to TCP when the peer does not read
+            //
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketWritable)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    if (!pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    // data left means the socket buffer filled up; wait for the next edge
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                    fSendPending = !pnode->vSendMsg.empty();
+                }
+                else
+                    fSendPending = true;
+            }
+
+            //
+            // Receive
+            //
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketReadable && !fSendPending)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                {
+                    int nRead = 0;
+                    while (CanReceive(pnode))
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (nRead == MAX_RECV_PER_ROUND) {
+                            fMoreWork = true;
+                            break;
+                        }
+                        if (ReceiveData(pnode) <= 0) {
+                            pnode->fSocketReadable = false;
+                            break;
+                        }
+                        nRead++;
                     }
                 }
             }
+
+            // keep it queued while readiness is left to use
+            if (pnode->hSocket != INVALID_SOCKET && (pnode->fSocketReadable || (pnode->fSocketWritable && fSendPending)))
+                *itKeep++ = pnode;
+            else
+            {
+                pnode->fSocketQueued = false;
+                vRelease.push_back(pnode);
+            }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+        vQueue.erase(itKeep, vQueue.end());
 
+        //
+        // Inactivity checking
+        //
+        bool fInactivityCheck = GetTime() != nLastInactivityCheck;
+        if (fInactivityCheck)
+            nLastInactivityCheck = GetTime();
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vRelease)
+                pnode->Release();
+            if (fInactivityCheck)
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode->hSocket != INVALID_SOCKET)
+                        InactivityCheck(pnode);
+        }
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -864,9 +1198,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -895,51 +1227,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -965,39 +1254,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    ReceiveData(pnode);
             }
 
             //
@@ -1015,26 +1272,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    LogPrintf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    LogPrintf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1043,6 +1281,7 @@ void ThreadSocketHandler()
         }
     }
 }
+#endif
 
 
 
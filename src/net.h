@@ -206,6 +206,12 @@ public:
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // readiness of the socket reported by epoll and not used up yet, and
+    // whether the node is queued for service; socket handler thread only
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fSocketQueued;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -297,6 +303,9 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fSocketQueued = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
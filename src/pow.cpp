@@ -1,22 +1,37 @@
 #include "pow.h"
-#include "bignum.h"
+#include "arith_uint256.h"
 #include "chainparams.h"
 #include "util.h"
 #include "equihash.h"
 
+#include <set>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace {
+    // Bounds the cache at about 1MB; far more headers than are in flight at once
+    const unsigned int nMaxPoWCacheSize = 20000;
+    std::set<uint256> setPoWVerified;
+    boost::shared_mutex cs_powcache;
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo)
  {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint320 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit()*GetAlgoWeight(algo)) {
+    // Check range (weighted limits can exceed 256 bits on testnet)
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > arith_uint320(Params().ProofOfWorkLimit())*GetAlgoWeight(algo)) {
       return error("CheckProofOfWork() : nBits below minimum work");
     }
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256()) {
-      return error("CheckProofOfWork() : hash doesn't match nBits (hash is %s, nbits is %s",hash.GetHex().c_str(),bnTarget.getuint256().GetHex().c_str());
+    uint256 target = ArithToUint256(arith_uint256(bnTarget));
+    if (hash > target) {
+      return error("CheckProofOfWork() : hash doesn't match nBits (hash is %s, nbits is %s",hash.GetHex().c_str(),target.GetHex().c_str());
     }
 
     return true;
@@ -68,3 +83,36 @@ bool CheckEquihashSolution(const CPureBlockHeader *pblock, const CChainParams& p
     
     return true;
 }
+
+uint256 GetPoWCacheKey(const CBlockHeader& block)
+{
+    // the header serialization asserts that an auxpow version has an auxpow
+    if (block.IsAuxpow() && !block.auxpow)
+        return 0;
+    CHashWriter ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return ss.GetHash();
+}
+
+bool IsPoWVerified(const uint256& key)
+{
+    if (key == 0)
+        return false;
+    boost::shared_lock<boost::shared_mutex> lock(cs_powcache);
+    return setPoWVerified.count(key) > 0;
+}
+
+void SetPoWVerified(const uint256& key)
+{
+    if (key == 0)
+        return;
+    boost::unique_lock<boost::shared_mutex> lock(cs_powcache);
+    while (setPoWVerified.size() >= nMaxPoWCacheSize) {
+        // Evict a random entry, as the signature cache does
+        std::set<uint256>::iterator it = setPoWVerified.lower_bound(GetRandHash());
+        if (it == setPoWVerified.end())
+            it = setPoWVerified.begin();
+        setPoWVerified.erase(it);
+    }
+    setPoWVerified.insert(key);
+}
@@ -4,10 +4,22 @@
 #include "uint256.h"
 #include "core.h"
 
+class CBlockHeader;
+
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo);
 
 /** Check whether the block's equihash solultion is valid, in the case of an equihash algo */
 bool CheckEquihashSolution(const CPureBlockHeader *pblock, const CChainParams& params);
 
+/**
+ * Headers whose proof of work (including auxpow and Equihash solution) has
+ * been fully checked are remembered by the hash of the complete serialized
+ * header, so that the memory-hard PoW hashes are computed once per header.
+ * GetPoWCacheKey returns 0 for a header that cannot be cached.
+ */
+uint256 GetPoWCacheKey(const CBlockHeader& block);
+bool IsPoWVerified(const uint256& key);
+void SetPoWVerified(const uint256& key);
+
 #endif
@@ -0,0 +1,132 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "powalgo.h"
+
+#include "hash.h"
+#include "multibuffer.h"
+#include "pureheader.h"
+
+#include <vector>
+
+namespace {
+
+uint256 HashScrypt(const CPureBlockHeader& header)
+{
+    uint256 thash;
+    hash_scrypt(BEGIN(header.nVersion), BEGIN(thash));
+    return thash;
+}
+
+uint256 HashSHA256D(const CPureBlockHeader& header)
+{
+    return header.GetHash();
+}
+
+uint256 HashYescrypt(const CPureBlockHeader& header)
+{
+    uint256 thash;
+    hash_yescrypt(BEGIN(header.nVersion), BEGIN(thash));
+    return thash;
+}
+
+uint256 HashArgon2(const CPureBlockHeader& header)
+{
+    uint256 thash;
+    hash_argon2(BEGIN(header.nVersion), BEGIN(thash));
+    return thash;
+}
+
+uint256 HashX17(const CPureBlockHeader& header)
+{
+    return hash_x17(BEGIN(header.nVersion), END(header.nNonce));
+}
+
+uint256 HashLyra2REv2(const CPureBlockHeader& header)
+{
+    uint256 thash;
+    hash_lyra2rev2(BEGIN(header.nVersion), BEGIN(thash));
+    return thash;
+}
+
+uint256 HashEquihash(const CPureBlockHeader& header)
+{
+    return header.GetHashE();
+}
+
+uint256 HashCryptoNight(const CPureBlockHeader& header)
+{
+    uint256 thash;
+    if (header.vector_format)
+        hash_cryptonight((const char*)&header.vector_rep[0], BEGIN(thash), header.vector_rep.size());
+    else
+        hash_cryptonight(BEGIN(header.nVersion), BEGIN(thash), 80);
+    return thash;
+}
+
+template<PoWHashFn Hash>
+void HashBatchSerial(const CPureBlockHeader* const* ppheader, uint256* phash, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++)
+        phash[i] = Hash(*ppheader[i]);
+}
+
+void HashBatchScrypt(const CPureBlockHeader* const* ppheader, uint256* phash, unsigned int n)
+{
+    std::vector<const char*> vInput(n);
+    std::vector<char*> vOutput(n);
+    for (unsigned int i = 0; i < n; i++) {
+        vInput[i] = BEGIN(ppheader[i]->nVersion);
+        vOutput[i] = BEGIN(phash[i]);
+    }
+    scrypt_1024_1_1_256_multi(&vInput[0], &vOutput[0], n);
+}
+
+// GetHash is the plain double SHA256 of the 80 byte header except for
+// equihash and vector format cryptonight headers, which are hashed one by one.
+void HashBatchSHA256D(const CPureBlockHeader* const* ppheader, uint256* phash, unsigned int n)
+{
+    std::vector<const unsigned char*> vInput;
+    std::vector<unsigned char*> vOutput;
+    vInput.reserve(n);
+    vOutput.reserve(n);
+    for (unsigned int i = 0; i < n; i++) {
+        const CPureBlockHeader& header = *ppheader[i];
+        int algo = header.GetAlgo();
+        if (algo == ALGO_EQUIHASH || (algo == ALGO_CRYPTONIGHT && header.vector_format)) {
+            phash[i] = header.GetHash();
+            continue;
+        }
+        vInput.push_back((const unsigned char*)BEGIN(header.nVersion));
+        vOutput.push_back((unsigned char*)BEGIN(phash[i]));
+    }
+    if (!vInput.empty())
+        sha256d_80_multi(&vInput[0], &vOutput[0], vInput.size());
+}
+
+}
+
+const CPoWAlgo vPoWAlgos[NUM_ALGOS] = {
+    { ALGO_SCRYPT,      "SCRYPT",      BLOCK_VERSION_SCRYPT,      8000,    true,  &HashScrypt,      &HashBatchScrypt },
+    { ALGO_SHA256D,     "SHA256D",     BLOCK_VERSION_SHA256D,     1,       false, &HashSHA256D,     &HashBatchSHA256D },
+    { ALGO_YESCRYPT,    "YESCRYPT",    BLOCK_VERSION_YESCRYPT,    800000,  true,  &HashYescrypt,    &HashBatchSerial<HashYescrypt> },
+    { ALGO_ARGON2,      "ARGON2",      BLOCK_VERSION_ARGON2,      4000000, true,  &HashArgon2,      &HashBatchSerial<HashArgon2> },
+    { ALGO_X17,         "X17",         BLOCK_VERSION_X17,         8000,    false, &HashX17,         &HashBatchSerial<HashX17> },
+    { ALGO_LYRA2REv2,   "LYRA2REv2",   BLOCK_VERSION_LYRA2REv2,   8000,    true,  &HashLyra2REv2,   &HashBatchSerial<HashLyra2REv2> },
+    { ALGO_EQUIHASH,    "EQUIHASH",    BLOCK_VERSION_EQUIHASH,    8000000, true,  &HashEquihash,    &HashBatchSerial<HashEquihash> },
+    { ALGO_CRYPTONIGHT, "CRYPTONIGHT", BLOCK_VERSION_CRYPTONIGHT, 8000000, true,  &HashCryptoNight, &HashBatchSerial<HashCryptoNight> },
+};
+
+int GetAlgo (int nVersion)
+{
+    for (int i = 0; i < NUM_ALGOS; i++)
+        if ((nVersion & BLOCK_VERSION_ALGO) == vPoWAlgos[i].nVersionBits)
+            return vPoWAlgos[i].nId;
+    return ALGO_SCRYPT;
+}
+
+const char * GetAlgoName (int algo)
+{
+    return GetPoWAlgo(algo).pszName;
+}
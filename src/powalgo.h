@@ -0,0 +1,63 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_POWALGO_H
+#define BITMARK_POWALGO_H
+
+#include "uint256.h"
+
+class CPureBlockHeader;
+
+const int NUM_ALGOS = 8;
+
+/* Proof of work algorithm ids. These are consensus critical: the id is
+   stored in bits 10-12 of the block version (see BLOCK_VERSION_ALGO). */
+enum {
+  ALGO_SCRYPT = 0,
+  ALGO_SHA256D = 1,
+  ALGO_YESCRYPT = 2,
+  ALGO_ARGON2 = 3,
+  ALGO_X17 = 4,
+  ALGO_LYRA2REv2 = 5,
+  ALGO_EQUIHASH = 6,
+  ALGO_CRYPTONIGHT = 7
+};
+
+/** Compute the proof of work hash of a header */
+typedef uint256 (*PoWHashFn)(const CPureBlockHeader& header);
+
+/** Compute the proof of work hashes of n headers at once, phash[i] for *ppheader[i].
+ *  Algorithms with a multi-buffer implementation hash several headers per pass;
+ *  the others loop over the single header function.
+ */
+typedef void (*PoWHashBatchFn)(const CPureBlockHeader* const* ppheader, uint256* phash, unsigned int n);
+
+/** Description of a proof of work algorithm */
+struct CPoWAlgo
+{
+    int nId;                // ALGO_*
+    const char* pszName;    // as shown by the RPC interface
+    int nVersionBits;       // BLOCK_VERSION_* flag selecting the algo
+    unsigned int nWeight;   // difficulty weight, see GetAlgoWeight
+    bool fMemoryHard;       // hashing touches a large scratchpad
+    PoWHashFn Hash;
+    PoWHashBatchFn HashBatch;
+};
+
+/** All algorithms, indexed by id */
+extern const CPoWAlgo vPoWAlgos[NUM_ALGOS];
+
+/** Descriptor of an algo; unknown ids fall back to scrypt, the original algo */
+inline const CPoWAlgo& GetPoWAlgo(int algo)
+{
+    return vPoWAlgos[algo >= 0 && algo < NUM_ALGOS ? algo : ALGO_SCRYPT];
+}
+
+/* Get Proof of Work Algo for the block from the block's nVersion */
+int GetAlgo (int nVersion);
+
+/* Get name of algo from its number */
+const char * GetAlgoName (int algo);
+
+#endif // BITMARK_POWALGO_H
@@ -7,19 +7,7 @@
 #include "scrypt.h"
 #include "hash.h"
 #include "bignum.h"
-
-const int NUM_ALGOS = 8;
-
-enum {
-  ALGO_SCRYPT = 0,
-  ALGO_SHA256D = 1,
-  ALGO_YESCRYPT = 2,
-  ALGO_ARGON2 = 3,
-  ALGO_X17 = 4,
-  ALGO_LYRA2REv2 = 5,
-  ALGO_EQUIHASH = 6,
-  ALGO_CRYPTONIGHT = 7
-};
+#include "powalgo.h"
 
 /* Use the rightmost 8 bits for standard version number, 9th bit for merge mining, 10-12 th bits for POW algo, 13 th bit for update scaling factor flag, 14-16 th bits for protocol variant */
 enum
@@ -77,8 +65,6 @@ class CPureBlockHeader { // Needed to resolve circular dependecies with CAuxPow
        }
        READWRITE(nTime);
        READWRITE(nBits);
-       CBigNum nBits_bn;
-       nBits_bn.SetCompact(nBits);
        if ((!isParent && GetAlgo()==ALGO_EQUIHASH) || (isParent && algoParent==ALGO_EQUIHASH)) {
 	 READWRITE(nNonce256);
 	 READWRITE(nSolution);
@@ -108,59 +94,13 @@ class CPureBlockHeader { // Needed to resolve circular dependecies with CAuxPow
 
   void SetAlgo(int algo)
   {
-    switch(algo)
-      {
-      case ALGO_SHA256D:
-	nVersion |= BLOCK_VERSION_SHA256D;
-	break;
-      case ALGO_SCRYPT:
-	nVersion |= BLOCK_VERSION_SCRYPT;
-	break;
-      case ALGO_ARGON2:
-	nVersion |= BLOCK_VERSION_ARGON2;
-	break;
-      case ALGO_X17:
-	nVersion |= BLOCK_VERSION_X17;
-	break;
-      case ALGO_LYRA2REv2:
-	nVersion |= BLOCK_VERSION_LYRA2REv2;
-	break;
-      case ALGO_EQUIHASH:
-	nVersion |= BLOCK_VERSION_EQUIHASH;
-	break;
-      case ALGO_CRYPTONIGHT:
-	nVersion |= BLOCK_VERSION_CRYPTONIGHT;
-	break;
-      case ALGO_YESCRYPT:
-	nVersion |= BLOCK_VERSION_YESCRYPT;
-	break;
-      default:
-	break;
-      }
+    if (algo >= 0 && algo < NUM_ALGOS)
+      nVersion |= vPoWAlgos[algo].nVersionBits;
   }
 
   int GetAlgo () const {
     if (algoParent != -1) return algoParent;
-    switch (nVersion & BLOCK_VERSION_ALGO)
-      {
-      case BLOCK_VERSION_SHA256D:
-	return ALGO_SHA256D;
-      case BLOCK_VERSION_SCRYPT:
-	return ALGO_SCRYPT;
-      case BLOCK_VERSION_ARGON2:
-	return ALGO_ARGON2;
-      case BLOCK_VERSION_X17:
-	return ALGO_X17;
-      case BLOCK_VERSION_LYRA2REv2:
-	return ALGO_LYRA2REv2;
-      case BLOCK_VERSION_EQUIHASH:
-	return ALGO_EQUIHASH;
-      case BLOCK_VERSION_CRYPTONIGHT:
-	return ALGO_CRYPTONIGHT;
-      case BLOCK_VERSION_YESCRYPT:
-	return ALGO_YESCRYPT;
-      }
-    return ALGO_SCRYPT;
+    return ::GetAlgo(nVersion);
   }
 
   void SetChainId(int32_t id)
@@ -197,61 +137,7 @@ class CPureBlockHeader { // Needed to resolve circular dependecies with CAuxPow
 
   uint256 GetPoWHash(int algo) const
   {
-    switch(algo) {
-    case ALGO_SHA256D:
-      return GetHash();
-    case ALGO_SCRYPT:
-      {
-	//special for testing
-	/*if (nTime > 1527138083 && nBits == 453187307) {
-	  //LogPrintf("do special powhash\n");
-	  uint256 thash;
-	  hash_easy(BEGIN(nVersion),BEGIN(thash));
-	  return thash;
-	  }*/
-	uint256 thash;
-	hash_scrypt(BEGIN(nVersion),BEGIN(thash));
-	return thash;
-      }
-    case ALGO_ARGON2:
-      {
-	uint256 thash;
-	hash_argon2(BEGIN(nVersion),BEGIN(thash));
-	return thash;
-      }
-    case ALGO_X17:
-      return hash_x17(BEGIN(nVersion), END(nNonce));
-    case ALGO_LYRA2REv2:
-      {
-	uint256 thash;
-	hash_lyra2rev2(BEGIN(nVersion),BEGIN(thash));
-	return thash;
-      }
-    case ALGO_EQUIHASH:
-      {
-	return GetHashE();
-      }
-    case ALGO_CRYPTONIGHT:
-      {
-	uint256 thash;
-	if (vector_format) {
-	  hash_cryptonight(BEGIN(vector_rep[0]),BEGIN(thash),vector_rep.size());
-	}
-	else {
-	  hash_cryptonight(BEGIN(nVersion),BEGIN(thash),80);
-	}
-	return thash;
-      } 
-    case ALGO_YESCRYPT:
-      {
-	uint256 thash;
-	hash_yescrypt(BEGIN(nVersion),BEGIN(thash));
-	return thash;
-      }
-    }
-    uint256 thash;
-    hash_scrypt(BEGIN(nVersion),BEGIN(thash));
-    return thash;
+    return GetPoWAlgo(algo).Hash(*this);
   }
   
   uint256 GetPoWHash() const
@@ -15,7 +15,7 @@
 #include "monitoreddatamapper.h"
 #include "optionsmodel.h"
 
-#include "main.h" // for CTransaction::nMinTxFee and MAX_SCRIPTCHECK_THREADS
+#include "main.h" // for CTransaction::nMinTxFee
 #include "netbase.h"
 #include "txdb.h" // for -dbcache defaults
 
@@ -39,7 +39,8 @@ OptionsDialog::OptionsDialog(QWidget *parent) :
     ui->databaseCache->setMinimum(nMinDbCache);
     ui->databaseCache->setMaximum(nMaxDbCache);
     ui->threadsScriptVerif->setMinimum(-(int)boost::thread::hardware_concurrency());
-    ui->threadsScriptVerif->setMaximum(MAX_SCRIPTCHECK_THREADS);
+    // -par has no upper bound; offer up to twice the cores
+    ui->threadsScriptVerif->setMaximum(2 * (int)boost::thread::hardware_concurrency());
 
     /* Network elements init */
 #ifndef USE_UPNP
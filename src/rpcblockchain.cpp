@@ -8,6 +8,7 @@
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 
 #include <stdint.h>
 
@@ -50,7 +51,7 @@ double GetDifficulty(const CBlockIndex* blockindex, int algo, bool weighted, boo
       nBits = blockindex->nBits;
     }
     else {
-      nBits = (Params().ProofOfWorkLimit()*algoWeight).GetCompact();
+      nBits = (arith_uint320(Params().ProofOfWorkLimit())*algoWeight).GetCompact();
     }
     
     int nShift = (nBits >> 24) & 0xff;
@@ -92,38 +93,10 @@ double GetPeakHashrate (const CBlockIndex* blockindex, int algo) {
       const CBlockIndex * pprev_algo = get_pprev_algo(blockindex,-1);
       for (int i=0; i<365; i++) {
 	if (!pprev_algo) break;
-	int time_f = pprev_algo->GetMedianTimePast();
-	CBigNum hashes_bn = pprev_algo->GetBlockWork();
-	int time_i = 0;
-	
-	for (int j=0; j<nSSF-1; j++) {
-	 
-	  pprev_algo = get_pprev_algo(pprev_algo,-1);
-
-	  if (pprev_algo) {
-	    time_i = pprev_algo->GetMedianTimePast();
-	  }
-	  else {
-	    hashes_bn = CBigNum(0);
-	    break;
-	  }
-	  //LogPrintf("j=%d add block work of block %lu\n",j,pprev_algo->nHeight);
-	  hashes_bn += pprev_algo->GetBlockWork();	  
-	}
-	CBlockIndex * pprev_algo_time = get_pprev_algo(pprev_algo,-1);
-	if (pprev_algo_time) {
-	  time_i = pprev_algo_time->GetMedianTimePast();
-	}
-	else {
-	  const CBlockIndex * blockindex_time = pprev_algo;
-	  while (blockindex_time && onFork(blockindex_time)) {
-	    blockindex_time = blockindex_time->pprev;
-	  }
-	  if (blockindex_time) {
-	    time_i = blockindex_time->GetBlockTime();
-	  }
-	}
-	pprev_algo = pprev_algo_time;
+	CSSFWindow window = get_ssf_window(pprev_algo);
+	int time_f = window.nTimeFirst;
+	int time_i = window.nTimeLast;
+	pprev_algo = window.pnext;
 	
 	if (time_f>time_i) {
 	  time_f -= time_i;
@@ -131,8 +104,8 @@ double GetPeakHashrate (const CBlockIndex* blockindex, int algo) {
 	else {
 	  return std::numeric_limits<double>::max();
 	}
-	//LogPrintf("hashes = %f, time = %f\n",(double)hashes_bn.getulong(),(double)time_f);
-	double hashes = (((hashes_bn/time_f)/1000000)/1000).getulong();
+	//LogPrintf("hashes = %f, time = %f\n",window.hashes.getdouble(),(double)time_f);
+	double hashes = (((window.hashes/time_f)/1000000)/1000).GetLow64Saturated();
 	//LogPrintf("hashes per sec = %f\n",hashes);
 	if (hashes>hashes_peak) hashes_peak = hashes;
       }
@@ -163,31 +136,12 @@ double GetCurrentHashrate (const CBlockIndex* blockindex, int algo) { //as used
     if (update_ssf(blockindex->nVersion)) {
       const CBlockIndex * pcur_algo = get_pprev_algo(blockindex,-1);
       if (!pcur_algo) return 0.;
-      int time_f = pcur_algo->GetMedianTimePast();
-      CBigNum hashes_bn = pcur_algo->GetBlockWork();
-      int time_i = 0;
-      const CBlockIndex * pprev_algo = pcur_algo;
-      for (int j=0; j<nSSF-1; j++) {
-	pprev_algo = get_pprev_algo(pprev_algo,-1);
-	if (pprev_algo) {
-	  time_i = pprev_algo->GetMedianTimePast();
-	}
-	else {
-	  return 0.;
-	}
-	hashes_bn += pprev_algo->GetBlockWork();
-      }
-      CBlockIndex * pprev_algo_time = get_pprev_algo(pprev_algo,-1);
-      if (pprev_algo_time) {
-	time_i = pprev_algo_time->GetMedianTimePast();
-      }
-      else {
-	const CBlockIndex * blockindex_time = pprev_algo;
-	while (blockindex_time && onFork(blockindex_time)) {
-	  blockindex_time = blockindex_time->pprev;
-	}
-	if (blockindex_time) time_i = blockindex_time->GetBlockTime();
+      CSSFWindow window = get_ssf_window(pcur_algo);
+      if (!window.fComplete) {
+	return 0.;
       }
+      int time_f = window.nTimeFirst;
+      int time_i = window.nTimeLast;
 
       if (time_f>time_i) {
 	time_f -= time_i;
@@ -195,8 +149,8 @@ double GetCurrentHashrate (const CBlockIndex* blockindex, int algo) { //as used
       else {
 	return std::numeric_limits<double>::max();
       }
-      //LogPrintf("return %lu / %f\n",(double)hashes_bn.getulong(),(double)time_f);
-      return (((hashes_bn/time_f)/1000000)/1000).getulong();
+      //LogPrintf("return %f / %f\n",window.hashes.getdouble(),(double)time_f);
+      return (((window.hashes/time_f)/1000000)/1000).GetLow64Saturated();
     }
     blockindex = get_pprev_algo(blockindex,-1);
   } while (blockindex);
@@ -260,6 +214,7 @@ double GetBlockReward (CBlockIndex * blockindex, int algo, bool noScale) {
   CBlockIndex indexDummy(*pblock);
   indexDummy.pprev = blockindex;
   indexDummy.nHeight = blockindex->nHeight + 1;
+  indexDummy.BuildAlgoLinks();
   return ((double)GetBlockValue(&indexDummy,0,noScale))/100000000.;
   
 }
@@ -682,7 +637,7 @@ Value gettxout(const Array& params, bool fHelp)
     if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
         return Value::null;
 
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
     if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
@@ -735,6 +690,7 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "{\n"
             "  \"chain\": \"xxxx\",        (string) current chain (main, testnet3, regtest)\n"
             "  \"blocks\": xxxxxx,         (numeric) the current number of blocks processed in the server\n"
+            "  \"headers\": xxxxxx,        (numeric) the current number of headers we have validated\n"
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
@@ -754,9 +710,63 @@ Value getblockchaininfo(const Array& params, bool fHelp)
         chain = "main";
     obj.push_back(Pair("chain",         chain));
     obj.push_back(Pair("blocks",        (int)chainActive.Height()));
+    obj.push_back(Pair("headers",       GetBestHeaderHeight()));
     obj.push_back(Pair("bestblockhash", chainActive.Tip()->GetBlockHash().GetHex()));
     obj.push_back(Pair("difficulty",    (double)GetDifficulty(NULL,-1)));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
     return obj;
 }
+
+Value getscriptcheckinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscriptcheckinfo\n"
+            "Returns how the script checks of the last connected block were spread over the verification threads.\n"
+            "Empty until a block is connected with -par above 1.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"threads\": n,           (numeric) the number of script verification threads\n"
+            "  \"height\": n,            (numeric) the height of the block\n"
+            "  \"hash\": \"hash\",        (string) the hash of the block\n"
+            "  \"checks\": n,            (numeric) the number of script checks run\n"
+            "  \"walltime\": x.xxx,      (numeric) milliseconds from the first to the last check of the block\n"
+            "  \"workers\": [            (array) one entry per thread, the first being the block validation thread\n"
+            "    {\n"
+            "      \"checks\": n,        (numeric) the number of checks run by this thread\n"
+            "      \"steals\": n,        (numeric) the number of batches taken from other threads\n"
+            "      \"busytime\": x.xxx,  (numeric) milliseconds spent running checks\n"
+            "      \"idletime\": x.xxx   (numeric) milliseconds of walltime not spent running checks\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getscriptcheckinfo", "")
+            + HelpExampleRpc("getscriptcheckinfo", "")
+        );
+
+    Object obj;
+    obj.push_back(Pair("threads", nScriptCheckThreads));
+    uint256 hashBlock;
+    int nHeight;
+    CCheckQueueStats stats;
+    if (!GetScriptCheckStats(hashBlock, nHeight, stats))
+        return obj;
+    obj.push_back(Pair("height", nHeight));
+    obj.push_back(Pair("hash", hashBlock.GetHex()));
+    obj.push_back(Pair("checks", (int)stats.nChecks));
+    obj.push_back(Pair("walltime", 0.001 * stats.nWallMicros));
+    Array workers;
+    BOOST_FOREACH(const CCheckQueueWorkerStats &worker, stats.vWorker) {
+        Object entry;
+        entry.push_back(Pair("checks", (int)worker.nChecks));
+        entry.push_back(Pair("steals", (int)worker.nSteals));
+        entry.push_back(Pair("busytime", 0.001 * worker.nBusyMicros));
+        entry.push_back(Pair("idletime", 0.001 * (stats.nWallMicros - worker.nBusyMicros)));
+        workers.push_back(entry);
+    }
+    obj.push_back(Pair("workers", workers));
+    return obj;
+}
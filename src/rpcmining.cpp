@@ -10,6 +10,7 @@
 #include "net.h"
 #include "main.h"
 #include "miner.h"
+#include "templatecache.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
 #include "wallet.h"
@@ -55,10 +56,36 @@ void ShutdownRPCMining()
 
 /* Set mining algo here for rpc mining */
 int miningAlgo = ALGO_SCRYPT;
-int miningAlgoGBT = miningAlgo;
-int miningAlgoGAB = miningAlgo;
 bool confAlgoIsSet = false;
 
+// The shared template for the mining algo, and the block it builds on
+static boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(CBlockIndex*& pindexPrev)
+{
+    if (!confAlgoIsSet) {
+      miningAlgo = GetArg("-miningalgo", miningAlgo);
+      confAlgoIsSet = true;
+    }
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate = ptemplateCache->Get(miningAlgo, pindexPrev);
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Could not create a block template");
+    return pblocktemplate;
+}
+
+#ifdef ENABLE_WALLET
+// A copy of a shared template paying to a key of the wallet
+static CBlockTemplate* CopyBlockTemplate(const CBlockTemplate& blocktemplate, CReserveKey& reservekey)
+{
+    CPubKey pubkey;
+    if (!reservekey.GetReservedKey(pubkey))
+        return NULL;
+    CBlockTemplate* pblocktemplate = new CBlockTemplate(blocktemplate);
+    CTransaction& txCoinbase = pblocktemplate->block.vtx[0];
+    txCoinbase.vout[0].scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(txCoinbase);
+    return pblocktemplate;
+}
+#endif
+
 // Return average network hashes per second based on the last 'lookup' blocks,
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
@@ -87,7 +114,7 @@ Value GetNetworkHashPS(int lookup, int height, int algo) {
     if (!pb0) return 0.;
     int64_t minTime = pb0->GetBlockTime();
     int64_t maxTime = minTime;
-    CBigNum hashes_bn = pb0->GetBlockWork();
+    arith_uint320 hashes_bn = pb0->GetBlockWork();
     for (int i = 0; i < lookup; i++) {
         pb0 = pb0->pprev;
 	if (!pb0) break;
@@ -108,7 +135,7 @@ Value GetNetworkHashPS(int lookup, int height, int algo) {
     //uint256 workDiff = pb->nChainWork - pb0->nChainWork;
     int64_t timeDiff = maxTime - minTime;
 
-    return (((double)hashes_bn.getulong()) / (double)timeDiff);
+    return (((double)hashes_bn.GetLow64Saturated()) / (double)timeDiff);
 }
 
 Value getnetworkhashps(const Array& params, bool fHelp)
@@ -341,14 +368,8 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",      (double)GetDifficulty(NULL,miningAlgo,true,true)));
 //  sdifficulty: the "simple", unweighted difficulty
     obj.push_back(Pair("sdifficulty",       (double)GetDifficulty(NULL,miningAlgo,false,true)));
-    obj.push_back(Pair("difficulty SCRYPT", (double)GetDifficulty(NULL,ALGO_SCRYPT,true,true)));
-    obj.push_back(Pair("difficulty SHA256D",    (double)GetDifficulty(NULL,ALGO_SHA256D,true,true)));
-    obj.push_back(Pair("difficulty YESCRYPT",    (double)GetDifficulty(NULL,ALGO_YESCRYPT,true,true)));
-    obj.push_back(Pair("difficulty ARGON2",    (double)GetDifficulty(NULL,ALGO_ARGON2,true,true)));
-    obj.push_back(Pair("difficulty X17",    (double)GetDifficulty(NULL,ALGO_X17,true,true)));
-    obj.push_back(Pair("difficulty LYRA2REv2",    (double)GetDifficulty(NULL,ALGO_LYRA2REv2,true,true)));
-    obj.push_back(Pair("difficulty EQUIHASH",    (double)GetDifficulty(NULL,ALGO_EQUIHASH,true,true)));
-    obj.push_back(Pair("difficulty CRYPTONIGHT",    (double)GetDifficulty(NULL,ALGO_CRYPTONIGHT,true,true)));
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+        obj.push_back(Pair(string("difficulty ") + GetAlgoName(algo), (double)GetDifficulty(NULL,algo,true,true)));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
@@ -389,24 +410,28 @@ Value getwork(const Array& params, bool fHelp)
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
 
-    if (IsInitialBlockDownload())
+    if (ptemplateCache->IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
 
+    static CCriticalSection cs_getwork;
+    LOCK(cs_getwork);
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
+    static mapNewBlock_t mapNewBlock;
     static vector<CBlockTemplate*> vNewBlockTemplate;
 
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static boost::shared_ptr<const CBlockTemplate> psharedLast;
         static CBlockIndex* pindexPrev;
         static int64_t nStart;
         static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        CBlockIndex* pindexPrevNew = NULL;
+        boost::shared_ptr<const CBlockTemplate> pshared = GetBlockTemplate(pindexPrevNew);
+        if (pindexPrev != pindexPrevNew ||
+            (pshared != psharedLast && GetTime() - nStart > 60))
         {
-            if (pindexPrev != chainActive.Tip())
+            if (pindexPrev != pindexPrevNew)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -417,19 +442,16 @@ Value getwork(const Array& params, bool fHelp)
 
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
             nStart = GetTime();
 
             // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
+            pblocktemplate = CopyBlockTemplate(*pshared, *pMiningKey);
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
             vNewBlockTemplate.push_back(pblocktemplate);
 
-            // Need to update only after we know CreateNewBlock succeeded
+            // Need to update only after we know the copy succeeded
+            psharedLast = pshared;
             pindexPrev = pindexPrevNew;
         }
         CBlock* pblock = &pblocktemplate->block; // pointer for convenience
@@ -463,7 +485,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -500,6 +522,45 @@ Value getwork(const Array& params, bool fHelp)
 }
 #endif
 
+// The transactions of a template as getblocktemplate lists them
+static Array TemplateTransactions(const CBlockTemplate& blocktemplate)
+{
+    Array transactions;
+    map<uint256, int64_t> setTxIndex;
+    int i = 0;
+    BOOST_FOREACH (const CTransaction& tx, blocktemplate.block.vtx)
+    {
+        uint256 txHash = tx.GetHash();
+        setTxIndex[txHash] = i++;
+
+        if (tx.IsCoinBase())
+            continue;
+
+        Object entry;
+
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+
+        entry.push_back(Pair("hash", txHash.GetHex()));
+
+        Array deps;
+        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        {
+            if (setTxIndex.count(in.prevout.hash))
+                deps.push_back(setTxIndex[in.prevout.hash]);
+        }
+        entry.push_back(Pair("depends", deps));
+
+        int index_in_template = i - 1;
+        entry.push_back(Pair("fee", blocktemplate.vTxFees[index_in_template]));
+        entry.push_back(Pair("sigops", blocktemplate.vTxSigOps[index_in_template]));
+
+        transactions.push_back(entry);
+    }
+    return transactions;
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -583,92 +644,41 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
 
-    if (IsInitialBlockDownload())
+    if (ptemplateCache->IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() || miningAlgo != miningAlgoGBT ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-	miningAlgoGBT = miningAlgo;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    CBlockIndex* pindexPrev = NULL;
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate = GetBlockTemplate(pindexPrev);
+    const CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
-    UpdateTime(*pblock, pindexPrev);
-    pblock->nNonce = 0;
+    CBlockHeader header = *pblock;
+    UpdateTime(header, pindexPrev);
 
+    // The transactions only change with the template
+    static CCriticalSection cs_transactions;
+    static boost::shared_ptr<const CBlockTemplate> ptemplateLast;
+    static Array transactionsLast;
     Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
     {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        Object entry;
-
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        LOCK(cs_transactions);
+        if (pblocktemplate != ptemplateLast)
         {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
+            transactionsLast = TemplateTransactions(*pblocktemplate);
+            ptemplateLast = pblocktemplate;
         }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
+        transactions = transactionsLast;
     }
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(pblock->nBits));
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
-    }
+    Array aMutable;
+    aMutable.push_back("time");
+    aMutable.push_back("transactions");
+    aMutable.push_back("prevblock");
 
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
@@ -682,8 +692,8 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("noncerange", "00000000ffffffff"));
     result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
     result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", (int64_t)pblock->nTime));
-    result.push_back(Pair("bits", HexBits(pblock->nBits)));
+    result.push_back(Pair("curtime", (int64_t)header.nTime));
+    result.push_back(Pair("bits", HexBits(header.nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
 
     return result;
@@ -773,14 +783,15 @@ Value getauxblock(const Array& params, bool fHelp)
     throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
   if (vNodes.empty())
     throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
-  if (IsInitialBlockDownload())
+  if (ptemplateCache->IsInitialBlockDownload())
     throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
   static CCriticalSection cs_auxblockCache;
   LOCK(cs_auxblockCache);
   static std::map<uint256, CBlock*> mapNewBlock;
   static std::vector<CBlockTemplate*> vNewBlockTemplate;
   if (params.size() == 0) {
-    static unsigned nTransactionsUpdatedLast;
+    static boost::shared_ptr<const CBlockTemplate> psharedLast;
+    static int nAlgoLast = -1;
     static CBlockIndex* pindexPrev = NULL;
     static uint64_t nStart;
     static CBlockTemplate* pblocktemplate;
@@ -788,23 +799,24 @@ Value getauxblock(const Array& params, bool fHelp)
     CReserveKey reservekey(pwalletMain);
 
     {
-      LOCK(cs_main);
-      if (pindexPrev != chainActive.Tip() || miningAlgo != miningAlgoGAB
-	  || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast
-	      && GetTime() - nStart > 60)) {
-	if (pindexPrev != chainActive.Tip()) {
+      CBlockIndex* pindexPrevNew = NULL;
+      boost::shared_ptr<const CBlockTemplate> pshared = GetBlockTemplate(pindexPrevNew);
+      if (pindexPrev != pindexPrevNew || miningAlgo != nAlgoLast
+	  || (pshared != psharedLast && GetTime() - nStart > 60)) {
+	if (pindexPrev != pindexPrevNew) {
 	  mapNewBlock.clear();
 	  BOOST_FOREACH(CBlockTemplate* pbt, vNewBlockTemplate)
 	    delete pbt;
 	  vNewBlockTemplate.clear();
 	}
 
-	pblocktemplate = CreateNewBlockWithKey(reservekey);
+	pblocktemplate = CopyBlockTemplate(*pshared, reservekey);
 	if (!pblocktemplate)
 	  throw JSONRPCError(RPC_OUT_OF_MEMORY, "out of memory");
 
-	nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-	pindexPrev = chainActive.Tip();
+	psharedLast = pshared;
+	nAlgoLast = miningAlgo;
+	pindexPrev = pindexPrevNew;
 	nStart = GetTime();
 
 	CBlock* pblock = &pblocktemplate->block;
@@ -815,13 +827,12 @@ Value getauxblock(const Array& params, bool fHelp)
 
 	mapNewBlock[pblock->GetHash()] = pblock;
 	vNewBlockTemplate.push_back(pblocktemplate);
-	miningAlgoGAB = miningAlgo;
       }	    	  
     }
 
     const CBlock& block = pblocktemplate->block;
 
-    uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+    uint256 hashTarget = ArithToUint256(arith_uint256().SetCompact(block.nBits));
 
     json_spirit::Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
@@ -877,7 +888,11 @@ Value getauxblock(const Array& params, bool fHelp)
     assert(block.GetHash() == hash);
   }
   CValidationState state;
-  bool fAccepted = ProcessBlock(state, NULL, &block);
+  bool fAccepted;
+  {
+    LOCK(cs_main);
+    fAccepted = ProcessBlock(state, NULL, &block);
+  }
   if (!fAccepted)
     return "rejected";
   return Value::null;
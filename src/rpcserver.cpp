@@ -265,8 +265,8 @@ static const CRPCCommand vRPCCommands[] =
     { "grmp",                   &getrawmempool,          true,      false,      false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "gtxo",                   &gettxout,               true,      false,      false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
-    { "gtxosi",                 &gettxoutsetinfo,        true,      false,      false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      true,       false },
+    { "gtxosi",                 &gettxoutsetinfo,        true,      true,       false },
     { "verifychain",            &verifychain,            true,      false,      false },
     { "vc",                     &verifychain,            true,      false,      false },
     { "getblockspacing",        &getblockspacing,        true,      false,      false },
@@ -277,10 +277,12 @@ static const CRPCCommand vRPCCommands[] =
     { "gms",         		&getmoneysupply,         true,      false,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "gd",                     &getdifficulty,          true,      false,      false },
+    { "getscriptcheckinfo",     &getscriptcheckinfo,     true,      false,      false },
+    { "gsci",                   &getscriptcheckinfo,     true,      false,      false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "gbt",                    &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
+    { "gbt",                    &getblocktemplate,       true,      true,       false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "gmi",                    &getmininginfo,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
@@ -344,11 +346,11 @@ static const CRPCCommand vRPCCommands[] =
     { "gub",                    &getunconfirmedbalance,  false,     false,      true },
     { "getwalletinfo",          &getwalletinfo,          false,      false,      true },
     { "gwi",                    &getwalletinfo,          false,      false,      true },
-    { "importprivkey",          &importprivkey,          true,     false,      true },
-    { "ipk",                    &importprivkey,          true,     false,      true },
-    { "importwallet",           &importwallet,           true,     false,      true },
-    { "importaddress",          &importaddress,          true,     false,      true },
-    { "iw",                     &importwallet,           true,     false,      true },
+    { "importprivkey",          &importprivkey,          true,     true,       true },
+    { "ipk",                    &importprivkey,          true,     true,       true },
+    { "importwallet",           &importwallet,           true,     true,       true },
+    { "importaddress",          &importaddress,          true,     true,       true },
+    { "iw",                     &importwallet,           true,     true,       true },
     { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "kpr",                    &keypoolrefill,          true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
@@ -395,14 +397,14 @@ static const CRPCCommand vRPCCommands[] =
     { "gg",                     &getgenerate,            true,      false,      false },
     { "gethashespersec",        &gethashespersec,        true,      false,      false },
     { "ghps",                   &gethashespersec,        true,      false,      false },
-    { "getwork",                &getwork,                true,      false,      true  },
-    { "gw",                     &getwork,                true,      false,      true  },
+    { "getwork",                &getwork,                true,      true,       true  },
+    { "gw",                     &getwork,                true,      true,       true  },
     { "setminingalgo",            &setminingalgo,            true,      true,       false },
     { "getminingalgo",            &getminingalgo,            true,      true,       false },
     { "setgenerate",            &setgenerate,            true,      true,       false },
     { "sg",                     &setgenerate,            true,      true,       false },
-    { "getauxblock",            &getauxblock,            true,     false,      false },
-    { "gab",                    &getauxblock,            true,     false,      false },
+    { "getauxblock",            &getauxblock,            true,     true,       false },
+    { "gab",                    &getauxblock,            true,     true,       false },
 #endif // ENABLE_WALLET
 };
 
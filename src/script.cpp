@@ -10,13 +10,12 @@
 #include "hash.h"
 #include "key.h"
 #include "keystore.h"
+#include "sigcache.h"
 #include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -30,7 +29,7 @@ static const CScriptNum bnOne(1);
 static const CScriptNum bnFalse(0);
 static const CScriptNum bnTrue(1);
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CPrecomputedTransactionData* ptxdata = NULL);
 
 bool CastToBool(const valtype& vch)
 {
@@ -444,7 +443,7 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CPrecomputedTransactionData* ptxdata)
 {
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
@@ -1030,7 +1029,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
 		    bool fSuccess = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey, flags) &&
-		      CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+		      CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, ptxdata);
 		    /*
 		    else {
 		      bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
@@ -1098,7 +1097,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
 			bool fOk = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey, flags) &&
-			  CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+			  CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, ptxdata);
 
 			
                         /*bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
@@ -1252,9 +1251,57 @@ public:
         ::Serialize(s, txTo.nLockTime, nType, nVersion);
     }
 };
+
+/** Stream that feeds everything written to it into a SHA256 state */
+class CSHA256Writer
+{
+private:
+    SHA256_CTX& ctx;
+
+public:
+    explicit CSHA256Writer(SHA256_CTX& ctxIn) : ctx(ctxIn) {}
+
+    CSHA256Writer& write(const char *pch, size_t size) {
+        SHA256_Update(&ctx, pch, size);
+        return (*this);
+    }
+};
+
+// prevout, an empty script and nSequence
+const size_t SIGHASH_BLANK_INPUT_SIZE = 36 + 1 + 4;
+}
+
+CPrecomputedTransactionData::CPrecomputedTransactionData(const CTransaction& txTo)
+{
+    CDataStream ssInputs(SER_GETHASH, 0);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+    assert(vchInputs.size() == txTo.vin.size() * SIGHASH_BLANK_INPUT_SIZE);
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    vPrefix.resize(txTo.vin.size());
+    if (vPrefix.empty())
+        return;
+    SHA256_Init(&vPrefix[0]);
+    CSHA256Writer ss(vPrefix[0]);
+    ::Serialize(ss, txTo.nVersion, SER_GETHASH, 0);
+    ::WriteCompactSize(ss, txTo.vin.size());
+    for (unsigned int i = 1; i < vPrefix.size(); i++) {
+        vPrefix[i] = vPrefix[i - 1];
+        SHA256_Update(&vPrefix[i], &vchInputs[(i - 1) * SIGHASH_BLANK_INPUT_SIZE], SIGHASH_BLANK_INPUT_SIZE);
+    }
 }
 
 uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    return SignatureHash(scriptCode, txTo, nIn, nHashType, NULL);
+}
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CPrecomputedTransactionData* ptxdata)
 {
     if (nIn >= txTo.vin.size()) {
         LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
@@ -1272,6 +1319,26 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // Every other input and all outputs are committed to as they are: hash
+    // them from the precomputed buffers around the script code of this input
+    if (ptxdata && ptxdata->vPrefix.size() == txTo.vin.size() &&
+        !(nHashType & SIGHASH_ANYONECANPAY) && (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        const std::vector<unsigned char>& vchInputs = ptxdata->vchInputs;
+        const size_t nNextInput = (nIn + 1) * SIGHASH_BLANK_INPUT_SIZE;
+        SHA256_CTX ctx = ptxdata->vPrefix[nIn];
+        CSHA256Writer ss(ctx);
+        SHA256_Update(&ctx, &vchInputs[nIn * SIGHASH_BLANK_INPUT_SIZE], 36);
+        txTmp.SerializeScriptCode(ss, SER_GETHASH, 0);
+        SHA256_Update(&ctx, &vchInputs[nNextInput - 4], vchInputs.size() - nNextInput + 4);
+        SHA256_Update(&ctx, &ptxdata->vchOutputs[0], ptxdata->vchOutputs.size());
+        ::Serialize(ss, nHashType, SER_GETHASH, 0);
+        uint256 hash1;
+        SHA256_Final((unsigned char*)&hash1, &ctx);
+        uint256 hash2;
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        return hash2;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1282,63 +1349,22 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-
-class CSignatureCache
+static size_t GetSignatureCacheBytes()
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
-    }
-
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
-    }
-};
+    // -maxsigcachesize is a number of entries, as it was for the old cache
+    if (!mapArgs.count("-sigcachesize") && mapArgs.count("-maxsigcachesize")) {
+        int64_t nEntries = GetArg("-maxsigcachesize", 0);
+        int64_t nMaxEntries = (MAX_SIG_CACHE_SIZE << 20) / CSignatureCache::SlotBytes();
+        return std::max((int64_t)0, std::min(nEntries, nMaxEntries)) * CSignatureCache::SlotBytes();
+    }
+    int64_t nMaxCacheSize = GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE);
+    return std::max((int64_t)0, std::min(nMaxCacheSize, MAX_SIG_CACHE_SIZE)) << 20;
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CPrecomputedTransactionData* ptxdata)
 {
-    static CSignatureCache signatureCache;
+    static CSignatureCache signatureCache(GetSignatureCacheBytes());
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid()) {
@@ -1360,10 +1386,14 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
     }
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, ptxdata);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
-      return true;
+    uint256 entry;
+    if (signatureCache.Size() > 0) {
+        entry = signatureCache.GetEntry(sighash, vchSig, pubkey);
+        if (signatureCache.Get(entry))
+            return true;
+    }
 
     if (!pubkey.Verify(sighash, vchSig)) {
       //printf("checksig !pubkey.Verify txid = %s\n",txTo.GetHash().GetHex().c_str());
@@ -1374,8 +1404,8 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
       return false;
     }
 
-    if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+    if (!(flags & SCRIPT_VERIFY_NOCACHE) && signatureCache.Size() > 0)
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -1811,7 +1841,7 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CPrecomputedTransactionData* ptxdata)
 {
   if (flags & SCRIPT_VERIFY_DERSIG) {
     //printf("%lu verify script with dersig\n",(unsigned long)GetTime());
@@ -1820,13 +1850,13 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     //printf("%lu verify script without dersig\n",(unsigned long)GetTime());
   }
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType)) {
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, ptxdata)) {
       //printf("verify script err 1\n");
         return false;
     }
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType)) {
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, ptxdata)) {
       //printf("verify script err 2\n");
         return false;
     }
@@ -1857,7 +1887,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType)) {
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, ptxdata)) {
 	  //printf("verify script err 6\n");
             return false;
 	}
@@ -1872,14 +1902,14 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CPrecomputedTransactionData* ptxdata)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, ptxdata);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1893,7 +1923,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, ptxdata);
 
         txnouttype subType;
         bool fSolved =
@@ -1904,17 +1934,17 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY, 0, ptxdata);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CPrecomputedTransactionData* ptxdata)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, ptxdata);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -17,6 +17,7 @@
 
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
+#include <openssl/sha.h>
 
 class CCoins;
 class CKeyStore;
@@ -812,7 +813,32 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** The parts of a transaction's signature hashes that do not depend on the
+ *  input being signed, serialized once. Legacy signature hashes cover the
+ *  whole transaction, so hashing every input of a large transaction from
+ *  scratch is quadratic in its size; with this the prefix before each input
+ *  is a saved SHA256 state and the rest is hashed straight from these
+ *  buffers. Only SIGHASH_ALL without ANYONECANPAY uses it. The other input
+ *  scripts are blanked in those hashes, so the data stays valid while the
+ *  transaction's inputs are being signed.
+ */
+class CPrecomputedTransactionData
+{
+public:
+    /** SHA256 state after nVersion, the input count and inputs [0, i) */
+    std::vector<SHA256_CTX> vPrefix;
+    /** Every input serialized with an empty script */
+    std::vector<unsigned char> vchInputs;
+    /** The outputs and nLockTime */
+    std::vector<unsigned char> vchOutputs;
+
+    CPrecomputedTransactionData() {}
+    explicit CPrecomputedTransactionData(const CTransaction& txTo);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CPrecomputedTransactionData* ptxdata);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CPrecomputedTransactionData* ptxdata = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -821,9 +847,9 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CPrecomputedTransactionData* ptxdata = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CPrecomputedTransactionData* ptxdata = NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CPrecomputedTransactionData* ptxdata = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
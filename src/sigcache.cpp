@@ -0,0 +1,148 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sigcache.h"
+
+#include "hash.h"
+#include "key.h"
+#include "util.h"
+
+#include <string.h>
+
+namespace {
+
+void GetWords(const uint256& entry, uint64_t vWord[4])
+{
+    memcpy(vWord, entry.begin(), 32);
+}
+
+// Map a 32 bit value onto [0, n) without a division
+size_t Reduce(uint32_t x, size_t n)
+{
+    return ((uint64_t)x * n) >> 32;
+}
+
+}
+
+CSignatureCache::CSignatureCache(size_t nBytes) : vSlot(NULL), nBuckets(0)
+{
+    nonce = GetRandHash();
+    nBuckets = nBytes / (sizeof(Slot) * SLOTS_PER_BUCKET);
+    // the bucket index is taken from 32 bits of the entry
+    if (nBuckets > 0xffffffffUL)
+        nBuckets = 0xffffffffUL;
+    if (nBuckets == 0)
+        return;
+    vSlot = new Slot[nBuckets * SLOTS_PER_BUCKET];
+    for (size_t i = 0; i < nBuckets * SLOTS_PER_BUCKET; i++) {
+        vSlot[i].nSequence.store(0, std::memory_order_relaxed);
+        for (int j = 0; j < 4; j++)
+            vSlot[i].vWord[j].store(0, std::memory_order_relaxed);
+    }
+    LogPrintf("Using %u MiB for the signature cache, %u entries\n", (unsigned int)(nBytes >> 20), (unsigned int)Size());
+}
+
+CSignatureCache::~CSignatureCache()
+{
+    delete[] vSlot;
+}
+
+size_t CSignatureCache::SlotBytes()
+{
+    return sizeof(Slot);
+}
+
+uint256 CSignatureCache::GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << nonce << hash << vchSig << pubKey;
+    return ss.GetHash();
+}
+
+void CSignatureCache::GetBuckets(const uint256& entry, size_t vBucket[2]) const
+{
+    uint64_t vWord[4];
+    GetWords(entry, vWord);
+    vBucket[0] = Reduce((uint32_t)vWord[0], nBuckets);
+    vBucket[1] = Reduce((uint32_t)(vWord[0] >> 32), nBuckets);
+    if (vBucket[1] == vBucket[0] && nBuckets > 1)
+        vBucket[1] = (vBucket[0] + 1) % nBuckets;
+}
+
+bool CSignatureCache::Matches(const Slot& slot, const uint64_t vWord[4]) const
+{
+    uint32_t nSeq = slot.nSequence.load(std::memory_order_acquire);
+    if (nSeq & 1)
+        return false;
+    bool fMatch = true;
+    for (int i = 0; i < 4; i++)
+        if (slot.vWord[i].load(std::memory_order_relaxed) != vWord[i])
+            fMatch = false;
+    // a writer that got in meanwhile may have left a mix of two entries
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return fMatch && slot.nSequence.load(std::memory_order_relaxed) == nSeq;
+}
+
+bool CSignatureCache::IsEmpty(const Slot& slot) const
+{
+    for (int i = 0; i < 4; i++)
+        if (slot.vWord[i].load(std::memory_order_relaxed) != 0)
+            return false;
+    return true;
+}
+
+bool CSignatureCache::TryWrite(Slot& slot, const uint64_t vWord[4], bool fOnlyIfEmpty)
+{
+    if (fOnlyIfEmpty && !IsEmpty(slot))
+        return false;
+    uint32_t nSeq = slot.nSequence.load(std::memory_order_relaxed);
+    if ((nSeq & 1) || !slot.nSequence.compare_exchange_strong(nSeq, nSeq + 1, std::memory_order_relaxed))
+        return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    // another writer may have filled the slot since it was checked
+    bool fWrite = !fOnlyIfEmpty || IsEmpty(slot);
+    if (fWrite)
+        for (int i = 0; i < 4; i++)
+            slot.vWord[i].store(vWord[i], std::memory_order_relaxed);
+    slot.nSequence.store(nSeq + 2, std::memory_order_release);
+    return fWrite;
+}
+
+bool CSignatureCache::Get(const uint256& entry) const
+{
+    if (nBuckets == 0)
+        return false;
+    uint64_t vWord[4];
+    GetWords(entry, vWord);
+    size_t vBucket[2];
+    GetBuckets(entry, vBucket);
+    for (int b = 0; b < 2; b++)
+        for (unsigned int i = 0; i < SLOTS_PER_BUCKET; i++)
+            if (Matches(vSlot[vBucket[b] * SLOTS_PER_BUCKET + i], vWord))
+                return true;
+    return false;
+}
+
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (nBuckets == 0)
+        return;
+    uint64_t vWord[4];
+    GetWords(entry, vWord);
+    size_t vBucket[2];
+    GetBuckets(entry, vBucket);
+    const unsigned int nCandidates = 2 * SLOTS_PER_BUCKET;
+    for (unsigned int i = 0; i < nCandidates; i++)
+        if (TryWrite(vSlot[vBucket[i / SLOTS_PER_BUCKET] * SLOTS_PER_BUCKET + i % SLOTS_PER_BUCKET], vWord, true))
+            return;
+
+    // Both buckets are full: evict a candidate picked by the salted entry,
+    // which an attacker cannot predict, moving on if a writer holds it
+    unsigned int nStart = vWord[1] % nCandidates;
+    for (unsigned int i = 0; i < nCandidates; i++) {
+        unsigned int n = (nStart + i) % nCandidates;
+        if (TryWrite(vSlot[vBucket[n / SLOTS_PER_BUCKET] * SLOTS_PER_BUCKET + n % SLOTS_PER_BUCKET], vWord, false))
+            return;
+    }
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_SIGCACHE_H
+#define BITMARK_SIGCACHE_H
+
+#include "uint256.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+class CPubKey;
+
+/** Default size of the signature cache in megabytes (-sigcachesize) */
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 32;
+/** Upper bound on the signature cache size, in megabytes */
+static const int64_t MAX_SIG_CACHE_SIZE = 1024;
+
+/**
+ * Fixed size cache of valid signatures, so that a signature checked when its
+ * transaction entered the memory pool is not checked again by ConnectBlock.
+ *
+ * Entries are 32 byte salted hashes of (signature hash, signature, public key).
+ * Each entry may live in either of two buckets of four slots, both chosen by
+ * the salted hash, so an attacker cannot aim entries at one bucket. A full
+ * insert overwrites a random candidate slot.
+ *
+ * There is no global lock. Every slot carries a sequence number that is odd
+ * while a writer owns it: readers treat a slot that changed under them as a
+ * miss, and writers skip slots that another writer holds.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int SLOTS_PER_BUCKET = 4;
+
+    /** Cache of at most nBytes; 0 disables it */
+    explicit CSignatureCache(size_t nBytes);
+    ~CSignatureCache();
+
+    /** Salted hash identifying a signature check */
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+
+    bool Get(const uint256& entry) const;
+    void Set(const uint256& entry);
+
+    /** Bytes taken by each slot */
+    static size_t SlotBytes();
+
+    /** Number of slots, 0 if the cache is disabled */
+    size_t Size() const { return nBuckets * SLOTS_PER_BUCKET; }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint32_t> nSequence;
+        std::atomic<uint64_t> vWord[4];
+    };
+
+    Slot* vSlot;
+    size_t nBuckets;
+    uint256 nonce;
+
+    CSignatureCache(const CSignatureCache&);
+    CSignatureCache& operator=(const CSignatureCache&);
+
+    void GetBuckets(const uint256& entry, size_t vBucket[2]) const;
+    bool Matches(const Slot& slot, const uint64_t vWord[4]) const;
+    bool IsEmpty(const Slot& slot) const;
+    bool TryWrite(Slot& slot, const uint64_t vWord[4], bool fOnlyIfEmpty);
+};
+
+#endif // BITMARK_SIGCACHE_H
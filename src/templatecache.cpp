@@ -0,0 +1,123 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "templatecache.h"
+
+#include "main.h"
+#include "miner.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+CBlockTemplateCache* ptemplateCache = NULL;
+
+CBlockTemplateCache::CBlockTemplateCache() :
+    pindexTip(NULL), fActive(false), fStopped(false), fInitialDownload(true), nLastAlgo(0)
+{
+}
+
+void CBlockTemplateCache::NotifyTip(CBlockIndex* pindexNew)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    pindexTip = pindexNew;
+    condBuild.notify_one();
+}
+
+bool CBlockTemplateCache::NeedsBuild(const Entry& entry, unsigned int nTransactionsUpdated, int64_t nNow) const
+{
+    if (entry.pindexPrev != pindexTip)
+        return true;
+    // Also retries a template that failed to build
+    return entry.nTransactionsUpdated != nTransactionsUpdated && nNow - entry.nTime >= TEMPLATE_REFRESH_SECONDS;
+}
+
+void CBlockTemplateCache::Build(int algo, unsigned int nTransactionsUpdated)
+{
+    CScript scriptDummy = CScript() << OP_TRUE;
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    CBlockIndex* pindexPrev;
+    int64_t nStart = GetTimeMicros();
+    {
+        LOCK(cs_main);
+        pindexPrev = chainActive.Tip();
+        try {
+            ptemplate.reset(CreateNewBlock(scriptDummy, algo));
+        } catch (std::exception& e) {
+            LogPrintf("CBlockTemplateCache : %s\n", e.what());
+        }
+
+        // Stored before cs_main is released, so that a NotifyTip for a newer
+        // tip, which holds cs_main too, cannot come in between
+        boost::unique_lock<boost::mutex> lock(mutex);
+        pindexTip = pindexPrev;
+        Entry& entry = vEntry[algo];
+        entry.ptemplate = ptemplate;
+        entry.pindexPrev = pindexPrev;
+        entry.nTransactionsUpdated = nTransactionsUpdated;
+        entry.nTime = GetTime();
+        condReady.notify_all();
+    }
+    if (fBenchmark)
+        LogPrintf("- Template for %s at height %d: %.2fms\n", GetAlgoName(algo), pindexPrev->nHeight + 1,
+                  (GetTimeMicros() - nStart) * 0.001);
+}
+
+void CBlockTemplateCache::Thread()
+{
+    RenameThread("bitmark-templates");
+    try {
+        while (true) {
+            bool fIBD = ::IsInitialBlockDownload();
+            unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            int nAlgo = -1;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fInitialDownload = fIBD;
+                if (fActive && pindexTip) {
+                    int64_t nNow = GetTime();
+                    for (int i = 0; i < NUM_ALGOS && nAlgo < 0; i++) {
+                        int algo = (nLastAlgo + i) % NUM_ALGOS;
+                        if (NeedsBuild(vEntry[algo], nTransactionsUpdated, nNow))
+                            nAlgo = algo;
+                    }
+                }
+                if (nAlgo < 0) {
+                    condBuild.timed_wait(lock, boost::posix_time::seconds(1));
+                    continue;
+                }
+            }
+            boost::this_thread::interruption_point();
+            Build(nAlgo, nTransactionsUpdated);
+        }
+    } catch (...) {
+        // Interrupted or failed, Get() must not wait for it any more
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStopped = true;
+        condReady.notify_all();
+        throw;
+    }
+}
+
+boost::shared_ptr<const CBlockTemplate> CBlockTemplateCache::Get(int algo, CBlockIndex*& pindexPrevRet)
+{
+    algo = GetPoWAlgo(algo).nId;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fActive = true;
+    nLastAlgo = algo;
+    const Entry& entry = vEntry[algo];
+    while (entry.pindexPrev != pindexTip) {
+        if (fStopped)
+            return boost::shared_ptr<const CBlockTemplate>();
+        condBuild.notify_one();
+        condReady.wait(lock);
+    }
+    pindexPrevRet = entry.pindexPrev;
+    return entry.ptemplate;
+}
+
+bool CBlockTemplateCache::IsInitialBlockDownload()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fInitialDownload;
+}
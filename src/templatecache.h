@@ -0,0 +1,83 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_TEMPLATECACHE_H
+#define BITMARK_TEMPLATECACHE_H
+
+#include "powalgo.h"
+
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+struct CBlockTemplate;
+
+/** Seconds a template is kept after the memory pool changed */
+static const int64_t TEMPLATE_REFRESH_SECONDS = 5;
+
+/**
+ * Block templates for every mining algorithm on the current tip, shared by
+ * getblocktemplate, getwork and getauxblock.
+ *
+ * A builder thread makes them ahead of the miners: for every algorithm as
+ * soon as UpdateTip reports a new tip, starting with the one asked for last,
+ * and again once the memory pool has changed and a template is more than
+ * TEMPLATE_REFRESH_SECONDS old. It stays idle until a template is first asked
+ * for, so a node that does not mine does not build any.
+ *
+ * Templates pay to OP_TRUE; callers that pay to a key copy them. Get never
+ * takes cs_main: it returns what the builder made for the tip, waiting for
+ * the builder only if that is not done yet.
+ */
+class CBlockTemplateCache
+{
+public:
+    CBlockTemplateCache();
+
+    /** Builder thread; runs until interrupted */
+    void Thread();
+
+    /** The active chain has a new tip; called with cs_main held */
+    void NotifyTip(CBlockIndex* pindexNew);
+
+    /** Template for algo on the tip, or NULL if it could not be built;
+        pindexPrevRet is set to the block it builds on */
+    boost::shared_ptr<const CBlockTemplate> Get(int algo, CBlockIndex*& pindexPrevRet);
+
+    /** IsInitialBlockDownload() as the builder last saw it, at most a second ago */
+    bool IsInitialBlockDownload();
+
+private:
+    struct Entry
+    {
+        boost::shared_ptr<const CBlockTemplate> ptemplate;
+        CBlockIndex* pindexPrev;
+        unsigned int nTransactionsUpdated;
+        int64_t nTime;
+
+        Entry() : pindexPrev(NULL), nTransactionsUpdated(0), nTime(0) { }
+    };
+
+    boost::mutex mutex;
+    // wakes the builder
+    boost::condition_variable condBuild;
+    // signalled when a template is made, or the builder stopped
+    boost::condition_variable condReady;
+    CBlockIndex* pindexTip;
+    bool fActive;
+    bool fStopped;
+    bool fInitialDownload;
+    int nLastAlgo;
+    Entry vEntry[NUM_ALGOS];
+
+    bool NeedsBuild(const Entry& entry, unsigned int nTransactionsUpdated, int64_t nNow) const;
+    void Build(int algo, unsigned int nTransactionsUpdated);
+};
+
+extern CBlockTemplateCache* ptemplateCache;
+
+#endif // BITMARK_TEMPLATECACHE_H
@@ -0,0 +1,155 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "bignum.h"
+#include "core.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(arith_uint256_tests)
+
+static CBigNum ToBn(const arith_uint256& a)
+{
+    return CBigNum(ArithToUint256(a));
+}
+
+// 320 bit values are compared through their low and high parts
+static CBigNum ToBn(const arith_uint320& a)
+{
+    return (ToBn(arith_uint256(a >> 256)) << 256) + ToBn(arith_uint256(a));
+}
+
+static uint256 RandUint256()
+{
+    uint256 r;
+    for (unsigned int i = 0; i < 8; i++)
+        ((uint32_t*)r.begin())[i] = insecure_rand();
+    return r;
+}
+
+BOOST_AUTO_TEST_CASE(arith_conversions)
+{
+    for (int i = 0; i < 100; i++) {
+        uint256 r = RandUint256();
+        BOOST_CHECK(ArithToUint256(UintToArith256(r)) == r);
+        BOOST_CHECK(ToBn(UintToArith256(r)) == CBigNum(r));
+        arith_uint320 wide(UintToArith256(r));
+        BOOST_CHECK(arith_uint256(wide) == UintToArith256(r));
+        BOOST_CHECK(arith_uint256(wide << 64) == UintToArith256(r) << 64);
+        BOOST_CHECK((wide << 64) >> 64 == wide);
+    }
+    BOOST_CHECK(arith_uint256(0x1234567890abcdefULL).GetLow64() == 0x1234567890abcdefULL);
+    BOOST_CHECK(arith_uint256(0x1234567890abcdefULL).GetLow64Saturated() == 0x1234567890abcdefULL);
+    BOOST_CHECK((arith_uint256(1) << 64).GetLow64Saturated() == (CBigNum(1) << 64).getulong());
+    BOOST_CHECK((arith_uint256(1) << 64).GetLow64() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(arith_compact)
+{
+    unsigned int vCompact[] = { 0, 0x00123456, 0x01003456, 0x02000056, 0x03000000, 0x04000000,
+                                0x00923456, 0x01803456, 0x02800056, 0x03800000, 0x04800000,
+                                0x01123456, 0x02123456, 0x03123456, 0x04123456, 0x05009234,
+                                0x20123456, 0x1d00ffff, 0x1e0fffff, 0x207fffff, 0x1c0ffff0,
+                                0x21007fff, 0x2100ffff, 0x22000123 };
+    for (unsigned int i = 0; i < sizeof(vCompact)/sizeof(vCompact[0]); i++) {
+        CBigNum bn;
+        bn.SetCompact(vCompact[i]);
+        bool fNegative, fOverflow;
+        arith_uint320 a;
+        a.SetCompact(vCompact[i], &fNegative, &fOverflow);
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        if (fNegative)
+            continue;
+        // every target in the compact range used here fits in 320 bits
+        BOOST_CHECK(!fOverflow);
+        BOOST_CHECK(ToBn(a) == bn);
+        BOOST_CHECK_EQUAL(a.GetCompact(), bn.GetCompact());
+
+        arith_uint256 b;
+        b.SetCompact(vCompact[i], NULL, &fOverflow);
+        BOOST_CHECK_EQUAL(fOverflow, bn >= (CBigNum(1) << 256));
+        if (!fOverflow)
+            BOOST_CHECK(ToBn(b) == bn);
+    }
+    // random targets round-trip like CBigNum does
+    for (int i = 0; i < 1000; i++) {
+        unsigned int nBits = ((3 + insecure_rand() % 30) << 24) | (insecure_rand() & 0x007fffff);
+        CBigNum bn;
+        bn.SetCompact(nBits);
+        arith_uint256 a;
+        a.SetCompact(nBits);
+        BOOST_CHECK(ToBn(a) == bn);
+        BOOST_CHECK_EQUAL(a.GetCompact(), bn.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_muldiv)
+{
+    for (int i = 0; i < 200; i++) {
+        arith_uint256 a = UintToArith256(RandUint256()) >> (insecure_rand() % 256);
+        arith_uint256 b = UintToArith256(RandUint256()) >> (insecure_rand() % 256);
+        uint32_t m = insecure_rand();
+        CBigNum bnA = ToBn(a), bnB = ToBn(b);
+        CBigNum bnMod = CBigNum(1) << 320;
+        arith_uint320 wa(a), wb(b);
+        BOOST_CHECK(ToBn(wa + wb) == bnA + bnB);
+        BOOST_CHECK(ToBn(wa * m) == bnA * CBigNum(m));
+        BOOST_CHECK(ToBn(wa * wb) == (bnA * bnB) % bnMod);
+        if (b != 0) {
+            BOOST_CHECK(ToBn(a / b) == bnA / bnB);
+            BOOST_CHECK(ToBn(wa / wb) == bnA / bnB);
+        }
+        if (a >= b)
+            BOOST_CHECK(ToBn(a - b) == bnA - bnB);
+    }
+    BOOST_CHECK(arith_uint256(5) / arith_uint256(0) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(arith_block_work)
+{
+    // work for the hardest and easiest targets of every algo and network limit matches CBigNum
+    unsigned int vBits[] = { 0x1c0ffff0, 0x1d00ffff, 0x1e0fffff, 0x1f00ffff, 0x207fffff, 0x2100ffff, 0x03000001, 0x1b0404cb };
+    for (unsigned int i = 0; i < sizeof(vBits)/sizeof(vBits[0]); i++) {
+        for (int algo = 0; algo < NUM_ALGOS; algo++) {
+            CBlockIndex index;
+            index.nVersion = 4 | (algo << 9);
+            index.nBits = vBits[i];
+            CBigNum bnTarget;
+            bnTarget.SetCompact(vBits[i]);
+            CBigNum weight(GetAlgoWeight(algo));
+            CBigNum bnWork = (CBigNum(1)<<256) / (bnTarget/weight+1);
+            BOOST_CHECK(ToBn(index.GetBlockWork()) == bnWork);
+        }
+    }
+    CBlockIndex index;
+    index.nBits = 0x04923456; // negative
+    BOOST_CHECK(index.GetBlockWork() == 0);
+    index.nBits = 0;
+    BOOST_CHECK(index.GetBlockWork() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(arith_retarget_average)
+{
+    // the running average used by DarkGravityWave, with weighted testnet size targets
+    arith_uint320 avg;
+    CBigNum bnAvg;
+    for (int64_t n = 1; n <= 25; n++) {
+        unsigned int nBits = 0x2000ffff - (insecure_rand() % 0x8000);
+        arith_uint320 target = arith_uint320().SetCompact(nBits) * 8000000;
+        CBigNum bnTarget = CBigNum().SetCompact(nBits) * 8000000;
+        if (n == 1) {
+            avg = target;
+            bnAvg = bnTarget;
+        } else {
+            avg = ((avg * arith_uint320(n-1)) + target) / arith_uint320(n);
+            bnAvg = ((bnAvg * (n-1)) + bnTarget) / n;
+        }
+        BOOST_CHECK(ToBn(avg) == bnAvg);
+        BOOST_CHECK_EQUAL(avg.GetCompact(), bnAvg.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
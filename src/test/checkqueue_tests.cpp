@@ -0,0 +1,125 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+static const int NUM_WORKERS = 4;
+
+// Counts how often it ran, and fails if told to
+class CCountingCheck
+{
+private:
+    std::atomic<int> *pnRun;
+    bool fOk;
+
+public:
+    CCountingCheck() : pnRun(NULL), fOk(true) {}
+    CCountingCheck(std::atomic<int> *pnRunIn, bool fOkIn) : pnRun(pnRunIn), fOk(fOkIn) {}
+
+    bool operator()() {
+        (*pnRun)++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck &check) {
+        std::swap(pnRun, check.pnRun);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < NUM_WORKERS - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    // blocks of growing size, added one transaction at a time
+    for (int nChecks = 0; nChecks < 5000; nChecks = nChecks * 3 + 1) {
+        std::atomic<int> nRun(0);
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (int nAdded = 0; nAdded < nChecks; ) {
+            std::vector<CCountingCheck> vChecks;
+            for (int i = 0; i < 1 + nAdded % 7 && nAdded < nChecks; i++, nAdded++)
+                vChecks.push_back(CCountingCheck(&nRun, true));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRun.load(), nChecks);
+
+        CCheckQueueStats stats;
+        BOOST_CHECK(control.GetStats(stats));
+        BOOST_CHECK_EQUAL(stats.nChecks, (unsigned int)nChecks);
+        unsigned int nWorkerChecks = 0;
+        BOOST_FOREACH(const CCheckQueueWorkerStats &worker, stats.vWorker) {
+            nWorkerChecks += worker.nChecks;
+            BOOST_CHECK(worker.nBusyMicros <= stats.nWallMicros);
+        }
+        BOOST_CHECK_EQUAL(nWorkerChecks, (unsigned int)nChecks);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < NUM_WORKERS - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    for (int nFail = 0; nFail < 1000; nFail += 97) {
+        std::atomic<int> nRun(0);
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks;
+        for (int i = 0; i < 1000; i++)
+            vChecks.push_back(CCountingCheck(&nRun, i != nFail));
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+        // checks after the failure may be skipped, never repeated
+        BOOST_CHECK(nRun.load() <= 1000);
+    }
+
+    // the failure does not leak into the next block
+    {
+        std::atomic<int> nRun(0);
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100, CCountingCheck(&nRun, true));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRun.load(), 100);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_master_only)
+{
+    // without worker threads the master runs everything in Wait
+    CCheckQueue<CCountingCheck> queue(16);
+    std::atomic<int> nRun(0);
+    CCheckQueueControl<CCountingCheck> control(&queue);
+    std::vector<CCountingCheck> vChecks(500, CCountingCheck(&nRun, true));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nRun.load(), 500);
+
+    CCheckQueueStats stats;
+    BOOST_CHECK(control.GetStats(stats));
+    BOOST_CHECK_EQUAL(stats.vWorker.size(), 1U);
+    BOOST_CHECK_EQUAL(stats.vWorker[0].nChecks, 500U);
+    BOOST_CHECK_EQUAL(stats.vWorker[0].nSteals, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,179 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+
+#include "util.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+
+// In memory backend that records what reaches it
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> map;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : nWrites(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) {
+        std::map<uint256, CCoins>::iterator it = map.find(txid);
+        if (it == map.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid) {
+        return map.count(txid) > 0;
+    }
+
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            nWrites++;
+            if (it->second.coins.IsPruned())
+                map.erase(it->first);
+            else
+                map[it->first] = it->second.coins;
+        }
+        return true;
+    }
+};
+
+CCoins RandomCoins(unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nHeight = GetRand(1000);
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = 1 + GetRand(COIN);
+        coins.vout[i].scriptPubKey = CScript() << OP_TRUE << std::vector<unsigned char>(GetRand(64), 1);
+    }
+    return coins;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+// Random modifications through a stack of caches, flushed at random, must
+// match a plain map of the expected state at every level.
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 200; i++)
+        vTxid.push_back(GetRandHash());
+
+    CCoinsViewTest base;
+    std::map<uint256, CCoins> mapExpected;
+    std::vector<CCoinsViewCache*> vStack;
+    vStack.push_back(new CCoinsViewCache(base));
+
+    for (int nStep = 0; nStep < 20000; nStep++) {
+        const uint256 &txid = vTxid[GetRand(vTxid.size())];
+        CCoinsViewCache &top = *vStack.back();
+        int nAction = GetRand(10);
+        if (nAction < 4) {
+            // spend an output, or replace a spent transaction
+            CCoinsModifier coins = top.ModifyCoins(txid);
+            if (coins->IsPruned()) {
+                *coins = RandomCoins(1 + GetRand(4));
+            } else {
+                unsigned int n = GetRand(coins->vout.size());
+                coins->Spend(n);
+            }
+            CCoins result = *coins;
+            result.Cleanup();
+            if (result.IsPruned())
+                mapExpected.erase(txid);
+            else
+                mapExpected[txid] = result;
+        } else if (nAction < 8) {
+            const CCoins* coins = top.AccessCoins(txid);
+            std::map<uint256, CCoins>::iterator it = mapExpected.find(txid);
+            if (it == mapExpected.end())
+                BOOST_CHECK(!coins || coins->IsPruned());
+            else
+                BOOST_CHECK(coins && *coins == it->second);
+            BOOST_CHECK_EQUAL(top.HaveCoins(txid), it != mapExpected.end());
+        } else if (nAction == 8 && vStack.size() < 4) {
+            vStack.push_back(new CCoinsViewCache(top, true));
+        } else if (nAction == 9) {
+            BOOST_CHECK(top.Flush());
+            BOOST_CHECK_EQUAL(top.GetCacheSize(), 0U);
+            if (vStack.size() > 1) {
+                delete vStack.back();
+                vStack.pop_back();
+            }
+        }
+    }
+
+    while (!vStack.empty()) {
+        BOOST_CHECK(vStack.back()->Flush());
+        delete vStack.back();
+        vStack.pop_back();
+    }
+    BOOST_CHECK(base.map == mapExpected);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_flags)
+{
+    CCoinsViewTest base;
+    uint256 txidOld = GetRandHash(), txidRead = GetRandHash(), txidNew = GetRandHash();
+    base.map[txidOld] = RandomCoins(2);
+    base.map[txidRead] = RandomCoins(2);
+
+    CCoinsViewCache cache(base);
+    // read only: nothing to write back
+    BOOST_CHECK(cache.AccessCoins(txidRead) != NULL);
+    // spent in part
+    cache.ModifyCoins(txidOld)->Spend(0);
+    // created and entirely spent without the base ever knowing about it
+    *cache.ModifyCoins(txidNew) = RandomCoins(1);
+    BOOST_CHECK(cache.HaveCoins(txidNew));
+    cache.ModifyCoins(txidNew)->Spend(0);
+    BOOST_CHECK(!cache.HaveCoins(txidNew));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+    BOOST_CHECK(!base.map[txidOld].IsAvailable(0));
+    BOOST_CHECK(base.map[txidOld].IsAvailable(1));
+    BOOST_CHECK(!base.map.count(txidNew));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_memory_usage)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(base);
+    size_t nEmpty = cache.DynamicMemoryUsage();
+
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 1000; i++) {
+        vTxid.push_back(GetRandHash());
+        *cache.ModifyCoins(vTxid.back()) = RandomCoins(10);
+    }
+    size_t nFull = cache.DynamicMemoryUsage();
+    // at least the outputs themselves
+    BOOST_CHECK(nFull > nEmpty + 1000 * 10 * sizeof(CTxOut));
+
+    // spending shrinks it, and spending everything of fresh coins empties it
+    for (int i = 0; i < 1000; i++)
+        for (int j = 0; j < 10; j++)
+            cache.ModifyCoins(vTxid[i])->Spend(j);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nFull / 4);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,136 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "main.h"
+#include "pow.h"
+#include "txdb.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+static CTransaction SpendingTx(const std::vector<COutPoint> &vPrevout)
+{
+    CTransaction tx;
+    BOOST_FOREACH(const COutPoint &prevout, vPrevout) {
+        tx.vin.push_back(CTxIn(prevout));
+        tx.vin.back().scriptSig << OP_TRUE;
+    }
+    tx.vout.resize(2);
+    tx.vout[0].nValue = tx.vout[1].nValue = COIN;
+    tx.vout[0].scriptPubKey = tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static void WriteCoins(CCoinsViewDB &db, const uint256 &txid, const CCoins &coins)
+{
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry &entry = mapCoins[txid];
+    entry.coins = coins;
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(db.BatchWrite(mapCoins, 0));
+}
+
+struct PrefetchSetup {
+    CCoinsViewDB db;
+    CCoinsPrefetcher prefetcher;
+    boost::thread_group threadGroup;
+    CTransaction txPrev1, txPrev2;
+    CBlock block;
+    CDiskBlockPos pos;
+
+    PrefetchSetup() : db(1 << 20, true), prefetcher(db), pos(99999, 0) {
+        txPrev1 = SpendingTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)));
+        txPrev2 = SpendingTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)));
+        WriteCoins(db, txPrev1.GetHash(), CCoins(txPrev1, 1));
+        WriteCoins(db, txPrev2.GetHash(), CCoins(txPrev2, 1));
+
+        // a coinbase, a transaction spending both, and one spending that one
+        block.vtx.push_back(SpendingTx(std::vector<COutPoint>(1, COutPoint())));
+        std::vector<COutPoint> vPrevout;
+        vPrevout.push_back(COutPoint(txPrev1.GetHash(), 0));
+        vPrevout.push_back(COutPoint(txPrev2.GetHash(), 1));
+        vPrevout.push_back(COutPoint(txPrev1.GetHash(), 1));
+        block.vtx.push_back(SpendingTx(vPrevout));
+        block.vtx.push_back(SpendingTx(std::vector<COutPoint>(1, COutPoint(block.vtx[1].GetHash(), 0))));
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        // the proof of work of a stored block was checked when it arrived
+        SetPoWVerified(GetPoWCacheKey(block));
+        BOOST_CHECK(WriteBlockToDisk(block, pos));
+
+        for (int i = 0; i < 2; i++)
+            threadGroup.create_thread(boost::bind(&CCoinsPrefetcher::Thread, &prefetcher));
+    }
+
+    ~PrefetchSetup() {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(coinsprefetch_tests, PrefetchSetup)
+
+BOOST_AUTO_TEST_CASE(prefetch_warms_cache)
+{
+    CCoinsViewCache cache(db);
+    BOOST_CHECK_EQUAL(prefetcher.Apply(block.GetHash(), cache), 0U);
+
+    prefetcher.Prefetch(block.GetHash(), pos);
+    // let the readers finish, Apply drops what they did not start
+    MilliSleep(200);
+    BOOST_CHECK_EQUAL(prefetcher.Apply(block.GetHash(), cache), 2U);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+    BOOST_CHECK(*cache.AccessCoins(txPrev1.GetHash()) == CCoins(txPrev1, 1));
+    BOOST_CHECK(*cache.AccessCoins(txPrev2.GetHash()) == CCoins(txPrev2, 1));
+    // applied once only
+    BOOST_CHECK_EQUAL(prefetcher.Apply(block.GetHash(), cache), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(prefetch_keeps_cached_coins)
+{
+    CCoinsViewCache cache(db);
+    CCoins coins(txPrev1, 1);
+    coins.Spend(0);
+    BOOST_CHECK(cache.SetCoins(txPrev1.GetHash(), coins));
+
+    prefetcher.Prefetch(block.GetHash(), pos);
+    MilliSleep(200);
+    BOOST_CHECK(prefetcher.Apply(block.GetHash(), cache) <= 1U);
+    BOOST_CHECK(*cache.AccessCoins(txPrev1.GetHash()) == coins);
+    BOOST_CHECK(*cache.AccessCoins(txPrev2.GetHash()) == CCoins(txPrev2, 1));
+}
+
+BOOST_AUTO_TEST_CASE(prefetch_drops_stale_coins)
+{
+    for (int i = 0; i < 20; i++) {
+        CCoinsViewCache cache(db);
+        prefetcher.Prefetch(block.GetHash(), pos);
+        // written while, or after, the readers look them up
+        MilliSleep(i % 4);
+        CCoins coins(txPrev1, 1);
+        coins.nHeight = 2 + i;
+        WriteCoins(db, txPrev1.GetHash(), coins);
+        prefetcher.Apply(block.GetHash(), cache);
+
+        CCoins coinsDB;
+        BOOST_CHECK(db.GetCoins(txPrev1.GetHash(), coinsDB));
+        BOOST_CHECK(*cache.AccessCoins(txPrev1.GetHash()) == coinsDB);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prefetch_evicts_unapplied_blocks)
+{
+    // blocks that are never applied make room once their reads are done
+    for (int i = 0; i < 10; i++)
+        prefetcher.Prefetch(GetRandHash(), pos);
+    MilliSleep(200);
+    CCoinsViewCache cache(db);
+    prefetcher.Prefetch(block.GetHash(), pos);
+    MilliSleep(200);
+    BOOST_CHECK_EQUAL(prefetcher.Apply(block.GetHash(), cache), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,11 +4,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "multibuffer.h"
+#include "scrypt.h"
 #include "util.h"
 
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -47,4 +51,124 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+static void HashX17Range(const vector<vector<char> >* pvData, vector<uint256>* pvHash, int nRounds)
+{
+    for (int n = 0; n < nRounds; n++)
+        for (unsigned int i = 0; i < pvData->size(); i++)
+            (*pvHash)[i] = hash_x17(&(*pvData)[i][0], &(*pvData)[i][0] + (*pvData)[i].size());
+}
+
+BOOST_AUTO_TEST_CASE(x17)
+{
+    char data[80];
+    for (int i = 0; i < 80; i++)
+        data[i] = i;
+    BOOST_CHECK_EQUAL(hash_x17(data, data).GetHex(), "537920b6f5354b10a5adb27c070d38058b1bdce070de338cf5034d7c3f0c3696");
+    BOOST_CHECK_EQUAL(hash_x17(data, data + 80).GetHex(), "46d6e98b38cf958524d425e39ddc2477c05dd22720fd97422797620d81096835");
+
+    // hashing from several threads at once gives the same results as hashing serially
+    vector<vector<char> > vData(64, vector<char>(80));
+    for (unsigned int i = 0; i < vData.size(); i++)
+        for (int j = 0; j < 80; j++)
+            vData[i][j] = insecure_rand();
+    vector<uint256> vExpected(vData.size());
+    HashX17Range(&vData, &vExpected, 1);
+
+    const int nThreads = 4;
+    vector<vector<uint256> > vResults(nThreads, vector<uint256>(vData.size()));
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&HashX17Range, &vData, &vResults[i], 10));
+    threads.join_all();
+    for (int i = 0; i < nThreads; i++)
+        BOOST_CHECK(vResults[i] == vExpected);
+}
+
+static void HashCryptoNight(const char* pdata, uint256* phash)
+{
+    CCryptoNightContext ctx;
+    hash_cryptonight(pdata, BEGIN(*phash), 80, ctx);
+}
+
+BOOST_AUTO_TEST_CASE(cryptonight)
+{
+    char data[80], data2[80];
+    for (int i = 0; i < 80; i++) {
+        data[i] = i;
+        data2[i] = 0xff - i;
+    }
+    uint256 hash;
+    hash_cryptonight(data, BEGIN(hash), 80);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "35f71644b1d40e1e5b068504c1861bb0e5e0585b4920855463795fe909b18bf9");
+
+    // one context can be reused for any number of hashes
+    CCryptoNightContext ctx;
+    hash_cryptonight(data2, BEGIN(hash), 80, ctx);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "46b494577429124cb0292ad9e7454667b47517f7203927228e2ac7f706207dc5");
+    hash_cryptonight(data, BEGIN(hash), 80, ctx);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "35f71644b1d40e1e5b068504c1861bb0e5e0585b4920855463795fe909b18bf9");
+
+    // a released scratchpad is handed to the next context instead of a new one
+    unsigned char *pScratchpad;
+    {
+        CCryptoNightContext ctx2;
+        pScratchpad = ctx2.Scratchpad();
+        BOOST_CHECK(pScratchpad != ctx.Scratchpad());
+    }
+    CCryptoNightContext ctx3;
+    BOOST_CHECK(ctx3.Scratchpad() == pScratchpad);
+
+    // concurrent contexts each get their own scratchpad
+    const int nThreads = 3;
+    vector<uint256> vHash(nThreads);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&HashCryptoNight, (i & 1) ? data2 : data, &vHash[i]));
+    threads.join_all();
+    for (int i = 0; i < nThreads; i++)
+        BOOST_CHECK_EQUAL(vHash[i].GetHex(), (i & 1) ? "46b494577429124cb0292ad9e7454667b47517f7203927228e2ac7f706207dc5" : "35f71644b1d40e1e5b068504c1861bb0e5e0585b4920855463795fe909b18bf9");
+}
+
+BOOST_AUTO_TEST_CASE(multibuffer)
+{
+    // every lane width gives the scalar results, including partly filled passes
+    const unsigned int nMax = 9;
+    unsigned char vData[nMax][80];
+    for (unsigned int i = 0; i < nMax; i++)
+        for (int j = 0; j < 80; j++)
+            vData[i][j] = insecure_rand();
+    uint256 vSHA256D[nMax], vScrypt[nMax];
+    for (unsigned int i = 0; i < nMax; i++) {
+        vSHA256D[i] = Hash(vData[i], vData[i] + 80);
+        scrypt_1024_1_1_256((const char*)vData[i], BEGIN(vScrypt[i]));
+    }
+
+    const unsigned char* vpData[nMax];
+    for (unsigned int i = 0; i < nMax; i++)
+        vpData[i] = vData[i];
+    unsigned int nLanes = multibuffer_lanes();
+    const unsigned int vLanes[] = { 1, 4, 8 };
+    for (unsigned int l = 0; l < sizeof(vLanes) / sizeof(vLanes[0]); l++) {
+        if (multibuffer_set_lanes(vLanes[l]) != vLanes[l])
+            continue;
+        for (unsigned int n = 1; n <= nMax; n++) {
+            uint256 vHash[nMax];
+            unsigned char* vpHash[nMax];
+            for (unsigned int i = 0; i < nMax; i++)
+                vpHash[i] = vHash[i].begin();
+
+            sha256d_80_multi(vpData, vpHash, n);
+            for (unsigned int i = 0; i < nMax; i++)
+                BOOST_CHECK(vHash[i] == (i < n ? vSHA256D[i] : uint256(0)));
+
+            for (unsigned int i = 0; i < nMax; i++)
+                vHash[i] = 0;
+            scrypt_1024_1_1_256_multi((const char* const*)vpData, (char* const*)vpHash, n);
+            for (unsigned int i = 0; i < nMax; i++)
+                BOOST_CHECK(vHash[i] == (i < n ? vScrypt[i] : uint256(0)));
+        }
+    }
+    multibuffer_set_lanes(nLanes);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "bignum.h"
 #include "core.h"
+#include "chainparams.h"
 #include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "txdb.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -25,4 +30,305 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
   */
 }
 
+BOOST_AUTO_TEST_CASE(pprev_algo_links_test)
+{
+    // Two identical chains: one with algo links built, one that falls back to walking pprev
+    const int nBlocks = 800;
+    std::vector<uint256> vHash(nBlocks);
+    std::vector<CBlockIndex> vLinked(nBlocks);
+    std::vector<CBlockIndex> vWalked(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        // pre-fork blocks, then multi algo blocks with a dip in the version share that takes the chain off the fork for a while
+        int nVersion = 2;
+        if (i >= 300 && (i < 500 || i >= 560))
+            nVersion = 4 | ((insecure_rand() % NUM_ALGOS) << 9);
+        vHash[i] = i;
+        for (int j = 0; j < 2; j++) {
+            CBlockIndex& index = j ? vWalked[i] : vLinked[i];
+            index.phashBlock = &vHash[i];
+            index.pprev = i ? (j ? &vWalked[i-1] : &vLinked[i-1]) : NULL;
+            index.nHeight = i;
+            index.nVersion = nVersion;
+        }
+        vLinked[i].BuildAlgoLinks();
+        BOOST_CHECK(vLinked[i].fAlgoLinks);
+    }
+
+    int nOnFork = 0;
+    for (int i = 0; i < nBlocks; i++) {
+        BOOST_CHECK_EQUAL(vLinked[i].onFork(), vWalked[i].onFork());
+        if (vLinked[i].onFork())
+            nOnFork++;
+        for (int algo = -1; algo < NUM_ALGOS; algo++) {
+            CBlockIndex* pLinked = get_pprev_algo(&vLinked[i], algo);
+            CBlockIndex* pWalked = get_pprev_algo(&vWalked[i], algo);
+            BOOST_CHECK_EQUAL(pLinked ? pLinked->nHeight : -1, pWalked ? pWalked->nHeight : -1);
+        }
+    }
+    BOOST_CHECK(nOnFork > 0 && nOnFork < nBlocks);
+}
+
+// CBlockIndex::GetBlockWork as it was computed with CBigNum
+static CBigNum GetBlockWorkBn(const CBlockIndex* pindex)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(pindex->nBits);
+    if (bnTarget <= 0)
+        return 0;
+    CBigNum weight(GetAlgoWeight(pindex->GetAlgo()));
+    return (CBigNum(1)<<256) / (bnTarget/weight+1);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_aux_test)
+{
+    // an Equihash block's solution is not kept in CBlockIndex, but read back from the block tree db
+    CBlockIndex index;
+    index.nVersion = 4 | BLOCK_VERSION_EQUIHASH;
+    index.nTime = 1405000000;
+    index.nBits = 0x1e0fffff;
+    CBlockIndexAux aux;
+    aux.nNonce256 = 12345;
+    aux.hashReserved = 678;
+    for (int i = 0; i < 1344; i++)
+        aux.nSolution.push_back(insecure_rand());
+    CDiskBlockIndex diskindex(&index, aux);
+    uint256 hash = diskindex.GetBlockHash();
+    index.phashBlock = &hash;
+    BOOST_CHECK(pblocktree->WriteBlockIndex(diskindex));
+
+    for (int i = 0; i < 2; i++) {
+        // the first lookup goes to the db, the second is served from the cache
+        CBlockIndexAux auxRead;
+        BOOST_CHECK(GetBlockIndexAux(&index, auxRead));
+        BOOST_CHECK(auxRead.nNonce256 == aux.nNonce256);
+        BOOST_CHECK(auxRead.hashReserved == aux.hashReserved);
+        BOOST_CHECK(auxRead.nSolution == aux.nSolution);
+        BOOST_CHECK(CDiskBlockIndex(&index, auxRead).GetBlockHash() == hash);
+    }
+
+    uint256 hashUnknown = 1;
+    index.phashBlock = &hashUnknown;
+    CBlockIndexAux auxRead;
+    BOOST_CHECK(!GetBlockIndexAux(&index, auxRead));
+}
+
+BOOST_AUTO_TEST_CASE(pow_cache_test)
+{
+    CBlock genesis = Params().GenesisBlock();
+    CBlock bad = genesis;
+    bad.nNonce++;
+    uint256 key = GetPoWCacheKey(genesis);
+    uint256 keyBad = GetPoWCacheKey(bad);
+    BOOST_CHECK(key != 0 && key != keyBad);
+
+    // an auxpow version without an auxpow cannot be cached
+    CBlockHeader header = genesis.GetBlockHeader();
+    header.nVersion |= BLOCK_VERSION_AUXPOW;
+    BOOST_CHECK(GetPoWCacheKey(header) == 0);
+    BOOST_CHECK(!IsPoWVerified(0));
+
+    std::vector<const CBlockHeader*> vpblock;
+    vpblock.push_back(&genesis);
+    vpblock.push_back(&bad);
+    PreVerifyBlockPoW(vpblock);
+    BOOST_CHECK(IsPoWVerified(key));
+    BOOST_CHECK(!IsPoWVerified(keyBad));
+
+    CValidationState state;
+    BOOST_CHECK(CheckBlockHeaderPoW(genesis, state));
+    BOOST_CHECK(!CheckBlockHeaderPoW(bad, state));
+}
+
+BOOST_AUTO_TEST_CASE(powalgo_registry_test)
+{
+    CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    header.nVersion = 4 | BLOCK_VERSION_AUXPOW;
+    for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        const CPoWAlgo& desc = GetPoWAlgo(algo);
+        BOOST_CHECK_EQUAL(desc.nId, algo);
+        BOOST_CHECK_EQUAL(GetAlgo(header.nVersion | desc.nVersionBits), algo);
+        CBlockHeader withAlgo = header;
+        withAlgo.SetAlgo(algo);
+        BOOST_CHECK_EQUAL(withAlgo.GetAlgo(), algo);
+        BOOST_CHECK_EQUAL(std::string(GetAlgoName(algo)), std::string(desc.pszName));
+        BOOST_CHECK_EQUAL(GetAlgoWeight(algo), desc.nWeight);
+    }
+    BOOST_CHECK_EQUAL(GetAlgoWeight(ALGO_SHA256D), 1U);
+    BOOST_CHECK_EQUAL(GetAlgoWeight(ALGO_ARGON2), 4000000U);
+    BOOST_CHECK(GetPoWAlgo(ALGO_LYRA2REv2).fMemoryHard);
+    BOOST_CHECK(!GetPoWAlgo(ALGO_SHA256D).fMemoryHard);
+    BOOST_CHECK_EQUAL(std::string(GetAlgoName(NUM_ALGOS)), "SCRYPT");
+    BOOST_CHECK_EQUAL(GetPoWAlgo(-1).nId, ALGO_SCRYPT);
+
+    // registry entries hash exactly like the underlying functions
+    uint256 hash;
+    hash_scrypt(BEGIN(header.nVersion), BEGIN(hash));
+    BOOST_CHECK(header.GetPoWHash(ALGO_SCRYPT) == hash);
+    BOOST_CHECK(header.GetPoWHash(NUM_ALGOS) == hash);
+    BOOST_CHECK(header.GetPoWHash(ALGO_SHA256D) == header.GetHash());
+    BOOST_CHECK(header.GetPoWHash(ALGO_X17) == hash_x17(BEGIN(header.nVersion), END(header.nNonce)));
+    hash_cryptonight(BEGIN(header.nVersion), BEGIN(hash), 80);
+    BOOST_CHECK(header.GetPoWHash(ALGO_CRYPTONIGHT) == hash);
+
+    // batch entry points agree with hashing one header at a time
+    CBlockHeader vHeader[3];
+    const CPureBlockHeader* vpHeader[3];
+    for (int i = 0; i < 3; i++) {
+        vHeader[i] = header;
+        vHeader[i].nNonce += i;
+        vpHeader[i] = &vHeader[i];
+    }
+    for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        uint256 vHash[3];
+        GetPoWAlgo(algo).HashBatch(vpHeader, vHash, 3);
+        for (int i = 0; i < 3; i++)
+            BOOST_CHECK(vHash[i] == vHeader[i].GetPoWHash(algo));
+    }
+}
+
+// get_ssf as it was before SSF windows were cached: rescan every window of every call
+static CBigNum get_ssf_rescan(CBlockIndex* pindex)
+{
+    CBigNum scalingFactor = CBigNum(0);
+    CBlockIndex* pprev_algo = pindex;
+    CBigNum hashes_peak = CBigNum(0);
+    CBigNum hashes_cur = CBigNum(0);
+    for (int i = 0; i < 365; i++) {
+        pprev_algo = get_pprev_algo(pprev_algo, -1);
+        if (!pprev_algo)
+            break;
+        CBigNum hashes = GetBlockWorkBn(pprev_algo);
+        unsigned int time_f = pprev_algo->GetMedianTimePast();
+        unsigned int time_i = 0;
+        for (int j = 0; j < nSSF-1; j++) {
+            pprev_algo = get_pprev_algo(pprev_algo, -1);
+            if (!pprev_algo) {
+                hashes = CBigNum(0);
+                break;
+            }
+            hashes += GetBlockWorkBn(pprev_algo);
+            time_i = pprev_algo->GetMedianTimePast();
+        }
+        CBlockIndex* pprev_algo_time = get_pprev_algo(pprev_algo, -1);
+        if (pprev_algo_time) {
+            time_i = pprev_algo_time->GetMedianTimePast();
+        } else {
+            CBlockIndex* blockindex = pprev_algo;
+            while (blockindex && onFork(blockindex))
+                blockindex = blockindex->pprev;
+            if (blockindex)
+                time_i = blockindex->GetBlockTime();
+        }
+        if (time_f > time_i)
+            time_f -= time_i;
+        else
+            return scalingFactor;
+        hashes = (hashes*100000000)/time_f;
+        if (hashes > hashes_peak)
+            hashes_peak = hashes;
+        if (i == 0)
+            hashes_cur = hashes;
+    }
+    if (hashes_peak > CBigNum(0) && hashes_cur != hashes_peak)
+        scalingFactor = CBigNum(((100000000*hashes_peak)/(hashes_peak-hashes_cur)).getuint());
+    return scalingFactor;
+}
+
+BOOST_AUTO_TEST_CASE(ssf_window_cache_test)
+{
+    const int nBlocks = 3000;
+    std::vector<uint256> vHash(nBlocks);
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    unsigned int nTime = 1405000000;
+    for (int i = 0; i < nBlocks; i++) {
+        CBlockIndex& index = vIndex[i];
+        vHash[i] = uint256(i + 1) << 160;
+        index.phashBlock = &vHash[i];
+        index.pprev = i ? &vIndex[i-1] : NULL;
+        index.nHeight = i;
+        index.nVersion = i < 250 ? 2 : 4 | ((insecure_rand() % NUM_ALGOS) << 9);
+        index.nBits = 0x1c000000 | (0x100000 + insecure_rand() % 0x600000);
+        // mostly increasing times, with the odd step backwards
+        nTime = nTime + 120 - (insecure_rand() % 100 == 0 ? 600 : insecure_rand() % 200);
+        index.nTime = nTime;
+        index.BuildAlgoLinks();
+    }
+
+    int nNonZero = 0;
+    for (int i = 0; i < nBlocks; i++) {
+        arith_uint256 ssf = get_ssf(&vIndex[i]);
+        BOOST_CHECK(CBigNum(ArithToUint256(ssf)) == get_ssf_rescan(&vIndex[i]));
+        // second call is served from the window cache
+        BOOST_CHECK(ssf == get_ssf(&vIndex[i]));
+        if (ssf > 0)
+            nNonZero++;
+    }
+    BOOST_CHECK(nNonZero > 0);
+}
+
+// Solve a regtest block on top of hashPrev at the given height
+static void MineRegtestBlock(CBlock& block, const uint256& hashPrev, int nHeight, unsigned int nTime)
+{
+    block.hashPrevBlock = hashPrev;
+    block.nTime = nTime;
+    block.vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    CBigNum bnTarget;
+    bnTarget.SetCompact(block.nBits);
+    for (block.nNonce = 0; CBigNum(block.GetPoWHash()) > bnTarget; block.nNonce++);
+}
+
+BOOST_AUTO_TEST_CASE(headers_first_test)
+{
+    SelectParams(CChainParams::REGTEST);
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CBlockTemplate *pblocktemplate;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    }
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlock block1 = pblocktemplate->block;
+    MineRegtestBlock(block1, pindexTip->GetBlockHash(), pindexTip->nHeight + 1, pindexTip->GetMedianTimePast() + 1);
+    CBlock block2 = block1;
+    MineRegtestBlock(block2, block1.GetHash(), pindexTip->nHeight + 2, block1.nTime + 1);
+    delete pblocktemplate;
+
+    // headers are accepted ahead of their blocks and extend the best header chain only
+    CValidationState state;
+    CBlockIndex* pindex2 = NULL;
+    BOOST_CHECK(!AcceptBlockHeader(block2.GetBlockHeader(), state, &pindex2));
+    BOOST_CHECK(state.IsInvalid());
+    state = CValidationState();
+    BOOST_CHECK(AcceptBlockHeader(block1.GetBlockHeader(), state));
+    BOOST_CHECK(AcceptBlockHeader(block2.GetBlockHeader(), state, &pindex2));
+    BOOST_CHECK(pindex2 != NULL && pindex2->nHeight == pindexTip->nHeight + 2);
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), pindexTip->nHeight + 2);
+    BOOST_CHECK(chainActive.Tip() == pindexTip);
+    // and are written to the block tree with the rest of their header
+    CBlockIndexAux aux;
+    BOOST_CHECK(GetBlockIndexAux(pindex2, aux));
+
+    // a header with the wrong difficulty is rejected
+    CBlockHeader bad = block1.GetBlockHeader();
+    bad.nBits--;
+    BOOST_CHECK(!AcceptBlockHeader(bad, state));
+    int nDoS = 0;
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS > 0);
+
+    // a block whose parent is still missing goes to disk instead of the orphan pool
+    state = CValidationState();
+    BOOST_CHECK(ProcessBlock(state, NULL, &block2));
+    BOOST_CHECK(mapBlockIndex.count(block2.GetHash()) == 0);
+    BOOST_CHECK(chainActive.Tip() == pindexTip);
+
+    // its parent arriving connects both
+    BOOST_CHECK(ProcessBlock(state, NULL, &block1));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(chainActive.Tip() == pindex2);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block2.GetHash());
+
+    SelectParams(CChainParams::MAIN);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,180 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "miner.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+
+// A transaction spending output 0 of each of vPrev, or an unknown coin
+CTransaction Spend(const std::vector<uint256>& vPrev, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(vPrev.empty() ? 1 : vPrev.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout = COutPoint(vPrev.empty() ? GetRandHash() : vPrev[i], 0);
+        tx.vin[i].scriptSig = CScript() << OP_1;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+CTransaction Spend(const uint256& hashPrev, int64_t nValue)
+{
+    return Spend(std::vector<uint256>(1, hashPrev), nValue);
+}
+
+uint256 Add(CTxMemPool& pool, const CTransaction& tx, int64_t nFee, double dPriority = 0)
+{
+    uint256 hash = tx.GetHash();
+    pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, 0, dPriority, 1, 1));
+    return hash;
+}
+
+const CTxMemPoolEntry& Entry(CTxMemPool& pool, const uint256& hash)
+{
+    return pool.mapTx.find(hash)->second;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_state)
+{
+    CTxMemPool pool;
+    CTransaction txParent = Spend(std::vector<uint256>(), 10 * COIN);
+    uint256 hashParent = Add(pool, txParent, 1000);
+    CTransaction txChild = Spend(hashParent, 9 * COIN);
+    uint256 hashChild = Add(pool, txChild, 2000);
+    CTransaction txGrandChild = Spend(hashChild, 8 * COIN);
+    uint256 hashGrandChild = Add(pool, txGrandChild, 3000);
+
+    const CTxMemPoolEntry& grandChild = Entry(pool, hashGrandChild);
+    BOOST_CHECK_EQUAL(grandChild.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandChild.GetFeesWithAncestors(), 6000);
+    BOOST_CHECK_EQUAL(grandChild.GetSigOpsWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandChild.GetSizeWithAncestors(),
+                      Entry(pool, hashParent).GetTxSize() + Entry(pool, hashChild).GetTxSize() + grandChild.GetTxSize());
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 3);
+    BOOST_CHECK_EQUAL(pool.setByPriority.size(), 3);
+    BOOST_CHECK_EQUAL(pool.setByAncestorScore.size(), 3);
+    BOOST_CHECK((*pool.setByFeeRate.begin())->first == hashGrandChild);
+
+    // The parent confirms: its descendants stay, without it among their ancestors
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(Entry(pool, hashChild).GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(Entry(pool, hashChild).GetFeesWithAncestors(), 2000);
+    BOOST_CHECK_EQUAL(Entry(pool, hashGrandChild).GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(Entry(pool, hashGrandChild).GetFeesWithAncestors(), 5000);
+    BOOST_CHECK(pool.GetParents(pool.mapTx.find(hashChild)).empty());
+
+    // ... and comes back when its block is disconnected
+    Add(pool, txParent, 1000);
+    BOOST_CHECK_EQUAL(pool.GetParents(pool.mapTx.find(hashChild)).size(), 1);
+    BOOST_CHECK_EQUAL(Entry(pool, hashGrandChild).GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(Entry(pool, hashGrandChild).GetFeesWithAncestors(), 6000);
+
+    // Removing a conflict takes its descendants with it
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK(pool.setByFeeRate.empty() && pool.setByPriority.empty() && pool.setByAncestorScore.empty());
+    BOOST_CHECK(pool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_select_packages)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // A parent paying little with a child paying for both goes ahead of
+    // a transaction paying in between
+    uint256 hashParent = Add(pool, Spend(std::vector<uint256>(), 10 * COIN), 1000);
+    uint256 hashChild = Add(pool, Spend(hashParent, 9 * COIN), 200000);
+    uint256 hashMiddle = Add(pool, Spend(std::vector<uint256>(), 10 * COIN), 50000);
+    // Only final transactions are taken, with their descendants waiting
+    CTransaction txLocked = Spend(std::vector<uint256>(), 10 * COIN);
+    txLocked.nLockTime = 1000;
+    txLocked.vin[0].nSequence = 0;
+    uint256 hashLocked = Add(pool, txLocked, 900000);
+    Add(pool, Spend(hashLocked, 9 * COIN), 900000);
+
+    std::vector<const CTxMemPoolEntry*> vSelected;
+    bool fSkippedNonFinal = false;
+    SelectMemPoolTransactions(pool, 100, MAX_BLOCK_SIZE / 2, 0, 0, vSelected, &fSkippedNonFinal);
+    BOOST_CHECK(fSkippedNonFinal);
+    BOOST_REQUIRE_EQUAL(vSelected.size(), 3);
+    BOOST_CHECK(vSelected[0] == &Entry(pool, hashParent));
+    BOOST_CHECK(vSelected[1] == &Entry(pool, hashChild));
+    BOOST_CHECK(vSelected[2] == &Entry(pool, hashMiddle));
+
+    // A block with room for one transaction takes the best one that fits
+    vSelected.clear();
+    SelectMemPoolTransactions(pool, 100, 1000 + Entry(pool, hashMiddle).GetTxSize() + 1, 0, 0, vSelected);
+    BOOST_REQUIRE_EQUAL(vSelected.size(), 1);
+    BOOST_CHECK(vSelected[0] == &Entry(pool, hashMiddle));
+
+    // Transactions with high priority come first, up to the priority size
+    uint256 hashOld = Add(pool, Spend(std::vector<uint256>(), 10 * COIN), 0, COIN * 144 / 250.0 * 10);
+    vSelected.clear();
+    SelectMemPoolTransactions(pool, 100, MAX_BLOCK_SIZE / 2, 50000, 0, vSelected);
+    BOOST_REQUIRE_EQUAL(vSelected.size(), 4);
+    BOOST_CHECK(vSelected[0] == &Entry(pool, hashOld));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // A chain two longer than the package limit is kept whole, but only the
+    // packages within the limit are indexed for block assembly
+    std::vector<CTransaction> vChain(1, Spend(std::vector<uint256>(), 100 * COIN));
+    std::vector<uint256> vHash(1, Add(pool, vChain.back(), 1000));
+    for (unsigned int i = 1; i < MAX_PACKAGE_COUNT + 2; i++) {
+        vChain.push_back(Spend(vHash.back(), (100 - i) * COIN));
+        vHash.push_back(Add(pool, vChain.back(), 1000));
+    }
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), MAX_PACKAGE_COUNT + 2);
+    BOOST_CHECK_EQUAL(pool.setByAncestorScore.size(), MAX_PACKAGE_COUNT);
+    BOOST_CHECK_EQUAL(Entry(pool, vHash[MAX_PACKAGE_COUNT - 1]).GetCountWithAncestors(), MAX_PACKAGE_COUNT);
+
+    std::vector<const CTxMemPoolEntry*> vSelected;
+    SelectMemPoolTransactions(pool, 100, MAX_BLOCK_SIZE / 2, 0, 0, vSelected);
+    BOOST_CHECK_EQUAL(vSelected.size(), MAX_PACKAGE_COUNT);
+
+    // The first confirms, and the next one comes within the limit
+    std::list<CTransaction> removed;
+    pool.remove(vChain[0], removed);
+    BOOST_CHECK_EQUAL(pool.setByAncestorScore.size(), MAX_PACKAGE_COUNT);
+    BOOST_CHECK_EQUAL(Entry(pool, vHash[MAX_PACKAGE_COUNT]).GetCountWithAncestors(), MAX_PACKAGE_COUNT);
+    BOOST_CHECK_EQUAL(Entry(pool, vHash[MAX_PACKAGE_COUNT]).GetFeesWithAncestors(), 1000 * MAX_PACKAGE_COUNT);
+
+    // ... and goes out again when that block is disconnected
+    Add(pool, vChain[0], 1000);
+    BOOST_CHECK_EQUAL(pool.setByAncestorScore.size(), MAX_PACKAGE_COUNT);
+    BOOST_CHECK(!pool.setByAncestorScore.count(pool.mapTx.find(vHash[MAX_PACKAGE_COUNT])));
+
+    // A package over the size limit is left out the same way
+    CTxMemPool poolLarge;
+    CTransaction txLarge = Spend(std::vector<uint256>(), 10 * COIN);
+    txLarge.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(MAX_PACKAGE_SIZE / 2) << OP_DROP << OP_TRUE;
+    uint256 hashLarge = Add(poolLarge, txLarge, 1000);
+    CTransaction txLargeChild = Spend(hashLarge, 9 * COIN);
+    txLargeChild.vout[0].scriptPubKey = txLarge.vout[0].scriptPubKey;
+    Add(poolLarge, txLargeChild, 1000);
+    BOOST_CHECK_EQUAL(poolLarge.setByAncestorScore.size(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,10 +5,13 @@
 
 #include "main.h"
 #include "miner.h"
+#include "templatecache.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 extern void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
@@ -292,6 +295,78 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
 }
 
+BOOST_AUTO_TEST_CASE(template_cache)
+{
+    CBlockTemplateCache cache;
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        cache.NotifyTip(pindexTip);
+    }
+    boost::thread thread(boost::bind(&CBlockTemplateCache::Thread, &cache));
+
+    CBlockIndex* pindexPrev = NULL;
+    boost::shared_ptr<const CBlockTemplate> ptemplate = cache.Get(ALGO_SCRYPT, pindexPrev);
+    BOOST_REQUIRE(ptemplate);
+    BOOST_CHECK(pindexPrev == pindexTip);
+    BOOST_CHECK(ptemplate->block.hashPrevBlock == pindexTip->GetBlockHash());
+
+    // the same template is handed out until the tip or the pool changes
+    BOOST_CHECK(cache.Get(ALGO_SCRYPT, pindexPrev) == ptemplate);
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(template_cache_tip_race)
+{
+    CBlockTemplateCache cache;
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        cache.NotifyTip(pindexTip);
+    }
+    boost::thread thread(boost::bind(&CBlockTemplateCache::Thread, &cache));
+    CBlockIndex* pindexPrev = NULL;
+    cache.Get(ALGO_SCRYPT, pindexPrev);
+
+    // New tips arrive while the builder works through the algorithms; it
+    // must never hand out templates for the tip before
+    const int nTips = 20;
+    std::vector<uint256> vHash(nTips);
+    std::vector<CBlockIndex> vIndex(nTips);
+    for (int i = 0; i < nTips; i++) {
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindexLast = chainActive.Tip();
+            vHash[i] = GetRandHash();
+            vIndex[i] = *pindexLast;
+            vIndex[i].phashBlock = &vHash[i];
+            vIndex[i].pprev = pindexLast;
+            vIndex[i].nHeight = pindexLast->nHeight + 1;
+            vIndex[i].BuildAlgoLinks();
+            mapBlockIndex[vHash[i]] = &vIndex[i];
+            chainActive.SetTip(&vIndex[i]);
+            pcoinsTip->SetBestBlock(vHash[i]);
+            cache.NotifyTip(&vIndex[i]);
+        }
+        for (int algo = 0; algo < NUM_ALGOS; algo += 3) {
+            cache.Get(algo, pindexPrev);
+            BOOST_CHECK(pindexPrev == &vIndex[i]);
+        }
+    }
+
+    thread.interrupt();
+    thread.join();
+    LOCK(cs_main);
+    chainActive.SetTip(pindexTip);
+    pcoinsTip->SetBestBlock(pindexTip->GetBlockHash());
+    for (int i = 0; i < nTips; i++)
+        mapBlockIndex.erase(vHash[i]);
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
@@ -11,6 +11,7 @@
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
+#include "sigcache.h"
 
 #include <fstream>
 #include <stdint.h>
@@ -25,6 +26,7 @@
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 #include <boost/assign/list_of.hpp>
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_utils.h"
@@ -497,4 +499,69 @@ BOOST_AUTO_TEST_CASE(script_standard_push)
     }
 }
 
+static void SignatureCacheWorker(CSignatureCache* pcache, const std::vector<uint256>* pvEntry, int nOffset, int* pnFalseHits)
+{
+    // workers insert entries 4n and 4n+1, the others are never inserted
+    for (unsigned int i = nOffset; i < pvEntry->size(); i += 4) {
+        pcache->Set((*pvEntry)[i]);
+        if (pcache->Get((*pvEntry)[i + 2]) || pcache->Get((*pvEntry)[i + 3 - nOffset]))
+            ++*pnFalseHits;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<unsigned char> vchSig(72, 0x30);
+
+    CSignatureCache disabled(0);
+    BOOST_CHECK_EQUAL(disabled.Size(), 0U);
+    uint256 entry = disabled.GetEntry(1, vchSig, key.GetPubKey());
+    disabled.Set(entry);
+    BOOST_CHECK(!disabled.Get(entry));
+
+    // entries are salted per cache and depend on every part of the check
+    CSignatureCache cache(1 << 16);
+    BOOST_CHECK(cache.Size() > 0 && cache.Size() <= (1 << 16) / 32);
+    entry = cache.GetEntry(1, vchSig, key.GetPubKey());
+    BOOST_CHECK(entry != disabled.GetEntry(1, vchSig, key.GetPubKey()));
+    BOOST_CHECK(entry != cache.GetEntry(2, vchSig, key.GetPubKey()));
+    std::vector<unsigned char> vchSig2(vchSig);
+    vchSig2.back() = 0x31;
+    BOOST_CHECK(entry != cache.GetEntry(1, vchSig2, key.GetPubKey()));
+    BOOST_CHECK(!cache.Get(entry));
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry));
+
+    // filled to half its size, nearly everything is kept
+    std::vector<uint256> vEntry;
+    for (unsigned int i = 0; i < cache.Size() * 4; i++)
+        vEntry.push_back(cache.GetEntry(i + 2, vchSig, key.GetPubKey()));
+    unsigned int nHalf = cache.Size() / 2;
+    for (unsigned int i = 0; i < nHalf; i++)
+        cache.Set(vEntry[i]);
+    unsigned int nHits = 0;
+    for (unsigned int i = 0; i < nHalf; i++)
+        nHits += cache.Get(vEntry[i]);
+    BOOST_CHECK(nHits >= nHalf * 95 / 100);
+
+    // overfilled, the most recent entries are mostly kept and the memory stays bounded
+    for (unsigned int i = 0; i < vEntry.size(); i++)
+        cache.Set(vEntry[i]);
+    nHits = 0;
+    for (unsigned int i = vEntry.size() - nHalf; i < vEntry.size(); i++)
+        nHits += cache.Get(vEntry[i]);
+    BOOST_CHECK(nHits >= nHalf / 2);
+
+    // concurrent writers and readers never see an entry nobody inserted
+    CSignatureCache shared(1 << 16);
+    int vFalseHits[2] = {0, 0};
+    boost::thread_group threads;
+    for (int i = 0; i < 2; i++)
+        threads.create_thread(boost::bind(&SignatureCacheWorker, &shared, &vEntry, i, &vFalseHits[i]));
+    threads.join_all();
+    BOOST_CHECK_EQUAL(vFalseHits[0] + vFalseHits[1], 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
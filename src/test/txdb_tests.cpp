@@ -0,0 +1,243 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+
+#include "hash.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+
+// Gives the tests access to the records themselves
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacy(const uint256 &txid, const CCoins &coins) {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+
+    bool HaveLegacy(const uint256 &txid) {
+        return db.Exists(std::make_pair('c', txid));
+    }
+
+    unsigned int CountRecords() {
+        unsigned int n = 0;
+        leveldb::Iterator *pcursor = db.NewIterator();
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next())
+            n++;
+        delete pcursor;
+        return n;
+    }
+};
+
+CCoins RandomCoins(unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nHeight = 1 + GetRand(100000);
+    coins.fCoinBase = GetRand(2);
+    coins.nVersion = 1;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = 1 + GetRand(COIN);
+        coins.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return coins;
+}
+
+// Order of txids in the database keys
+struct CompareSerialized
+{
+    bool operator()(const uint256 &a, const uint256 &b) const {
+        return memcmp(a.begin(), b.begin(), 32) < 0;
+    }
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(txdb_per_output_records)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    // more than 128 outputs, so the output index takes two bytes in the key
+    CCoins coins = RandomCoins(200);
+
+    {
+        CCoinsViewCache cache(db);
+        *cache.ModifyCoins(txid) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+    // one record per output and the transaction's marker
+    BOOST_CHECK_EQUAL(db.CountRecords(), 201U);
+    CCoins read;
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(db.HaveCoins(txid));
+    BOOST_CHECK(!db.HaveCoins(GetRandHash()));
+
+    // spending outputs, the last ones included, only removes their records
+    {
+        CCoinsViewCache cache(db);
+        {
+            CCoinsModifier modifier = cache.ModifyCoins(txid);
+            for (unsigned int i = 150; i < 200; i++)
+                modifier->Spend(i);
+            modifier->Spend(3);
+            coins = *modifier;
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(coins.vout.size(), 150U);
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK_EQUAL(db.CountRecords(), 150U);
+
+    // spending the rest removes the transaction
+    {
+        CCoinsViewCache cache(db);
+        {
+            CCoinsModifier modifier = cache.ModifyCoins(txid);
+            for (unsigned int i = 0; i < 150; i++)
+                modifier->Spend(i);
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetCoins(txid, read));
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK_EQUAL(db.CountRecords(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txdb_replaced_coins)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(3);
+    BOOST_CHECK(db.SetCoins(txid, coins));
+
+    // same outputs, other height: the metadata of every record is updated
+    coins.nHeight++;
+    BOOST_CHECK(db.SetCoins(txid, coins));
+    CCoins read;
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK_EQUAL(read.nHeight, coins.nHeight);
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK_EQUAL(db.CountRecords(), 4U);
+
+    // outputs spent on disk and restored in a cache, as by DisconnectBlock
+    CCoins spent = coins;
+    spent.Spend(1);
+    BOOST_CHECK(db.SetCoins(txid, spent));
+    {
+        CCoinsViewCache cache(db);
+        BOOST_CHECK(cache.SetCoins(txid, coins));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK_EQUAL(db.CountRecords(), 4U);
+}
+
+BOOST_AUTO_TEST_CASE(txdb_upgrade)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 25000; i++) {
+        CCoins coins = RandomCoins(1 + GetRand(5));
+        if (coins.vout.size() > 1)
+            coins.vout[0].SetNull();
+        uint256 txid = GetRandHash();
+        db.WriteLegacy(txid, coins);
+        mapCoins[txid] = coins;
+    }
+    BOOST_CHECK(db.GetBestBlock() == uint256(0));
+
+    BOOST_CHECK(db.Upgrade());
+    unsigned int nOutputs = 0;
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        BOOST_CHECK(!db.HaveLegacy(it->first));
+        CCoins read;
+        BOOST_CHECK(db.GetCoins(it->first, read));
+        BOOST_CHECK(read == it->second);
+        for (unsigned int i = 0; i < it->second.vout.size(); i++)
+            nOutputs += it->second.IsAvailable(i);
+    }
+    BOOST_CHECK_EQUAL(db.CountRecords(), nOutputs + mapCoins.size());
+
+    // nothing left to do the second time
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.CountRecords(), nOutputs + mapCoins.size());
+}
+
+BOOST_AUTO_TEST_CASE(txdb_stats)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins, CompareSerialized> mapCoins;
+    {
+        CCoinsViewCache cache(db);
+        for (int i = 0; i < 5000; i++) {
+            uint256 txid = GetRandHash();
+            CCoins coins = RandomCoins(1 + GetRand(5));
+            if (coins.vout.size() > 2)
+                coins.vout[1].SetNull();
+            *cache.ModifyCoins(txid) = coins;
+            mapCoins[txid] = coins;
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // the digest of the whole set, computed in one go
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    uint256 hashBlock = db.GetBestBlock();
+    ss << hashBlock;
+    uint64_t nOutputs = 0;
+    int64_t nTotalAmount = 0;
+    for (std::map<uint256, CCoins, CompareSerialized>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoins &coins = it->second;
+        ss << it->first << VARINT(coins.nVersion) << (coins.fCoinBase ? 'c' : 'n') << VARINT(coins.nHeight);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (coins.vout[i].IsNull())
+                continue;
+            ss << VARINT(i+1) << coins.vout[i];
+            nOutputs++;
+            nTotalAmount += coins.vout[i].nValue;
+        }
+        ss << VARINT(0);
+    }
+
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(stats.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(stats.nTransactions, mapCoins.size());
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nOutputs);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, nTotalAmount);
+    BOOST_CHECK(stats.hashSerialized == ss.GetHash());
+
+    // same best block: the same answer, from the cache
+    CCoinsStats stats2;
+    BOOST_CHECK(db.GetStats(stats2));
+    BOOST_CHECK(stats2.hashSerialized == stats.hashSerialized);
+
+    // a new best block is recomputed
+    {
+        CCoinsViewCache cache(db);
+        cache.ModifyCoins(mapCoins.begin()->first)->Spend(0);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetStats(stats2));
+    BOOST_CHECK(stats2.hashBlock != stats.hashBlock);
+    BOOST_CHECK_EQUAL(stats2.nTransactionOutputs, nOutputs - 1);
+    BOOST_CHECK(stats2.hashSerialized != stats.hashSerialized);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
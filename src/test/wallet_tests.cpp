@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "walletscan.h"
 
 #include <set>
 #include <stdint.h>
@@ -22,6 +23,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -304,4 +307,222 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static bool HasUnspentTx(const uint256& hash)
+{
+    vector<pair<uint256, const CWalletTx*> > vUnspent;
+    pwalletMain->GetUnspentTx(vUnspent);
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+        if (vUnspent[i].first == hash)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    int64_t nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+
+    // a payment to us waiting in the memory pool
+    CTransaction txPay;
+    txPay.vin.resize(1);
+    txPay.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txPay.vout.resize(1);
+    txPay.vout[0].nValue = 5 * COIN;
+    txPay.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    uint256 hashPay = txPay.GetHash();
+    mempool.addUnchecked(hashPay, CTxMemPoolEntry(txPay, 0, GetTime(), 0.0, 1));
+    pwalletMain->SyncTransaction(hashPay, txPay, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 5 * COIN);
+    // asked again with nothing changed
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 5 * COIN);
+
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable, false);
+    int nFound = 0;
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        if (out.tx->GetHash() == hashPay)
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, 1);
+
+    // a spend in the memory pool makes it unavailable, but it stays indexed
+    // as the spend may still leave the pool
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(hashPay, 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashSpend = txSpend.GetHash();
+    mempool.addUnchecked(hashSpend, CTxMemPoolEntry(txSpend, 0, GetTime(), 0.0, 1));
+    pwalletMain->SyncTransaction(hashSpend, txSpend, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        BOOST_CHECK(out.tx->GetHash() != hashPay);
+    BOOST_CHECK(HasUnspentTx(hashPay));
+
+    // the spend confirms in a block on top of the tip: it drops out
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlock block;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.vtx.push_back(txSpend);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    uint256 hashBlock = block.GetHash();
+    CBlockIndex index = *pindexPrev;
+    index.phashBlock = &hashBlock;
+    index.pprev = pindexPrev;
+    index.nHeight = pindexPrev->nHeight + 1;
+    index.hashMerkleRoot = block.hashMerkleRoot;
+    index.BuildAlgoLinks();
+    mapBlockIndex[hashBlock] = &index;
+    chainActive.SetTip(&index);
+    pwalletMain->SyncTransaction(hashSpend, txSpend, &block);
+    BOOST_CHECK_EQUAL(pwalletMain->mapWallet[hashSpend].GetDepthInMainChain(), 1);
+    BOOST_CHECK(!HasUnspentTx(hashPay));
+
+    // ... and comes back when that block is disconnected
+    chainActive.SetTip(pindexPrev);
+    pwalletMain->SyncTransaction(hashSpend, txSpend, NULL);
+    BOOST_CHECK(HasUnspentTx(hashPay));
+
+    list<CTransaction> removed;
+    mempool.remove(txPay, removed, true);
+    pwalletMain->EraseFromWallet(hashSpend);
+    pwalletMain->EraseFromWallet(hashPay);
+    mapBlockIndex.erase(hashBlock);
+}
+
+static bool HasTx(const vector<const CWalletTx*>& vwtx, const uint256& hash)
+{
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+        if (pwtx->GetHash() == hash)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(tx_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // one in the genesis block, one in a block we do not know
+    CWalletTx wtxInChain, wtxUnknown;
+    wtxInChain.vin.resize(1);
+    wtxInChain.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtxInChain.hashBlock = chainActive.Genesis()->GetBlockHash();
+    wtxUnknown.vin.resize(1);
+    wtxUnknown.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtxUnknown.hashBlock = GetRandHash();
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxInChain));
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxUnknown));
+    uint256 hashInChain = wtxInChain.GetHash(), hashUnknown = wtxUnknown.GetHash();
+
+    CWallet::TxItems::reverse_iterator it = pwalletMain->wtxOrdered.rbegin();
+    BOOST_CHECK(it->second.first == &pwalletMain->mapWallet[hashUnknown]);
+    ++it;
+    BOOST_CHECK(it->second.first == &pwalletMain->mapWallet[hashInChain]);
+
+    vector<const CWalletTx*> vwtx;
+    pwalletMain->GetTxSinceHeight(0, vwtx);
+    BOOST_CHECK(!HasTx(vwtx, hashInChain));
+    BOOST_CHECK(HasTx(vwtx, hashUnknown));
+    pwalletMain->GetTxSinceHeight(-1, vwtx);
+    BOOST_CHECK(HasTx(vwtx, hashInChain));
+    BOOST_CHECK(HasTx(vwtx, hashUnknown));
+
+    // notified without a block, but its block is still in the main chain
+    CWalletTx wtxNoBlock = wtxInChain;
+    wtxNoBlock.hashBlock = 0;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxNoBlock));
+    pwalletMain->GetTxSinceHeight(0, vwtx);
+    BOOST_CHECK(!HasTx(vwtx, hashInChain));
+
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CAccountingEntry acentry;
+    acentry.strAccount = "a";
+    acentry.nCreditDebit = COIN;
+    acentry.nTime = GetAdjustedTime() + 200;
+    acentry.strOtherAccount = "b";
+    acentry.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+    pwalletMain->AddAccountingEntry(acentry);
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.second->strOtherAccount == "b");
+
+    // the smart time of a transaction only follows the default account's entries
+    CWalletTx wtxNext;
+    wtxNext.vin.resize(1);
+    wtxNext.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtxNext.hashBlock = chainActive.Genesis()->GetBlockHash();
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxNext));
+    BOOST_CHECK(pwalletMain->mapWallet[wtxNext.GetHash()].nTimeSmart < acentry.nTime);
+    pwalletMain->EraseFromWallet(wtxNext.GetHash());
+
+    pwalletMain->EraseFromWallet(hashUnknown);
+    pwalletMain->GetTxSinceHeight(-1, vwtx);
+    BOOST_CHECK(!HasTx(vwtx, hashUnknown));
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, pwalletMain->wtxOrdered)
+        BOOST_CHECK(!item.second.first || item.second.first->GetHash() != hashUnknown);
+    pwalletMain->EraseFromWallet(hashInChain);
+}
+
+BOOST_AUTO_TEST_CASE(scan_filter)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey(), pubkeyOther = keyOther.GetPubKey();
+
+    CScript scriptMultisig;
+    scriptMultisig << OP_1 << pubkeyOther << pubkey << OP_2 << OP_CHECKMULTISIG;
+    CScript scriptWatch;
+    scriptWatch << OP_RETURN << vector<unsigned char>(4, 0x42);
+
+    CWalletScanFilter filter;
+    filter.AddKey(pubkey.GetID());
+    filter.AddScript(scriptMultisig.GetID());
+    filter.AddWatchOnly(scriptWatch);
+
+    CScript script;
+    script.SetDestination(pubkey.GetID());
+    BOOST_CHECK(filter.MatchesOutput(script));
+    script.SetDestination(pubkeyOther.GetID());
+    BOOST_CHECK(!filter.MatchesOutput(script));
+    script.SetDestination(scriptMultisig.GetID());
+    BOOST_CHECK(filter.MatchesOutput(script));
+    script = CScript() << pubkey << OP_CHECKSIG;
+    BOOST_CHECK(filter.MatchesOutput(script));
+    script = CScript() << pubkeyOther << OP_CHECKSIG;
+    BOOST_CHECK(!filter.MatchesOutput(script));
+    // one key is enough to look closer
+    BOOST_CHECK(filter.MatchesOutput(scriptMultisig));
+    BOOST_CHECK(filter.MatchesOutput(scriptWatch));
+    BOOST_CHECK(!filter.MatchesOutput(CScript() << OP_RETURN));
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey.SetDestination(pubkeyOther.GetID());
+    BOOST_CHECK(!filter.Matches(tx));
+
+    // transactions in the wallet, spending from them or conflicting with them
+    CWalletScanFilter filterTx(filter);
+    filterTx.AddTransaction(tx.GetHash());
+    BOOST_CHECK(filterTx.Matches(tx));
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+    txSpend.vout = tx.vout;
+    BOOST_CHECK(!filter.Matches(txSpend));
+    BOOST_CHECK(filterTx.Matches(txSpend));
+    CWalletScanFilter filterSpent(filter);
+    filterSpent.AddSpent(tx.vin[0].prevout);
+    BOOST_CHECK(filterSpent.Matches(tx));
+
+    tx.vout.push_back(CTxOut(1, scriptWatch));
+    BOOST_CHECK(filter.Matches(tx));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,44 +7,198 @@
 #include "txdb.h"
 
 #include "core.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
 #include <inttypes.h>
 
+#include <boost/thread.hpp>
+
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
+// Present while a transaction has unspent outputs, so that looking up one
+// without any is a point read the bloom filter answers
+static const char DB_COIN_TX = 'T';
+static const char DB_BEST_BLOCK = 'B';
+
+// Transactions converted per batch by CCoinsViewDB::Upgrade
+static const unsigned int UPGRADE_BATCH_TXS = 10000;
+
+// GetStats splits the coins by the first byte of their txid
+static const unsigned int STATS_SHARDS = 256;
+static const unsigned int MAX_STATS_THREADS = 8;
+
+namespace {
+
+// Key of one unspent output in the coin database
+struct CCoinKey
+{
+    uint256 txid;
+    unsigned int n;
+
+    CCoinKey() : n(0) {}
+    CCoinKey(const uint256 &txidIn, unsigned int nIn) : txid(txidIn), n(nIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    )
+};
+
+/** One unspent output and the metadata of its transaction.
+ *
+ * Serialized format:
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - VARINT(nVersion)
+ * - the output (via CTxOutCompressor)
+ */
+struct CDiskCoin
+{
+    CTxOut out;
+    int nHeight;
+    bool fCoinBase;
+    int nVersion;
+
+    CDiskCoin() : nHeight(0), fCoinBase(false), nVersion(0) {}
+    CDiskCoin(const CCoins &coins, unsigned int n) : out(coins.vout[n]), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase), nVersion(coins.nVersion) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersionIn) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        return ::GetSerializeSize(VARINT(nCode), nType, nVersionIn) +
+               ::GetSerializeSize(VARINT(nVersion), nType, nVersionIn) +
+               ::GetSerializeSize(CTxOutCompressor(REF(out)), nType, nVersionIn);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersionIn) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        ::Serialize(s, VARINT(nCode), nType, nVersionIn);
+        ::Serialize(s, VARINT(nVersion), nType, nVersionIn);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersionIn);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersionIn) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(nCode), nType, nVersionIn);
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        ::Unserialize(s, VARINT(nVersion), nType, nVersionIn);
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersionIn);
+    }
+};
+
+std::string CoinsPrefix(const uint256 &txid)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(DB_COIN, txid);
+    return ssKey.str();
+}
+
+bool HasPrefix(const leveldb::Slice &slKey, const std::string &strPrefix)
+{
+    return slKey.size() > strPrefix.size() && memcmp(slKey.data(), strPrefix.data(), strPrefix.size()) == 0;
+}
+
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
-    batch.Write('B', hash);
+    batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nWriteCount(0) {
+}
+
+bool CCoinsViewDB::ReadCoins(const uint256 &txid, CCoins &coins) {
+    coins.Clear();
+    if (!db.Exists(make_pair(DB_COIN_TX, txid)))
+        return false;
+    std::string strPrefix = CoinsPrefix(txid);
+    leveldb::Iterator *pcursor = db.NewReadIterator();
+    bool fFound = false;
+    for (pcursor->Seek(strPrefix); pcursor->Valid() && HasPrefix(pcursor->key(), strPrefix); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        leveldb::Slice slValue = pcursor->value();
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CCoinKey key;
+            CDiskCoin coin;
+            ssKey >> chType >> key;
+            ssValue >> coin;
+            if (key.n >= coins.vout.size())
+                coins.vout.resize(key.n + 1);
+            coins.vout[key.n] = coin.out;
+            coins.nHeight = coin.nHeight;
+            coins.fCoinBase = coin.fCoinBase;
+            coins.nVersion = coin.nVersion;
+            fFound = true;
+        } catch (std::exception &e) {
+            LogPrintf("%s : Deserialize error for %s - %s\n", __func__, txid.ToString(), e.what());
+        }
+    }
+    delete pcursor;
+    return fFound;
+}
+
+// Bring the records of txid in line with a cache entry without reading
+// them: the outputs below nBaseOutputs were on disk unless already spent,
+// those now spent are erased and only the ones above it are new. An entry
+// that was replaced as a whole has all its unspent outputs written again.
+void CCoinsViewDB::BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &nWritten, size_t &nErased) {
+    const CCoins &coins = entry.coins;
+    unsigned int nBase = (entry.flags & CCoinsCacheEntry::FRESH) ? 0 : entry.nBaseOutputs;
+    bool fReplaced = entry.flags & CCoinsCacheEntry::REPLACED;
+    for (unsigned int i = 0; i < nBase; i++) {
+        if (!coins.IsAvailable(i)) {
+            batch.Erase(make_pair(DB_COIN, CCoinKey(txid, i)));
+            nErased++;
+        }
+    }
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (coins.vout[i].IsNull() || (i < nBase && !fReplaced))
+            continue;
+        batch.Write(make_pair(DB_COIN, CCoinKey(txid, i)), CDiskCoin(coins, i));
+        nWritten++;
+    }
+    if (coins.IsPruned()) {
+        if (nBase > 0)
+            batch.Erase(make_pair(DB_COIN_TX, txid));
+    } else if (nBase == 0)
+        batch.Write(make_pair(DB_COIN_TX, txid), '1');
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
-    return db.Read(make_pair('c', txid), coins);
+    return ReadCoins(txid, coins);
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
+    // without a cache entry to tell, what is on disk has to be read
+    CCoinsCacheEntry entry;
+    ReadCoins(txid, entry.coins);
+    entry.nBaseOutputs = entry.coins.vout.size();
+    entry.coins = coins;
+    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::REPLACED;
     CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
-    return db.WriteBatch(batch);
+    size_t nWritten = 0, nErased = 0;
+    BatchWriteCoins(batch, txid, entry, nWritten, nErased);
+    bool fOk = db.WriteBatch(batch);
+    nWriteCount++;
+    return fOk;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(make_pair(DB_COIN_TX, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
@@ -55,16 +209,97 @@ bool CCoinsViewDB::SetBestBlock(const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) {
-    LogPrint("coindb", "Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    size_t count = 0;
+    size_t changed = 0;
+    size_t nWritten = 0, nErased = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteCoins(batch, it->first, it->second, nWritten, nErased);
+            changed++;
+        }
+        count++;
+        it = mapCoins.erase(it);
+    }
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database, %u outputs written, %u erased...\n",
+             (unsigned int)changed, (unsigned int)count, (unsigned int)nWritten, (unsigned int)nErased);
+
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    return db.WriteBatch(batch);
+    bool fOk = db.WriteBatch(batch);
+    nWriteCount++;
+    return fOk;
+}
+
+bool CCoinsViewDB::Upgrade() {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COINS, uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS) {
+        delete pcursor;
+        return true;
+    }
+
+    LogPrintf("Upgrading coin database to per output records...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    int64_t nStart = GetTimeMillis();
+    CLevelDBBatch batch;
+    unsigned int nBatchTxs = 0;
+    size_t nTxs = 0, nOutputs = 0;
+    int nLastPercent = -1;
+    for (; pcursor->Valid() && pcursor->key()[0] == DB_COINS; pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            CCoins coins;
+            ssKey >> chType >> txid;
+            ssValue >> coins;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (coins.vout[i].IsNull())
+                    continue;
+                batch.Write(make_pair(DB_COIN, CCoinKey(txid, i)), CDiskCoin(coins, i));
+                nOutputs++;
+            }
+            if (!coins.IsPruned())
+                batch.Write(make_pair(DB_COIN_TX, txid), '1');
+            batch.Erase(make_pair(DB_COINS, txid));
+            nTxs++;
+
+            // keys are ordered by the first serialized byte of the txid
+            int nPercent = (unsigned char)slKey[1] * 100 / 256;
+            if (nPercent / 10 != nLastPercent / 10) {
+                LogPrintf("Upgrading coin database: %d%%\n", nPercent);
+                nLastPercent = nPercent;
+            }
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (++nBatchTxs == UPGRADE_BATCH_TXS) {
+            if (!db.WriteBatch(batch)) {
+                delete pcursor;
+                return error("%s : failed to write batch", __func__);
+            }
+            batch = CLevelDBBatch();
+            nBatchTxs = 0;
+        }
+    }
+    delete pcursor;
+    bool fOk = db.WriteBatch(batch, true);
+    nWriteCount++;
+    if (!fOk)
+        return error("%s : failed to write batch", __func__);
+    LogPrintf("Upgraded coin database: %u transactions, %u outputs in %dms\n",
+              (unsigned int)nTxs, (unsigned int)nOutputs, (int)(GetTimeMillis() - nStart));
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -75,6 +310,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
 {
     // Obsolete; only written for backward compatibility.
@@ -109,54 +349,219 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
+namespace {
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    int64_t nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+// Serialize one transaction's unspent outputs for the UTXO set digest
+template<typename Stream>
+void HashCoins(Stream &ss, CCoinsStats &stats, const uint256 &txid, const CCoins &coins)
+{
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
+// Coins whose txid starts with one byte, serialized as they go into the
+// digest, which has to be fed the shards in order
+struct CStatsShard
+{
+    bool fDone;
+    bool fOk;
+    CCoinsStats stats;
+    boost::shared_ptr<CDataStream> pss;
+
+    CStatsShard() : fDone(false), fOk(false), pss(new CDataStream(SER_GETHASH, PROTOCOL_VERSION)) {}
+};
+
+/** Shards of GetStats handed out to worker threads. Workers stay at most a
+ *  window of shards ahead of the one being hashed, which bounds the memory
+ *  held by serialized shards. */
+class CStatsJob
+{
+public:
+    CStatsJob(CLevelDBWrapper &dbIn, const leveldb::Snapshot *snapshotIn, unsigned int nWindowIn) :
+        db(dbIn), snapshot(snapshotIn), vShard(STATS_SHARDS), nNext(0), nHashed(0), nWindow(nWindowIn), fAbort(false) {}
+
+    void Thread() {
+        while (true) {
+            unsigned int n;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fAbort && nNext < STATS_SHARDS && nNext >= nHashed + nWindow)
+                    cond.wait(lock);
+                if (fAbort || nNext == STATS_SHARDS)
+                    return;
+                n = nNext++;
+            }
+            bool fOk = ReadShard(n, vShard[n]);
+            boost::unique_lock<boost::mutex> lock(cs);
+            vShard[n].fOk = fOk;
+            vShard[n].fDone = true;
+            cond.notify_all();
+        }
+    }
+
+    // Wait for shard n and feed it to the digest
+    bool HashShard(unsigned int n, CHashWriter &ss, CCoinsStats &stats) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!vShard[n].fDone)
+            cond.wait(lock);
+        CStatsShard &shard = vShard[n];
+        if (!shard.fOk)
+            return false;
+        if (!shard.pss->empty())
+            ss.write(&(*shard.pss)[0], shard.pss->size());
+        stats.nTransactions += shard.stats.nTransactions;
+        stats.nTransactionOutputs += shard.stats.nTransactionOutputs;
+        stats.nSerializedSize += shard.stats.nSerializedSize;
+        stats.nTotalAmount += shard.stats.nTotalAmount;
+        shard.pss.reset();
+        nHashed = n + 1;
+        cond.notify_all();
+        return true;
+    }
+
+    void Abort() {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fAbort = true;
+        cond.notify_all();
+    }
+
+private:
+    CLevelDBWrapper &db;
+    const leveldb::Snapshot *snapshot;
+    std::vector<CStatsShard> vShard;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nNext;
+    unsigned int nHashed;
+    unsigned int nWindow;
+    bool fAbort;
+
+    bool ReadShard(unsigned int n, CStatsShard &shard) {
+        leveldb::Iterator *pcursor = db.NewIterator(snapshot);
+        const char vchStart[2] = { DB_COIN, (char)n };
+        pcursor->Seek(leveldb::Slice(vchStart, 2));
+        // outputs of one transaction are adjacent; gather them so the digest
+        // stays the same as with whole transaction records
+        uint256 txidCur;
+        CCoins coinsCur;
+        bool fOk = true;
+        for (; pcursor->Valid(); pcursor->Next()) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
+            if (slKey.size() < 2 || slKey[0] != DB_COIN || (unsigned char)slKey[1] != n)
+                break;
+            try {
                 leveldb::Slice slValue = pcursor->value();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                char chType;
+                CCoinKey key;
+                CDiskCoin coin;
+                ssKey >> chType >> key;
+                ssValue >> coin;
+                if (key.txid != txidCur) {
+                    if (!coinsCur.vout.empty())
+                        HashCoins(*shard.pss, shard.stats, txidCur, coinsCur);
+                    txidCur = key.txid;
+                    coinsCur.Clear();
+                    coinsCur.nHeight = coin.nHeight;
+                    coinsCur.fCoinBase = coin.fCoinBase;
+                    coinsCur.nVersion = coin.nVersion;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                if (key.n >= coinsCur.vout.size())
+                    coinsCur.vout.resize(key.n + 1);
+                coinsCur.vout[key.n] = coin.out;
+                shard.stats.nSerializedSize += slKey.size() + slValue.size();
+            } catch (std::exception &e) {
+                fOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                break;
             }
-            pcursor->Next();
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            if (fAbort)
+                break;
         }
+        if (!pcursor->status().ok())
+            fOk = error("%s : I/O error - %s", __func__, pcursor->status().ToString());
+        delete pcursor;
+        if (fOk && !coinsCur.vout.empty())
+            HashCoins(*shard.pss, shard.stats, txidCur, coinsCur);
+        return fOk;
+    }
+};
+
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    LOCK(cs_stats);
+    const leveldb::Snapshot *snapshot = db.GetSnapshot();
+
+    uint256 hashBlock;
+    leveldb::Iterator *pcursor = db.NewIterator(snapshot);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_BEST_BLOCK;
+    pcursor->Seek(ssKeySet.str());
+    if (pcursor->Valid() && pcursor->key() == ssKeySet.str()) {
+        CDataStream ssValue(pcursor->value().data(), pcursor->value().data() + pcursor->value().size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> hashBlock;
     }
     delete pcursor;
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+
+    if (hashBlock != 0 && hashBlock == statsCached.hashBlock) {
+        db.ReleaseSnapshot(snapshot);
+        stats = statsCached;
+        return true;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    stats = CCoinsStats();
+    stats.hashBlock = hashBlock;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << stats.hashBlock;
+
+    unsigned int nThreads = std::max(1U, std::min(MAX_STATS_THREADS, boost::thread::hardware_concurrency()));
+    CStatsJob job(db, snapshot, 2 * nThreads);
+    boost::thread_group threadGroup;
+    bool fOk = true;
+    try {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CStatsJob::Thread, &job));
+        for (unsigned int n = 0; n < STATS_SHARDS && fOk; n++) {
+            boost::this_thread::interruption_point();
+            fOk = job.HashShard(n, ss, stats);
+        }
+    } catch (...) {
+        job.Abort();
+        threadGroup.join_all();
+        db.ReleaseSnapshot(snapshot);
+        throw;
+    }
+    job.Abort();
+    threadGroup.join_all();
+    db.ReleaseSnapshot(snapshot);
+    if (!fOk)
+        return false;
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            stats.nHeight = mi->second->nHeight;
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    statsCached = stats;
+    LogPrint("coindb", "Coin database statistics at %s computed by %u threads in %.2fms\n",
+             stats.hashBlock.ToString(), nThreads, (GetTimeMicros() - nStart) * 0.001);
     return true;
 }
 
@@ -208,7 +613,6 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 // Construct block index object
                 CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
                 pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-		pindexNew->pauxpow        = diskindex.pauxpow;
                 pindexNew->nHeight        = diskindex.nHeight;
                 pindexNew->nMoneySupply   = diskindex.nMoneySupply;
                 pindexNew->nFile          = diskindex.nFile;
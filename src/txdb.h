@@ -10,6 +10,7 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
@@ -26,21 +27,45 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 // min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * Every unspent output is a record of its own, keyed by txid and output
+ * index, so spending one output of a transaction deletes one record instead
+ * of rewriting all the remaining ones. A marker record per transaction with
+ * unspent outputs lets lookups of the others stop at the bloom filter.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    std::atomic<unsigned int> nWriteCount;
+
+    // statistics of the last GetStats, reused while the best block is the same
+    CCriticalSection cs_stats;
+    CCoinsStats statsCached;
+
+    bool ReadCoins(const uint256 &txid, CCoins &coins);
+    void BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &nWritten, size_t &nErased);
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
+    // Number of completed writes of coins, so that readers on other threads
+    // can tell whether what they read may have changed since
+    unsigned int GetWriteCount() const { return nWriteCount.load(); }
+
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    // Computed on a snapshot of the database by several threads, so the
+    // caller does not need to hold cs_main
     bool GetStats(CCoinsStats &stats);
+
+    // Convert whole transaction records left by older versions to per output
+    // records. Safe to interrupt: each batch converts a set of transactions.
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -53,6 +78,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo &fileinfo);
@@ -9,17 +9,22 @@
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry()
+CTxMemPoolEntry::CTxMemPoolEntry():
+    nFee(0), nTxSize(0), nTime(0), dPriority(0), nHeight(MEMPOOL_HEIGHT), nSigOps(0),
+    nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0), nSigOpsWithAncestors(0)
 {
-    nHeight = MEMPOOL_HEIGHT;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                                  int64_t _nTime, double _dPriority,
-                                 unsigned int _nHeight):
-    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+                                 unsigned int _nHeight, unsigned int _nSigOps):
+    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nSigOps(_nSigOps)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
+    nSigOpsWithAncestors = nSigOps;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -36,6 +41,45 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+double CTxMemPoolEntry::GetAncestorScore() const
+{
+    double dAncestorRate = (double)nFeesWithAncestors / nSizeWithAncestors;
+    return std::min(GetFeeRate(), dAncestorRate);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta, int nSigOpsDelta)
+{
+    nSizeWithAncestors += nSizeDelta;
+    nFeesWithAncestors += nFeeDelta;
+    nCountWithAncestors += nCountDelta;
+    nSigOpsWithAncestors += nSigOpsDelta;
+    assert(nCountWithAncestors >= 1 && nSizeWithAncestors >= nTxSize);
+}
+
+bool CTxMemPool::CompareByFeeRate::operator()(const txiter& a, const txiter& b) const
+{
+    double fa = a->second.GetFeeRate(), fb = b->second.GetFeeRate();
+    if (fa != fb)
+        return fa > fb;
+    return a->first < b->first;
+}
+
+bool CTxMemPool::CompareByPriority::operator()(const txiter& a, const txiter& b) const
+{
+    double pa = a->second.GetStartingPriority(), pb = b->second.GetStartingPriority();
+    if (pa != pb)
+        return pa > pb;
+    return a->first < b->first;
+}
+
+bool CTxMemPool::CompareByAncestorScore::operator()(const txiter& a, const txiter& b) const
+{
+    double sa = a->second.GetAncestorScore(), sb = b->second.GetAncestorScore();
+    if (sa != sb)
+        return sa > sb;
+    return a->first < b->first;
+}
+
 CTxMemPool::CTxMemPool()
 {
     // Sanity checks off by default for performance, because otherwise
@@ -77,15 +121,158 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        if (mapTx.count(hash))
+            return false;
+        txiter it = mapTx.insert(std::make_pair(hash, entry)).first;
+        const CTransaction& tx = it->second.GetTx();
+        TxLinks& links = mapLinks[it];
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter itParent = mapTx.find(tx.vin[i].prevout.hash);
+            if (itParent != mapTx.end() && links.parents.insert(itParent).second)
+                mapLinks[itParent].children.insert(it);
+        }
+        // A transaction resurrected from a disconnected block may already
+        // have spenders in the pool
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+            if (itNext == mapNextTx.end())
+                continue;
+            txiter itChild = mapTx.find(itNext->second.ptx->GetHash());
+            if (itChild != mapTx.end() && links.children.insert(itChild).second)
+                mapLinks[itChild].parents.insert(it);
+        }
+
+        UpdatePackage(it);
+        UpdateDescendants(links.children);
+        setByFeeRate.insert(it);
+        setByPriority.insert(it);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::UpdatePackage(txiter it)
+{
+    TxLinks& links = mapLinks.find(it)->second;
+    if (links.fPackage)
+        setByAncestorScore.erase(it);
+    setEntries setAncestors;
+    links.fPackage = CalculateAncestors(it, setAncestors, MAX_PACKAGE_COUNT, MAX_PACKAGE_SIZE);
+    if (!links.fPackage)
+        return;
+    CTxMemPoolEntry& entry = it->second;
+    int64_t nSize = entry.GetTxSize(), nFees = entry.GetFee();
+    int nSigOps = entry.GetSigOps();
+    BOOST_FOREACH(txiter itAncestor, setAncestors) {
+        nSize += itAncestor->second.GetTxSize();
+        nFees += itAncestor->second.GetFee();
+        nSigOps += itAncestor->second.GetSigOps();
+    }
+    entry.UpdateAncestorState(nSize - (int64_t)entry.GetSizeWithAncestors(), nFees - entry.GetFeesWithAncestors(),
+                              (int64_t)setAncestors.size() + 1 - (int64_t)entry.GetCountWithAncestors(),
+                              nSigOps - (int)entry.GetSigOpsWithAncestors());
+    setByAncestorScore.insert(it);
+}
+
+void CTxMemPool::UpdateDescendants(const setEntries& setRoots)
+{
+    // The descendants of a package over the limits are over them too, so
+    // the walk stops below entries that were and still are over them, and
+    // stays close to the packages within the limits
+    std::vector<txiter> vToVisit(setRoots.begin(), setRoots.end());
+    setEntries setVisited(setRoots);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        const TxLinks& links = mapLinks.find(itVisit)->second;
+        bool fWasPackage = links.fPackage;
+        UpdatePackage(itVisit);
+        if (!fWasPackage && !links.fPackage)
+            continue;
+        BOOST_FOREACH(txiter itChild, links.children)
+            if (setVisited.insert(itChild).second)
+                vToVisit.push_back(itChild);
+    }
+}
+
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    const CTxMemPoolEntry& entry = it->second;
+    std::map<txiter, TxLinks, CompareIteratorByHash>::iterator itLinks = mapLinks.find(it);
+    BOOST_FOREACH(txiter itParent, itLinks->second.parents)
+        mapLinks[itParent].children.erase(it);
+    BOOST_FOREACH(txiter itChild, itLinks->second.children)
+        mapLinks[itChild].parents.erase(it);
+    setEntries setChildren;
+    setChildren.swap(itLinks->second.children);
+    if (itLinks->second.fPackage)
+        setByAncestorScore.erase(it);
+    mapLinks.erase(itLinks);
+
+    BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin)
+        mapNextTx.erase(txin.prevout);
+    setByFeeRate.erase(it);
+    setByPriority.erase(it);
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+
+    // Descendants no longer count this transaction among their ancestors
+    UpdateDescendants(setChildren);
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetParents(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+void CTxMemPool::CalculateAncestors(txiter it, setEntries& setAncestors) const
+{
+    std::vector<txiter> vToVisit(1, it);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(txiter itParent, GetParents(itVisit))
+            if (setAncestors.insert(itParent).second)
+                vToVisit.push_back(itParent);
+    }
+}
+
+bool CTxMemPool::CalculateAncestors(txiter it, setEntries& setAncestors, uint64_t nLimitCount, uint64_t nLimitSize) const
+{
+    uint64_t nSize = it->second.GetTxSize();
+    std::vector<txiter> vToVisit(1, it);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(txiter itParent, GetParents(itVisit)) {
+            if (!setAncestors.insert(itParent).second)
+                continue;
+            nSize += itParent->second.GetTxSize();
+            if (setAncestors.size() + 1 > nLimitCount || nSize > nLimitSize)
+                return false;
+            vToVisit.push_back(itParent);
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries& setDescendants) const
+{
+    std::vector<txiter> vToVisit(1, it);
+    while (!vToVisit.empty()) {
+        txiter itVisit = vToVisit.back();
+        vToVisit.pop_back();
+        std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(itVisit);
+        assert(itLinks != mapLinks.end());
+        BOOST_FOREACH(txiter itChild, itLinks->second.children)
+            if (setDescendants.insert(itChild).second)
+                vToVisit.push_back(itChild);
+    }
+}
+
 
 void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive)
 {
@@ -101,13 +288,11 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
             removed.push_front(tx);
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            removeUnchecked(it);
         }
     }
 }
@@ -132,6 +317,10 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setByFeeRate.clear();
+    setByPriority.clear();
+    setByAncestorScore.clear();
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     ++nTransactionsUpdated;
@@ -155,8 +344,8 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
                 const CTransaction& tx2 = it2->second.GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
             } else {
-                CCoins &coins = pcoins->GetCoins(txin.prevout.hash);
-                assert(coins.IsAvailable(txin.prevout.n));
+                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
+                assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
             std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
@@ -175,6 +364,48 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
+
+    // Every entry is indexed, linked to its parents in the pool and, if its
+    // package is within the limits, carries the totals of its ancestors
+    assert(setByFeeRate.size() == mapTx.size());
+    assert(setByPriority.size() == mapTx.size());
+    assert(mapLinks.size() == mapTx.size());
+    CTxMemPool* pool = const_cast<CTxMemPool*>(this);
+    unsigned int nPackages = 0;
+    for (txiter it = pool->mapTx.begin(); it != pool->mapTx.end(); it++) {
+        assert(setByFeeRate.count(it) && setByPriority.count(it));
+        setEntries setParents;
+        BOOST_FOREACH(const CTxIn& txin, it->second.GetTx().vin) {
+            txiter itParent = pool->mapTx.find(txin.prevout.hash);
+            if (itParent != pool->mapTx.end())
+                setParents.insert(itParent);
+        }
+        assert(setParents == GetParents(it));
+        BOOST_FOREACH(txiter itParent, setParents)
+            assert(mapLinks.find(itParent)->second.children.count(it));
+
+        setEntries setAncestors;
+        CalculateAncestors(it, setAncestors);
+        uint64_t nSize = it->second.GetTxSize();
+        int64_t nFees = it->second.GetFee();
+        unsigned int nSigOps = it->second.GetSigOps();
+        BOOST_FOREACH(txiter itAncestor, setAncestors) {
+            nSize += itAncestor->second.GetTxSize();
+            nFees += itAncestor->second.GetFee();
+            nSigOps += itAncestor->second.GetSigOps();
+        }
+        bool fPackage = setAncestors.empty() || (setAncestors.size() + 1 <= MAX_PACKAGE_COUNT && nSize <= MAX_PACKAGE_SIZE);
+        assert(mapLinks.find(it)->second.fPackage == fPackage);
+        if (!fPackage)
+            continue;
+        nPackages++;
+        assert(setByAncestorScore.count(it));
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSize);
+        assert(it->second.GetFeesWithAncestors() == nFees);
+        assert(it->second.GetSigOpsWithAncestors() == nSigOps);
+    }
+    assert(setByAncestorScore.size() == nPackages);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
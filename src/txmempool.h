@@ -7,6 +7,7 @@
 #define BITMARK_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "coins.h"
 #include "core.h"
@@ -14,6 +15,11 @@
 
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Largest package of unconfirmed transactions, the transaction with its
+    ancestors in the pool, whose totals are kept for block assembly */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Largest size in bytes of such a package */
+static const unsigned int MAX_PACKAGE_SIZE = 101000;
 
 /*
  * CTxMemPool stores these:
@@ -27,19 +33,44 @@ private:
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    unsigned int nSigOps; // Legacy and P2SH signature operations
+
+    // Totals over this transaction and its ancestors in the pool,
+    // maintained by CTxMemPool as transactions come and go
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
-                    int64_t _nTime, double _dPriority, unsigned int _nHeight);
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight,
+                    unsigned int _nSigOps = 0);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
+    double GetStartingPriority() const { return dPriority; }
     int64_t GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetSigOps() const { return nSigOps; }
+
+    /** Fee per byte of this transaction alone */
+    double GetFeeRate() const { return (double)nFee / nTxSize; }
+    /** Fee per byte of the transaction with its ancestors, or of the
+        transaction alone if that is lower: a parent paying well should not
+        wait for its child */
+    double GetAncestorScore() const;
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetSigOpsWithAncestors() const { return nSigOpsWithAncestors; }
+
+    void UpdateAncestorState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta, int nSigOpsDelta);
 };
 
 /*
@@ -54,15 +85,70 @@ public:
  */
 class CTxMemPool
 {
+public:
+    typedef std::map<uint256, CTxMemPoolEntry>::iterator txiter;
+
+    struct CompareIteratorByHash
+    {
+        bool operator()(const txiter& a, const txiter& b) const { return a->first < b->first; }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    /** Index orders, best first; ties are broken by txid so they are total */
+    struct CompareByFeeRate
+    {
+        bool operator()(const txiter& a, const txiter& b) const;
+    };
+    struct CompareByPriority
+    {
+        bool operator()(const txiter& a, const txiter& b) const;
+    };
+    struct CompareByAncestorScore
+    {
+        bool operator()(const txiter& a, const txiter& b) const;
+    };
+
 private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
 
+    struct TxLinks
+    {
+        setEntries parents;
+        setEntries children;
+        bool fPackage; // within the package limits, with its totals kept
+
+        TxLinks() : fPackage(false) {}
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    /** Recompute the ancestor totals of an entry from its links, or leave
+        it out of setByAncestorScore if its package is over the limits */
+    void UpdatePackage(txiter it);
+    /** Update the packages of the descendants of setRoots, themselves
+        included, after their ancestors changed */
+    void UpdateDescendants(const setEntries& setRoots);
+    void removeUnchecked(txiter it);
+
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    /*
+     * Indexes over mapTx, kept up to date by addUnchecked and remove so a
+     * block template can be assembled by walking them in order. The priority
+     * index holds the priority on entering the pool; priorities grow with
+     * the value of the inputs as blocks arrive, so it is a close order rather
+     * than an exact one. setByAncestorScore only holds the transactions whose
+     * package is within MAX_PACKAGE_COUNT and MAX_PACKAGE_SIZE, which bounds
+     * the walks keeping the totals; the others wait for their ancestors to
+     * confirm.
+     */
+    std::set<txiter, CompareByFeeRate> setByFeeRate;
+    std::set<txiter, CompareByPriority> setByPriority;
+    std::set<txiter, CompareByAncestorScore> setByAncestorScore;
+
     CTxMemPool();
 
     /*
@@ -96,6 +182,16 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    /** Transactions in the pool that it spends from directly */
+    const setEntries& GetParents(txiter it) const;
+    /** Every transaction in the pool that it depends on, not including itself */
+    void CalculateAncestors(txiter it, setEntries& setAncestors) const;
+    /** The same, giving up with false once there are more than nLimitCount
+        transactions or nLimitSize bytes with it */
+    bool CalculateAncestors(txiter it, setEntries& setAncestors, uint64_t nLimitCount, uint64_t nLimitSize) const;
+    /** Every transaction in the pool that depends on it, not including itself */
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
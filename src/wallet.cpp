@@ -10,8 +10,11 @@
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "net.h"
+#include "walletscan.h"
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <openssl/rand.h>
 
 using namespace std;
@@ -20,6 +23,11 @@ using namespace std;
 int64_t nTransactionFee = DEFAULT_TRANSACTION_FEE;
 bool bSpendZeroConfChange = true;
 
+// Threads reading and matching blocks during a rescan
+static const unsigned int MAX_SCAN_THREADS = 8;
+// Blocks each of them may read ahead of the one being added to the wallet
+static const unsigned int SCAN_WINDOW_PER_THREAD = 4;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapWallet
@@ -124,6 +132,10 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        MarkUnspentTxDirty();
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -149,6 +161,10 @@ bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_wallet);
+        MarkUnspentTxDirty();
+    }
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     if (!fFileBacked)
         return true;
@@ -462,29 +478,88 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::IndexTransactions()
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    LOCK2(cs_main, cs_wallet);
+    laccentries.clear();
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+    wtxOrdered.clear();
+    setTxByHeight.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        // a block it was in may have left the main chain while we were not told
+        BlockMap::iterator mi = mapBlockIndex.find(wtx->hashBlock);
+        bool fInChain = wtx->hashBlock != 0 && mi != mapBlockIndex.end() && chainActive.Contains(mi->second);
+        setTxByHeight.insert(make_pair(fInChain ? mi->second->nHeight : -1, it->first));
+    }
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+    {
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+}
+
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    AssertLockHeld(cs_wallet); // laccentries
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+static int GetBlockHeight(const uint256& hashBlock)
+{
+    if (hashBlock == 0)
+        return -1;
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    return mi == mapBlockIndex.end() ? -1 : mi->second->nHeight;
+}
+
+// Move a transaction from where hashBlockOld put it to where hashBlock does
+void CWallet::IndexTxHeight(const uint256& hash, const uint256& hashBlockOld, const uint256& hashBlock)
+{
+    AssertLockHeld(cs_wallet);
+    setTxByHeight.erase(make_pair(-1, hash));
+    setTxByHeight.erase(make_pair(GetBlockHeight(hashBlockOld), hash));
+    setTxByHeight.insert(make_pair(GetBlockHeight(hashBlock), hash));
+}
+
+void CWallet::GetTxSinceHeight(int nHeight, vector<const CWalletTx*>& vwtx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    vwtx.clear();
+
+    // Give the transactions at -1 that are in the main chain their height
+    set<pair<int, uint256> >::iterator it = setTxByHeight.begin();
+    while (it != setTxByHeight.end() && it->first == -1)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit == mapWallet.end())
+        {
+            setTxByHeight.erase(it++);
+            continue;
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(mit->second.hashBlock);
+        if (mit->second.hashBlock != 0 && mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+        {
+            setTxByHeight.insert(make_pair(mi->second->nHeight, it->second));
+            setTxByHeight.erase(it++);
+            continue;
+        }
+        vwtx.push_back(&mit->second);
+        ++it;
     }
 
-    return txOrdered;
+    for (it = setTxByHeight.lower_bound(make_pair(nHeight + 1, uint256(0))); it != setTxByHeight.end(); ++it)
+    {
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end())
+            vwtx.push_back(&mit->second);
+    }
 }
 
 void CWallet::MarkDirty()
@@ -493,7 +568,31 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        MarkUnspentTxDirty();
+    }
+}
+
+void CWallet::AddToUnspentTx(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    setUnspentTx.insert(wtx.GetHash());
+    // it may be one that left a block, and what it spends unspent again
+    if (!wtx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            if (mapWallet.count(txin.prevout.hash))
+                setUnspentTx.insert(txin.prevout.hash);
     }
+    nTxUpdated++;
+}
+
+// Outputs of any transaction may have become ours
+void CWallet::MarkUnspentTxDirty()
+{
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        setUnspentTx.insert(setUnspentTx.end(), item.first);
+    nTxUpdated++;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
@@ -505,6 +604,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        AddToUnspentTx(mapWallet[hash]);
     }
     else
     {
@@ -513,11 +613,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
+        AddToUnspentTx(wtx);
         bool fInsertedNew = ret.second;
+        uint256 hashBlockOld = wtx.hashBlock;
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -529,14 +632,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
                                 continue;
                             CAccountingEntry *const pacentry = (*it).second.second;
+                            // Only the default account's entries, as before
+                            if (pacentry && pacentry->strAccount != "")
+                                continue;
                             int64_t nSmartTime;
                             if (pwtx)
                             {
@@ -588,6 +692,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                 fUpdated = true;
             }
         }
+        // notified without a block, it may have left the one it was in
+        IndexTxHeight(hash, hashBlockOld, wtxIn.hashBlock == 0 ? uint256(0) : wtx.hashBlock);
 
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -685,8 +791,23 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(mi->second.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+                if (it->second.first == &mi->second)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            setTxByHeight.erase(make_pair(-1, hash));
+            setTxByHeight.erase(make_pair(GetBlockHeight(mi->second.hashBlock), hash));
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        setUnspentTx.erase(hash);
+        nTxUpdated++;
     }
     return;
 }
@@ -886,13 +1007,125 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+void CWallet::GetScanFilter(CWalletScanFilter& filter) const
+{
+    AssertLockHeld(cs_wallet);
+    set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        filter.AddKey(keyID);
+    {
+        LOCK(cs_KeyStore);
+        BOOST_FOREACH(const PAIRTYPE(CScriptID, CScript)& item, mapScripts)
+            filter.AddScript(item.first);
+        BOOST_FOREACH(const CScript& script, setWatchOnly)
+            filter.AddWatchOnly(script);
+    }
+    BOOST_FOREACH(const PAIRTYPE(uint256, CWalletTx)& item, mapWallet)
+        filter.AddTransaction(item.first);
+    BOOST_FOREACH(const PAIRTYPE(COutPoint, uint256)& item, mapTxSpends)
+        filter.AddSpent(item.first);
+}
+
+static bool SpendsAny(const CTransaction& tx, const set<uint256>& setTx)
+{
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setTx.count(txin.prevout.hash))
+            return true;
+    return false;
+}
+
+static bool SpendsAny(const CBlock& block, const set<uint256>& setTx)
+{
+    if (setTx.empty())
+        return false;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (SpendsAny(tx, setTx))
+            return true;
+    return false;
+}
+
+// Add the transactions of vpindex that involve us, in chain order. Worker
+// threads read the blocks and match them against filter without locks;
+// cs_main and cs_wallet are only taken for blocks with a match.
+int CWallet::ScanBlocks(const std::vector<CBlockIndex*>& vpindex, const CWalletScanFilter& filter, bool fUpdate,
+                        double dProgressStart, double dProgressTip)
+{
+    int ret = 0;
+    int64_t nStart = GetTimeMillis();
+    int64_t nNow = GetTime();
+    unsigned int nThreads = std::max(1U, std::min(MAX_SCAN_THREADS, boost::thread::hardware_concurrency()));
+    CWalletScanJob job(filter, vpindex, SCAN_WINDOW_PER_THREAD * nThreads);
+    boost::thread_group threadGroup;
+    // transactions added by this scan; the filter does not know them
+    set<uint256> setFound;
+    try {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletScanJob::Thread, &job));
+        for (unsigned int n = 0; n < vpindex.size(); n++)
+        {
+            boost::this_thread::interruption_point();
+            CBlockIndex* pindex = vpindex[n];
+            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            if (GetTime() >= nNow + 60) {
+                nNow = GetTime();
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+            }
+
+            CBlock block;
+            vector<unsigned int> vMatch;
+            job.GetBlock(n, block, vMatch);
+            if (vMatch.empty() && !SpendsAny(block, setFound))
+                continue;
+
+            LOCK2(cs_main, cs_wallet);
+            // a block reorganized away meanwhile; the wallet was told about
+            // the ones replacing it, which a later pass scans too
+            if (!chainActive.Contains(pindex))
+                continue;
+            vector<unsigned int>::const_iterator it = vMatch.begin();
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
+            {
+                const CTransaction& tx = block.vtx[i];
+                bool fMatch = (it != vMatch.end() && *it == i);
+                if (fMatch)
+                    it++;
+                else if (!SpendsAny(tx, setFound))
+                    continue;
+                uint256 hash = tx.GetHash();
+                if (AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
+                {
+                    ret++;
+                    setFound.insert(hash);
+                }
+            }
+        }
+    } catch (...) {
+        job.Abort();
+        threadGroup.join_all();
+        throw;
+    }
+    job.Abort();
+    threadGroup.join_all();
+    LogPrintf("Rescanned %u blocks using %u threads in %dms\n", (unsigned int)vpindex.size(), nThreads, (int)(GetTimeMillis() - nStart));
+    return ret;
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// The blocks up to the tip are scanned without holding the locks, so blocks
+// keep being connected meanwhile. Those may spend outputs found by the scan
+// before they were added to the wallet; they are scanned again at the end,
+// with the locks held.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
-    int64_t nNow = GetTime();
+    double dProgressStart, dProgressTip;
+    vector<CBlockIndex*> vpindex;
+    CWalletScanFilter filter;
 
     CBlockIndex* pindex = pindexStart;
     {
@@ -903,29 +1136,34 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
-        {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+        for (; pindex; pindex = chainActive.Next(pindex))
+            vpindex.push_back(pindex);
+        GetScanFilter(filter);
+    }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
-            }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    ret += ScanBlocks(vpindex, filter, fUpdate, dProgressStart, dProgressTip);
+
+    if (!vpindex.empty())
+    {
+        LOCK2(cs_main, cs_wallet);
+        // continue after the last block scanned, or where the chain forked from it
+        pindex = vpindex.back();
+        while (!chainActive.Contains(pindex))
+            pindex = pindex->pprev;
+        vpindex.clear();
+        for (pindex = chainActive.Next(pindex); pindex; pindex = chainActive.Next(pindex))
+            vpindex.push_back(pindex);
+        if (!vpindex.empty())
+        {
+            CWalletScanFilter filterTail;
+            GetScanFilter(filterTail);
+            ret += ScanBlocks(vpindex, filterTail, fUpdate, dProgressStart, dProgressTip);
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1022,94 +1260,123 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64_t CWallet::GetBalance() const
+// Every output of ours is spent by a transaction in a block
+bool CWallet::IsSettled(const uint256& hash, const CWalletTx& wtx) const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        bool fSpent = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpent; ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpent = (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 1);
         }
+        if (!fSpent && IsMine(wtx.vout[i]) != ISMINE_NO)
+            return false;
     }
-
-    return nTotal;
+    return true;
 }
 
-int64_t CWallet::GetUnconfirmedBalance() const
+// Walk setUnspentTx, dropping the transactions that are settled
+void CWallet::GetUnspentTx(vector<pair<uint256, const CWalletTx*> >& vUnspent) const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    vUnspent.clear();
+    vUnspent.reserve(setUnspentTx.size());
+    set<uint256>::iterator it = setUnspentTx.begin();
+    while (it != setUnspentTx.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(*it);
+        if (mit == mapWallet.end() || IsSettled(mit->first, mit->second))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
+            setUnspentTx.erase(it++);
+            continue;
         }
+        vUnspent.push_back(make_pair(mit->first, &mit->second));
+        ++it;
     }
-    return nTotal;
 }
 
-int64_t CWallet::GetImmatureBalance() const
+const CWallet::CBalances& CWallet::GetBalances() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (balances.fValid && balances.pindexTip == chainActive.Tip() &&
+        balances.nMempoolUpdated == mempool.GetTransactionsUpdated() && balances.nTxUpdated == nTxUpdated)
+        return balances;
+
+    CBalances result;
+    result.pindexTip = chainActive.Tip();
+    result.nMempoolUpdated = mempool.GetTransactionsUpdated();
+    result.nTxUpdated = nTxUpdated;
+    result.nBalance = result.nUnconfirmed = result.nImmature = 0;
+    result.nWatchOnly = result.nUnconfirmedWatchOnly = result.nImmatureWatchOnly = 0;
+    // lock times can pass without a new block
+    bool fAllFinal = true;
+    vector<pair<uint256, const CWalletTx*> > vUnspent;
+    GetUnspentTx(vUnspent);
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+    {
+        const CWalletTx* pcoin = vUnspent[i].second;
+        bool fFinal = IsFinalTx(*pcoin);
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+        {
+            result.nBalance += pcoin->GetAvailableCredit();
+            result.nWatchOnly += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+            result.nUnconfirmed += pcoin->GetAvailableCredit();
+            result.nUnconfirmedWatchOnly += pcoin->GetAvailableWatchOnlyCredit();
         }
+        result.nImmature += pcoin->GetImmatureCredit();
+        result.nImmatureWatchOnly += pcoin->GetImmatureWatchOnlyCredit();
+        fAllFinal &= fFinal;
     }
-    return nTotal;
+    result.fValid = fAllFinal;
+    balances = result;
+    return balances;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nBalance;
+}
+
+int64_t CWallet::GetUnconfirmedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmed;
+}
+
+int64_t CWallet::GetImmatureBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 int64_t CWallet::GetWatchOnlyBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnly;
 }
 
 int64_t CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmedWatchOnly;
 }
 
 int64_t CWallet::GetImmatureWatchOnlyBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmatureWatchOnly;
 }
 
 // populate vCoins with vector of available COutputs.
@@ -1119,10 +1386,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
     	LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<pair<uint256, const CWalletTx*> > vUnspent;
+        GetUnspentTx(vUnspent);
+        for (unsigned int n = 0; n < vUnspent.size(); n++)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = vUnspent[n].first;
+            const CWalletTx* pcoin = vUnspent[n].second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1140,8 +1409,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
             }
         }
@@ -1450,8 +1719,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 
                 // Sign
                 int nIn = 0;
+                CPrecomputedTransactionData txdata(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &txdata))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
@@ -1611,6 +1881,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    IndexTransactions();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2129,7 +2401,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && chainActive.Contains(blit->second)) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -38,6 +38,7 @@ class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWalletScanFilter;
 class CWalletTx;
 
 /** (client) version numbers for particular wallet features */
@@ -124,6 +125,52 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Wallet transactions that may still have unspent outputs of ours.
+    // Once all of them are spent by transactions in blocks, a transaction
+    // only has unspent outputs again after a reorganization, which goes
+    // through AddToWallet, or after a new script or watch-only address is
+    // added. Balances and coin selection skip the others.
+    mutable std::set<uint256> setUnspentTx;
+    // Bumped whenever the transactions or what is ours changes
+    unsigned int nTxUpdated;
+
+    /** Every balance, from one pass over setUnspentTx */
+    struct CBalances
+    {
+        bool fValid;
+        const CBlockIndex* pindexTip;
+        unsigned int nMempoolUpdated;
+        unsigned int nTxUpdated;
+        int64_t nBalance;
+        int64_t nUnconfirmed;
+        int64_t nImmature;
+        int64_t nWatchOnly;
+        int64_t nUnconfirmedWatchOnly;
+        int64_t nImmatureWatchOnly;
+
+        CBalances() : fValid(false) { }
+    };
+    // Balances are kept until the tip, the memory pool or the wallet changes
+    mutable CBalances balances;
+
+    void AddToUnspentTx(const CWalletTx& wtx);
+    void MarkUnspentTxDirty();
+    bool IsSettled(const uint256& hash, const CWalletTx& wtx) const;
+    const CBalances& GetBalances() const;
+
+    // Wallet transactions by the height of the block they were last seen
+    // in, or -1. A transaction only gets a height from a block being
+    // connected or found in the main chain, and goes back to -1 when a
+    // block leaving the main chain gives it back, so one that is not in the
+    // main chain at or below height h is at -1 or above h. Those at -1 that
+    // turn out to be in the main chain get their height from the next query.
+    mutable std::set<std::pair<int, uint256> > setTxByHeight;
+    void IndexTxHeight(const uint256& hash, const uint256& hashBlockOld, const uint256& hashBlock);
+
+    void GetScanFilter(CWalletScanFilter& filter) const;
+    int ScanBlocks(const std::vector<CBlockIndex*>& vpindex, const CWalletScanFilter& filter, bool fUpdate,
+                   double dProgressStart, double dProgressTip);
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -167,6 +214,7 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        nTxUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -245,11 +293,21 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    // The wallet's activity log: transactions and accounting entries by
+    // nOrderPos, kept up to date by AddToWallet and AddAccountingEntry
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    /** Rebuild wtxOrdered and the height index, after loading or reordering */
+    void IndexTransactions();
+    /** Add an accounting entry to the activity log, once it is written to
+        the wallet file */
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    /** Wallet transactions that may not be in a block of the main chain at
+        or below nHeight (with a few that turn out to be), by block height */
+    void GetTxSinceHeight(int nHeight, std::vector<const CWalletTx*>& vwtx) const;
+    /** Wallet transactions that may still have unspent outputs of ours */
+    void GetUnspentTx(std::vector<std::pair<uint256, const CWalletTx*> >& vUnspent) const;
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
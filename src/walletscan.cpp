@@ -0,0 +1,122 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletscan.h"
+
+#include "main.h"
+
+#include <string.h>
+#include <utility>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool CWalletScanFilter::MatchesOutput(const CScript& scriptPubKey) const
+{
+    if (!setWatchOnly.empty() && setWatchOnly.count(scriptPubKey))
+        return true;
+
+    // Pay to pubkey hash and pay to script hash, the forms nearly all
+    // outputs take, are matched without going through Solver
+    uint160 id;
+    if (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 &&
+        scriptPubKey[2] == 20 && scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG) {
+        memcpy(id.begin(), &scriptPubKey[3], 20);
+        return setKey.count(id) > 0;
+    }
+    if (scriptPubKey.IsPayToScriptHash()) {
+        memcpy(id.begin(), &scriptPubKey[2], 20);
+        return setScript.count(id) > 0;
+    }
+
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return setKey.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+        return setKey.count(uint160(vSolutions[0])) > 0;
+    case TX_SCRIPTHASH:
+        return setScript.count(uint160(vSolutions[0])) > 0;
+    case TX_MULTISIG:
+        // IsMine wants all the keys; any one of them makes it worth a look
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (setKey.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::Matches(const CTransaction& tx) const
+{
+    if (!setTx.empty() && setTx.count(tx.GetHash()))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setTx.count(txin.prevout.hash) || setSpent.count(txin.prevout))
+            return true;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (MatchesOutput(txout.scriptPubKey))
+            return true;
+    return false;
+}
+
+CWalletScanJob::CWalletScanJob(const CWalletScanFilter& filterIn, const std::vector<CBlockIndex*>& vpindexIn, unsigned int nWindowIn) :
+    filter(filterIn), vpindex(vpindexIn), vSlot(nWindowIn), nNext(0), nTaken(0), nWindow(nWindowIn), fAbort(false)
+{
+}
+
+void CWalletScanJob::Thread()
+{
+    while (true) {
+        unsigned int n;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fAbort && nNext < vpindex.size() && nNext >= nTaken + nWindow)
+                cond.wait(lock);
+            if (fAbort || nNext == vpindex.size())
+                return;
+            n = nNext++;
+        }
+
+        // the slot is this thread's until it is marked done: block n - nWindow
+        // that used it before has been taken
+        Slot& slot = vSlot[n % nWindow];
+        if (!ReadBlockFromDisk(slot.block, vpindex[n]))
+            slot.block.SetNull();
+        slot.vMatch.clear();
+        for (unsigned int i = 0; i < slot.block.vtx.size(); i++)
+            if (filter.Matches(slot.block.vtx[i]))
+                slot.vMatch.push_back(i);
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        slot.fDone = true;
+        cond.notify_all();
+    }
+}
+
+void CWalletScanJob::GetBlock(unsigned int n, CBlock& block, std::vector<unsigned int>& vMatch)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    Slot& slot = vSlot[n % nWindow];
+    while (!slot.fDone)
+        cond.wait(lock);
+    std::swap(block, slot.block);
+    vMatch.swap(slot.vMatch);
+    slot.fDone = false;
+    nTaken = n + 1;
+    cond.notify_all();
+}
+
+void CWalletScanJob::Abort()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    fAbort = true;
+    cond.notify_all();
+}
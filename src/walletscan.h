@@ -0,0 +1,107 @@
+// Copyright (c) 2014 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_WALLETSCAN_H
+#define BITMARK_WALLETSCAN_H
+
+#include "core.h"
+#include "key.h"
+#include "keystore.h"
+#include "script.h"
+#include "uint256.h"
+
+#include <stddef.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_set.hpp>
+
+class CBlockIndex;
+
+/** Key ids, script ids and txids are hashes already, so their low bits make a good hash */
+struct WalletScanHasher
+{
+    size_t operator()(const uint160& id) const { return id.GetLow64(); }
+    size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
+    size_t operator()(const COutPoint& outpoint) const { return outpoint.hash.GetLow64() ^ outpoint.n; }
+};
+
+/**
+ * Compact copy of what a wallet recognizes in the block chain, which a
+ * rescan tests transactions against without taking cs_wallet or the key
+ * store lock.
+ *
+ * It is a superset test: a transaction that IsMine, IsFromMe or is in the
+ * wallet always matches, but one that matches may still turn out not to be
+ * ours (a multisig output with only some of its keys in the wallet, say),
+ * so matches are checked again with the wallet locked.
+ */
+class CWalletScanFilter
+{
+public:
+    void AddKey(const CKeyID& keyID) { setKey.insert(keyID); }
+    void AddScript(const CScriptID& scriptID) { setScript.insert(scriptID); }
+    void AddWatchOnly(const CScript& script) { setWatchOnly.insert(script); }
+    /** A transaction in the wallet: it matches itself and whatever spends from it */
+    void AddTransaction(const uint256& hash) { setTx.insert(hash); }
+    /** An outpoint spent by the wallet: transactions that conflict with it match */
+    void AddSpent(const COutPoint& outpoint) { setSpent.insert(outpoint); }
+
+    bool Matches(const CTransaction& tx) const;
+    bool MatchesOutput(const CScript& scriptPubKey) const;
+
+private:
+    boost::unordered_set<uint160, WalletScanHasher> setKey;
+    boost::unordered_set<uint160, WalletScanHasher> setScript;
+    boost::unordered_set<uint256, WalletScanHasher> setTx;
+    boost::unordered_set<COutPoint, WalletScanHasher> setSpent;
+    WatchOnlySet setWatchOnly;
+};
+
+/**
+ * Blocks of a rescan, read from disk and matched against a filter by
+ * worker threads ahead of the thread adding the matches to the wallet.
+ *
+ * Workers stay at most a window of blocks ahead of the one handed out last,
+ * which bounds the memory held by blocks read ahead.
+ */
+class CWalletScanJob
+{
+public:
+    CWalletScanJob(const CWalletScanFilter& filterIn, const std::vector<CBlockIndex*>& vpindexIn, unsigned int nWindowIn);
+
+    /** Worker thread; returns when all blocks are read or the job is aborted */
+    void Thread();
+
+    /** Wait for block n, in order, and take it with the positions of the
+        transactions that match the filter; the block is empty if it could
+        not be read */
+    void GetBlock(unsigned int n, CBlock& block, std::vector<unsigned int>& vMatch);
+
+    void Abort();
+
+private:
+    struct Slot
+    {
+        bool fDone;
+        CBlock block;
+        std::vector<unsigned int> vMatch;
+
+        Slot() : fDone(false) { }
+    };
+
+    const CWalletScanFilter& filter;
+    const std::vector<CBlockIndex*>& vpindex;
+    // block n goes to vSlot[n % nWindow]
+    std::vector<Slot> vSlot;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nNext;
+    unsigned int nTaken;
+    unsigned int nWindow;
+    bool fAbort;
+};
+
+#endif // BITMARK_WALLETSCAN_H